@@ -32,7 +32,9 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := flvstreamer
-LOCAL_SRC_FILES := log.c rtmp.c amf.c flvstreamer.c parseurl.c com_sarltokyo_flvdownloadservice_FlvDownloadService.c
+LOCAL_SRC_FILES := log.c rtmp.c amf.c flv.c flvstreamer.c parseurl.c com_sarltokyo_flvdownloadservice_FlvDownloadService.c
 LOCAL_LDLIBS := -llog
+# debug messages are compiled out, nothing in the service asks for them
+LOCAL_CFLAGS := -DLOG_MAX_LEVEL=LOGINFO
 
 include $(BUILD_SHARED_LIBRARY)
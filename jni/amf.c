@@ -759,6 +759,9 @@ AMFProp_Dump(AMFObjectProperty * prop)
   char str[256];
   AVal name;
 
+  if (!LOG_ENABLED(LOGDEBUG))
+    return;
+
   if (prop->p_type == AMF_INVALID)
     {
       Log(LOGDEBUG, "Property: INVALID");
@@ -775,6 +778,13 @@ AMFProp_Dump(AMFObjectProperty * prop)
     {
       name = prop->p_name;
     }
+  else if (debuglevel < LOGALL)
+    {
+      // properties without a name are only shown with everything else
+      if (prop->p_type == AMF_OBJECT)
+	AMF_Dump(&prop->p_vu.p_object);
+      return;
+    }
   else
     {
       name.av_val = "no-name.";
@@ -1116,6 +1126,8 @@ void
 AMF_Dump(AMFObject * obj)
 {
   int n;
+  if (!LOG_ENABLED(LOGDEBUG))
+    return;
   Log(LOGDEBUG, "(object begin)");
   for (n = 0; n < obj->o_num; n++)
     {
@@ -30,108 +30,281 @@
 #include "flvstreamer.h"
 #include "com_sarltokyo_flvdownloadservice_FlvDownloadService.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "log.h"
 
-JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerw
-  (JNIEnv *env, jobject me, jstring urlj, jstring outfilej) {
+/* Downloads run on a pool of native threads, so that the service can
+ * have several going at once and cancel each on its own. A job lives
+ * in a slot from StartJob until WaitJob has taken its result, or, once
+ * it has ended with nobody waiting, until StartJob needs the slot.
+ */
+#define WORKERS 4
+#define MAX_JOBS 32
 
-  const char *url;
-  const char *outfile;
+enum { JOB_FREE, JOB_QUEUED, JOB_RUNNING, JOB_DONE };
 
-  int argc = 6;
-  char *argv[6];
+typedef struct Job {
+  int state;
+  int id;
+  FLVSession *ss;
   int rtn;
+  int waiters;			/* in WaitJob */
+} Job;
 
-  url = (*env)->GetStringUTFChars(env, urlj, NULL);
-  if (url == NULL) return -1;
+static Job jobs[MAX_JOBS];
+static int nextId = 1;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
 
-  outfile = (*env)->GetStringUTFChars(env, outfilej, NULL);
-  if (outfile == NULL) return -1;
+static Job *FindJob(int id) {
+  int i;
+  for (i = 0; i < MAX_JOBS; i++)
+    if (jobs[i].state != JOB_FREE && jobs[i].id == id)
+      return &jobs[i];
+  return NULL;
+}
 
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, url = %s", url);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, outfile = %s", outfile);
+static void *Worker(void *arg) {
+  Job *job;
+  int i, rtn;
 
-  argv[0] = (char *)malloc(sizeof(char) * (strlen("flvstreamer") + 1));
-  if (argv[0] == NULL) {
-    LogPrintf("memory allocation of argv[0] failed");
-    return -1;
+  pthread_mutex_lock(&poolLock);
+  for (;;) {
+    /* oldest queued job first */
+    job = NULL;
+    for (i = 0; i < MAX_JOBS; i++)
+      if (jobs[i].state == JOB_QUEUED && (job == NULL || jobs[i].id < job->id))
+        job = &jobs[i];
+    if (job == NULL) {
+      pthread_cond_wait(&queued, &poolLock);
+      continue;
+    }
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&poolLock);
+
+    rtn = FLVSession_Run(job->ss);
+
+    pthread_mutex_lock(&poolLock);
+    job->rtn = rtn;
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&done);
   }
-  memset(argv[0], 0, strlen("flvstreamer") + 1);
-  strcpy(argv[0], "flvstreamer");
-  
-  argv[1] = (char *)malloc(sizeof(char) * (strlen("-r") + 1));
-  if (argv[1] == NULL) {
-    LogPrintf("memory allocation of argv[1] failed");
-    return -1;
+  return NULL;
+}
+
+static void StartWorkers(void) {
+  pthread_t thread;
+  int i;
+  for (i = 0; i < WORKERS; i++) {
+    if (pthread_create(&thread, NULL, Worker, NULL) != 0) {
+      LogPrintf("couldn't start download thread %d", i);
+      continue;
+    }
+    pthread_detach(thread);
   }
-  memset(argv[1], 0, strlen("-r") +1);
-  strcpy(argv[1], "-r");
+}
 
-  argv[2] = (char *)malloc(sizeof(char) * (strlen(url) + 1));
-  if (argv[2] == NULL) {
-    LogPrintf("memory allocation of argv[2] failed");
-    free(argv[1]);
+static void FreeJob(Job *job) {
+  FLVSession_Free(job->ss);
+  memset(job, 0, sizeof(Job));
+}
+
+/* Queue the download of url to outfile, resuming what is there, over
+ * parallel connections. Returns the job id, or -1.
+ */
+static int StartJob(const char *url, const char *outfile, int parallel) {
+  FLVRequest req;
+  Job *job = NULL;
+  int i, id;
+
+  pthread_once(&poolOnce, StartWorkers);
+
+  pthread_mutex_lock(&poolLock);
+  for (i = 0; i < MAX_JOBS && job == NULL; i++)
+    if (jobs[i].state == JOB_FREE)
+      job = &jobs[i];
+  /* else the oldest that ended without anyone waiting for it */
+  for (i = 0; i < MAX_JOBS && job == NULL; i++)
+    if (jobs[i].state == JOB_DONE && jobs[i].waiters == 0
+        && (job == NULL || jobs[i].id < job->id))
+      job = &jobs[i];
+  if (job != NULL && job->state == JOB_DONE)
+    FreeJob(job);
+  if (job == NULL) {
+    pthread_mutex_unlock(&poolLock);
+    LogPrintf("too many downloads");
     return -1;
   }
-  memset(argv[2], 0, strlen(url) + 1);
-  strcpy(argv[2], url);
-  
-  argv[3] = (char *)malloc(sizeof(char) * (strlen("-o") + 1));
-  if (argv[3] == NULL) {
-    LogPrintf("memory allocation of argv[3] failed");
-    free(argv[0]);
-    free(argv[1]);
-    free(argv[2]);
+
+  memset(&req, 0, sizeof(req));
+  req.url = url;
+  req.outfile = outfile;
+  req.resume = 1;
+  /* download over several connections at once */
+  req.parallel = parallel;
+  job->ss = FLVSession_New(&req);
+  if (job->ss == NULL) {
+    LogPrintf("memory allocation of the download failed");
+    pthread_mutex_unlock(&poolLock);
     return -1;
   }
-  memset(argv[3], 0, strlen("-o") + 1);
-  strcpy(argv[3], "-o");
-  
-  argv[4] = (char *)malloc(sizeof(char) * (strlen(outfile) + 1));
-  if (argv[4] == NULL) {
-    LogPrintf("memory allocation of argv[4] failed");
-    free(argv[0]);
-    free(argv[1]);
-    free(argv[2]);
-    free(argv[3]);
-    return -1;
+
+  id = job->id = nextId++;
+  job->state = JOB_QUEUED;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&poolLock);
+  return id;
+}
+
+/* Wait for the job to end and return how it ended, FLV_SUCCESS,
+ * FLV_FAILED or FLV_INCOMPLETE. Of several waiting for the same job
+ * the first to wake takes the result, the others get -1.
+ */
+static int WaitJob(int id) {
+  Job *job;
+  int rtn = -1;
+
+  pthread_mutex_lock(&poolLock);
+  job = FindJob(id);
+  while (job != NULL && job->state != JOB_DONE) {
+    job->waiters++;
+    pthread_cond_wait(&done, &poolLock);
+    /* taken by another waiter meanwhile, the slot may hold a new job */
+    job = FindJob(id);
+    if (job != NULL)
+      job->waiters--;
   }
-  memset(argv[4], 0, strlen(outfile) + 1);
-  strcpy(argv[4], outfile);
-
-  argv[5] = (char *)malloc(sizeof(char) * (strlen("-e") + 1));
-  if (argv[5] == NULL) {
-    LogPrintf("memory allocation of argv[5] failed");
-    free(argv[0]);
-    free(argv[1]);
-    free(argv[2]);
-    free(argv[3]);
-    free(argv[4]);
-    return -1;
+  if (job != NULL) {
+    rtn = job->rtn;
+    FreeJob(job);
+  }
+  pthread_mutex_unlock(&poolLock);
+  return rtn;
+}
+
+static int CancelJob(int id) {
+  Job *job;
+  int rtn = -1;
+
+  pthread_mutex_lock(&poolLock);
+  job = FindJob(id);
+  if (job != NULL) {
+    if (job->state == JOB_QUEUED) {
+      /* never started */
+      job->rtn = FLV_FAILED;
+      job->state = JOB_DONE;
+      pthread_cond_broadcast(&done);
+    } else if (job->state == JOB_RUNNING) {
+      FLVSession_Cancel(job->ss);
+    }
+    rtn = 0;
+  }
+  pthread_mutex_unlock(&poolLock);
+  return rtn;
+}
+
+/* The order of FlvDownloadService.PROGRESS_* */
+enum {
+  PROGRESS_STATE, PROGRESS_STATUS, PROGRESS_PERCENT, PROGRESS_BYTES,
+  PROGRESS_TIMESTAMP, PROGRESS_DURATION, PROGRESS_BITRATE,
+  PROGRESS_AVG_BITRATE, PROGRESS_ELAPSED, PROGRESS_STALLS,
+  PROGRESS_RECONNECTS, PROGRESS_FIELDS
+};
+
+/* A snapshot of the progress of a job, false if there is no such job.
+ * The download does not notice, it keeps its counters without locks.
+ */
+static int QueryJob(int id, FLVSessionInfo *info) {
+  Job *job;
+
+  pthread_mutex_lock(&poolLock);
+  job = FindJob(id);
+  if (job != NULL) {
+    FLVSession_Query(job->ss, info);
+    /* cancelled before a worker took it, the session never ran */
+    if (job->state == JOB_DONE && info->state != FLV_DONE) {
+      info->state = FLV_DONE;
+      info->status = job->rtn;
+    }
   }
-  memset(argv[5], 0, strlen("-e") + 1);
-  strcpy(argv[5], "-e");
+  pthread_mutex_unlock(&poolLock);
+  return job != NULL;
+}
 
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[0] = %s", argv[0]);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[1] = %s", argv[1]);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[2] = %s", argv[2]);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[3] = %s", argv[3]);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[4] = %s", argv[4]);
-  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, argv[5] = %s", argv[5]);
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerStart
+  (JNIEnv *env, jobject me, jstring urlj, jstring outfilej, jint parallel) {
 
-  rtn = flvstreamer(argc, argv);
+  const char *url;
+  const char *outfile;
+  int id;
 
-  free(argv[0]);
-  free(argv[1]);
-  free(argv[2]);
-  free(argv[3]);
-  free(argv[4]);
-  free(argv[5]);
+  url = (*env)->GetStringUTFChars(env, urlj, NULL);
+  if (url == NULL) return -1;
+
+  outfile = (*env)->GetStringUTFChars(env, outfilej, NULL);
+  if (outfile == NULL) {
+    (*env)->ReleaseStringUTFChars(env, urlj, url);
+    return -1;
+  }
+
+  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, url = %s", url);
+  LogPrintf("in com_sarltokyo_flvdownloadservice_FlvDownloadService, outfile = %s", outfile);
+
+  id = StartJob(url, outfile, parallel);
 
   (*env)->ReleaseStringUTFChars(env, urlj, url);
   (*env)->ReleaseStringUTFChars(env, outfilej, outfile);
 
-  return rtn;
+  return id;
+}
+
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerWait
+  (JNIEnv *env, jobject me, jint id) {
+  return WaitJob(id);
+}
+
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerCancel
+  (JNIEnv *env, jobject me, jint id) {
+  return CancelJob(id);
+}
+
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerw
+  (JNIEnv *env, jobject me, jstring urlj, jstring outfilej, jint parallel) {
+
+  int id = Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerStart(env, me, urlj, outfilej, parallel);
+  if (id < 0) return -1;
+
+  return WaitJob(id);
 }
 
+JNIEXPORT jlongArray JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerProgress
+  (JNIEnv *env, jobject me, jint id) {
+
+  FLVSessionInfo info;
+  jlong values[PROGRESS_FIELDS];
+  jlongArray array;
+
+  if (!QueryJob(id, &info)) return NULL;
+
+  values[PROGRESS_STATE] = info.state;
+  values[PROGRESS_STATUS] = info.status;
+  /* hundredths of a percent, -1 if unknown */
+  values[PROGRESS_PERCENT] = info.percent < 0 ? -1 : (jlong) (info.percent * 100);
+  values[PROGRESS_BYTES] = info.bytes;
+  values[PROGRESS_TIMESTAMP] = info.timestamp;
+  values[PROGRESS_DURATION] = info.duration;
+  values[PROGRESS_BITRATE] = info.bitrate;
+  values[PROGRESS_AVG_BITRATE] = info.avgBitrate;
+  values[PROGRESS_ELAPSED] = info.elapsed;
+  values[PROGRESS_STALLS] = info.stalls;
+  values[PROGRESS_RECONNECTS] = info.reconnects;
+
+  array = (*env)->NewLongArray(env, PROGRESS_FIELDS);
+  if (array == NULL) return NULL;
+  (*env)->SetLongArrayRegion(env, array, 0, PROGRESS_FIELDS, values);
+  return array;
+}
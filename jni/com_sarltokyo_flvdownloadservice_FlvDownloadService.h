@@ -10,10 +10,42 @@ extern "C" {
 /*
  * Class:     com_sarltokyo_flvdownloadservice_FlvDownloadService
  * Method:    flvstreamerw
- * Signature: (Ljava/lang/String;Ljava/lang/String;)I
+ * Signature: (Ljava/lang/String;Ljava/lang/String;I)I
  */
 JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerw
-  (JNIEnv *, jobject, jstring, jstring);
+  (JNIEnv *, jobject, jstring, jstring, jint);
+
+/*
+ * Class:     com_sarltokyo_flvdownloadservice_FlvDownloadService
+ * Method:    flvstreamerStart
+ * Signature: (Ljava/lang/String;Ljava/lang/String;I)I
+ */
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerStart
+  (JNIEnv *, jobject, jstring, jstring, jint);
+
+/*
+ * Class:     com_sarltokyo_flvdownloadservice_FlvDownloadService
+ * Method:    flvstreamerWait
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerWait
+  (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_sarltokyo_flvdownloadservice_FlvDownloadService
+ * Method:    flvstreamerCancel
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerCancel
+  (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_sarltokyo_flvdownloadservice_FlvDownloadService
+ * Method:    flvstreamerProgress
+ * Signature: (I)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_com_sarltokyo_flvdownloadservice_FlvDownloadService_flvstreamerProgress
+  (JNIEnv *, jobject, jint);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,230 @@
+/*  FLV file access
+ *  Copyright (C) 2011 The Flvstreamer Team
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with flvstreamer; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#define _FILE_OFFSET_BITS	64
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#define lseek _lseeki64
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "flv.h"
+#include "log.h"
+
+/* Make [offset, offset+len) of the file addressable, moving the window
+ * if necessary. Returns NULL if the range is outside the file.
+ */
+static char *
+Map(FLVFile *f, off_t offset, size_t len)
+{
+  off_t start;
+  size_t size;
+
+  if (offset < 0 || offset + (off_t) len > f->f_size)
+    return NULL;
+
+  if (f->f_map && offset >= f->f_mapOffset
+      && offset + (off_t) len <= f->f_mapOffset + (off_t) f->f_mapSize)
+    return f->f_map + (offset - f->f_mapOffset);
+
+  /* center the new window on the range, so that walking either way
+   * moves it rarely */
+  start = offset + (off_t) len / 2 - FLV_WINDOW / 2;
+  if (start < 0)
+    start = 0;
+  start &= ~(off_t) 65535;	/* page aligned on every platform */
+  size = FLV_WINDOW;
+  if (start + (off_t) size > f->f_size)
+    size = f->f_size - start;
+  if (offset + (off_t) len > start + (off_t) size)	/* tag larger than half a window */
+    size = offset + len - start;
+
+#ifdef WIN32
+  free(f->f_map);
+  f->f_map = malloc(size);
+  if (f->f_map
+      && (lseek(f->f_fd, start, SEEK_SET) != start
+	  || read(f->f_fd, f->f_map, size) != (int) size))
+    {
+      free(f->f_map);
+      f->f_map = NULL;
+    }
+#else
+  if (f->f_map)
+    munmap(f->f_map, f->f_mapSize);
+  f->f_map = mmap(NULL, size, PROT_READ, MAP_SHARED, f->f_fd, start);
+  if (f->f_map == MAP_FAILED)
+    f->f_map = NULL;
+#endif
+  if (!f->f_map)
+    {
+      Log(LOGERROR, "%s: couldn't map %lu bytes at %llu", __FUNCTION__,
+	  (unsigned long) size, (unsigned long long) start);
+      return NULL;
+    }
+  f->f_mapOffset = start;
+  f->f_mapSize = size;
+  return f->f_map + (offset - start);
+}
+
+bool
+FLV_Open(FLVFile *f, int fd)
+{
+  struct stat st;
+  char *p;
+  uint32_t dataOffset;
+
+  memset(f, 0, sizeof(FLVFile));
+  f->f_fd = fd;
+
+  if (fstat(fd, &st) < 0)
+    return false;
+  f->f_size = st.st_size;
+
+  p = Map(f, 0, 13);
+  if (!p)
+    {
+      Log(LOGERROR, "Couldn't read FLV file header!");
+      return false;
+    }
+  if (p[0] != 'F' || p[1] != 'L' || p[2] != 'V' || p[3] != 0x01)
+    {
+      Log(LOGERROR, "Invalid FLV file!");
+      FLV_Close(f);
+      return false;
+    }
+  f->f_flags = p[4];
+
+  dataOffset = AMF_DecodeInt32(p + 5);
+  p = Map(f, dataOffset, 4);
+  if (!p)
+    {
+      Log(LOGERROR, "Invalid FLV file: missing first prevTagSize!");
+      FLV_Close(f);
+      return false;
+    }
+  if (AMF_DecodeInt32(p) != 0)
+    Log(LOGWARNING, "First prevTagSize is not zero: prevTagSize = 0x%08X",
+	AMF_DecodeInt32(p));
+  f->f_start = dataOffset + 4;
+  return true;
+}
+
+void
+FLV_Close(FLVFile *f)
+{
+  if (f->f_map)
+#ifdef WIN32
+    free(f->f_map);
+#else
+    munmap(f->f_map, f->f_mapSize);
+#endif
+  f->f_map = NULL;
+}
+
+/* Position c on the tag at offset, if there is a valid one. */
+static bool
+ReadTag(FLVFile *f, FLVCursor *c, off_t offset)
+{
+  char *p;
+  uint32_t size;
+
+  if (offset < f->f_start || !(p = Map(f, offset, 11)))
+    return false;
+  size = AMF_DecodeInt24(p + 1);
+  if (!(p = Map(f, offset, 11 + size + 4))
+      || AMF_DecodeInt32(p + 11 + size) != 11 + size)
+    return false;
+
+  c->c_file = f;
+  c->c_offset = offset;
+  c->c_type = p[0];
+  c->c_size = size;
+  c->c_timestamp = AMF_DecodeInt24(p + 4) | ((uint32_t) (uint8_t) p[7] << 24);
+  c->c_body = p + 11;
+  return true;
+}
+
+/* Position c on the tag that ends (with its prevTagSize) at end. */
+static bool
+ReadTagBefore(FLVFile *f, FLVCursor *c, off_t end)
+{
+  char *p;
+  uint32_t prevTagSize;
+  off_t offset;
+
+  if (end - 4 < f->f_start || !(p = Map(f, end - 4, 4)))
+    return false;
+  prevTagSize = AMF_DecodeInt32(p);
+  offset = end - 4 - prevTagSize;
+  if (prevTagSize < 11 || offset < f->f_start)
+    return false;
+  return ReadTag(f, c, offset) && c->c_size + 11 == prevTagSize;
+}
+
+bool
+FLV_First(FLVFile *f, FLVCursor *c)
+{
+  return ReadTag(f, c, f->f_start);
+}
+
+bool
+FLV_Last(FLVFile *f, FLVCursor *c)
+{
+  return ReadTagBefore(f, c, f->f_size);
+}
+
+bool
+FLV_Seek(FLVFile *f, FLVCursor *c, off_t offset)
+{
+  return ReadTag(f, c, offset);
+}
+
+bool
+FLV_Next(FLVCursor *c)
+{
+  return ReadTag(c->c_file, c, c->c_offset + 11 + c->c_size + 4);
+}
+
+bool
+FLV_Prev(FLVCursor *c)
+{
+  return ReadTagBefore(c->c_file, c, c->c_offset);
+}
+
+bool
+FLV_NextMapped(FLVCursor *c)
+{
+  FLVFile *f = c->c_file;
+  off_t offset = c->c_offset + 11 + c->c_size + 4;
+  off_t end = f->f_mapOffset + (off_t) f->f_mapSize;
+
+  if (!f->f_map || offset < f->f_mapOffset || offset + 11 > end)
+    return false;
+  return offset + 11 + AMF_DecodeInt24(f->f_map + (offset - f->f_mapOffset) + 1)
+    + 4 <= end;
+}
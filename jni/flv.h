@@ -0,0 +1,81 @@
+#ifndef __FLV_H__
+#define __FLV_H__
+/*  FLV file access
+ *  Copyright (C) 2011 The Flvstreamer Team
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with flvstreamer; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "amf.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* A read only cursor over the tags of an FLV file. The file is memory
+ * mapped in windows of FLV_WINDOW bytes, so that large files also work
+ * in a 32 bit address space. A tag is only returned when it lies
+ * completely inside the file and its prevTagSize matches.
+ *
+ * c_body points into the mapping and stays valid until the next call
+ * on any cursor of the same file.
+ */
+#define FLV_WINDOW	(64 * 1024 * 1024)
+
+  typedef struct FLVFile
+  {
+    int f_fd;
+    off_t f_size;
+    uint8_t f_flags;		/* from the file header: 0x04 audio, 0x01 video */
+    off_t f_start;		/* offset of the first tag */
+    char *f_map;		/* current window */
+    off_t f_mapOffset;
+    size_t f_mapSize;
+  } FLVFile;
+
+  typedef struct FLVCursor
+  {
+    FLVFile *c_file;
+    off_t c_offset;		/* of the tag header */
+    uint8_t c_type;
+    uint32_t c_size;		/* without tag header and prevTagSize */
+    uint32_t c_timestamp;
+    char *c_body;
+  } FLVCursor;
+
+  bool FLV_Open(FLVFile *f, int fd);
+  void FLV_Close(FLVFile *f);
+
+  bool FLV_First(FLVFile *f, FLVCursor *c);
+  bool FLV_Last(FLVFile *f, FLVCursor *c);
+  bool FLV_Seek(FLVFile *f, FLVCursor *c, off_t offset);
+  bool FLV_Next(FLVCursor *c);
+  bool FLV_Prev(FLVCursor *c);
+
+  /* Whether the tag after c lies in the current window, so that moving
+   * on to it leaves the bodies of the tags before it valid. */
+  bool FLV_NextMapped(FLVCursor *c);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
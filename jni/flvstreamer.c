@@ -24,18 +24,30 @@
  */
 
 #define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE		/* fallocate */
 
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 #include <signal.h>		// to catch Ctrl-C
 #include <getopt.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#endif
 
 #include "rtmp.h"
 #include "log.h"
 #include "parseurl.h"
+#include "flv.h"
+#include "flvstreamer.h"
 
 #ifdef WIN32
 #define fseeko fseeko64
@@ -47,206 +59,1572 @@
 #define	SET_BINMODE(f)
 #endif
 
-#define RD_SUCCESS		0
-#define RD_FAILED		1
-#define RD_INCOMPLETE		2
+#define RD_SUCCESS		FLV_SUCCESS
+#define RD_FAILED		FLV_FAILED
+#define RD_INCOMPLETE		FLV_INCOMPLETE
 
-// starts sockets
-bool
-InitSockets()
+/* Where the downloaded tags go. Tags are written with writev() straight
+ * from the RTMP packet body; only the 11 byte tag header and the 4 byte
+ * prevTagSize are built on the side.
+ *
+ * The writes are done by a separate thread so that a slow SD card does
+ * not stop us from reading the socket. The network side fills tags into
+ * a single-producer/single-consumer ring and hands the packet over with
+ * them; the writer thread gathers whatever is queued into one writev()
+ * and marks the slots done. The packets are freed back on the network
+ * side, since the packet pool belongs to the RTMP connection.
+ *
+ * When more than OUTPUT_RING_BYTES are queued, or all slots are in use,
+ * the network side waits for the writer.
+ *
+ * To keep the filesystem from fragmenting the file, the writer holds
+ * back until OUTPUT_WRITE_SIZE bytes are queued (or OUTPUT_FLUSH_MS have
+ * passed) and ends every write on an OUTPUT_ALIGN boundary of the file,
+ * carrying the rest over to the next write. Once onMetaData tells the
+ * expected size, the file is preallocated without changing its size, so
+ * an interrupted download still resumes from where the data ends; the
+ * unused part is released when the output is closed.
+ */
+#define OUTPUT_RING_SLOTS	256	/* must be a power of two */
+#define OUTPUT_RING_BYTES	(8 * 1024 * 1024)
+#define OUTPUT_BATCH		256	/* tags per writev, 3 iovecs each */
+#define OUTPUT_WRITE_SIZE	(256 * 1024)
+#define OUTPUT_ALIGN		(64 * 1024)
+#define OUTPUT_FLUSH_MS		500
+
+/* the indices and flags shared with the writer thread */
+#ifdef __ATOMIC_SEQ_CST
+#define OUTPUT_GET(v)		__atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define OUTPUT_SET(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#else
+#define OUTPUT_GET(v)		(__sync_synchronize(), (v))
+#define OUTPUT_SET(v, x)	do { __sync_synchronize(); (v) = (x); __sync_synchronize(); } while (0)
+#endif
+
+/* Keyframe index kept next to the output file, so that resuming does
+ * not have to walk the file tag by tag. It is an 8 byte header followed
+ * by 24 byte records, appended by the writer thread once the tags they
+ * describe are written:
+ *
+ *   0	offset of the tag in the file, 64 bit
+ *   8	timestamp
+ *  12	tag type, data size (24 bit)
+ *  16	flags, 3 bytes reserved
+ *  20	FNV-1a checksum of bytes 0-19
+ *
+ * Only onMetaData, video keyframes and one audio tag per second (for
+ * audio only streams) are recorded. A torn or stale end of the index
+ * fails the checksum or the checks against the file, and is cut off.
+ */
+#define INDEX_SUFFIX		".idx"
+#define INDEX_MAGIC		"FLVIDX\0\1"
+#define INDEX_HEADER_SIZE	8
+#define INDEX_RECORD_SIZE	24
+#define INDEX_KEYFRAME		0x01
+#define INDEX_PER_TAG		4	/* records per queued tag, for aggregates */
+
+typedef struct FLVIndexEntry
 {
-#ifdef WIN32
-  WORD version;
-  WSADATA wsaData;
+  off_t ie_offset;
+  uint32_t ie_timestamp;
+  uint32_t ie_size;		/* data size, without tag header and prevTagSize */
+  uint8_t ie_type;
+  uint8_t ie_flags;
+} FLVIndexEntry;
+
+typedef struct FLVIndex
+{
+  FLVIndexEntry *fi_entries;
+  int fi_count;
+} FLVIndex;
 
-  version = MAKEWORD(1, 1);
-  return (WSAStartup(version, &wsaData) == 0);
-#else
-  return true;
+/* Reads the records of an open index a block at a time. */
+typedef struct FLVIndexReader
+{
+  int ir_fd;
+  off_t ir_offset;		/* of the next block */
+  int ir_pos, ir_len;
+  char ir_buf[256 * INDEX_RECORD_SIZE];
+} FLVIndexReader;
+
+typedef struct FLVTag
+{
+  RTMPPacket ft_packet;		/* owns the body ft_iov points into */
+  struct iovec ft_iov[3];
+  int ft_iovcnt;
+  uint32_t ft_size;
+  char ft_head[13];		/* tag header, or the FLV file header */
+  char ft_tail[4];		/* prevTagSize */
+  FLVIndexEntry ft_index[INDEX_PER_TAG];
+  int ft_nindex;
+} FLVTag;
+
+typedef struct FLVOutputStats
+{
+  uint32_t os_highSlots;	/* most tags queued at once */
+  uint32_t os_highBytes;	/* most bytes queued at once */
+  uint32_t os_stalls;		/* times the network side had to wait */
+  uint32_t os_stallMs;		/* total time it waited */
+  uint32_t os_writes;		/* number of writev calls */
+  uint32_t os_writeMs;		/* total time the writer spent in writev */
+  uint32_t os_maxWriteMs;	/* longest single writev */
+} FLVOutputStats;
+
+typedef struct FLVOutput
+{
+  FILE *fo_file;
+  int fo_fd;
+  FLVTag fo_ring[OUTPUT_RING_SLOTS];
+  volatile uint32_t fo_head;	/* next slot the network side fills */
+  volatile uint32_t fo_tail;	/* next slot the writer writes */
+  uint32_t fo_reclaim;		/* next written slot whose packet is freed */
+  volatile uint32_t fo_bytes;	/* queued, not yet written */
+  volatile int fo_error;
+  volatile int fo_closing;
+  volatile int fo_wantData;	/* writer is asleep on an empty ring */
+  volatile int fo_wantRoom;	/* network side is asleep on a full ring */
+  volatile uint32_t fo_preallocKB;	/* expected size, set by the network side */
+  uint32_t fo_preallocated;	/* what the writer has allocated so far, kB */
+  int fo_preallocErr;		/* errno of the last fallocate */
+  off_t fo_offset;		/* file offset of the next write */
+  off_t fo_end;			/* file offset of the next queued tag */
+  int fo_indexFd;		/* keyframe index, -1 if none */
+  int64_t fo_indexAudio;	/* timestamp of the last indexed audio tag */
+  bool fo_reserveMeta;		/* pad the next meta data, see MetaReserve */
+  char fo_indexBuf[OUTPUT_BATCH * INDEX_PER_TAG * INDEX_RECORD_SIZE];
+#ifndef WIN32
+  pthread_mutex_t fo_lock;
+  pthread_cond_t fo_cond;
+  pthread_t fo_thread;
 #endif
+  FLVOutputStats fo_stats;
+} FLVOutput;
+
+static uint32_t
+IndexCheck(const char *p, int len)
+{
+  uint32_t h = 2166136261U;
+
+  while (len--)
+    {
+      h ^= (unsigned char) *p++;
+      h *= 16777619U;
+    }
+  return h;
 }
 
-inline void
-CleanupSockets()
+static void
+IndexEncode(char *rec, const FLVIndexEntry *e)
 {
-#ifdef WIN32
-  WSACleanup();
-#endif
+  char *end = rec + INDEX_RECORD_SIZE;
+
+  AMF_EncodeInt32(rec, end, (uint32_t) ((uint64_t) e->ie_offset >> 32));
+  AMF_EncodeInt32(rec + 4, end, (uint32_t) e->ie_offset);
+  AMF_EncodeInt32(rec + 8, end, e->ie_timestamp);
+  rec[12] = e->ie_type;
+  AMF_EncodeInt24(rec + 13, end, e->ie_size);
+  rec[16] = e->ie_flags;
+  rec[17] = rec[18] = rec[19] = 0;
+  AMF_EncodeInt32(rec + 20, end, IndexCheck(rec, 20));
 }
 
-#ifdef _DEBUG
-uint32_t debugTS = 0;
-int pnum = 0;
+static bool
+IndexDecode(const char *rec, FLVIndexEntry *e)
+{
+  if (AMF_DecodeInt32(rec + 20) != IndexCheck(rec, 20))
+    return false;
+  e->ie_offset = (off_t) (((uint64_t) AMF_DecodeInt32(rec) << 32)
+			  | AMF_DecodeInt32(rec + 4));
+  e->ie_timestamp = AMF_DecodeInt32(rec + 8);
+  e->ie_type = rec[12];
+  e->ie_size = AMF_DecodeInt24(rec + 13);
+  e->ie_flags = rec[16];
+  return true;
+}
 
-FILE *netstackdump = 0;
-FILE *netstackdump_read = 0;
-#endif
+/* Append the index records of a written tag to buf, returns their size. */
+static int
+IndexPut(char *buf, const FLVTag *tag)
+{
+  int i;
 
-uint32_t nIgnoredFlvFrameCounter = 0;
-uint32_t nIgnoredFrameCounter = 0;
-#define MAX_IGNORED_FRAMES	50
+  for (i = 0; i < tag->ft_nindex; i++)
+    IndexEncode(buf + i * INDEX_RECORD_SIZE, &tag->ft_index[i]);
+  return tag->ft_nindex * INDEX_RECORD_SIZE;
+}
 
-FILE *file = 0;
+static char *
+IndexName(const char *flvFile)
+{
+  char *name = malloc(strlen(flvFile) + sizeof(INDEX_SUFFIX));
 
-void
-sigIntHandler(int sig)
+  if (name)
+    {
+      strcpy(name, flvFile);
+      strcat(name, INDEX_SUFFIX);
+    }
+  return name;
+}
+
+/* Fill in e if the tag is one of those the index keeps. lastAudio is
+ * the timestamp of the last audio tag kept, -1 before the first one.
+ */
+static bool
+IndexTag(FLVIndexEntry *e, off_t offset, uint8_t type, uint32_t timestamp,
+	 uint32_t size, const char *data, int64_t *lastAudio)
 {
-  RTMP_ctrlC = true;
-  LogPrintf("Caught signal: %d, cleaning up, just a second...\n", sig);
-  // ignore all these signals now and let the connection close
-  signal(SIGINT, SIG_IGN);
-  signal(SIGTERM, SIG_IGN);
-#ifndef WIN32
-  signal(SIGHUP, SIG_IGN);
-  signal(SIGPIPE, SIG_IGN);
-  signal(SIGQUIT, SIG_IGN);
-#endif
+  uint8_t flags = 0;
+
+  switch (type)
+    {
+    case 0x12:
+      if (size < 13 || data[0] != 0x02 || memcmp(data + 3, "onMetaData", 10))
+	return false;
+      break;
+    case 0x09:
+      if (size < 1 || (data[0] & 0xf0) != 0x10)
+	return false;
+      flags = INDEX_KEYFRAME;
+      break;
+    case 0x08:
+      if (*lastAudio >= 0 && timestamp - (uint32_t) *lastAudio < 1000)
+	return false;
+      *lastAudio = timestamp;
+      break;
+    default:
+      return false;
+    }
+
+  e->ie_offset = offset;
+  e->ie_timestamp = timestamp;
+  e->ie_size = size;
+  e->ie_type = type;
+  e->ie_flags = flags;
+  return true;
 }
 
-int
-WriteHeader(char **buf,		// target pointer, maybe preallocated
-	    unsigned int len	// length of buffer if preallocated
-  )
+/* Whether e is a tag players can seek to: a video keyframe, or in files
+ * without video, one of the indexed audio tags.
+ */
+static bool
+IndexSeekable(const FLVIndexEntry *e, bool bVideo)
 {
-  char flvHeader[] = { 'F', 'L', 'V', 0x01,
-    0x05,			// video + audio, we finalize later if the value is different
-    0x00, 0x00, 0x00, 0x09,
-    0x00, 0x00, 0x00, 0x00	// first prevTagSize=0
-  };
+  return bVideo ? e->ie_type == 0x09 && (e->ie_flags & INDEX_KEYFRAME)
+    : e->ie_type == 0x08;
+}
 
-  unsigned int size = sizeof(flvHeader);
+/* Read the index of flvFile, keeping the records up to the first one
+ * that is damaged or doesn't fit into the file of the given size.
+ */
+static void
+IndexLoad(FLVIndex *index, const char *flvFile, off_t size)
+{
+  char *name = IndexName(flvFile), *buf = NULL;
+  FILE *fp;
+  long len;
+  int i, n;
 
-  if (size > len)
+  index->fi_entries = NULL;
+  index->fi_count = 0;
+
+  fp = name ? fopen(name, "rb") : NULL;
+  free(name);
+  if (!fp)
+    return;
+
+  if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > INDEX_HEADER_SIZE
+      && (buf = malloc(len)) != NULL)
     {
-      *buf = (char *) realloc(*buf, size);
-      if (*buf == 0)
-	{
-	  Log(LOGERROR, "Couldn't reallocate memory!");
-	  return -1;		// fatal error
-	}
+      fseek(fp, 0, SEEK_SET);
+      if (fread(buf, 1, len, fp) != (size_t) len
+	  || memcmp(buf, INDEX_MAGIC, INDEX_HEADER_SIZE) != 0)
+	len = 0;
     }
-  memcpy(*buf, flvHeader, sizeof(flvHeader));
-  return size;
+  else
+    len = 0;
+  fclose(fp);
+
+  n = len > INDEX_HEADER_SIZE ? (len - INDEX_HEADER_SIZE) / INDEX_RECORD_SIZE : 0;
+  if (n > 0)
+    index->fi_entries = malloc(n * sizeof(FLVIndexEntry));
+  if (!index->fi_entries)
+    n = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      FLVIndexEntry *e = &index->fi_entries[i];
+      if (!IndexDecode(buf + INDEX_HEADER_SIZE + i * INDEX_RECORD_SIZE, e)
+	  || e->ie_offset < 13
+	  || e->ie_offset + 11 + e->ie_size + 4 > size
+	  || (i > 0 && e->ie_offset <= e[-1].ie_offset))
+	break;
+    }
+  index->fi_count = i;
+  free(buf);
+
+  Log(LOGDEBUG, "%s: %d of %d index records usable", __FUNCTION__, i, n);
 }
 
-static const AVal av_onMetaData = AVC("onMetaData");
-static const AVal av_duration = AVC("duration");
+static void
+IndexFree(FLVIndex *index)
+{
+  free(index->fi_entries);
+  index->fi_entries = NULL;
+  index->fi_count = 0;
+}
 
-// Returns -3 if Play.Close/Stop, -2 if fatal error, -1 if no more media packets, 0 if ignorable error, >0 if there is a media packet
-int
-WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
-	    unsigned int len,	// length of buffer if preallocated
-	    uint32_t * tsm,	// pointer to timestamp, will contain timestamp of last video packet returned
-	    bool bResume,	// resuming mode, will not write FLV header and compare metaHeader and first kexframe
-	    bool bLiveStream,	// live mode, will not report absolute timestamps
-	    uint32_t nResumeTS,	// resume keyframe timestamp
-	    char *metaHeader,	// pointer to meta header (if bResume == TRUE)
-	    uint32_t nMetaHeaderSize,	// length of meta header, if zero meta header check omitted (if bResume == TRUE)
-	    char *initialFrame,	// pointer to initial keyframe (no FLV header or tagSize, raw data) (if bResume == TRUE)
-	    uint8_t initialFrameType,	// initial frame type (audio or video)
-	    uint32_t nInitialFrameSize,	// length of initial frame in bytes, if zero initial frame check omitted (if bResume == TRUE)
-	    uint8_t * dataType	// whenever we get a video/audio packet we set an appropriate flag here, this will be later written to the FLV header
-  )
+/* Open the index of flvFile for appending. The records of tags that end
+ * beyond keep are dropped, since the file will be overwritten from there.
+ * Returns -1 if there is no index.
+ */
+static int
+IndexOpen(const char *flvFile, const FLVIndex *index, off_t keep)
 {
-  static bool bStopIgnoring = false;
-  static bool bFoundKeyframe = false;
-  static bool bFoundFlvKeyframe = false;
+  char *name = IndexName(flvFile);
+  int fd, n = 0;
 
-  uint32_t prevTagSize = 0;
-  int rtnGetNextMediaPacket = 0, ret = -1;
-  RTMPPacket packet = { 0 };
+  fd = name ? open(name, O_RDWR | O_CREAT, 0644) : -1;
+  if (fd < 0)
+    {
+      Log(LOGWARNING, "Couldn't open keyframe index %s", name ? name : flvFile);
+      free(name);
+      return -1;
+    }
+  free(name);
+
+  if (index)
+    while (n < index->fi_count
+	   && index->fi_entries[n].ie_offset + 11 +
+	   index->fi_entries[n].ie_size + 4 <= keep)
+      n++;
+
+  if (ftruncate(fd, INDEX_HEADER_SIZE + (off_t) n * INDEX_RECORD_SIZE) < 0
+      || lseek(fd, 0, SEEK_SET) < 0
+      || write(fd, INDEX_MAGIC, INDEX_HEADER_SIZE) != INDEX_HEADER_SIZE
+      || lseek(fd, 0, SEEK_END) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
 
-  rtnGetNextMediaPacket = RTMP_GetNextMediaPacket(rtmp, &packet);
-  while (rtnGetNextMediaPacket)
+static void
+IndexRewind(FLVIndexReader *r, int fd)
+{
+  r->ir_fd = fd;
+  r->ir_offset = INDEX_HEADER_SIZE;
+  r->ir_pos = r->ir_len = 0;
+}
+
+/* Get the next record. Returns false at the end of the index, or at a
+ * damaged record.
+ */
+static bool
+IndexNext(FLVIndexReader *r, FLVIndexEntry *e)
+{
+  if (r->ir_pos == r->ir_len)
     {
-      char *packetBody = packet.m_body;
-      unsigned int nPacketLen = packet.m_nBodySize;
+      ssize_t n;
+      if (lseek(r->ir_fd, r->ir_offset, SEEK_SET) < 0
+	  || (n = read(r->ir_fd, r->ir_buf, sizeof(r->ir_buf))) <
+	  INDEX_RECORD_SIZE)
+	return false;
+      r->ir_len = n - n % INDEX_RECORD_SIZE;
+      r->ir_pos = 0;
+      r->ir_offset += r->ir_len;
+    }
+  r->ir_pos += INDEX_RECORD_SIZE;
+  return IndexDecode(r->ir_buf + r->ir_pos - INDEX_RECORD_SIZE, e);
+}
 
-      // Return -3 if this was completed nicely with invoke message Play.Stop or Play.Complete
-      if (rtnGetNextMediaPacket == 2)
+/* Append the records of the tags before end that the index doesn't have
+ * yet, walking the file from the last tag it has. This brings an index
+ * that was lost, or stopped being written, up to date with the file.
+ */
+static bool
+IndexCatchUp(int fd, FLVFile *flv, off_t end)
+{
+  char buf[64 * INDEX_RECORD_SIZE], *p = buf;
+  FLVIndexEntry e;
+  FLVCursor c;
+  off_t len = lseek(fd, 0, SEEK_END);
+  int64_t lastAudio = -1;
+  int added = 0;
+  bool more;
+
+  /* a torn record at the end is dropped; if the last one isn't right,
+   * nothing of the index can be trusted */
+  if (len < INDEX_HEADER_SIZE)
+    return false;
+  len -= (len - INDEX_HEADER_SIZE) % INDEX_RECORD_SIZE;
+  if (len > INDEX_HEADER_SIZE
+      && (lseek(fd, len - INDEX_RECORD_SIZE, SEEK_SET) < 0
+	  || read(fd, buf, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE
+	  || !IndexDecode(buf, &e) || !FLV_Seek(flv, &c, e.ie_offset)
+	  || c.c_type != e.ie_type || c.c_size != e.ie_size))
+    len = INDEX_HEADER_SIZE;
+  if (ftruncate(fd, len) < 0 || lseek(fd, len, SEEK_SET) < 0)
+    return false;
+
+  more = len > INDEX_HEADER_SIZE ? FLV_Next(&c) : FLV_First(flv, &c);
+  for (; more && c.c_offset + 11 + c.c_size + 4 <= end; more = FLV_Next(&c))
+    {
+      if (!IndexTag(&e, c.c_offset, c.c_type, c.c_timestamp, c.c_size,
+		    c.c_body, &lastAudio))
+	continue;
+      IndexEncode(p, &e);
+      p += INDEX_RECORD_SIZE;
+      added++;
+      if (p == buf + sizeof(buf))
 	{
-	  Log(LOGDEBUG,
-	      "Got Play.Complete or Play.Stop from server. Assuming stream is complete");
-	  ret = -3;
-	  break;
+	  if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+	    return false;
+	  p = buf;
 	}
+    }
+  if (p != buf && write(fd, buf, p - buf) != p - buf)
+    return false;
 
-      // skip video info/command packets
-      if (packet.m_packetType == 0x09 &&
-	  nPacketLen == 2 && ((*packetBody & 0xf0) == 0x50))
+  if (added)
+    Log(LOGDEBUG, "%s: added %d records", __FUNCTION__, added);
+  return true;
+}
+
+static bool
+OutputWrite(FLVOutput *out, struct iovec *iov, int iovcnt)
+{
+#ifdef WIN32
+  for (; iovcnt > 0; iov++, iovcnt--)
+    if (fwrite(iov->iov_base, 1, iov->iov_len, out->fo_file) != iov->iov_len)
+      return false;
+#else
+  while (iovcnt > 0)
+    {
+      ssize_t n = writev(out->fo_fd, iov, iovcnt);
+      if (n < 0)
 	{
-	  ret = 0;
-	  break;
+	  if (errno == EINTR)
+	    continue;
+	  return false;
 	}
-
-      if (packet.m_packetType == 0x09 && nPacketLen <= 5)
+      while (iovcnt > 0 && n >= (ssize_t) iov->iov_len)
 	{
-	  Log(LOGWARNING, "ignoring too small video packet: size: %d",
-	      nPacketLen);
-	  ret = 0;
-	  break;
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
 	}
-      if (packet.m_packetType == 0x08 && nPacketLen <= 1)
+      if (n)
 	{
-	  Log(LOGWARNING, "ignoring too small audio packet: size: %d",
-	      nPacketLen);
-	  ret = 0;
-	  break;
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
 	}
-#ifdef _DEBUG
-      Log(LOGDEBUG, "type: %02X, size: %d, TS: %d ms, abs TS: %d",
-	  packet.m_packetType, nPacketLen, packet.m_nTimeStamp,
-	  packet.m_hasAbsTimestamp);
-      if (packet.m_packetType == 0x09)
-	Log(LOGDEBUG, "frametype: %02X", (*packetBody & 0xf0));
+    }
 #endif
+  return true;
+}
 
-      // check the header if we get one
-      if (bResume && packet.m_nTimeStamp == 0)
+#ifndef WIN32
+static void
+OutputWake(FLVOutput *out, volatile int *flag)
+{
+  if (OUTPUT_GET(*flag))
+    {
+      pthread_mutex_lock(&out->fo_lock);
+      pthread_cond_broadcast(&out->fo_cond);
+      pthread_mutex_unlock(&out->fo_lock);
+    }
+}
+
+static void
+OutputPreallocate(FLVOutput *out)
+{
+  uint32_t kb = OUTPUT_GET(out->fo_preallocKB);
+
+  if (kb <= out->fo_preallocated)
+    return;
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fallocate(out->fo_fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) kb * 1024) < 0)
+    out->fo_preallocErr = errno;
+#else
+  out->fo_preallocErr = ENOSYS;
+#endif
+  out->fo_preallocated = kb;	/* don't retry */
+}
+
+static void *
+OutputThread(void *arg)
+{
+  FLVOutput *out = arg;
+  struct iovec iov[OUTPUT_BATCH * 3];
+  uint32_t tail = out->fo_tail;
+  uint32_t done = 0;		/* bytes of the tail tag already written */
+  uint32_t since = 0;		/* when the oldest unwritten data came in */
+  bool indexFailed = false;
+
+  for (;;)
+    {
+      uint32_t head = OUTPUT_GET(out->fo_head), end, pending, len, freed = 0;
+      bool closing = OUTPUT_GET(out->fo_closing), flush = closing;
+      int n = 0;
+
+      OutputPreallocate(out);
+
+      if (head == tail)
 	{
-	  if (nMetaHeaderSize > 0 && packet.m_packetType == 0x12)
-	    {
+	  if (closing)
+	    break;
+	  since = 0;
+	}
+      else
+	{
+	  int32_t left;
+
+	  if (!since)
+	    since = RTMP_GetTime() | 1;
+	  left = OUTPUT_FLUSH_MS - (int32_t) (RTMP_GetTime() - since);
+	  pending = OUTPUT_GET(out->fo_bytes) - done;
+	  if (left <= 0 || pending >= OUTPUT_WRITE_SIZE
+	      || head - tail >= OUTPUT_BATCH)
+	    flush = flush || left <= 0;
+	  else if (!closing)
+	    head = tail;	/* not enough yet, wait for more */
+	}
 
-	      AMFObject metaObj;
-	      int nRes = AMF_Decode(&metaObj, packetBody, nPacketLen, false);
-	      if (nRes >= 0)
-		{
-		  AVal metastring;
-		  AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0),
-				    &metastring);
+      if (head == tail)
+	{
+	  struct timespec ts;
+	  int rc = 0;
 
-		  if (AVMATCH(&metastring, &av_onMetaData))
-		    {
-		      // compare
-		      if ((nMetaHeaderSize != nPacketLen) ||
-			  (memcmp(metaHeader, packetBody, nMetaHeaderSize) !=
-			   0))
-			{
-			  ret = -2;
-			}
-		    }
-		  AMF_Reset(&metaObj);
-		  if (ret == -2)
-		    break;
+	  /* wait for more; when something is queued, only until it is due */
+	  if (since)
+	    {
+	      int32_t left =
+		OUTPUT_FLUSH_MS - (int32_t) (RTMP_GetTime() - since);
+	      if (left < 0)
+		left = 0;
+	      clock_gettime(CLOCK_REALTIME, &ts);
+	      ts.tv_sec += left / 1000;
+	      ts.tv_nsec += (left % 1000) * 1000000;
+	      if (ts.tv_nsec >= 1000000000)
+		{
+		  ts.tv_sec++;
+		  ts.tv_nsec -= 1000000000;
 		}
 	    }
+	  pthread_mutex_lock(&out->fo_lock);
+	  OUTPUT_SET(out->fo_wantData, 1);
+	  head = OUTPUT_GET(out->fo_head);
+	  while (OUTPUT_GET(out->fo_head) == head
+		 && !OUTPUT_GET(out->fo_closing) && rc == 0)
+	    {
+	      if (since)
+		rc = pthread_cond_timedwait(&out->fo_cond, &out->fo_lock, &ts);
+	      else
+		pthread_cond_wait(&out->fo_cond, &out->fo_lock);
+	    }
+	  OUTPUT_SET(out->fo_wantData, 0);
+	  pthread_mutex_unlock(&out->fo_lock);
+	  continue;
+	}
 
-	  // check first keyframe to make sure we got the right position in the stream!
-	  // (the first non ignored frame)
-	  if (nInitialFrameSize > 0)
+      /* gather, skipping what was written of the first tag last time */
+      len = 0;
+      for (end = tail; end != head && n + 3 <= OUTPUT_BATCH * 3; end++)
+	{
+	  FLVTag *tag = &out->fo_ring[end & (OUTPUT_RING_SLOTS - 1)];
+	  memcpy(iov + n, tag->ft_iov, tag->ft_iovcnt * sizeof(struct iovec));
+	  n += tag->ft_iovcnt;
+	  len += tag->ft_size;
+	}
+      if (done)
+	{
+	  uint32_t skip = done;
+	  int i = 0;
+	  while (skip >= iov[i].iov_len)
+	    skip -= iov[i++].iov_len;
+	  iov[i].iov_base = (char *) iov[i].iov_base + skip;
+	  iov[i].iov_len -= skip;
+	  memmove(iov, iov + i, (n - i) * sizeof(struct iovec));
+	  n -= i;
+	  len -= done;
+	}
+
+      /* end on an aligned offset, unless that leaves nothing to write */
+      if (!flush)
+	{
+	  uint32_t over = (out->fo_offset + len) % OUTPUT_ALIGN;
+	  if (over < len)
 	    {
+	      uint32_t keep = len - over;
+	      len = 0;
+	      for (n = 0; len + iov[n].iov_len < keep; n++)
+		len += iov[n].iov_len;
+	      iov[n].iov_len = keep - len;
+	      n++;
+	      len = keep;
+	    }
+	}
+      since = 0;
 
-	      // video or audio data
-	      if (packet.m_packetType == initialFrameType
-		  && nInitialFrameSize == nPacketLen)
-		{
-		  // we don't compare the sizes since the packet can contain several FLV packets, just make
-		  // sure the first frame is our keyframe (which we are going to rewrite)
-		  if (memcmp(initialFrame, packetBody, nInitialFrameSize) ==
-		      0)
+      if (!out->fo_error)
+	{
+	  uint32_t t = RTMP_GetTime(), dt;
+	  if (!OutputWrite(out, iov, n))
+	    OUTPUT_SET(out->fo_error, 1);
+	  dt = RTMP_GetTime() - t;
+	  out->fo_stats.os_writes++;
+	  out->fo_stats.os_writeMs += dt;
+	  if (dt > out->fo_stats.os_maxWriteMs)
+	    out->fo_stats.os_maxWriteMs = dt;
+	}
+      out->fo_offset += len;
+
+      /* hand back the tags that are now completely written, and index
+       * them */
+      done += len;
+      n = 0;
+      for (; tail != end; tail++)
+	{
+	  FLVTag *tag = &out->fo_ring[tail & (OUTPUT_RING_SLOTS - 1)];
+	  if (done < tag->ft_size)
+	    break;
+	  done -= tag->ft_size;
+	  freed += tag->ft_size;
+	  n += IndexPut(out->fo_indexBuf + n, tag);
+	}
+      if (n && !out->fo_error && !indexFailed
+	  && write(out->fo_indexFd, out->fo_indexBuf, n) != n)
+	indexFailed = true;	/* resume falls back to scanning */
+
+      __sync_fetch_and_sub(&out->fo_bytes, freed);
+      OUTPUT_SET(out->fo_tail, tail);
+      OutputWake(out, &out->fo_wantRoom);
+    }
+  return NULL;
+}
+#endif
+
+/* Free the packets of the tags the writer is done with. */
+static void
+OutputReclaim(FLVOutput *out)
+{
+  uint32_t tail = OUTPUT_GET(out->fo_tail);
+
+  for (; out->fo_reclaim != tail; out->fo_reclaim++)
+    RTMPPacket_Free(&out->fo_ring[out->fo_reclaim & (OUTPUT_RING_SLOTS - 1)].
+		    ft_packet);
+}
+
+/* Start writing to file at its current position. indexFd is the
+ * keyframe index to append to, or -1.
+ */
+static bool
+OutputOpen(FLVOutput *out, FILE *file, int indexFd)
+{
+  off_t pos = ftello(file);
+
+  memset(out, 0, sizeof(FLVOutput));
+  out->fo_file = file;
+  out->fo_fd = fileno(file);
+  out->fo_offset = pos > 0 ? pos : 0;
+  out->fo_end = out->fo_offset;
+  out->fo_indexFd = indexFd;
+  out->fo_indexAudio = -1;
+
+  /* from here on the fd is written directly; make sure it is positioned
+   * where the FILE thinks it is (not possible, nor needed, on pipes) */
+  if (fflush(file))
+    return false;
+  if (pos >= 0)
+    lseek(out->fo_fd, pos, SEEK_SET);
+
+#ifndef WIN32
+  pthread_mutex_init(&out->fo_lock, NULL);
+  pthread_cond_init(&out->fo_cond, NULL);
+  if (pthread_create(&out->fo_thread, NULL, OutputThread, out))
+    {
+      Log(LOGERROR, "%s: Couldn't start writer thread", __FUNCTION__);
+      pthread_cond_destroy(&out->fo_cond);
+      pthread_mutex_destroy(&out->fo_lock);
+      return false;
+    }
+#endif
+  return true;
+}
+
+/* Wait for the queued tags to be written and stop the writer.
+ * Returns false if any write failed.
+ */
+static bool
+OutputClose(FLVOutput *out)
+{
+#ifndef WIN32
+  pthread_mutex_lock(&out->fo_lock);
+  OUTPUT_SET(out->fo_closing, 1);
+  pthread_cond_broadcast(&out->fo_cond);
+  pthread_mutex_unlock(&out->fo_lock);
+  pthread_join(out->fo_thread, NULL);
+  pthread_cond_destroy(&out->fo_cond);
+  pthread_mutex_destroy(&out->fo_lock);
+
+  /* give back what was preallocated past the end of the data */
+  if (out->fo_preallocated)
+    {
+      if (out->fo_preallocErr)
+	Log(LOGDEBUG, "%s: couldn't preallocate %u kB: %s", __FUNCTION__,
+	    out->fo_preallocated, strerror(out->fo_preallocErr));
+      else if (ftruncate(out->fo_fd, out->fo_offset) < 0)
+	Log(LOGDEBUG, "%s: ftruncate failed: %s", __FUNCTION__,
+	    strerror(errno));
+    }
+#endif
+  OutputReclaim(out);
+
+  /* whether the ring is big enough, and the disk fast enough */
+  Log(LOGINFO, "Output: queued at most %u tags / %u kB, waited %u times (%u ms)",
+      out->fo_stats.os_highSlots, out->fo_stats.os_highBytes / 1024,
+      out->fo_stats.os_stalls, out->fo_stats.os_stallMs);
+  Log(LOGDEBUG,
+      "Output: %u writes of %u kB average took %u ms (longest %u ms)",
+      out->fo_stats.os_writes,
+      out->fo_stats.os_writes ? (uint32_t) (out->fo_offset / 1024 / out->fo_stats.os_writes) : 0,
+      out->fo_stats.os_writeMs, out->fo_stats.os_maxWriteMs);
+  return !out->fo_error;
+}
+
+#ifndef WIN32
+static bool
+OutputFull(FLVOutput *out)
+{
+  uint32_t queued = out->fo_head - OUTPUT_GET(out->fo_tail);
+
+  return queued == OUTPUT_RING_SLOTS
+    || (queued && OUTPUT_GET(out->fo_bytes) >= OUTPUT_RING_BYTES);
+}
+#endif
+
+/* Get the next free slot, waiting for the writer if the ring is full.
+ * Returns NULL if the writer has failed.
+ */
+static FLVTag *
+OutputReserve(FLVOutput *out)
+{
+  FLVTag *tag;
+
+  OutputReclaim(out);
+#ifndef WIN32
+  if (OutputFull(out))
+    {
+      uint32_t t = RTMP_GetTime();
+
+      pthread_mutex_lock(&out->fo_lock);
+      OUTPUT_SET(out->fo_wantRoom, 1);
+      while (!OUTPUT_GET(out->fo_error) && OutputFull(out))
+	pthread_cond_wait(&out->fo_cond, &out->fo_lock);
+      OUTPUT_SET(out->fo_wantRoom, 0);
+      pthread_mutex_unlock(&out->fo_lock);
+
+      out->fo_stats.os_stalls++;
+      out->fo_stats.os_stallMs += RTMP_GetTime() - t;
+      OutputReclaim(out);
+    }
+#endif
+  if (OUTPUT_GET(out->fo_error))
+    return NULL;
+
+  tag = &out->fo_ring[out->fo_head & (OUTPUT_RING_SLOTS - 1)];
+  tag->ft_iovcnt = 0;
+  tag->ft_size = 0;
+  tag->ft_nindex = 0;
+  return tag;
+}
+
+/* Record a tag of a reserved slot in the keyframe index if it is one of
+ * the tags resuming looks for. offset is where the tag starts in the file.
+ */
+static void
+OutputIndex(FLVOutput *out, FLVTag *tag, off_t offset, uint8_t type,
+	    uint32_t timestamp, uint32_t size, const char *data)
+{
+  FLVIndexEntry e;
+
+  if (out->fo_indexFd < 0
+      || !IndexTag(&e, offset, type, timestamp, size, data,
+		   &out->fo_indexAudio))
+    return;
+
+  /* an aggregate with more than INDEX_PER_TAG of them keeps the last */
+  tag->ft_index[tag->ft_nindex < INDEX_PER_TAG ? tag->ft_nindex++
+		: INDEX_PER_TAG - 1] = e;
+}
+
+/* Queue a tag filled in after OutputReserve. The packet body, if any,
+ * is taken over by the tag.
+ */
+static bool
+OutputCommit(FLVOutput *out, FLVTag *tag, RTMPPacket *packet)
+{
+  int i;
+
+  for (i = 0; i < tag->ft_iovcnt; i++)
+    tag->ft_size += tag->ft_iov[i].iov_len;
+  if (packet)
+    {
+      tag->ft_packet = *packet;
+      packet->m_body = NULL;
+    }
+  else
+    tag->ft_packet.m_body = NULL;
+
+  out->fo_end += tag->ft_size;
+
+#ifdef WIN32
+  out->fo_tail = ++out->fo_head;
+  if (!OutputWrite(out, tag->ft_iov, tag->ft_iovcnt))
+    out->fo_error = 1;
+  else if (out->fo_indexFd >= 0)
+    {
+      int n = IndexPut(out->fo_indexBuf, tag);
+      if (n && write(out->fo_indexFd, out->fo_indexBuf, n) != n)
+	out->fo_indexFd = -1;
+    }
+  out->fo_offset = out->fo_end;
+  OutputReclaim(out);
+#else
+  {
+    uint32_t bytes = __sync_add_and_fetch(&out->fo_bytes, tag->ft_size);
+    uint32_t queued;
+
+    OUTPUT_SET(out->fo_head, out->fo_head + 1);	/* publishes the slot */
+    OutputWake(out, &out->fo_wantData);
+
+    queued = out->fo_head - OUTPUT_GET(out->fo_tail);
+    if (queued > out->fo_stats.os_highSlots)
+      out->fo_stats.os_highSlots = queued;
+    if (bytes > out->fo_stats.os_highBytes)
+      out->fo_stats.os_highBytes = bytes;
+  }
+#endif
+  return !OUTPUT_GET(out->fo_error);
+}
+
+// starts sockets
+bool
+InitSockets()
+{
+#ifdef WIN32
+  WORD version;
+  WSADATA wsaData;
+
+  version = MAKEWORD(1, 1);
+  return (WSAStartup(version, &wsaData) == 0);
+#else
+  return true;
+#endif
+}
+
+inline void
+CleanupSockets()
+{
+#ifdef WIN32
+  WSACleanup();
+#endif
+}
+
+#ifdef _DEBUG
+uint32_t debugTS = 0;
+int pnum = 0;
+
+FILE *netstackdump = 0;
+FILE *netstackdump_read = 0;
+#endif
+
+/* How far WriteStream got in lining up a resumed stream with the file,
+ * one for each download.
+ */
+typedef struct FLVResume
+{
+  bool bStopIgnoring;
+  bool bFoundKeyframe;
+  bool bFoundFlvKeyframe;
+  uint32_t nIgnoredFrameCounter;
+  uint32_t nIgnoredFlvFrameCounter;
+} FLVResume;
+#define MAX_IGNORED_FRAMES	50
+
+/* How to get the stream: everything but where it goes and which part of
+ * it. The segments of a parallel download share one.
+ */
+typedef struct FLVStream
+{
+  int protocol;
+  char *hostname;
+  int port;
+  char *sockshost;
+  AVal playpath;
+  AVal tcUrl;
+  AVal swfUrl;
+  AVal pageUrl;
+  AVal app;
+  AVal auth;
+  AVal swfHash;
+  uint32_t swfSize;
+  AVal flashVer;
+  AVal subscribepath;
+  AVal token;
+  AMFObject extras;
+  bool bLiveStream;
+  long int timeout;
+  uint32_t bufferTime;
+  bool bOverrideBufferTime;
+  int nSkipKeyFrames;
+  bool bStdoutMode;
+  bool bHashes;
+  FLVSession *session;		// to check for cancelling
+} FLVStream;
+
+/* How far one connection of a session got. Only the connection writes
+ * it, FLVSession_Query reads it from any thread at any time. Each field
+ * stands on its own, so they are stored and loaded one by one without
+ * ordering: the download loop pays no more than plain stores for it,
+ * and a reader may see one packet more in one field than in another.
+ */
+#ifdef __ATOMIC_RELAXED
+#define STATS_GET(v)		__atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STATS_SET(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+#else
+#define STATS_GET(v)		(*(volatile __typeof__(v) *) &(v))
+#define STATS_SET(v, x)		(*(volatile __typeof__(v) *) &(v) = (x))
+#endif
+#define STALL_MS	2000	// without data, to count as a stall
+#define RATE_MS		1000	// to average the current bitrate over
+
+typedef struct FLVPart
+{
+  uint32_t pt_start;		// ms into the stream it was asked to start at
+  uint32_t pt_stop;		// and to stop at, 0 for the end
+  uint32_t pt_timestamp;	// ms into the stream it got to
+  uint32_t pt_duration;		// of the stream in ms, 0 while unknown
+  uint64_t pt_bytes;		// in its file
+  uint64_t pt_received;		// of that, got in this session
+  uint32_t pt_bitrate;		// kbit/s over the last RATE_MS
+  uint32_t pt_lastData;		// RTMP_GetTime() of the last packet
+  uint32_t pt_stalls;
+  uint32_t pt_reconnects;
+} FLVPart;
+
+/* One run of flvstreamer, so that it can be cancelled on its own while
+ * other downloads go on in the same process. RTMP_ctrlC, set by the
+ * signal handlers, still stops all of them.
+ *
+ * Cancelling also shuts down the sockets of the download, so that a
+ * recv() waiting for the server returns at once. The session keeps a
+ * dup() of each of its sockets for that: the RTMP code may close its
+ * own at any time, the copy stays valid until SessionUnwatch().
+ *
+ * ss_lock guards the sockets; the callbacks are
+ * called under ss_callbackLock, so that they may cancel or query the
+ * session.
+ */
+#define MAX_WATCHED	32
+#define MAX_SEGMENTS	16	// connections of a parallel download
+#define MAX_KEPT	16
+#define PROGRESS_MS	200
+
+struct FLVSession
+{
+  FLVStream ss_stream;
+  char *ss_file;		// NULL for stdout
+  bool ss_resume;
+  uint32_t ss_start;
+  uint32_t ss_stop;
+  int ss_parallel;
+  FLVCallbacks ss_callbacks;
+  void *ss_ctx;
+  char *ss_kept[MAX_KEPT];	// strings the stream points into, ours to free
+  int ss_nKept;
+
+  int ss_state;			// FLV_IDLE, FLV_RUNNING, FLV_DONE
+  int ss_status;
+  uint32_t ss_startTime;	// RTMP_GetTime() of FLVSession_Run
+  uint32_t ss_endTime;
+  bool ss_cancel;
+  FLVPart ss_parts[MAX_SEGMENTS];
+  int ss_nParts;
+#ifndef WIN32
+  pthread_mutex_t ss_lock;
+  pthread_mutex_t ss_callbackLock;
+  int ss_sockets[MAX_WATCHED];	// -1 for a free slot
+  pthread_t ss_thread;
+  bool ss_threaded;
+#endif
+};
+
+#ifdef WIN32
+#define SESSION_LOCK(ss, lock)
+#define SESSION_UNLOCK(ss, lock)
+#else
+#define SESSION_LOCK(ss, lock)		pthread_mutex_lock(&(ss)->lock)
+#define SESSION_UNLOCK(ss, lock)	pthread_mutex_unlock(&(ss)->lock)
+#endif
+
+static FLVSession *
+SessionAlloc(void)
+{
+  FLVSession *ss = calloc(1, sizeof(FLVSession));
+#ifndef WIN32
+  int i;
+
+  if (!ss)
+    return NULL;
+  pthread_mutex_init(&ss->ss_lock, NULL);
+  pthread_mutex_init(&ss->ss_callbackLock, NULL);
+  for (i = 0; i < MAX_WATCHED; i++)
+    ss->ss_sockets[i] = -1;
+#endif
+  return ss;
+}
+
+/* Hand str over to the session, to be freed with it. */
+static char *
+SessionKeep(FLVSession * ss, char *str)
+{
+  if (str && ss->ss_nKept < MAX_KEPT)
+    ss->ss_kept[ss->ss_nKept++] = str;
+  else if (str)
+    {
+      Log(LOGERROR, "%s: too many strings", __FUNCTION__);
+      free(str);
+      str = NULL;
+    }
+  return str;
+}
+
+/* Point av at a copy of str, if there is one. */
+static void
+SessionString(FLVSession * ss, AVal * av, const char *str)
+{
+  if (str)
+    {
+      av->av_val = SessionKeep(ss, strdup(str));
+      av->av_len = av->av_val ? strlen(av->av_val) : 0;
+    }
+}
+
+void
+FLVSession_Free(FLVSession * ss)
+{
+  int i;
+
+  if (!ss)
+    return;
+#ifndef WIN32
+  if (ss->ss_threaded)
+    pthread_join(ss->ss_thread, NULL);
+  pthread_mutex_destroy(&ss->ss_lock);
+  pthread_mutex_destroy(&ss->ss_callbackLock);
+#endif
+  for (i = 0; i < ss->ss_nKept; i++)
+    free(ss->ss_kept[i]);
+  AMF_Reset(&ss->ss_stream.extras);
+  free(ss);
+}
+
+void
+FLVSession_Cancel(FLVSession * ss)
+{
+#ifndef WIN32
+  int i;
+
+  SESSION_LOCK(ss, ss_lock);
+  OUTPUT_SET(ss->ss_cancel, true);
+  for (i = 0; i < MAX_WATCHED; i++)
+    if (ss->ss_sockets[i] >= 0)
+      shutdown(ss->ss_sockets[i], SHUT_RDWR);
+  SESSION_UNLOCK(ss, ss_lock);
+#else
+  OUTPUT_SET(ss->ss_cancel, true);
+#endif
+}
+
+static bool
+Cancelled(FLVSession * ss)
+{
+  return RTMP_ctrlC || OUTPUT_GET(ss->ss_cancel);
+}
+
+/* Let FLVSession_Cancel shut down the socket of a connected rtmp.
+ * Returns the slot for SessionUnwatch, or -1.
+ */
+static int
+SessionWatch(FLVSession * ss, RTMP * rtmp)
+{
+  int slot = -1;
+#ifndef WIN32
+  int i;
+
+  SESSION_LOCK(ss, ss_lock);
+  for (i = 0; i < MAX_WATCHED && slot < 0; i++)
+    if (ss->ss_sockets[i] < 0)
+      {
+	ss->ss_sockets[i] = dup(rtmp->m_socket);
+	if (ss->ss_sockets[i] >= 0)
+	  slot = i;
+      }
+  // cancelled while we were connecting
+  if (slot >= 0 && OUTPUT_GET(ss->ss_cancel))
+    shutdown(ss->ss_sockets[slot], SHUT_RDWR);
+  SESSION_UNLOCK(ss, ss_lock);
+#endif
+  return slot;
+}
+
+static void
+SessionUnwatch(FLVSession * ss, int slot)
+{
+#ifndef WIN32
+  if (slot < 0)
+    return;
+  SESSION_LOCK(ss, ss_lock);
+  close(ss->ss_sockets[slot]);
+  ss->ss_sockets[slot] = -1;
+  SESSION_UNLOCK(ss, ss_lock);
+#endif
+}
+
+/* Split the progress of the session into n parts, one for each
+ * connection, each with the range of the stream it is to get.
+ */
+static FLVPart *
+SessionParts(FLVSession * ss, int n, const uint32_t * start,
+	     const uint32_t * stop)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      FLVPart *part = &ss->ss_parts[i];
+
+      STATS_SET(part->pt_start, start[i]);
+      STATS_SET(part->pt_stop, stop[i]);
+      STATS_SET(part->pt_timestamp, start[i]);
+      STATS_SET(part->pt_duration, 0);
+      STATS_SET(part->pt_bytes, 0);
+      STATS_SET(part->pt_received, 0);
+      STATS_SET(part->pt_bitrate, 0);
+      STATS_SET(part->pt_lastData, RTMP_GetTime());
+      STATS_SET(part->pt_stalls, 0);
+      STATS_SET(part->pt_reconnects, 0);
+    }
+  OUTPUT_SET(ss->ss_nParts, n);
+  return ss->ss_parts;
+}
+
+/* Add up the parts of the session. percent is of the ranges the parts
+ * were asked for, -1 while the duration is not known.
+ */
+static void
+SessionStats(FLVSession * ss, FLVSessionInfo * info)
+{
+  uint32_t now = RTMP_GetTime(), end;
+  uint64_t received = 0;
+  double got = 0, total = 0;
+  bool known = true;
+  int i, n = OUTPUT_GET(ss->ss_nParts);
+
+  memset(info, 0, sizeof(FLVSessionInfo));
+  info->state = OUTPUT_GET(ss->ss_state);
+  if (info->state == FLV_DONE)
+    info->status = OUTPUT_GET(ss->ss_status);
+
+  for (i = 0; i < n; i++)
+    {
+      FLVPart *part = &ss->ss_parts[i];
+      uint32_t start = STATS_GET(part->pt_start);
+      uint32_t stop = STATS_GET(part->pt_stop);
+      uint32_t timestamp = STATS_GET(part->pt_timestamp);
+      uint32_t duration = STATS_GET(part->pt_duration);
+
+      info->bytes += STATS_GET(part->pt_bytes);
+      received += STATS_GET(part->pt_received);
+      // a stalled connection is not getting anything now
+      if (info->state == FLV_RUNNING
+	  && now - STATS_GET(part->pt_lastData) < STALL_MS)
+	info->bitrate += STATS_GET(part->pt_bitrate);
+      info->stalls += STATS_GET(part->pt_stalls);
+      info->reconnects += STATS_GET(part->pt_reconnects);
+      if (timestamp > info->timestamp)
+	info->timestamp = timestamp;
+      if (duration > info->duration)
+	info->duration = duration;
+
+      if (!stop)
+	stop = duration;
+      if (!stop)
+	known = false;
+      else if (stop > start)
+	{
+	  if (timestamp > stop)
+	    timestamp = stop;
+	  if (timestamp > start)
+	    got += timestamp - start;
+	  total += stop - start;
+	}
+    }
+
+  info->percent = known && total > 0 ? got / total * 100.0 : -1;
+  if (info->state == FLV_DONE && info->status == RD_SUCCESS)
+    info->percent = 100.0;
+
+  if (info->state != FLV_IDLE)
+    {
+      end = info->state == FLV_DONE ? OUTPUT_GET(ss->ss_endTime) : now;
+      info->elapsed = end - OUTPUT_GET(ss->ss_startTime);
+    }
+  if (info->elapsed > 0)
+    info->avgBitrate = (uint32_t) (received * 8 / info->elapsed);
+}
+
+static void
+SessionProgress(FLVSession * ss)
+{
+  FLVSessionInfo info;
+
+  if (!ss->ss_callbacks.progress)
+    return;
+  SessionStats(ss, &info);
+  SESSION_LOCK(ss, ss_callbackLock);
+  ss->ss_callbacks.progress(ss->ss_ctx, &info);
+  SESSION_UNLOCK(ss, ss_callbackLock);
+}
+
+/* Log an error and tell the error callback. */
+static void
+SessionError(FLVSession * ss, const char *format, ...)
+{
+  char str[256];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(str, sizeof(str), format, args);
+  va_end(args);
+
+  Log(LOGERROR, "%s", str);
+  if (ss->ss_callbacks.error)
+    {
+      SESSION_LOCK(ss, ss_callbackLock);
+      ss->ss_callbacks.error(ss->ss_ctx, str);
+      SESSION_UNLOCK(ss, ss_callbackLock);
+    }
+}
+
+void
+sigIntHandler(int sig)
+{
+  RTMP_ctrlC = true;
+  LogPrintf("Caught signal: %d, cleaning up, just a second...\n", sig);
+  // ignore all these signals now and let the connection close
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+#ifndef WIN32
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+#endif
+}
+
+int
+WriteHeader(char **buf,		// target pointer, maybe preallocated
+	    unsigned int len	// length of buffer if preallocated
+  )
+{
+  char flvHeader[] = { 'F', 'L', 'V', 0x01,
+    0x05,			// video + audio, we finalize later if the value is different
+    0x00, 0x00, 0x00, 0x09,
+    0x00, 0x00, 0x00, 0x00	// first prevTagSize=0
+  };
+
+  unsigned int size = sizeof(flvHeader);
+
+  if (size > len)
+    {
+      *buf = (char *) realloc(*buf, size);
+      if (*buf == 0)
+	{
+	  Log(LOGERROR, "Couldn't reallocate memory!");
+	  return -1;		// fatal error
+	}
+    }
+  memcpy(*buf, flvHeader, sizeof(flvHeader));
+  return size;
+}
+
+static const AVal av_onMetaData = AVC("onMetaData");
+static const AVal av_duration = AVC("duration");
+
+/* what the finalize pass writes into onMetaData, see Finalize() */
+static const AVal av_filesize = AVC("filesize");
+static const AVal av_lasttimestamp = AVC("lasttimestamp");
+static const AVal av_lastkeyframetimestamp = AVC("lastkeyframetimestamp");
+static const AVal av_lastkeyframelocation = AVC("lastkeyframelocation");
+static const AVal av_hasVideo = AVC("hasVideo");
+static const AVal av_hasAudio = AVC("hasAudio");
+static const AVal av_hasKeyframes = AVC("hasKeyframes");
+static const AVal av_hasMetadata = AVC("hasMetadata");
+static const AVal av_videocodecid = AVC("videocodecid");
+static const AVal av_audiocodecid = AVC("audiocodecid");
+static const AVal av_audiosamplerate = AVC("audiosamplerate");
+static const AVal av_audiosamplesize = AVC("audiosamplesize");
+static const AVal av_stereo = AVC("stereo");
+static const AVal av_keyframes = AVC("keyframes");
+static const AVal av_filepositions = AVC("filepositions");
+static const AVal av_times = AVC("times");
+static const AVal av_padding = AVC("padding");
+
+static const AVal *finalProps[] = {
+  &av_duration, &av_filesize, &av_lasttimestamp, &av_lastkeyframetimestamp,
+  &av_lastkeyframelocation, &av_hasVideo, &av_hasAudio, &av_hasKeyframes,
+  &av_hasMetadata, &av_videocodecid, &av_audiocodecid, &av_audiosamplerate,
+  &av_audiosamplesize, &av_stereo, &av_keyframes, &av_padding, NULL
+};
+
+/* Copy the encoded properties of an onMetaData body to out, except those
+ * in finalProps. out must have room for size bytes. Returns the number
+ * of properties copied and their size in *len, or -1 if body isn't
+ * onMetaData.
+ */
+static int
+MetaStrip(const char *body, uint32_t size, char *out, uint32_t * len)
+{
+  const char *p = body + 13, *end = body + size;
+  int n = 0;
+
+  *len = 0;
+  if (size < 14 || body[0] != AMF_STRING || memcmp(body + 3, "onMetaData", 10))
+    return -1;
+  if (*p == AMF_ECMA_ARRAY && end - p >= 5)
+    p += 5;
+  else if (*p == AMF_OBJECT)
+    p++;
+  else
+    return 0;
+
+  while (end - p >= 3 && AMF_DecodeInt24(p) != AMF_OBJECT_END)
+    {
+      AMFObjectProperty prop;
+      int i, nRes = AMFProp_Decode(&prop, p, end - p, true);
+      if (nRes < 0)
+	break;
+      for (i = 0; finalProps[i]; i++)
+	if (AVMATCH(&prop.p_name, finalProps[i]))
+	  break;
+      if (!finalProps[i])
+	{
+	  memcpy(out + *len, p, nRes);
+	  *len += nRes;
+	  n++;
+	}
+      AMFProp_Reset(&prop);
+      p += nRes;
+    }
+  return n;
+}
+
+/* Whether two onMetaData bodies are the same, apart from what the
+ * finalize pass changed.
+ */
+static bool
+MetaMatches(const char *a, uint32_t alen, const char *b, uint32_t blen)
+{
+  char *sa = malloc(alen), *sb = malloc(blen);
+  uint32_t la, lb;
+  bool bMatch = sa && sb
+    && MetaStrip(a, alen, sa, &la) >= 0 && MetaStrip(b, blen, sb, &lb) >= 0
+    && la == lb && memcmp(sa, sb, la) == 0;
+
+  free(sa);
+  free(sb);
+  return bMatch;
+}
+
+/* The first onMetaData of a download that is finalized gets a padding
+ * property, a long string of zeros, so that Finalize can write the
+ * keyframes into its room instead of moving the rest of the file. It is
+ * made for META_PAD_PER_SEC bytes of keyframes a second of the
+ * duration, or of an hour if that isn't known.
+ */
+#define META_PAD_MIN		(2 + 7 + 1 + 4)	/* the property, empty */
+#define META_PAD_PER_SEC	(2 * 18)	/* two keyframes a second */
+#define META_PAD_MAX		(4 * 1024 * 1024)
+
+/* Encode the name and type of a padding property of len bytes in all.
+ * The value, len - META_PAD_MIN bytes, follows.
+ */
+static char *
+MetaPadding(char *p, char *pend, uint32_t len)
+{
+  p = AMF_EncodeInt16(p, pend, av_padding.av_len);
+  memcpy(p, av_padding.av_val, av_padding.av_len);
+  p += av_padding.av_len;
+  *p++ = AMF_LONG_STRING;
+  return AMF_EncodeInt32(p, pend, len - META_PAD_MIN);
+}
+
+/* Copy an onMetaData body into padded, with a padding property added at
+ * its end. Returns false if body isn't onMetaData, or on no memory. The
+ * copy is freed with RTMPPacket_Free.
+ */
+static bool
+MetaReserve(const char *body, uint32_t size, RTMPPacket * padded)
+{
+  AMFObject obj;
+  AMFObjectProperty prop;
+  double duration = 0;
+  uint32_t pad;
+  char *p;
+
+  if (size < 18 || body[0] != AMF_STRING || memcmp(body + 3, "onMetaData", 10)
+      || (body[13] != AMF_ECMA_ARRAY && body[13] != AMF_OBJECT)
+      || AMF_DecodeInt24(body + size - 3) != AMF_OBJECT_END)
+    return false;
+  if (AMF_Decode(&obj, body, size, false) >= 0)
+    {
+      if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
+	duration = AMFProp_GetNumber(&prop);
+      AMF_Reset(&obj);
+    }
+
+  if (duration <= 0 || duration > META_PAD_MAX / META_PAD_PER_SEC)
+    duration = duration > 0 ? META_PAD_MAX / META_PAD_PER_SEC : 3600;
+  pad = META_PAD_MIN + 1024 + (uint32_t) (duration * META_PAD_PER_SEC);
+  if (size + pad > 0xffffff || !RTMPPacket_Alloc(padded, size + pad))
+    return false;
+
+  p = padded->m_body;
+  memcpy(p, body, size - 3);
+  if (body[13] == AMF_ECMA_ARRAY)
+    AMF_EncodeInt32(p + 14, p + 18, AMF_DecodeInt32(body + 14) + 1);
+  p = MetaPadding(p + size - 3, p + size + pad, pad);
+  p += pad - META_PAD_MIN;	/* zeroed by RTMPPacket_Alloc */
+  AMF_EncodeInt24(p, p + 3, AMF_OBJECT_END);
+  padded->m_nBodySize = size + pad;
+  return true;
+}
+
+// Returns -4 if writing the output failed, -3 if Play.Close/Stop, -2 if fatal error, -1 if no more media packets, 0 if ignorable error, >0 number of bytes written
+int
+WriteStream(RTMP * rtmp, FLVOutput * out,	// where the tags are written
+	    FLVResume * rs,	// state of the resume checks
+	    uint32_t * tsm,	// pointer to timestamp, will contain timestamp of last video packet returned
+	    bool bResume,	// resuming mode, will not write FLV header and compare metaHeader and first kexframe
+	    bool bLiveStream,	// live mode, will not report absolute timestamps
+	    uint32_t nResumeTS,	// resume keyframe timestamp
+	    char *metaHeader,	// pointer to meta header (if bResume == TRUE)
+	    uint32_t nMetaHeaderSize,	// length of meta header, if zero meta header check omitted (if bResume == TRUE)
+	    char *initialFrame,	// pointer to initial keyframe (no FLV header or tagSize, raw data) (if bResume == TRUE)
+	    uint8_t initialFrameType,	// initial frame type (audio or video)
+	    uint32_t nInitialFrameSize,	// length of initial frame in bytes, if zero initial frame check omitted (if bResume == TRUE)
+	    uint8_t * dataType	// whenever we get a video/audio packet we set an appropriate flag here, this will be later written to the FLV header
+  )
+{
+  uint32_t prevTagSize = 0;
+  int rtnGetNextMediaPacket = 0, ret = -1;
+  RTMPPacket packet = { 0 };
+
+  rtnGetNextMediaPacket = RTMP_GetNextMediaPacket(rtmp, &packet);
+  while (rtnGetNextMediaPacket)
+    {
+      char *packetBody = packet.m_body;
+      unsigned int nPacketLen = packet.m_nBodySize;
+
+      // Return -3 if this was completed nicely with invoke message Play.Stop or Play.Complete
+      if (rtnGetNextMediaPacket == 2)
+	{
+	  Log(LOGDEBUG,
+	      "Got Play.Complete or Play.Stop from server. Assuming stream is complete");
+	  ret = -3;
+	  break;
+	}
+
+      // skip video info/command packets
+      if (packet.m_packetType == 0x09 &&
+	  nPacketLen == 2 && ((*packetBody & 0xf0) == 0x50))
+	{
+	  ret = 0;
+	  break;
+	}
+
+      if (packet.m_packetType == 0x09 && nPacketLen <= 5)
+	{
+	  Log(LOGWARNING, "ignoring too small video packet: size: %d",
+	      nPacketLen);
+	  ret = 0;
+	  break;
+	}
+      if (packet.m_packetType == 0x08 && nPacketLen <= 1)
+	{
+	  Log(LOGWARNING, "ignoring too small audio packet: size: %d",
+	      nPacketLen);
+	  ret = 0;
+	  break;
+	}
+#ifdef _DEBUG
+      Log(LOGDEBUG, "type: %02X, size: %d, TS: %d ms, abs TS: %d",
+	  packet.m_packetType, nPacketLen, packet.m_nTimeStamp,
+	  packet.m_hasAbsTimestamp);
+      if (packet.m_packetType == 0x09)
+	Log(LOGDEBUG, "frametype: %02X", (*packetBody & 0xf0));
+#endif
+
+      // check the header if we get one
+      if (bResume && packet.m_nTimeStamp == 0)
+	{
+	  if (nMetaHeaderSize > 0 && packet.m_packetType == 0x12)
+	    {
+
+	      AMFObject metaObj;
+	      int nRes = AMF_Decode(&metaObj, packetBody, nPacketLen, false);
+	      if (nRes >= 0)
+		{
+		  AVal metastring;
+		  AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0),
+				    &metastring);
+
+		  if (AVMATCH(&metastring, &av_onMetaData))
+		    {
+		      // compare, allowing for what finalizing the file changed
+		      if (((nMetaHeaderSize != nPacketLen) ||
+			   (memcmp(metaHeader, packetBody, nMetaHeaderSize) !=
+			    0))
+			  && !MetaMatches(metaHeader, nMetaHeaderSize,
+					  packetBody, nPacketLen))
+			{
+			  ret = -2;
+			}
+		    }
+		  AMF_Reset(&metaObj);
+		  if (ret == -2)
+		    break;
+		}
+	    }
+
+	  // check first keyframe to make sure we got the right position in the stream!
+	  // (the first non ignored frame)
+	  if (nInitialFrameSize > 0)
+	    {
+
+	      // video or audio data
+	      if (packet.m_packetType == initialFrameType
+		  && nInitialFrameSize == nPacketLen)
+		{
+		  // we don't compare the sizes since the packet can contain several FLV packets, just make
+		  // sure the first frame is our keyframe (which we are going to rewrite)
+		  if (memcmp(initialFrame, packetBody, nInitialFrameSize) ==
+		      0)
 		    {
 		      Log(LOGDEBUG, "Checked keyframe successfully!");
-		      bFoundKeyframe = true;
+		      rs->bFoundKeyframe = true;
 		      ret = 0;	// ignore it! (what about audio data after it? it is handled by ignoring all 0ms frames, see below)
 		      break;
 		    }
@@ -292,7 +1670,7 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 				  ret = -2;
 				  break;
 				}
-			      bFoundFlvKeyframe = true;
+			      rs->bFoundFlvKeyframe = true;
 
 			      // ok, skip this packet
 			      // check whether skipable:
@@ -323,7 +1701,7 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 		    }
 		stopKeyframeSearch:
 		  ;
-		  if (!bFoundFlvKeyframe)
+		  if (!rs->bFoundFlvKeyframe)
 		    {
 		      Log(LOGERROR,
 			  "Couldn't find the seeked keyframe in this chunk!");
@@ -335,7 +1713,7 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 	}
 
       if (bResume && packet.m_nTimeStamp > 0
-	  && (bFoundFlvKeyframe || bFoundKeyframe))
+	  && (rs->bFoundFlvKeyframe || rs->bFoundKeyframe))
 	{
 	  // another problem is that the server can actually change from 09/08 video/audio packets to an FLV stream
 	  // or vice versa and our keyframe check will prevent us from going along with the new stream if we resumed
@@ -344,715 +1722,1779 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 	  // We assume that if we found one keyframe somewhere and were already beyond TS > 0 we have written
 	  // data to the output which means we can accept all forthcoming data inclusing the change between 08/09 <-> FLV
 	  // packets
-	  bFoundFlvKeyframe = true;
-	  bFoundKeyframe = true;
+	  rs->bFoundFlvKeyframe = true;
+	  rs->bFoundKeyframe = true;
 	}
 
       // skip till we find out keyframe (seeking might put us somewhere before it)
-      if (bResume && !bFoundKeyframe && packet.m_packetType != 0x16)
+      if (bResume && !rs->bFoundKeyframe && packet.m_packetType != 0x16)
 	{
 	  Log(LOGWARNING,
 	      "Stream does not start with requested frame, ignoring data... ");
-	  nIgnoredFrameCounter++;
-	  if (nIgnoredFrameCounter > MAX_IGNORED_FRAMES)
+	  rs->nIgnoredFrameCounter++;
+	  if (rs->nIgnoredFrameCounter > MAX_IGNORED_FRAMES)
 	    ret = -2;		// fatal error, couldn't continue stream
 	  else
 	    ret = 0;
 	  break;
 	}
       // ok, do the same for FLV streams
-      if (bResume && !bFoundFlvKeyframe && packet.m_packetType == 0x16)
+      if (bResume && !rs->bFoundFlvKeyframe && packet.m_packetType == 0x16)
 	{
 	  Log(LOGWARNING,
 	      "Stream does not start with requested FLV frame, ignoring data... ");
-	  nIgnoredFlvFrameCounter++;
-	  if (nIgnoredFlvFrameCounter > MAX_IGNORED_FRAMES)
+	  rs->nIgnoredFlvFrameCounter++;
+	  if (rs->nIgnoredFlvFrameCounter > MAX_IGNORED_FRAMES)
 	    ret = -2;
 	  else
 	    ret = 0;
 	  break;
 	}
-
-      // if bResume, we continue a stream, we have to ignore the 0ms frames since these are the first keyframes, we've got these
-      // so don't mess around with multiple copies sent by the server to us! (if the keyframe is found at a later position
-      // there is only one copy and it will be ignored by the preceding if clause)
-      if (!bStopIgnoring && bResume && packet.m_packetType != 0x16)
-	{			// exclude type 0x16 (FLV) since it can conatin several FLV packets
-	  if (packet.m_nTimeStamp == 0)
+
+      // if bResume, we continue a stream, we have to ignore the 0ms frames since these are the first keyframes, we've got these
+      // so don't mess around with multiple copies sent by the server to us! (if the keyframe is found at a later position
+      // there is only one copy and it will be ignored by the preceding if clause)
+      if (!rs->bStopIgnoring && bResume && packet.m_packetType != 0x16)
+	{			// exclude type 0x16 (FLV) since it can conatin several FLV packets
+	  if (packet.m_nTimeStamp == 0)
+	    {
+	      ret = 0;
+	      break;
+	    }
+	  else
+	    {
+	      rs->bStopIgnoring = true;	// stop ignoring packets
+	    }
+	}
+
+      FLVTag *tag = OutputReserve(out);
+      struct iovec *iov;
+      int niov = 0;
+      char *tagHeader, *ptr, *pend, *trailer;
+      unsigned int size = nPacketLen;
+
+      if (!tag)
+	{
+	  ret = -4;
+	  break;
+	}
+      iov = tag->ft_iov;
+      tagHeader = ptr = tag->ft_head;
+      pend = tagHeader + 11;
+      trailer = tag->ft_tail;
+
+      uint32_t nTimeStamp = 0;	// use to return timestamp of last processed packet
+
+      // audio (0x08), video (0x09) or metadata (0x12) packets :
+      // construct 11 byte header then add rtmp packet's data
+      if (packet.m_packetType == 0x08 || packet.m_packetType == 0x09
+	  || packet.m_packetType == 0x12)
+	{
+	  // room for Finalize in the first meta data, which it replaces
+	  if (packet.m_packetType == 0x12 && out->fo_reserveMeta)
+	    {
+	      RTMPPacket padded = packet;
+	      if (MetaReserve(packetBody, nPacketLen, &padded))
+		{
+		  RTMPPacket_Free(&packet);
+		  packet = padded;
+		  packetBody = packet.m_body;
+		  size = nPacketLen = packet.m_nBodySize;
+		}
+	      out->fo_reserveMeta = false;
+	    }
+
+	  // set data type
+	  *dataType |=
+	    (((packet.m_packetType == 0x08) << 2) | (packet.m_packetType ==
+						     0x09));
+
+	  nTimeStamp = nResumeTS + packet.m_nTimeStamp;
+	  prevTagSize = 11 + nPacketLen;
+
+	  *ptr = packet.m_packetType;
+	  ptr++;
+	  ptr = AMF_EncodeInt24(ptr, pend, nPacketLen);
+
+	  /*if(packet.m_packetType == 0x09) { // video
+
+	     // H264 fix:
+	     if((packetBody[0] & 0x0f) == 7) { // CodecId = H264
+	     uint8_t packetType = *(packetBody+1);
+
+	     uint32_t ts = AMF_DecodeInt24(packetBody+2); // composition time
+	     int32_t cts = (ts+0xff800000)^0xff800000;
+	     Log(LOGDEBUG, "cts  : %d\n", cts);
+
+	     nTimeStamp -= cts;
+	     // get rid of the composition time
+	     CRTMP::EncodeInt24(packetBody+2, 0);
+	     }
+	     Log(LOGDEBUG, "VIDEO: nTimeStamp: 0x%08X (%d)\n", nTimeStamp, nTimeStamp);
+	     } */
+
+	  ptr = AMF_EncodeInt24(ptr, pend, nTimeStamp);
+	  *ptr = (char) ((nTimeStamp & 0xFF000000) >> 24);
+	  ptr++;
+
+	  // stream id
+	  ptr = AMF_EncodeInt24(ptr, pend, 0);
+
+	  iov[niov].iov_base = tagHeader;
+	  iov[niov++].iov_len = 11;
+	  size += 11;
+
+	  OutputIndex(out, tag, out->fo_end, packet.m_packetType, nTimeStamp,
+		      nPacketLen, packetBody);
+	}
+
+      iov[niov].iov_base = packetBody;
+      iov[niov++].iov_len = nPacketLen;
+
+      // correct tagSize and obtain timestamp if we have an FLV stream
+      if (packet.m_packetType == 0x16)
+	{
+	  unsigned int pos = 0;
+	  char *bodyEnd = packetBody + nPacketLen;
+
+	  while (pos + 11 < nPacketLen)
+	    {
+	      uint32_t dataSize = AMF_DecodeInt24(packetBody + pos + 1);	// size without header (11) and without prevTagSize (4)
+	      nTimeStamp = AMF_DecodeInt24(packetBody + pos + 4);
+	      nTimeStamp |= (packetBody[pos + 7] << 24);
+
+	      /*
+	         CRTMP::EncodeInt24(ptr+pos+4, nTimeStamp);
+	         ptr[pos+7] = (nTimeStamp>>24)&0xff;// */
+
+	      // set data type
+	      *dataType |=
+		(((*(packetBody + pos) ==
+		   0x08) << 2) | (*(packetBody + pos) == 0x09));
+
+	      if (pos + 11 + dataSize <= nPacketLen)
+		OutputIndex(out, tag, out->fo_end + pos, packetBody[pos],
+			    nTimeStamp, dataSize, packetBody + pos + 11);
+
+	      if (pos + 11 + dataSize + 4 > nPacketLen)
+		{
+		  if (pos + 11 + dataSize > nPacketLen)
+		    {
+		      Log(LOGERROR,
+			  "Wrong data size (%lu), stream corrupted, aborting!",
+			  dataSize);
+		      ret = -2;
+		      break;
+		    }
+		  Log(LOGWARNING, "No tagSize found, appending!");
+
+		  // we have to append a last tagSize!
+		  prevTagSize = dataSize + 11;
+		  AMF_EncodeInt32(trailer, trailer + 4, prevTagSize);
+		  iov[niov].iov_base = trailer;
+		  iov[niov++].iov_len = 4;
+		  size += 4;
+		}
+	      else
+		{
+		  prevTagSize =
+		    AMF_DecodeInt32(packetBody + pos + 11 + dataSize);
+
+#ifdef _DEBUG
+		  Log(LOGDEBUG,
+		      "FLV Packet: type %02X, dataSize: %lu, tagSize: %lu, timeStamp: %lu ms",
+		      (unsigned char) packetBody[pos], dataSize, prevTagSize,
+		      nTimeStamp);
+#endif
+
+		  if (prevTagSize != (dataSize + 11))
+		    {
+#ifdef _DEBUG
+		      Log(LOGWARNING,
+			  "Tag and data size are not consitent, writing tag size according to dataSize+11: %d",
+			  dataSize + 11);
+#endif
+
+		      // the packet body is ours, fix it in place
+		      prevTagSize = dataSize + 11;
+		      AMF_EncodeInt32(packetBody + pos + 11 + dataSize, bodyEnd, prevTagSize);
+		    }
+		}
+
+	      pos += prevTagSize + 4;	//(11+dataSize+4);
+	    }
+	}
+      else
+	{			// FLV tag packets contain their own prevTagSize
+	  AMF_EncodeInt32(trailer, trailer + 4, prevTagSize);
+	  iov[niov].iov_base = trailer;
+	  iov[niov++].iov_len = 4;
+	  size += 4;
+	}
+
+      tag->ft_iovcnt = niov;
+      if (!OutputCommit(out, tag, &packet))
+	{
+	  ret = -4;
+	  break;
+	}
+
+      // In non-live this nTimeStamp can contain an absolute TS.
+      // Update ext timestamp with this absolute offset in non-live mode otherwise report the relative one
+      // LogPrintf("\nDEBUG: type: %02X, size: %d, pktTS: %dms, TS: %dms, bLiveStream: %d", packet.m_packetType, nPacketLen, packet.m_nTimeStamp, nTimeStamp, bLiveStream);
+      if (tsm)
+	*tsm = bLiveStream ? packet.m_nTimeStamp : nTimeStamp;
+
+
+      ret = size;
+      break;
+    }
+
+  if (rtnGetNextMediaPacket)
+    RTMPPacket_Free(&packet);
+  return ret;			// no more media packets
+}
+
+/* Copy the meta data from an onMetaData tag. Returns false if the tag
+ * is something else.
+ */
+static bool
+ReadMetaHeader(const FLVCursor * c, char **metaHeader,
+	       uint32_t * nMetaHeaderSize, double *duration)
+{
+  AMFObject metaObj;
+  AVal metastring;
+  AMFObjectProperty prop;
+  int nRes = AMF_Decode(&metaObj, c->c_body, c->c_size, false);
+  if (nRes < 0)
+    {
+      Log(LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
+      return false;
+    }
+
+  AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0), &metastring);
+  if (!AVMATCH(&metastring, &av_onMetaData))
+    {
+      AMF_Reset(&metaObj);
+      return false;
+    }
+  AMF_Dump(&metaObj);
+
+  *nMetaHeaderSize = c->c_size;
+  if (*metaHeader)
+    free(*metaHeader);
+  *metaHeader = (char *) malloc(*nMetaHeaderSize);
+  memcpy(*metaHeader, c->c_body, *nMetaHeaderSize);
+
+  // get duration
+  if (RTMP_FindFirstMatchingProperty(&metaObj, &av_duration, &prop))
+    {
+      *duration = AMFProp_GetNumber(&prop);
+      Log(LOGDEBUG, "File has duration: %f", *duration);
+    }
+  AMF_Reset(&metaObj);
+  return true;
+}
+
+int
+OpenResumeFile(const char *flvFile,	// file name [in]
+	       FILE ** file,	// opened file [out]
+	       off_t * size,	// size of the file [out]
+	       char **metaHeader,	// meta data read from the file [out]
+	       uint32_t * nMetaHeaderSize,	// length of metaHeader [out]
+	       double *duration,	// duration of the stream in ms [out]
+	       FLVIndex * index)	// keyframe index of the file [out]
+{
+  FLVFile flv;
+  FLVCursor c;
+  bool bFoundMetaHeader = false;
+  bool bFromIndex = false;
+  int i;
+
+  *nMetaHeaderSize = 0;
+  *size = 0;
+
+  *file = fopen(flvFile, "r+b");
+  if (!*file)
+    return RD_SUCCESS;		// RD_SUCCESS, because we go to fresh file mode instead of quiting
+
+  fseek(*file, 0, SEEK_END);
+  *size = ftello(*file);
+  fseek(*file, 0, SEEK_SET);
+
+  if (*size == 0)
+    return RD_SUCCESS;
+
+  // verify FLV format and read header
+  if (!FLV_Open(&flv, fileno(*file)))
+    return RD_FAILED;
+
+  // check we've got a valid FLV file to continue!
+  if ((flv.f_flags & 0x05) == 0)
+    {
+      Log(LOGERROR, "FLV file contains neither video nor audio, aborting!");
+      FLV_Close(&flv);
+      return RD_FAILED;
+    }
+
+  // the keyframe index tells us where the meta data is
+  IndexLoad(index, flvFile, *size);
+  for (i = 0; i < index->fi_count; i++)
+    if (index->fi_entries[i].ie_type == 0x12)
+      {
+	bFromIndex = true;
+	if (FLV_Seek(&flv, &c, index->fi_entries[i].ie_offset)
+	    && c.c_type == 0x12)
+	  bFoundMetaHeader =
+	    ReadMetaHeader(&c, metaHeader, nMetaHeaderSize, duration);
+	break;
+      }
+  if (bFromIndex && !bFoundMetaHeader)
+    {
+      // index doesn't match the file, scan it after all
+      Log(LOGDEBUG, "%s: no meta data at indexed offset", __FUNCTION__);
+      IndexFree(index);
+    }
+
+  // otherwise go through the file to find the meta data!
+  if (!bFoundMetaHeader && FLV_First(&flv, &c))
+    do
+      {
+	if (c.c_type == 0x12
+	    && ReadMetaHeader(&c, metaHeader, nMetaHeaderSize, duration))
+	  {
+	    bFoundMetaHeader = true;
+	    break;
+	  }
+      }
+    while (FLV_Next(&c));
+
+  FLV_Close(&flv);
+  if (!bFoundMetaHeader)
+    Log(LOGWARNING, "Couldn't locate meta data!");
+
+  return RD_SUCCESS;
+}
+
+/* Like GetLastKeyframe, but takes the keyframe from the index.
+ * Returns false if the index has none or doesn't match the file; in the
+ * latter case the index is dropped.
+ */
+static bool
+GetIndexedKeyframe(FLVFile * flv, FLVIndex * index, bool bAudioOnly,
+		   int nSkipKeyFrames, FLVCursor * c)
+{
+  const FLVIndexEntry *e = NULL;
+  int i;
+
+  for (i = index->fi_count - 1; i >= 0; i--)
+    {
+      const FLVIndexEntry *x = &index->fi_entries[i];
+      if (bAudioOnly ? x->ie_type != 0x08
+	  : (x->ie_type != 0x09 || !(x->ie_flags & INDEX_KEYFRAME)))
+	continue;
+      if (nSkipKeyFrames-- > 0)
+	continue;
+      e = x;
+      break;
+    }
+  if (!e)
+    return false;
+
+  if (!FLV_Seek(flv, c, e->ie_offset) || c->c_type != e->ie_type
+      || c->c_size != e->ie_size || c->c_timestamp != e->ie_timestamp
+      || (e->ie_type == 0x09 && (c->c_body[0] & 0xf0) != 0x10))
+    {
+      Log(LOGDEBUG, "%s: index doesn't match the file, scanning",
+	  __FUNCTION__);
+      IndexFree(index);
+      return false;
+    }
+  Log(LOGDEBUG, "Last keyframe found in index at offset %llu",
+      (unsigned long long) e->ie_offset);
+  return true;
+}
+
+int
+GetLastKeyframe(FILE * file,	// output file [in]
+		FLVIndex * index,	// keyframe index of the file [in]
+		int nSkipKeyFrames,	// max number of frames to skip when searching for key frame [in]
+		uint32_t * dSeek,	// offset of the last key frame [out]
+		char **initialFrame,	// content of the last keyframe [out]
+		int *initialFrameType,	// initial frame type (audio/video) [out]
+		uint32_t * nInitialFrameSize)	// length of initialFrame [out]
+{
+  FLVFile flv;
+  FLVCursor c;
+  bool bAudioOnly;
+
+  if (!FLV_Open(&flv, fileno(file)))
+    return RD_FAILED;
+
+  bAudioOnly = (flv.f_flags & 0x4) && !(flv.f_flags & 0x1);
+
+  Log(LOGDEBUG, "bAudioOnly: %d, size: %llu", bAudioOnly,
+      (unsigned long long) flv.f_size);
+
+  // ok, we have to get the timestamp of the last keyframe (only keyframes are seekable) / last audio frame (audio only streams)
+  if (!GetIndexedKeyframe(&flv, index, bAudioOnly, nSkipKeyFrames, &c))
+    {
+      // go through the file backwards and find the last video keyframe
+      if (!FLV_Last(&flv, &c))
+	{
+	  Log(LOGERROR,
+	      "Last tag is corrupt or truncated, couldn't find keyframe to resume from!");
+	  FLV_Close(&flv);
+	  return RD_FAILED;
+	}
+      for (;;)
+	{
+#ifdef _DEBUG
+	  Log(LOGDEBUG, "%02X: TS: %d ms", c.c_type, c.c_timestamp);
+#endif
+	  // as long as we don't have a keyframe / last audio frame
+	  if (bAudioOnly ? c.c_type == 0x08
+	      : (c.c_type == 0x09 && c.c_size > 0
+		 && (c.c_body[0] & 0xf0) == 0x10))
 	    {
-	      ret = 0;
-	      break;
+	      // this just continues the loop whenever the number of skipped frames is > 0,
+	      // so we look for the next keyframe to continue with
+	      //
+	      // this helps if resuming from the last keyframe fails and one doesn't want to start
+	      // the download from the beginning
+	      //
+	      if (nSkipKeyFrames-- <= 0)
+		break;
 	    }
-	  else
+	  if (!FLV_Prev(&c))
 	    {
-	      bStopIgnoring = true;	// stop ignoring packets
+	      if (c.c_offset == flv.f_start)
+		Log(LOGERROR, "Couldn't find keyframe to resume from!");
+	      else
+		Log(LOGERROR,
+		    "Unexpected start of file, error in tag sizes, couldn't arrive at prevTagSize=0");
+	      FLV_Close(&flv);
+	      return RD_FAILED;
 	    }
 	}
+    }
 
-      // calculate packet size and reallocate buffer if necessary
-      unsigned int size = nPacketLen
-	+
-	((packet.m_packetType == 0x08 || packet.m_packetType == 0x09
-	  || packet.m_packetType ==
-	  0x12) ? 11 : 0) + (packet.m_packetType != 0x16 ? 4 : 0);
-
-      if (size + 4 > len)
-	{			// the extra 4 is for the case of an FLV stream without a last prevTagSize (we need extra 4 bytes to append it)
-	  *buf = (char *) realloc(*buf, size + 4);
-	  if (*buf == 0)
-	    {
-	      Log(LOGERROR, "Couldn't reallocate memory!");
-	      ret = -1;		// fatal error
-	      break;
-	    }
-	}
-      char *ptr = *buf, *pend = ptr+size+4;
+  // save keyframe to compare/find position in stream
+  *initialFrameType = c.c_type;
+  *nInitialFrameSize = c.c_size;
+  *initialFrame = (char *) malloc(*nInitialFrameSize);
+  if (!*initialFrame)
+    {
+      Log(LOGERROR, "Couldn't read last keyframe, aborting!");
+      FLV_Close(&flv);
+      return RD_FAILED;
+    }
+  memcpy(*initialFrame, c.c_body, *nInitialFrameSize);
+  *dSeek = c.c_timestamp;	// set seek position to keyframe tmestamp
+  FLV_Close(&flv);
 
-      uint32_t nTimeStamp = 0;	// use to return timestamp of last processed packet
+  Log(LOGDEBUG, "Last keyframe found at: %d ms, size: %d, type: %02X", *dSeek,
+      *nInitialFrameSize, *initialFrameType);
 
-      // audio (0x08), video (0x09) or metadata (0x12) packets :
-      // construct 11 byte header then add rtmp packet's data
-      if (packet.m_packetType == 0x08 || packet.m_packetType == 0x09
-	  || packet.m_packetType == 0x12)
-	{
-	  // set data type
-	  *dataType |=
-	    (((packet.m_packetType == 0x08) << 2) | (packet.m_packetType ==
-						     0x09));
+  if (*dSeek != 0)
+    {
+      // seek to position after keyframe in our file (we will ignore the keyframes resent by the server
+      // since they are sent a couple of times and handling this would be a mess)
+      fseeko(file, c.c_offset + 11 + c.c_size + 4, SEEK_SET);
 
-	  nTimeStamp = nResumeTS + packet.m_nTimeStamp;
-	  prevTagSize = 11 + nPacketLen;
+      // make sure the WriteStream doesn't write headers and ignores all the 0ms TS packets
+      // (including several meta data headers and the keyframe we seeked to)
+      //bNoHeader = true; if bResume==true this is true anyway
+    }
 
-	  *ptr = packet.m_packetType;
-	  ptr++;
-	  ptr = AMF_EncodeInt24(ptr, pend, nPacketLen);
+  return RD_SUCCESS;
+}
 
-	  /*if(packet.m_packetType == 0x09) { // video
+int
+Download(RTMP * rtmp,		// connected RTMP object
+	 FILE * file, uint32_t dSeek, uint32_t dLength, double duration, bool bResume, char *metaHeader, uint32_t nMetaHeaderSize, char *initialFrame, int initialFrameType, uint32_t nInitialFrameSize, int nSkipKeyFrames, bool bStdoutMode, bool bLiveStream, bool bHashes, bool bOverrideBufferTime, uint32_t bufferTime, double *percent,	// percentage downloaded [out]
+	 int indexFd,		// keyframe index to append to, or -1
+	 bool bFinalize,	// leave room in onMetaData for Finalize
+	 FLVSession * ss, FLVPart * part)	// cancelled?, progress [out]
+{
+  uint32_t timestamp = dSeek;
+  int32_t now, lastUpdate;
+  uint8_t dataType = 0;		// will be written into the FLV header (position 4)
+  int nRead = 0;
+  off_t size = ftello(file);
+  int32_t lastProgress, lastRate;
+  uint64_t rateReceived;
+  unsigned long lastPercent = 0;
+  FLVOutput *out;
+  FLVResume rs = { 0 };
 
-	     // H264 fix:
-	     if((packetBody[0] & 0x0f) == 7) { // CodecId = H264
-	     uint8_t packetType = *(packetBody+1);
+  *percent = 0.0;
 
-	     uint32_t ts = AMF_DecodeInt24(packetBody+2); // composition time
-	     int32_t cts = (ts+0xff800000)^0xff800000;
-	     Log(LOGDEBUG, "cts  : %d\n", cts);
+  if (size < 0)
+    size = 0;			// stdout on a pipe
+  STATS_SET(part->pt_timestamp, timestamp);
+  STATS_SET(part->pt_bytes, (uint64_t) size);
 
-	     nTimeStamp -= cts;
-	     // get rid of the composition time
-	     CRTMP::EncodeInt24(packetBody+2, 0);
-	     }
-	     Log(LOGDEBUG, "VIDEO: nTimeStamp: 0x%08X (%d)\n", nTimeStamp, nTimeStamp);
-	     } */
+  if (timestamp)
+    {
+      Log(LOGDEBUG, "Continuing at TS: %d ms\n", timestamp);
+    }
 
-	  ptr = AMF_EncodeInt24(ptr, pend, nTimeStamp);
-	  *ptr = (char) ((nTimeStamp & 0xFF000000) >> 24);
-	  ptr++;
+  if (bLiveStream)
+    {
+      LogPrintf("Starting Live Stream\n");
+    }
+  else
+    {
+      // print initial status
+      // Workaround to exit with 0 if the file is fully (> 99.9%) downloaded
+      if (duration > 0)
+	{
+	  if ((double) timestamp >= (double) duration * 999.0)
+	    {
+	      LogPrintf("Already Completed at: %.3f sec Duration=%.3f sec\n",
+			(double) timestamp / 1000.0,
+			(double) duration / 1000.0);
+	      return RD_SUCCESS;
+	    }
+	  else
+	    {
+	      *percent = ((double) timestamp) / (duration * 1000.0) * 100.0;
+	      *percent = ((double) (int) (*percent * 10.0)) / 10.0;
+	      LogPrintf("%s download at: %.3f kB / %.3f sec (%.1f%%)\n",
+			bResume ? "Resuming" : "Starting",
+			(double) size / 1024.0, (double) timestamp / 1000.0,
+			*percent);
+	    }
+	}
+      else
+	{
+	  LogPrintf("%s download at: %.3f kB\n",
+		    bResume ? "Resuming" : "Starting",
+		    (double) size / 1024.0);
+	}
+    }
 
-	  // stream id
-	  ptr = AMF_EncodeInt24(ptr, pend, 0);
+  if (dLength > 0)
+    LogPrintf("For duration: %.3f sec\n", (double) dLength / 1000.0);
+
+  out = malloc(sizeof(FLVOutput));
+  if (!out || !OutputOpen(out, file, indexFd))
+    {
+      SessionError(ss, "%s: Failed to set up output, exiting!", __FUNCTION__);
+      free(out);
+      return RD_FAILED;
+    }
+  out->fo_reserveMeta = bFinalize && !bResume;
+
+  // write FLV header if not resuming
+  if (!bResume)
+    {
+      FLVTag *tag = OutputReserve(out);
+      char *buffer = tag->ft_head;
+      nRead = WriteHeader(&buffer, sizeof(tag->ft_head));
+      if (nRead > 0)
+	{
+	  tag->ft_iov[0].iov_base = buffer;
+	  tag->ft_iov[0].iov_len = nRead;
+	  tag->ft_iovcnt = 1;
+	  OutputCommit(out, tag, NULL);
+	  size += nRead;
+	}
+      else
+	{
+	  Log(LOGERROR, "Couldn't obtain FLV header, exiting!");
+	  OutputClose(out);
+	  free(out);
+	  return RD_FAILED;
 	}
+    }
 
-      memcpy(ptr, packetBody, nPacketLen);
-      unsigned int len = nPacketLen;
+  now = RTMP_GetTime();
+  lastUpdate = now - 1000;
+  lastProgress = lastRate = now;
+  rateReceived = STATS_GET(part->pt_received);
+  STATS_SET(part->pt_lastData, (uint32_t) now);
+  do
+    {
+      nRead = WriteStream(rtmp, out, &rs, &timestamp, bResume
+			  && nInitialFrameSize > 0, bLiveStream, dSeek,
+			  metaHeader, nMetaHeaderSize, initialFrame,
+			  initialFrameType, nInitialFrameSize, &dataType);
 
-      // correct tagSize and obtain timestamp if we have an FLV stream
-      if (packet.m_packetType == 0x16)
+      //LogPrintf("nRead: %d\n", nRead);
+      if (nRead > 0)
 	{
-	  unsigned int pos = 0;
+	  size += nRead;
 
-	  while (pos + 11 < nPacketLen)
+	  //LogPrintf("write %dbytes (%.1f kB)\n", nRead, nRead/1024.0);
+	  if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
+	    duration = RTMP_GetDuration(rtmp);
+
+	  now = RTMP_GetTime();
+	  if (now - (int32_t) STATS_GET(part->pt_lastData) > STALL_MS)
+	    STATS_SET(part->pt_stalls, STATS_GET(part->pt_stalls) + 1);
+	  STATS_SET(part->pt_lastData, (uint32_t) now);
+	  STATS_SET(part->pt_timestamp, timestamp);
+	  STATS_SET(part->pt_bytes, (uint64_t) size);
+	  STATS_SET(part->pt_received, STATS_GET(part->pt_received) + nRead);
+	  if (duration > 0)
+	    STATS_SET(part->pt_duration, (uint32_t) (duration * 1000.0));
+	  if (now - lastRate >= RATE_MS)
 	    {
-	      uint32_t dataSize = AMF_DecodeInt24(packetBody + pos + 1);	// size without header (11) and without prevTagSize (4)
-	      nTimeStamp = AMF_DecodeInt24(packetBody + pos + 4);
-	      nTimeStamp |= (packetBody[pos + 7] << 24);
+	      uint64_t received = STATS_GET(part->pt_received);
+	      STATS_SET(part->pt_bitrate,
+			(uint32_t) ((received - rateReceived) * 8
+				    / (now - lastRate)));
+	      rateReceived = received;
+	      lastRate = now;
+	    }
+	  if (abs(now - lastProgress) > PROGRESS_MS)
+	    {
+	      SessionProgress(ss);
+	      lastProgress = now;
+	    }
 
-	      /*
-	         CRTMP::EncodeInt24(ptr+pos+4, nTimeStamp);
-	         ptr[pos+7] = (nTimeStamp>>24)&0xff;// */
+	  if (!out->fo_preallocKB && !bStdoutMode)
+	    {
+	      double filesize = RTMP_GetFilesize(rtmp);
+	      if (filesize > 0 && filesize < 4e12)
+		OUTPUT_SET(out->fo_preallocKB, (uint32_t) (filesize / 1024) + 1);
+	    }
 
-	      // set data type
-	      *dataType |=
-		(((*(packetBody + pos) ==
-		   0x08) << 2) | (*(packetBody + pos) == 0x09));
+	  if (duration > 0)
+	    {
+	      // make sure we claim to have enough buffer time!
+	      if (!bOverrideBufferTime && bufferTime < (duration * 1000.0))
+		{
+		  bufferTime = (uint32_t) (duration * 1000.0) + 5000;	// extra 5sec to make sure we've got enough
 
-	      if (pos + 11 + dataSize + 4 > nPacketLen)
+		  Log(LOGDEBUG,
+		      "Detected that buffer time is less than duration, resetting to: %dms",
+		      bufferTime);
+		  RTMP_SetBufferMS(rtmp, bufferTime);
+		  RTMP_UpdateBufferMS(rtmp);
+		}
+	      *percent = ((double) timestamp) / (duration * 1000.0) * 100.0;
+	      *percent = ((double) (int) (*percent * 10.0)) / 10.0;
+	      if (bHashes)
 		{
-		  if (pos + 11 + dataSize > nPacketLen)
+		  if (lastPercent + 1 <= *percent)
 		    {
-		      Log(LOGERROR,
-			  "Wrong data size (%lu), stream corrupted, aborting!",
-			  dataSize);
-		      ret = -2;
-		      break;
+		      LogStatus("#");
+		      lastPercent = (unsigned long) *percent;
 		    }
-		  Log(LOGWARNING, "No tagSize found, appending!");
-
-		  // we have to append a last tagSize!
-		  prevTagSize = dataSize + 11;
-		  AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend, prevTagSize);
-		  size += 4;
-		  len += 4;
 		}
 	      else
 		{
-		  prevTagSize =
-		    AMF_DecodeInt32(packetBody + pos + 11 + dataSize);
-
-#ifdef _DEBUG
-		  Log(LOGDEBUG,
-		      "FLV Packet: type %02X, dataSize: %lu, tagSize: %lu, timeStamp: %lu ms",
-		      (unsigned char) packetBody[pos], dataSize, prevTagSize,
-		      nTimeStamp);
-#endif
-
-		  if (prevTagSize != (dataSize + 11))
+		  now = RTMP_GetTime();
+		  if (abs(now - lastUpdate) > 200)
 		    {
-#ifdef _DEBUG
-		      Log(LOGWARNING,
-			  "Tag and data size are not consitent, writing tag size according to dataSize+11: %d",
-			  dataSize + 11);
-#endif
-
-		      prevTagSize = dataSize + 11;
-		      AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend, prevTagSize);
+		      LogStatus("\r%.3f kB / %.2f sec (%.1f%%)",
+				(double) size / 1024.0,
+				(double) (timestamp) / 1000.0, *percent);
+		      lastUpdate = now;
 		    }
 		}
-
-	      pos += prevTagSize + 4;	//(11+dataSize+4);
+	    }
+	  else
+	    {
+	      now = RTMP_GetTime();
+	      if (abs(now - lastUpdate) > 200)
+		{
+		  if (bHashes)
+		    LogStatus("#");
+		  else
+		    LogStatus("\r%.3f kB / %.2f sec", (double) size / 1024.0,
+			      (double) (timestamp) / 1000.0);
+		  lastUpdate = now;
+		}
 	    }
 	}
-      ptr += len;
+#ifdef _DEBUG
+      else
+	{
+	  Log(LOGDEBUG, "zero read!");
+	}
+#endif
+
+    }
+  while (!Cancelled(ss) && nRead > -1 && RTMP_IsConnected(rtmp));
 
-      if (packet.m_packetType != 0x16)
-	{			// FLV tag packets contain their own prevTagSize
-	  AMF_EncodeInt32(ptr, pend, prevTagSize);
-	  //ptr += 4;
-	}
+  Log(LOGDEBUG, "WriteStream returned: %d", nRead);
 
-      // In non-live this nTimeStamp can contain an absolute TS.
-      // Update ext timestamp with this absolute offset in non-live mode otherwise report the relative one
-      // LogPrintf("\nDEBUG: type: %02X, size: %d, pktTS: %dms, TS: %dms, bLiveStream: %d", packet.m_packetType, nPacketLen, packet.m_nTimeStamp, nTimeStamp, bLiveStream);
-      if (tsm)
-	*tsm = bLiveStream ? packet.m_nTimeStamp : nTimeStamp;
+  if (!OutputClose(out))
+    nRead = -4;
+  free(out);
+  if (nRead == -4)
+    {
+      SessionError(ss, "%s: Failed writing, exiting!", __FUNCTION__);
+      return RD_FAILED;
+    }
 
+  if (bResume && nRead == -2)
+    {
+      SessionError(ss, "Couldn't resume FLV file, try --skip %d",
+		   nSkipKeyFrames + 1);
+      return RD_FAILED;
+    }
 
-      ret = size;
-      break;
+  // finalize header by writing the correct dataType (video, audio, video+audio)
+  if (!bResume && dataType != 0x5 && !bStdoutMode)
+    {
+      //Log(LOGDEBUG, "Writing data type: %02X", dataType);
+      fseek(file, 4, SEEK_SET);
+      fwrite(&dataType, sizeof(unsigned char), 1, file);
+      /* resume uses ftell to see where we left off */
+      fseek(file, 0, SEEK_END);
     }
 
-  if (rtnGetNextMediaPacket)
-    RTMPPacket_Free(&packet);
-  return ret;			// no more media packets
-}
+  if (nRead == -3)
+    return RD_SUCCESS;
 
-int
-OpenResumeFile(const char *flvFile,	// file name [in]
-	       FILE ** file,	// opened file [out]
-	       off_t * size,	// size of the file [out]
-	       char **metaHeader,	// meta data read from the file [out]
-	       uint32_t * nMetaHeaderSize,	// length of metaHeader [out]
-	       double *duration)	// duration of the stream in ms [out]
-{
-  size_t bufferSize = 0;
-  char hbuf[16], *buffer = NULL;
+  if ((duration > 0 && *percent < 99.9) || Cancelled(ss) || nRead < 0
+      || RTMP_IsTimedout(rtmp))
+    {
+      return RD_INCOMPLETE;
+    }
 
-  *nMetaHeaderSize = 0;
-  *size = 0;
+  return RD_SUCCESS;
+}
 
-  *file = fopen(flvFile, "r+b");
-  if (!*file)
-    return RD_SUCCESS;		// RD_SUCCESS, because we go to fresh file mode instead of quiting
+#define FINAL_SUFFIX	".tmp"
 
-  fseek(*file, 0, SEEK_END);
-  *size = ftello(*file);
-  fseek(*file, 0, SEEK_SET);
+/* Copy the bytes from offset to end of fd to fp. */
+static bool
+FinalizeCopy(FILE * fp, int fd, off_t offset, off_t end, char *buf)
+{
+  if (lseek(fd, offset, SEEK_SET) < 0)
+    return false;
+  while (offset < end)
+    {
+      ssize_t n = end - offset < OUTPUT_WRITE_SIZE ? end - offset
+	: OUTPUT_WRITE_SIZE;
+      n = read(fd, buf, n);
+      if (n <= 0 || fwrite(buf, 1, n, fp) != (size_t) n)
+	return false;
+      offset += n;
+    }
+  return true;
+}
 
-  if (*size > 0)
+/* Write a named strict array with the positions (or times) of the count
+ * seekable tags in the index. Positions from moved on are off by delta
+ * in the new file.
+ */
+static bool
+FinalizeArray(FILE * fp, FLVIndexReader * r, int indexFd, const AVal * name,
+	      uint32_t count, bool bVideo, bool bTimes, off_t moved,
+	      off_t delta)
+{
+  char buf[64], *p = buf, *end = buf + sizeof(buf);
+  FLVIndexEntry e;
+
+  p = AMF_EncodeInt16(p, end, name->av_len);
+  memcpy(p, name->av_val, name->av_len);
+  p += name->av_len;
+  *p++ = AMF_STRICT_ARRAY;
+  p = AMF_EncodeInt32(p, end, count);
+  if (fwrite(buf, 1, p - buf, fp) != (size_t) (p - buf))
+    return false;
+
+  IndexRewind(r, indexFd);
+  while (count && IndexNext(r, &e))
     {
-      // verify FLV format and read header
-      uint32_t prevTagSize = 0;
+      if (!IndexSeekable(&e, bVideo))
+	continue;
+      if (bTimes)
+	AMF_EncodeNumber(buf, end, e.ie_timestamp / 1000.0);
+      else
+	AMF_EncodeNumber(buf, end, (double) (e.ie_offset >= moved ?
+					     e.ie_offset + delta :
+					     e.ie_offset));
+      if (fwrite(buf, 1, 9, fp) != 9)
+	return false;
+      count--;
+    }
+  return count == 0;		/* the index changed under us */
+}
 
-      // check we've got a valid FLV file to continue!
-      if (fread(hbuf, 1, 13, *file) != 13)
+/* Write the body of the new onMetaData: its head, headSize bytes at
+ * buf + OUTPUT_WRITE_SIZE, the keyframes, and pad bytes of padding. The
+ * first OUTPUT_WRITE_SIZE bytes of buf are scratch.
+ */
+static bool
+FinalizeMeta(FILE * fp, FLVIndexReader * r, int indexFd, char *buf,
+	     uint32_t headSize, uint32_t count, bool bVideo, off_t moved,
+	     off_t delta, uint32_t pad)
+{
+  char tail[32], *p;
+
+  if (fwrite(buf + OUTPUT_WRITE_SIZE, 1, headSize, fp) != headSize)
+    return false;
+  p = AMF_EncodeInt16(tail, tail + sizeof(tail), av_keyframes.av_len);
+  memcpy(p, av_keyframes.av_val, av_keyframes.av_len);
+  p += av_keyframes.av_len;
+  *p++ = AMF_OBJECT;
+  if (fwrite(tail, 1, p - tail, fp) != (size_t) (p - tail)
+      || !FinalizeArray(fp, r, indexFd, &av_filepositions, count, bVideo,
+			false, moved, delta)
+      || !FinalizeArray(fp, r, indexFd, &av_times, count, bVideo, true,
+			moved, delta))
+    return false;
+
+  p = AMF_EncodeInt24(tail, tail + sizeof(tail), AMF_OBJECT_END);
+  if (pad)
+    p = MetaPadding(p, tail + sizeof(tail), pad);
+  if (fwrite(tail, 1, p - tail, fp) != (size_t) (p - tail))
+    return false;
+  if (pad)
+    {
+      pad -= META_PAD_MIN;
+      memset(buf, 0, OUTPUT_WRITE_SIZE);
+      while (pad)
 	{
-	  Log(LOGERROR, "Couldn't read FLV file header!");
-	  return RD_FAILED;
+	  uint32_t n = pad < OUTPUT_WRITE_SIZE ? pad : OUTPUT_WRITE_SIZE;
+	  if (fwrite(buf, 1, n, fp) != n)
+	    return false;
+	  pad -= n;
 	}
-      if (hbuf[0] != 'F' || hbuf[1] != 'L' || hbuf[2] != 'V'
-	  || hbuf[3] != 0x01)
-	{
-	  Log(LOGERROR, "Invalid FLV file!");
-	  return RD_FAILED;
+    }
+  p = AMF_EncodeInt24(tail, tail + sizeof(tail), AMF_OBJECT_END);
+  return fwrite(tail, 1, p - tail, fp) == (size_t) (p - tail);
+}
 
-	}
+/* Move the offsets in the index by delta from moved on, to match the
+ * finalized file. The record of the replaced onMetaData at meta gets
+ * its new size.
+ */
+static bool
+FinalizeIndex(int indexFd, FLVIndexReader * r, off_t meta, off_t moved,
+	      off_t delta, uint32_t metaSize)
+{
+  FLVIndexEntry e;
+  off_t block;
+  ssize_t n;
+  int i;
 
-      if ((hbuf[4] & 0x05) == 0)
+  for (block = INDEX_HEADER_SIZE;; block += n)
+    {
+      if (lseek(indexFd, block, SEEK_SET) < 0)
+	return false;
+      n = read(indexFd, r->ir_buf, sizeof(r->ir_buf));
+      if (n < INDEX_RECORD_SIZE)
+	return n >= 0;
+      n -= n % INDEX_RECORD_SIZE;
+      for (i = 0; i < n; i += INDEX_RECORD_SIZE)
 	{
-	  Log(LOGERROR,
-	      "FLV file contains neither video nor audio, aborting!");
-	  return RD_FAILED;
+	  if (!IndexDecode(r->ir_buf + i, &e))
+	    return ftruncate(indexFd, block + i) == 0;
+	  if (e.ie_offset >= moved)
+	    e.ie_offset += delta;
+	  else if (e.ie_offset == meta && e.ie_type == 0x12)
+	    e.ie_size = metaSize;
+	  IndexEncode(r->ir_buf + i, &e);
 	}
+      if (lseek(indexFd, block, SEEK_SET) < 0
+	  || write(indexFd, r->ir_buf, n) != n)
+	return false;
+    }
+}
 
-      uint32_t dataOffset = AMF_DecodeInt32(hbuf + 5);
-      fseek(*file, dataOffset, SEEK_SET);
-
-      if (fread(hbuf, 1, 4, *file) != 4)
+/* Give a complete download an onMetaData players can seek with: the
+ * real duration and filesize, the codecs, and a keyframes object with
+ * the filepositions and times of the video keyframes (of one audio tag
+ * a second in audio only files). What else the server sent is kept.
+ *
+ * The keyframes come from the index collected during the download, not
+ * from searching the file. The new onMetaData is written over the old
+ * one, into the room MetaReserve left in it. Without that room (a file
+ * from before, or one whose meta data came in an FLV packet) everything
+ * behind it moves, so the file is copied once into a new one that
+ * replaces it. Memory use does not depend on the size of the file.
+ */
+static bool
+Finalize(const char *flvFile, FILE ** file, int indexFd)
+{
+  FLVFile flv;
+  FLVCursor c;
+  FLVIndexReader *r = NULL;
+  FLVIndexEntry e, meta = { 0 };
+  FILE *fp = NULL;
+  char *buf = NULL, *tmp = NULL, *p, *end, *pFilesize, *pLocation;
+  char tail[32];
+  off_t metaOffset, oldTotal = 0, moved, delta, lastKey = 0;
+  off_t firstVideo = -1, firstAudio = -1, lastVideo = 0, lastAudio = 0;
+  uint32_t nVideo = 0, nAudio = 0, count, bodySize, keptSize = 0,
+    headSize, pad = 0;
+  uint32_t lastTimestamp = 0, lastKeyTimestamp = 0, lastVideoTs = 0,
+    lastAudioTs = 0;
+  int videoCodec = -1, audioFlags = -1, nProps = 0, nKept;
+  bool bVideo, bHaveMeta = false, bInPlace, bOK = false;
+
+  if (indexFd < 0)
+    {
+      Log(LOGWARNING, "No keyframe index, leaving onMetaData as it is");
+      return false;
+    }
+  if (fflush(*file) || !FLV_Open(&flv, fileno(*file)))
+    return false;
+
+  r = malloc(sizeof(FLVIndexReader));
+  buf = malloc(OUTPUT_WRITE_SIZE);
+  tmp = malloc(strlen(flvFile) + sizeof(FINAL_SUFFIX));
+  if (!r || !buf || !tmp || !IndexCatchUp(indexFd, &flv, flv.f_size))
+    goto done;
+
+  // where the meta data is, and what can be seeked to
+  IndexRewind(r, indexFd);
+  while (IndexNext(r, &e))
+    {
+      if (e.ie_type == 0x12 && !bHaveMeta)
 	{
-	  Log(LOGERROR, "Invalid FLV file: missing first prevTagSize!");
-	  return RD_FAILED;
+	  meta = e;
+	  bHaveMeta = true;
 	}
-      prevTagSize = AMF_DecodeInt32(hbuf);
-      if (prevTagSize != 0)
+      else if (IndexSeekable(&e, true))
 	{
-	  Log(LOGWARNING,
-	      "First prevTagSize is not zero: prevTagSize = 0x%08X",
-	      prevTagSize);
+	  if (!nVideo++)
+	    firstVideo = e.ie_offset;
+	  lastVideo = e.ie_offset;
+	  lastVideoTs = e.ie_timestamp;
 	}
+      else if (IndexSeekable(&e, false))
+	{
+	  if (!nAudio++)
+	    firstAudio = e.ie_offset;
+	  lastAudio = e.ie_offset;
+	  lastAudioTs = e.ie_timestamp;
+	}
+    }
+  bVideo = nVideo > 0;
+  count = bVideo ? nVideo : nAudio;
+  lastKey = bVideo ? lastVideo : lastAudio;
+  lastKeyTimestamp = bVideo ? lastVideoTs : lastAudioTs;
+
+  // the codecs, from the first of each, and the duration from the last tag
+  if (firstVideo >= 0 && FLV_Seek(&flv, &c, firstVideo) && c.c_size > 0)
+    videoCodec = c.c_body[0] & 0x0f;
+  if (firstAudio >= 0 && FLV_Seek(&flv, &c, firstAudio) && c.c_size > 0)
+    audioFlags = (uint8_t) c.c_body[0];
+  if (FLV_Last(&flv, &c))
+    lastTimestamp = c.c_timestamp;
+
+  // the old onMetaData is replaced, keeping what we don't set ourselves
+  metaOffset = flv.f_start;
+  if (bHaveMeta && FLV_Seek(&flv, &c, meta.ie_offset) && c.c_type == 0x12)
+    {
+      metaOffset = c.c_offset;
+      oldTotal = 11 + c.c_size + 4;
+    }
+  else
+    c.c_size = 0;
+  headSize = c.c_size + 512;
+  p = realloc(buf, OUTPUT_WRITE_SIZE + headSize);
+  if (!p)
+    goto done;
+  buf = p;
+  p = buf + OUTPUT_WRITE_SIZE;
+  end = p + headSize;
+
+  p = AMF_EncodeString(p, end, &av_onMetaData);
+  *p++ = AMF_ECMA_ARRAY;
+  p += 4;			// count, below
+  p = AMF_EncodeNamedNumber(p, end, &av_duration, lastTimestamp / 1000.0);
+  pFilesize = p;
+  p = AMF_EncodeNamedNumber(p, end, &av_filesize, 0);
+  p = AMF_EncodeNamedNumber(p, end, &av_lasttimestamp, lastTimestamp / 1000.0);
+  p = AMF_EncodeNamedNumber(p, end, &av_lastkeyframetimestamp,
+			    lastKeyTimestamp / 1000.0);
+  pLocation = p;
+  p = AMF_EncodeNamedNumber(p, end, &av_lastkeyframelocation, 0);
+  p = AMF_EncodeNamedBoolean(p, end, &av_hasVideo, videoCodec >= 0);
+  p = AMF_EncodeNamedBoolean(p, end, &av_hasAudio, audioFlags >= 0);
+  p = AMF_EncodeNamedBoolean(p, end, &av_hasKeyframes, count > 0);
+  p = AMF_EncodeNamedBoolean(p, end, &av_hasMetadata, true);
+  nProps = 9;
+  if (videoCodec >= 0)
+    {
+      p = AMF_EncodeNamedNumber(p, end, &av_videocodecid, videoCodec);
+      nProps++;
+    }
+  if (audioFlags >= 0)
+    {
+      static const double rates[] = { 5512.5, 11025, 22050, 44100 };
+      p = AMF_EncodeNamedNumber(p, end, &av_audiocodecid, audioFlags >> 4);
+      p = AMF_EncodeNamedNumber(p, end, &av_audiosamplerate,
+				rates[(audioFlags >> 2) & 3]);
+      p = AMF_EncodeNamedNumber(p, end, &av_audiosamplesize,
+				(audioFlags & 0x02) ? 16 : 8);
+      p = AMF_EncodeNamedBoolean(p, end, &av_stereo, audioFlags & 0x01);
+      nProps += 4;
+    }
+  nKept = oldTotal ? MetaStrip(c.c_body, c.c_size, p, &keptSize) : 0;
+  if (nKept < 0)
+    nKept = keptSize = 0;
+  p += keptSize;
+  headSize = p - (buf + OUTPUT_WRITE_SIZE);
+
+  bodySize = headSize + 2 + av_keyframes.av_len + 1
+    + 2 + av_filepositions.av_len + 1 + 4 + 9 * count
+    + 2 + av_times.av_len + 1 + 4 + 9 * count + 3 + 3;
+  if (count > 0xffffff / 18 || bodySize > 0xffffff)
+    {
+      Log(LOGWARNING, "Too many keyframes for onMetaData, not finalizing");
+      goto done;
+    }
 
-      // go through the file to find the meta data!
-      off_t pos = dataOffset + 4;
-      bool bFoundMetaHeader = false;
-
-      while (pos < *size - 4 && !bFoundMetaHeader)
+  // in the old one if it has the room, the rest is padding
+  bInPlace = oldTotal && c.c_size >= bodySize
+    && (c.c_size == bodySize || c.c_size - bodySize >= META_PAD_MIN);
+  if (bInPlace)
+    {
+      pad = c.c_size - bodySize;
+      bodySize = c.c_size;
+      moved = flv.f_size;
+      delta = 0;
+    }
+  else
+    {
+      moved = metaOffset + oldTotal;
+      delta = 11 + bodySize + 4 - oldTotal;
+    }
+  AMF_EncodeInt32(buf + OUTPUT_WRITE_SIZE + 14, end,
+		  nProps + nKept + 1 + (pad > 0));
+  AMF_EncodeNamedNumber(pFilesize, end, &av_filesize,
+			(double) (flv.f_size + delta));
+  AMF_EncodeNamedNumber(pLocation, end, &av_lastkeyframelocation,
+			(double) (lastKey >= moved ? lastKey + delta : lastKey));
+
+  if (bInPlace)
+    {
+      if (fseeko(*file, metaOffset + 11, SEEK_SET) != 0
+	  || !FinalizeMeta(*file, r, indexFd, buf, headSize, count, bVideo,
+			   moved, delta, pad) || fflush(*file) != 0)
 	{
-	  fseeko(*file, pos, SEEK_SET);
-	  if (fread(hbuf, 1, 4, *file) != 4)
-	    break;
+	  Log(LOGWARNING, "Couldn't write %s", flvFile);
+	  goto done;
+	}
+      Log(LOGDEBUG, "%s: onMetaData of %u bytes with %u keyframes, in place",
+	  __FUNCTION__, bodySize, count);
+      bOK = true;
+      goto done;
+    }
 
-	  uint32_t dataSize = AMF_DecodeInt24(hbuf + 1);
+  strcpy(tmp, flvFile);
+  strcat(tmp, FINAL_SUFFIX);
+  fp = fopen(tmp, "wb");
+  if (!fp)
+    {
+      Log(LOGWARNING, "Couldn't create %s", tmp);
+      goto done;
+    }
 
-	  if (hbuf[0] == 0x12)
-	    {
-	      if (dataSize > bufferSize)
-		{
-                  /* round up to next page boundary */
-                  bufferSize = dataSize + 4095;
-		  bufferSize ^= (bufferSize & 4095);
-		  free(buffer);
-                  buffer = malloc(bufferSize);
-                  if (!buffer)
-		    return RD_FAILED;
-		}
+  // everything before the onMetaData, the new one, and everything after
+  memset(tail, 0, sizeof(tail));
+  tail[0] = 0x12;
+  AMF_EncodeInt24(tail + 1, tail + 4, bodySize);
+  if (!FinalizeCopy(fp, flv.f_fd, 0, metaOffset, buf)
+      || fwrite(tail, 1, 11, fp) != 11
+      || !FinalizeMeta(fp, r, indexFd, buf, headSize, count, bVideo, moved,
+		       delta, 0))
+    goto done;
+  p = AMF_EncodeInt32(tail, tail + sizeof(tail), 11 + bodySize);
+  if (fwrite(tail, 1, p - tail, fp) != (size_t) (p - tail)
+      || !FinalizeCopy(fp, flv.f_fd, moved, flv.f_size, buf)
+      || fclose(fp) != 0)
+    {
+      Log(LOGWARNING, "Couldn't write %s", tmp);
+      goto done;
+    }
+  fp = NULL;
 
-	      fseeko(*file, pos + 11, SEEK_SET);
-	      if (fread(buffer, 1, dataSize, *file) != dataSize)
-		break;
+  // the finalized file replaces the download
+  FLV_Close(&flv);
+  fclose(*file);
+  *file = NULL;
+#ifdef WIN32
+  remove(flvFile);
+#endif
+  if (rename(tmp, flvFile) != 0)
+    {
+      Log(LOGWARNING, "Couldn't rename %s to %s", tmp, flvFile);
+      goto done;
+    }
+  if (!FinalizeIndex(indexFd, r, metaOffset, moved, delta, bodySize)
+      && ftruncate(indexFd, 0) < 0)	/* resume does without */
+    Log(LOGDEBUG, "%s: couldn't drop the index", __FUNCTION__);
 
-	      AMFObject metaObj;
-	      int nRes = AMF_Decode(&metaObj, buffer, dataSize, false);
-	      if (nRes < 0)
-		{
-		  Log(LOGERROR, "%s, error decoding meta data packet",
-		      __FUNCTION__);
-		  break;
-		}
+  Log(LOGDEBUG, "%s: onMetaData of %u bytes with %u keyframes", __FUNCTION__,
+      bodySize, count);
+  bOK = true;
 
-	      AVal metastring;
-	      AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0), &metastring);
+done:
+  if (fp)
+    {
+      fclose(fp);
+      remove(tmp);
+    }
+  FLV_Close(&flv);
+  free(tmp);
+  free(buf);
+  free(r);
+  return bOK;
+}
 
-	      if (AVMATCH(&metastring, &av_onMetaData))
-		{
-		  AMF_Dump(&metaObj);
-
-		  *nMetaHeaderSize = dataSize;
-		  if (*metaHeader)
-		    free(*metaHeader);
-		  *metaHeader = (char *) malloc(*nMetaHeaderSize);
-		  memcpy(*metaHeader, buffer, *nMetaHeaderSize);
-
-		  // get duration
-		  AMFObjectProperty prop;
-		  if (RTMP_FindFirstMatchingProperty
-		      (&metaObj, &av_duration, &prop))
-		    {
-		      *duration = AMFProp_GetNumber(&prop);
-		      Log(LOGDEBUG, "File has duration: %f", *duration);
-		    }
+static void
+SetupStream(RTMP * rtmp, const FLVStream * s)
+{
+  AVal playpath = s->playpath, tcUrl = s->tcUrl, swfUrl = s->swfUrl;
+  AVal pageUrl = s->pageUrl, app = s->app, auth = s->auth;
+  AVal swfHash = s->swfHash, flashVer = s->flashVer;
+  AVal subscribepath = s->subscribepath;
 
-		  bFoundMetaHeader = true;
-		  break;
-		}
-	      //metaObj.Reset();
-	      //delete obj;
-	    }
-	  pos += (dataSize + 11 + 4);
-	}
+  RTMP_Init(rtmp);
+  RTMP_SetupStream(rtmp, s->protocol, s->hostname, s->port, s->sockshost,
+		   &playpath, &tcUrl, &swfUrl, &pageUrl, &app, &auth,
+		   &swfHash, s->swfSize, &flashVer, &subscribepath, 0, 0,
+		   s->bLiveStream, s->timeout);
 
-      free(buffer);
-      if (!bFoundMetaHeader)
-	Log(LOGWARNING, "Couldn't locate meta data!");
-    }
+  /* backward compatibility, we always sent this as true before */
+  if (auth.av_len)
+    rtmp->Link.authflag = true;
 
-  return RD_SUCCESS;
+  rtmp->Link.extras = s->extras;
+  rtmp->Link.token = s->token;
 }
 
-int
-GetLastKeyframe(FILE * file,	// output file [in]
-		int nSkipKeyFrames,	// max number of frames to skip when searching for key frame [in]
-		uint32_t * dSeek,	// offset of the last key frame [out]
-		char **initialFrame,	// content of the last keyframe [out]
-		int *initialFrameType,	// initial frame type (audio/video) [out]
-		uint32_t * nInitialFrameSize)	// length of initialFrame [out]
+/* Download the stream from dStartOffset to dStopOffset (0 for the end)
+ * to flvFile, or stdout. With bResume an existing file is continued
+ * from its last keyframe. A complete download is finalized if
+ * bFinalize. How far it got goes to part as it goes along.
+ */
+static int
+DownloadFile(const FLVStream * s, const char *flvFile, bool bResume,
+	     uint32_t dStartOffset, uint32_t dStopOffset, bool bFinalize,
+	     FLVPart * part, double *percent)
 {
-  const size_t bufferSize = 16;
-  char buffer[bufferSize];
-  uint8_t dataType;
-  bool bAudioOnly;
-  off_t size;
+  int nStatus = RD_SUCCESS;
+  double duration = 0.0;
+  uint32_t dSeek = 0;		// seek position in resume mode, 0 otherwise
+  uint32_t dLength = 0;		// length to play from stream - calculated from seek position and dStopOffset
+  uint32_t bufferTime = s->bufferTime;
+  int retries = 0;
+  int first = 1;
+  int watch = -1;
+  FILE *file = NULL;
+
+  // meta header and initial frame for the resume mode (they are read from the file and compared with
+  // the stream we are trying to continue
+  char *metaHeader = 0;
+  uint32_t nMetaHeaderSize = 0;
 
-  fseek(file, 0, SEEK_END);
-  size = ftello(file);
+  // video keyframe for matching
+  char *initialFrame = 0;
+  uint32_t nInitialFrameSize = 0;
+  int initialFrameType = 0;	// tye: audio or video
 
-  fseek(file, 4, SEEK_SET);
-  if (fread(&dataType, sizeof(uint8_t), 1, file) != 1)
-    return RD_FAILED;
+  RTMP rtmp = { 0 };
+  SetupStream(&rtmp, s);
 
-  bAudioOnly = (dataType & 0x4) && !(dataType & 0x1);
+  off_t size = 0;
+  FLVIndex flvIndex = { NULL, 0 };
+  int indexFd = -1;
 
-  Log(LOGDEBUG, "bAudioOnly: %d, size: %llu", bAudioOnly,
-      (unsigned long long) size);
+  *percent = 0;
 
   // ok, we have to get the timestamp of the last keyframe (only keyframes are seekable) / last audio frame (audio only streams)
+  if (bResume)
+    {
+      nStatus =
+	OpenResumeFile(flvFile, &file, &size, &metaHeader, &nMetaHeaderSize,
+		       &duration, &flvIndex);
+      if (nStatus == RD_FAILED)
+	goto clean;
 
-  //if(!bAudioOnly) // we have to handle video/video+audio different since we have non-seekable frames
-  //{
-  // find the last seekable frame
-  off_t tsize = 0;
-  uint32_t prevTagSize = 0;
+      if (!file)
+	{
+	  // file does not exist, so go back into normal mode
+	  bResume = false;	// we are back in fresh file mode (otherwise finalizing file won't be done)
+	}
+      else
+	{
+	  nStatus = GetLastKeyframe(file, &flvIndex, s->nSkipKeyFrames,
+				    &dSeek, &initialFrame,
+				    &initialFrameType, &nInitialFrameSize);
+	  if (nStatus == RD_FAILED)
+	    {
+	      Log(LOGDEBUG, "Failed to get last keyframe.");
+	      goto clean;
+	    }
 
-  // go through the file and find the last video keyframe
-  do
+	  if (dSeek == 0)
+	    {
+	      Log(LOGDEBUG,
+		  "Last keyframe is first frame in stream, switching from resume to normal mode!");
+	      bResume = false;
+	    }
+	}
+    }
+
+  if (!file)
     {
-      int xread;
-    skipkeyframe:
-      if (size - tsize < 13)
+      if (s->bStdoutMode)
 	{
-	  Log(LOGERROR,
-	      "Unexpected start of file, error in tag sizes, couldn't arrive at prevTagSize=0");
-	  return RD_FAILED;
+	  file = stdout;
+	  SET_BINMODE(file);
 	}
-      fseeko(file, size - tsize - 4, SEEK_SET);
-      xread = fread(buffer, 1, 4, file);
-      if (xread != 4)
+      else
 	{
-	  Log(LOGERROR, "Couldn't read prevTagSize from file!");
-	  return RD_FAILED;
+	  file = fopen(flvFile, "w+b");
+	  if (file == 0)
+	    {
+	      SessionError(s->session, "Failed to open file! %s", flvFile);
+	      nStatus = RD_FAILED;
+	      goto clean;
+	    }
 	}
+    }
 
-      prevTagSize = AMF_DecodeInt32(buffer);
-      //Log(LOGDEBUG, "Last packet: prevTagSize: %d", prevTagSize);
-
-      if (prevTagSize == 0)
+  // keep the index of what stays of the file, and add to it from there
+  if (!s->bStdoutMode)
+    indexFd = IndexOpen(flvFile, &flvIndex, bResume ? ftello(file) : 0);
+  IndexFree(&flvIndex);
+  if (indexFd >= 0 && bResume)
+    {
+      FLVFile flv;
+      if (FLV_Open(&flv, fileno(file)))
 	{
-	  Log(LOGERROR, "Couldn't find keyframe to resume from!");
-	  return RD_FAILED;
+	  IndexCatchUp(indexFd, &flv, ftello(file));
+	  FLV_Close(&flv);
 	}
+    }
+
+  while (!Cancelled(s->session))
+    {
+      Log(LOGDEBUG, "Setting buffer time to: %dms", bufferTime);
+      RTMP_SetBufferMS(&rtmp, bufferTime);
+
+      if (first)
+	{
+	  first = 0;
+	  LogPrintf("Connecting ...\n");
+
+	  if (!RTMP_Connect(&rtmp, NULL))
+	    {
+	      SessionError(s->session, "Couldn't connect to %s:%d",
+			   s->hostname, s->port);
+	      nStatus = RD_FAILED;
+	      break;
+	    }
+	  watch = SessionWatch(s->session, &rtmp);
+
+	  Log(LOGINFO, "Connected...");
+
+	  // User defined seek offset
+	  if (dStartOffset > 0)
+	    {
+	      // Don't need the start offset if resuming an existing file
+	      if (bResume)
+		{
+		  Log(LOGWARNING,
+		      "Can't seek a resumed stream, ignoring --start option");
+		  dStartOffset = 0;
+		}
+	      else
+		{
+		  dSeek = dStartOffset;
+		}
+	    }
+
+	  // Calculate the length of the stream to still play
+	  if (dStopOffset > 0)
+	    {
+	      dLength = dStopOffset - dSeek;
 
-      if (prevTagSize < 0 || prevTagSize > size - 4 - 13)
-	{
-	  Log(LOGERROR,
-	      "Last tag size must be greater/equal zero (prevTagSize=%d) and smaller then filesize, corrupt file!",
-	      prevTagSize);
-	  return RD_FAILED;
-	}
-      tsize += prevTagSize + 4;
+	      // Quit if start seek is past required stop offset
+	      if (dStopOffset <= dSeek)
+		{
+		  LogPrintf("Already Completed\n");
+		  nStatus = RD_SUCCESS;
+		  break;
+		}
+	    }
 
-      // read header
-      fseeko(file, size - tsize, SEEK_SET);
-      if (fread(buffer, 1, 12, file) != 12)
-	{
-	  Log(LOGERROR, "Couldn't read header!");
-	  return RD_FAILED;
+	  if (!RTMP_ConnectStream(&rtmp, dSeek, dLength))
+	    {
+	      SessionError(s->session, "Couldn't play %.*s",
+			   s->playpath.av_len, s->playpath.av_val);
+	      nStatus = RD_FAILED;
+	      break;
+	    }
 	}
-      //*
-#ifdef _DEBUG
-      uint32_t ts = AMF_DecodeInt24(buffer + 4);
-      ts |= (buffer[7] << 24);
-      Log(LOGDEBUG, "%02X: TS: %d ms", buffer[0], ts);
-#endif //*/
-
-      // this just continues the loop whenever the number of skipped frames is > 0,
-      // so we look for the next keyframe to continue with
-      //
-      // this helps if resuming from the last keyframe fails and one doesn't want to start
-      // the download from the beginning
-      //
-      if (nSkipKeyFrames > 0
-	  && !(!bAudioOnly
-	       && (buffer[0] != 0x09 || (buffer[11] & 0xf0) != 0x10)))
+      else
 	{
-#ifdef _DEBUG
-	  Log(LOGDEBUG,
-	      "xxxxxxxxxxxxxxxxxxxxxxxx Well, lets go one more back!");
-#endif
-	  nSkipKeyFrames--;
-	  goto skipkeyframe;
+	  nInitialFrameSize = 0;
+
+          if (retries)
+            {
+	      SessionError(s->session, "Failed to resume the stream");
+	      if (!RTMP_IsTimedout(&rtmp))
+	        nStatus = RD_FAILED;
+	      else
+	        nStatus = RD_INCOMPLETE;
+	      break;
+            }
+	  Log(LOGINFO, "Connection timed out, trying to resume.\n\n");
+	  STATS_SET(part->pt_reconnects, STATS_GET(part->pt_reconnects) + 1);
+          /* Did we already try pausing, and it still didn't work? */
+          if (rtmp.m_pausing == 3)
+            {
+              /* Only one try at reconnecting... */
+              retries = 1;
+              dSeek = rtmp.m_pauseStamp;
+              if (dStopOffset > 0)
+                {
+                  dLength = dStopOffset - dSeek;
+                  if (dStopOffset <= dSeek)
+                    {
+                      LogPrintf("Already Completed\n");
+		      nStatus = RD_SUCCESS;
+		      break;
+                    }
+                }
+              if (!RTMP_ReconnectStream(&rtmp, bufferTime, dSeek, dLength))
+                {
+	          SessionError(s->session, "Failed to resume the stream");
+	          if (!RTMP_IsTimedout(&rtmp))
+		    nStatus = RD_FAILED;
+	          else
+		    nStatus = RD_INCOMPLETE;
+	          break;
+                }
+            }
+	  else if (!RTMP_ToggleStream(&rtmp))
+	    {
+	      SessionError(s->session, "Failed to resume the stream");
+	      if (!RTMP_IsTimedout(&rtmp))
+		nStatus = RD_FAILED;
+	      else
+		nStatus = RD_INCOMPLETE;
+	      break;
+	    }
+	  bResume = true;
 	}
 
-    }
-  while ((bAudioOnly && buffer[0] != 0x08) || (!bAudioOnly && (buffer[0] != 0x09 || (buffer[11] & 0xf0) != 0x10)));	// as long as we don't have a keyframe / last audio frame
+      nStatus = Download(&rtmp, file, dSeek, dLength, duration, bResume,
+			 metaHeader, nMetaHeaderSize, initialFrame,
+			 initialFrameType, nInitialFrameSize,
+			 s->nSkipKeyFrames, s->bStdoutMode, s->bLiveStream,
+			 s->bHashes, s->bOverrideBufferTime, bufferTime,
+			 percent, indexFd, bFinalize && !s->bStdoutMode,
+			 s->session, part);
+      free(initialFrame);
+      initialFrame = NULL;
 
-  // save keyframe to compare/find position in stream
-  *initialFrameType = buffer[0];
-  *nInitialFrameSize = prevTagSize - 11;
-  *initialFrame = (char *) malloc(*nInitialFrameSize);
+      /* If we succeeded, we're done.
+       */
+      if (nStatus != RD_INCOMPLETE || !RTMP_IsTimedout(&rtmp)
+	  || s->bLiveStream)
+	break;
+    }
 
-  fseeko(file, size - tsize + 11, SEEK_SET);
-  if (fread(*initialFrame, 1, *nInitialFrameSize, file) != *nInitialFrameSize)
+  if (nStatus == RD_SUCCESS && bFinalize && !s->bStdoutMode
+      && !Finalize(flvFile, &file, indexFd))
     {
-      Log(LOGERROR, "Couldn't read last keyframe, aborting!");
-      return RD_FAILED;
+      SessionError(s->session, "Couldn't finalize %s", flvFile);
+      nStatus = RD_FAILED;
     }
 
-  *dSeek = AMF_DecodeInt24(buffer + 4);	// set seek position to keyframe tmestamp
-  *dSeek |= (buffer[7] << 24);
-  //}
-  //else // handle audio only, we can seek anywhere we'd like
-  //{
-  //}
+clean:
+  Log(LOGDEBUG, "Closing connection.\n");
+  SessionUnwatch(s->session, watch);
+  RTMP_Close(&rtmp);
 
-  if (*dSeek < 0)
-    {
-      Log(LOGERROR,
-	  "Last keyframe timestamp is negative, aborting, your file is corrupt!");
-      return RD_FAILED;
-    }
-  Log(LOGDEBUG, "Last keyframe found at: %d ms, size: %d, type: %02X", *dSeek,
-      *nInitialFrameSize, *initialFrameType);
+  if (file != 0 && file != stdout)
+    fclose(file);
+  if (indexFd >= 0)
+    close(indexFd);
+  IndexFree(&flvIndex);
+  free(initialFrame);
+  free(metaHeader);
 
-  /*
-     // now read the timestamp of the frame before the seekable keyframe:
-     fseeko(file, size-tsize-4, SEEK_SET);
-     if(fread(buffer, 1, 4, file) != 4) {
-     Log(LOGERROR, "Couldn't read prevTagSize from file!");
-     goto start;
-     }
-     uint32_t prevTagSize = RTMP_LIB::AMF_DecodeInt32(buffer);
-     fseeko(file, size-tsize-4-prevTagSize+4, SEEK_SET);
-     if(fread(buffer, 1, 4, file) != 4) {
-     Log(LOGERROR, "Couldn't read previous timestamp!");
-     goto start;
-     }
-     uint32_t timestamp = RTMP_LIB::AMF_DecodeInt24(buffer);
-     timestamp |= (buffer[3]<<24);
-
-     Log(LOGDEBUG, "Previous timestamp: %d ms", timestamp);
-   */
+  return nStatus;
+}
 
-  if (*dSeek != 0)
-    {
-      // seek to position after keyframe in our file (we will ignore the keyframes resent by the server
-      // since they are sent a couple of times and handling this would be a mess)
-      fseeko(file, size - tsize + prevTagSize + 4, SEEK_SET);
+/* A parallel download splits the stream into time ranges fetched over
+ * as many connections, each into a file of its own next to the
+ * download. Every segment goes on SEGMENT_OVERLAP past the start of the
+ * next one, so that both have a keyframe in common whatever the server
+ * makes of the start time; the segments are joined at that keyframe.
+ * A segment is resumed like any download, so an interrupted parallel
+ * download picks up where each of its connections stopped.
+ */
+#define SEGMENT_OVERLAP		10000	// ms
+#define SEGMENT_MATCH		3	// tags after the join that have to agree as well
+#define PROBE_PACKETS		64	// to wait for onMetaData
 
-      // make sure the WriteStream doesn't write headers and ignores all the 0ms TS packets
-      // (including several meta data headers and the keyframe we seeked to)
-      //bNoHeader = true; if bResume==true this is true anyway
-    }
+typedef struct FLVSegment
+{
+  const FLVStream *sg_stream;
+  char *sg_file;
+  bool sg_resume;
+  uint32_t sg_start;
+  uint32_t sg_stop;		// 0 for the end of the stream
+  FLVPart *sg_part;
+  double sg_percent;
+  int sg_status;
+#ifndef WIN32
+  pthread_t sg_thread;
+#endif
+} FLVSegment;
 
-  //}
+/* Connect once to learn the duration of the stream from its onMetaData,
+ * 0 if it has none.
+ */
+static double
+ProbeDuration(const FLVStream * s)
+{
+  RTMP rtmp = { 0 };
+  RTMPPacket packet = { 0 };
+  double duration = 0;
+  int n = 0;
 
-  return RD_SUCCESS;
+  SetupStream(&rtmp, s);
+  RTMP_SetBufferMS(&rtmp, s->bufferTime);
+  if (RTMP_Connect(&rtmp, NULL))
+    {
+      int watch = SessionWatch(s->session, &rtmp);
+      if (RTMP_ConnectStream(&rtmp, 0, 0))
+	while ((duration = RTMP_GetDuration(&rtmp)) <= 0
+	       && n++ < PROBE_PACKETS && !Cancelled(s->session)
+	       && RTMP_GetNextMediaPacket(&rtmp, &packet) == 1)
+	  RTMPPacket_Free(&packet);
+      RTMPPacket_Free(&packet);
+      SessionUnwatch(s->session, watch);
+    }
+  RTMP_Close(&rtmp);
+  return duration;
 }
 
-int
-Download(RTMP * rtmp,		// connected RTMP object
-	 FILE * file, uint32_t dSeek, uint32_t dLength, double duration, bool bResume, char *metaHeader, uint32_t nMetaHeaderSize, char *initialFrame, int initialFrameType, uint32_t nInitialFrameSize, int nSkipKeyFrames, bool bStdoutMode, bool bLiveStream, bool bHashes, bool bOverrideBufferTime, uint32_t bufferTime, double *percent)	// percentage downloaded [out]
+#ifdef WIN32
+static void
+#else
+static void *
+#endif
+SegmentThread(void *arg)
 {
-  uint32_t timestamp = dSeek;
-  int32_t now, lastUpdate;
-  uint8_t dataType = 0;		// will be written into the FLV header (position 4)
-  int bufferSize = 1024 * 1024;
-  char *buffer = (char *) malloc(bufferSize);
-  int nRead = 0;
-  off_t size = ftello(file);
-  unsigned long lastPercent = 0;
+  FLVSegment *sg = arg;
 
-  memset(buffer, 0, bufferSize);
+  sg->sg_status = DownloadFile(sg->sg_stream, sg->sg_file, sg->sg_resume,
+			       sg->sg_start, sg->sg_stop, false,
+			       sg->sg_part, &sg->sg_percent);
+#ifndef WIN32
+  return NULL;
+#endif
+}
 
-  *percent = 0.0;
+/* Can a segment be joined to the one before at this tag: a video
+ * keyframe, or any audio in audio only streams, but no decoder
+ * configuration, which the server sends again at every start.
+ */
+static bool
+SegmentJoinable(const FLVCursor * c, bool bVideo)
+{
+  if (c->c_size < 2)
+    return false;
+  if (bVideo)
+    return c->c_type == 0x09 && (c->c_body[0] & 0xf0) == 0x10
+      && ((c->c_body[0] & 0x0f) != 7 || c->c_body[1] == 1);	// AVC NALU
+  return c->c_type == 0x08
+    && ((c->c_body[0] & 0xf0) != 0xa0 || c->c_body[1] == 1);	// AAC raw
+}
 
-  if (timestamp)
-    {
-      Log(LOGDEBUG, "Continuing at TS: %d ms\n", timestamp);
-    }
+/* Are the tags at a in fa and b in fb the same, and the SEGMENT_MATCH
+ * after them as far as both files go?
+ */
+static bool
+SegmentMatch(FLVFile * fa, off_t a, FLVFile * fb, off_t b)
+{
+  FLVCursor ca, cb;
+  int n;
 
-  if (bLiveStream)
+  if (!FLV_Seek(fa, &ca, a) || !FLV_Seek(fb, &cb, b))
+    return false;
+  for (n = 0; n <= SEGMENT_MATCH; n++)
     {
-      LogPrintf("Starting Live Stream\n");
+      if (ca.c_type != cb.c_type || ca.c_size != cb.c_size
+	  || memcmp(ca.c_body, cb.c_body, ca.c_size) != 0)
+	return false;
+      if (!FLV_Next(&ca) || !FLV_Next(&cb))
+	break;
     }
-  else
+  return true;
+}
+
+static bool
+StitchTag(FILE * fp, const FLVCursor * c, uint32_t timestamp)
+{
+  char head[11], tail[4];
+
+  head[0] = c->c_type;
+  AMF_EncodeInt24(head + 1, head + 4, c->c_size);
+  AMF_EncodeInt24(head + 4, head + 7, timestamp);
+  head[7] = timestamp >> 24;
+  memset(head + 8, 0, 3);
+  AMF_EncodeInt32(tail, tail + 4, c->c_size + 11);
+  return fwrite(head, 1, 11, fp) == 11
+    && fwrite(c->c_body, 1, c->c_size, fp) == c->c_size
+    && fwrite(tail, 1, 4, fp) == 4;
+}
+
+/* Join the segments into flvFile. Each segment after the first starts
+ * at its first keyframe, which the one before has as well: the tags of
+ * the one before up to there are followed by the ones of the segment
+ * from there on, so the frames they both have are written once. The
+ * timestamps of a segment are moved to continue the ones before it.
+ */
+static int
+Stitch(const char *flvFile, FLVSegment * sg, int nSegments)
+{
+  FLVFile flv[MAX_SEGMENTS];
+  FLVCursor c, k;
+  off_t from[MAX_SEGMENTS], to[MAX_SEGMENTS];
+  int64_t shift[MAX_SEGMENTS];
+  char header[13];
+  char *buf = header;
+  FILE *file = NULL;
+  int indexFd = -1, i, nOpen = 0, nStatus = RD_FAILED;
+  uint8_t flags = 0;
+  bool bVideo, bReserved = false;
+
+  for (nOpen = 0; nOpen < nSegments; nOpen++)
     {
-      // print initial status
-      // Workaround to exit with 0 if the file is fully (> 99.9%) downloaded
-      if (duration > 0)
-	{
-	  if ((double) timestamp >= (double) duration * 999.0)
-	    {
-	      LogPrintf("Already Completed at: %.3f sec Duration=%.3f sec\n",
-			(double) timestamp / 1000.0,
-			(double) duration / 1000.0);
-	      return RD_SUCCESS;
-	    }
-	  else
-	    {
-	      *percent = ((double) timestamp) / (duration * 1000.0) * 100.0;
-	      *percent = ((double) (int) (*percent * 10.0)) / 10.0;
-	      LogPrintf("%s download at: %.3f kB / %.3f sec (%.1f%%)\n",
-			bResume ? "Resuming" : "Starting",
-			(double) size / 1024.0, (double) timestamp / 1000.0,
-			*percent);
-	    }
-	}
-      else
+      int fd = open(sg[nOpen].sg_file, O_RDONLY);
+      if (fd < 0 || !FLV_Open(&flv[nOpen], fd))
 	{
-	  LogPrintf("%s download at: %.3f kB\n",
-		    bResume ? "Resuming" : "Starting",
-		    (double) size / 1024.0);
+	  Log(LOGERROR, "Couldn't open segment %s", sg[nOpen].sg_file);
+	  if (fd >= 0)
+	    close(fd);
+	  goto clean;
 	}
+      flags |= flv[nOpen].f_flags;
     }
+  bVideo = (flags & 0x01) != 0;
 
-  if (dLength > 0)
-    LogPrintf("For duration: %.3f sec\n", (double) dLength / 1000.0);
-
-  // write FLV header if not resuming
-  if (!bResume)
+  // find the joins first, the copying moves the windows
+  from[0] = flv[0].f_start;
+  shift[0] = 0;
+  for (i = 1; i < nSegments; i++)
     {
-      nRead = WriteHeader(&buffer, bufferSize);
-      if (nRead > 0)
+      if (!FLV_First(&flv[i], &k))
 	{
-	  if (fwrite(buffer, sizeof(unsigned char), nRead, file) !=
-	      (size_t) nRead)
-	    {
-	      Log(LOGERROR, "%s: Failed writing FLV header, exiting!",
-		  __FUNCTION__);
-	      free(buffer);
-	      return RD_FAILED;
-	    }
-	  size += nRead;
+	  Log(LOGERROR, "Segment %s is empty", sg[i].sg_file);
+	  goto clean;
 	}
-      else
+      while (!SegmentJoinable(&k, bVideo))
+	if (!FLV_Next(&k))
+	  {
+	    Log(LOGERROR, "No keyframe in segment %s", sg[i].sg_file);
+	    goto clean;
+	  }
+
+      bool bFound = FLV_Last(&flv[i - 1], &c);
+      while (bFound && c.c_offset >= from[i - 1]
+	     && !(SegmentJoinable(&c, bVideo)
+		  && SegmentMatch(&flv[i - 1], c.c_offset, &flv[i], k.c_offset)))
+	bFound = FLV_Prev(&c);
+      if (!bFound || c.c_offset < from[i - 1])
 	{
-	  Log(LOGERROR, "Couldn't obtain FLV header, exiting!");
-	  free(buffer);
-	  return RD_FAILED;
+	  Log(LOGERROR,
+	      "Segments %s and %s don't overlap, can't join them",
+	      sg[i - 1].sg_file, sg[i].sg_file);
+	  goto clean;
 	}
+      to[i - 1] = c.c_offset;
+      from[i] = k.c_offset;
+      shift[i] = shift[i - 1] + c.c_timestamp - (int64_t) k.c_timestamp;
+      Log(LOGDEBUG, "%s: segment %d joins at %u ms", __FUNCTION__, i + 1,
+	  (uint32_t) (c.c_timestamp + shift[i - 1]));
     }
+  to[nSegments - 1] = flv[nSegments - 1].f_size;
 
-  now = RTMP_GetTime();
-  lastUpdate = now - 1000;
-  do
+  file = fopen(flvFile, "w+b");
+  if (!file)
     {
-      nRead = WriteStream(rtmp, &buffer, bufferSize, &timestamp, bResume
-			  && nInitialFrameSize > 0, bLiveStream, dSeek,
-			  metaHeader, nMetaHeaderSize, initialFrame,
-			  initialFrameType, nInitialFrameSize, &dataType);
+      LogPrintf("Failed to open file! %s\n", flvFile);
+      goto clean;
+    }
+  WriteHeader(&buf, sizeof(header));
+  header[4] = flags;
+  if (fwrite(header, 1, sizeof(header), file) != sizeof(header))
+    goto write_failed;
 
-      //LogPrintf("nRead: %d\n", nRead);
-      if (nRead > 0)
+  for (i = 0; i < nSegments; i++)
+    {
+      bool bMore = FLV_Seek(&flv[i], &c, from[i]);
+      for (; bMore && c.c_offset < to[i]; bMore = FLV_Next(&c))
 	{
-	  if (fwrite(buffer, sizeof(unsigned char), nRead, file) !=
-	      (size_t) nRead)
-	    {
-	      Log(LOGERROR, "%s: Failed writing, exiting!", __FUNCTION__);
-	      free(buffer);
-	      return RD_FAILED;
-	    }
-	  size += nRead;
-
-	  //LogPrintf("write %dbytes (%.1f kB)\n", nRead, nRead/1024.0);
-	  if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
-	    duration = RTMP_GetDuration(rtmp);
-
-	  if (duration > 0)
-	    {
-	      // make sure we claim to have enough buffer time!
-	      if (!bOverrideBufferTime && bufferTime < (duration * 1000.0))
-		{
-		  bufferTime = (uint32_t) (duration * 1000.0) + 5000;	// extra 5sec to make sure we've got enough
-
-		  Log(LOGDEBUG,
-		      "Detected that buffer time is less than duration, resetting to: %dms",
-		      bufferTime);
-		  RTMP_SetBufferMS(rtmp, bufferTime);
-		  RTMP_UpdateBufferMS(rtmp);
-		}
-	      *percent = ((double) timestamp) / (duration * 1000.0) * 100.0;
-	      *percent = ((double) (int) (*percent * 10.0)) / 10.0;
-	      if (bHashes)
-		{
-		  if (lastPercent + 1 <= *percent)
-		    {
-		      LogStatus("#");
-		      lastPercent = (unsigned long) *percent;
-		    }
-		}
-	      else
-		{
-		  now = RTMP_GetTime();
-		  if (abs(now - lastUpdate) > 200)
-		    {
-		      LogStatus("\r%.3f kB / %.2f sec (%.1f%%)",
-				(double) size / 1024.0,
-				(double) (timestamp) / 1000.0, *percent);
-		      lastUpdate = now;
-		    }
-		}
-	    }
-	  else
-	    {
-	      now = RTMP_GetTime();
-	      if (abs(now - lastUpdate) > 200)
-		{
-		  if (bHashes)
-		    LogStatus("#");
-		  else
-		    LogStatus("\r%.3f kB / %.2f sec", (double) size / 1024.0,
-			      (double) (timestamp) / 1000.0);
-		  lastUpdate = now;
+	  int64_t ts = c.c_timestamp + shift[i];
+	  if (c.c_type == 0x12 && i > 0)
+	    continue;
+	  if (c.c_type == 0x12 && !bReserved)
+	    {
+	      // room for Finalize, as Download leaves it
+	      RTMPPacket padded = { 0 };
+	      bReserved = true;
+	      if (MetaReserve(c.c_body, c.c_size, &padded))
+		{
+		  FLVCursor m = c;
+		  bool bOK;
+
+		  m.c_body = padded.m_body;
+		  m.c_size = padded.m_nBodySize;
+		  bOK = StitchTag(file, &m, ts > 0 ? (uint32_t) ts : 0);
+		  RTMPPacket_Free(&padded);
+		  if (!bOK)
+		    goto write_failed;
+		  continue;
 		}
 	    }
+	  if (!StitchTag(file, &c, ts > 0 ? (uint32_t) ts : 0))
+	    goto write_failed;
 	}
-#ifdef _DEBUG
-      else
-	{
-	  Log(LOGDEBUG, "zero read!");
-	}
-#endif
+    }
+
+  // the index is collected from the file
+  indexFd = IndexOpen(flvFile, NULL, 0);
+  if (Finalize(flvFile, &file, indexFd))
+    nStatus = RD_SUCCESS;
+  else
+    Log(LOGERROR, "%s: Couldn't finalize %s, keeping the segments",
+	__FUNCTION__, flvFile);
+  goto clean;
+
+write_failed:
+  Log(LOGERROR, "%s: Failed writing, exiting!", __FUNCTION__);
 
+clean:
+  for (i = 0; i < nOpen; i++)
+    {
+      close(flv[i].f_fd);
+      FLV_Close(&flv[i]);
     }
-  while (!RTMP_ctrlC && nRead > -1 && RTMP_IsConnected(rtmp));
-  free(buffer);
+  if (file)
+    fclose(file);
+  if (indexFd >= 0)
+    close(indexFd);
+  return nStatus;
+}
 
-  Log(LOGDEBUG, "WriteStream returned: %d", nRead);
+/* Download a VOD stream over nSegments connections at once, see
+ * FLVSegment.
+ */
+static int
+DownloadParallel(const FLVStream * s, const char *flvFile, bool bResume,
+		 uint32_t dStartOffset, uint32_t dStopOffset,
+		 int nSegments, FLVPart * part, double *percent)
+{
+  FLVSegment sg[MAX_SEGMENTS];
+  uint32_t start[MAX_SEGMENTS], stop[MAX_SEGMENTS];
+  FLVPart *parts;
+  struct stat st;
+  uint32_t dEnd = dStopOffset;
+  int i, nStatus = RD_SUCCESS;
+
+  *percent = 0;
+  if (bResume && stat(flvFile, &st) == 0 && st.st_size > 0)
+    {
+      Log(LOGDEBUG, "%s exists, resuming it over one connection", flvFile);
+      return DownloadFile(s, flvFile, bResume, dStartOffset, dStopOffset,
+			  true, part, percent);
+    }
+  if (!dEnd)
+    {
+      double duration = ProbeDuration(s);
+      if (duration <= 0)
+	{
+	  Log(LOGWARNING,
+	      "Couldn't get the duration of the stream, downloading over one connection");
+	  return DownloadFile(s, flvFile, bResume, dStartOffset, dStopOffset,
+			      true, part, percent);
+	}
+      dEnd = (uint32_t) (duration * 1000.0);
+    }
+  if (dEnd <= dStartOffset + (uint32_t) nSegments * SEGMENT_OVERLAP)
+    {
+      Log(LOGDEBUG, "Stream too short to split, downloading over one connection");
+      return DownloadFile(s, flvFile, bResume, dStartOffset, dStopOffset,
+			  true, part, percent);
+    }
 
-  if (bResume && nRead == -2)
+  LogPrintf("Downloading %.3f sec in %d segments\n",
+	    (double) (dEnd - dStartOffset) / 1000.0, nSegments);
+  for (i = 0; i < nSegments; i++)
     {
-      LogPrintf("Couldn't resume FLV file, try --skip %d\n\n",
-		nSkipKeyFrames + 1);
-      return RD_FAILED;
+      start[i] = dStartOffset
+	+ (uint64_t) (dEnd - dStartOffset) * i / nSegments;
+      // the last one runs to the end, the stream may be longer than its onMetaData says
+      stop[i] = i + 1 < nSegments ? dStartOffset
+	+ (uint64_t) (dEnd - dStartOffset) * (i + 1) / nSegments
+	+ SEGMENT_OVERLAP : dStopOffset;
     }
+  parts = SessionParts(s->session, nSegments, start, stop);
 
-  // finalize header by writing the correct dataType (video, audio, video+audio)
-  if (!bResume && dataType != 0x5 && !bStdoutMode)
+  for (i = 0; i < nSegments; i++)
     {
-      //Log(LOGDEBUG, "Writing data type: %02X", dataType);
-      fseek(file, 4, SEEK_SET);
-      fwrite(&dataType, sizeof(unsigned char), 1, file);
-      /* resume uses ftell to see where we left off */
-      fseek(file, 0, SEEK_END);
+      sg[i].sg_stream = s;
+      sg[i].sg_file = malloc(strlen(flvFile) + 16);
+      sprintf(sg[i].sg_file, "%s.%dof%d", flvFile, i + 1, nSegments);
+      sg[i].sg_resume = bResume;
+      sg[i].sg_start = start[i];
+      sg[i].sg_stop = stop[i];
+      sg[i].sg_part = &parts[i];
+      sg[i].sg_percent = 0;
+      sg[i].sg_status = RD_FAILED;
+#ifdef WIN32
+      SegmentThread(&sg[i]);
+#else
+      if (pthread_create(&sg[i].sg_thread, NULL, SegmentThread, &sg[i]))
+	{
+	  Log(LOGERROR, "%s: couldn't start segment %d", __FUNCTION__, i + 1);
+	  sg[i].sg_thread = pthread_self();
+	}
+#endif
     }
 
-  if (nRead == -3)
-    return RD_SUCCESS;
+  for (i = 0; i < nSegments; i++)
+    {
+#ifndef WIN32
+      if (!pthread_equal(sg[i].sg_thread, pthread_self()))
+	pthread_join(sg[i].sg_thread, NULL);
+#endif
+      if (sg[i].sg_status == RD_SUCCESS)
+	*percent += 100.0 / nSegments;
+      else if (nStatus != RD_FAILED)
+	nStatus = sg[i].sg_status;
+    }
 
-  if ((duration > 0 && *percent < 99.9) || RTMP_ctrlC || nRead < 0
-      || RTMP_IsTimedout(rtmp))
+  if (nStatus == RD_SUCCESS)
     {
-      return RD_INCOMPLETE;
+      nStatus = Stitch(flvFile, sg, nSegments);
+      if (nStatus == RD_SUCCESS)
+	for (i = 0; i < nSegments; i++)
+	  {
+	    char *name = IndexName(sg[i].sg_file);
+	    remove(sg[i].sg_file);
+	    if (name)
+	      remove(name);
+	    free(name);
+	  }
     }
 
-  return RD_SUCCESS;
+  for (i = 0; i < nSegments; i++)
+    free(sg[i].sg_file);
+  return nStatus;
 }
 
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
@@ -1148,14 +3590,348 @@ parseAMF(AMFObject *obj, const char *arg, int *depth)
   return 0;
 }
 
+/* getopt keeps its state in globals, so only one download at a time
+ * may parse its options.
+ */
+#ifdef WIN32
+#define OPTIONS_LOCK()
+#define OPTIONS_UNLOCK()
+#else
+static pthread_mutex_t optionsLock = PTHREAD_MUTEX_INITIALIZER;
+#define OPTIONS_LOCK()		pthread_mutex_lock(&optionsLock)
+#define OPTIONS_UNLOCK()	pthread_mutex_unlock(&optionsLock)
+#endif
+
+#undef OSS
+#ifdef WIN32
+#define	OSS	"WIN"
+#else
+#define OSS	"LNX"
+#endif
+
+static char DEFAULT_FLASH_VER[] = OSS " 10,0,22,87";
+
+#ifndef WIN32
+/* Without a handler of the embedding program, writing to a socket the
+ * server closed would kill it.
+ */
+static pthread_once_t sigpipeOnce = PTHREAD_ONCE_INIT;
+
+static void
+IgnoreSigpipe(void)
+{
+  struct sigaction sa;
+
+  if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+    signal(SIGPIPE, SIG_IGN);
+}
+#endif
+
+FLVSession *
+FLVSession_New(const FLVRequest * req)
+{
+  FLVSession *ss = SessionAlloc();
+  FLVStream *s;
+
+  if (!ss)
+    return NULL;
+  s = &ss->ss_stream;
+  s->protocol = RTMP_PROTOCOL_UNDEFINED;
+  s->port = -1;
+
+  if (req->url)
+    {
+      char *host = 0, *playpath = 0, *app = 0;
+      unsigned int port = 0;
+      int protocol = RTMP_PROTOCOL_UNDEFINED;
+
+      if (!ParseUrl((char *) req->url, &protocol, &host, &port, &playpath,
+		    &app))
+	{
+	  Log(LOGWARNING, "Couldn't parse the specified url (%s)!",
+	      req->url);
+	}
+      else
+	{
+	  s->protocol = protocol;
+	  s->port = port;
+	}
+      s->hostname = SessionKeep(ss, host);
+      if (SessionKeep(ss, playpath))
+	{
+	  STR2AVAL(s->playpath, playpath);
+	}
+      if (SessionKeep(ss, app))
+	{
+	  STR2AVAL(s->app, app);
+	}
+    }
+  if (req->hostname)
+    s->hostname = SessionKeep(ss, strdup(req->hostname));
+  if (req->port > 0)
+    s->port = req->port;
+  SessionString(ss, &s->app, req->app);
+  SessionString(ss, &s->playpath, req->playpath);
+  SessionString(ss, &s->tcUrl, req->tcUrl);
+  SessionString(ss, &s->swfUrl, req->swfUrl);
+  SessionString(ss, &s->pageUrl, req->pageUrl);
+  SessionString(ss, &s->flashVer, req->flashVer);
+  SessionString(ss, &s->auth, req->auth);
+  SessionString(ss, &s->token, req->token);
+  SessionString(ss, &s->subscribepath, req->subscribepath);
+
+  s->bLiveStream = req->live != 0;
+  s->timeout = req->timeout > 0 ? req->timeout : 120;
+  s->bufferTime = 10 * 60 * 60 * 1000;	// 10 hours as default
+  if (req->bufferTime > 0)
+    {
+      s->bufferTime = req->bufferTime;
+      s->bOverrideBufferTime = true;
+    }
+  s->nSkipKeyFrames = req->skipKeyFrames > 0 ? req->skipKeyFrames : 0;
+  s->bStdoutMode = !req->outfile || !strcmp(req->outfile, "-");
+  s->session = ss;
+
+  if (!s->bStdoutMode)
+    ss->ss_file = SessionKeep(ss, strdup(req->outfile));
+  ss->ss_resume = req->resume != 0;
+  ss->ss_start = req->start;
+  ss->ss_stop = req->stop;
+  ss->ss_parallel = req->parallel;
+  if (ss->ss_parallel < 1 || ss->ss_parallel > MAX_SEGMENTS)
+    {
+      if (ss->ss_parallel)
+	Log(LOGERROR,
+	    "Number of connections must be between 1 and %d, using one!",
+	    MAX_SEGMENTS);
+      ss->ss_parallel = 1;
+    }
+  ss->ss_callbacks = req->callbacks;
+  ss->ss_ctx = req->ctx;
+  return ss;
+}
+
+/* Check what the session was given, fill in the defaults and download. */
+static int
+SessionDownload(FLVSession * ss)
+{
+  FLVStream *s = &ss->ss_stream;
+  FLVPart *part;
+  double percent = 0;
+  int nStatus;
+
+  if (Cancelled(ss))
+    return RD_INCOMPLETE;
+
+  if (s->hostname == 0)
+    {
+      SessionError(ss,
+		   "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
+      return RD_FAILED;
+    }
+  if (s->playpath.av_len == 0)
+    {
+      SessionError(ss,
+		   "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
+      return RD_FAILED;
+    }
+
+  if (s->port == -1)
+    {
+      Log(LOGWARNING,
+	  "You haven't specified a port (--port) or rtmp url (-r), using default port 1935");
+      s->port = 1935;
+    }
+  if (s->port == 0)
+    {
+      s->port = 1935;
+    }
+  if (s->protocol == RTMP_PROTOCOL_UNDEFINED)
+    {
+      Log(LOGWARNING,
+	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
+      s->protocol = RTMP_PROTOCOL_RTMP;
+    }
+
+  if (s->bStdoutMode && ss->ss_resume)
+    {
+      Log(LOGWARNING,
+	  "Can't resume in stdout mode, ignoring --resume option");
+      ss->ss_resume = false;
+    }
+
+  if (s->bLiveStream && ss->ss_resume)
+    {
+      Log(LOGWARNING, "Can't resume live stream, ignoring --resume option");
+      ss->ss_resume = false;
+    }
+
+  if (s->flashVer.av_len == 0)
+    {
+      STR2AVAL(s->flashVer, DEFAULT_FLASH_VER);
+    }
+
+  if (s->tcUrl.av_len == 0 && s->app.av_len != 0)
+    {
+      char str[512] = { 0 };
+
+      snprintf(str, 511, "%s://%s:%d/%.*s",
+	       RTMPProtocolStringsLower[s->protocol], s->hostname, s->port,
+	       s->app.av_len, s->app.av_val);
+      if (SessionKeep(ss, strdup(str)))
+	{
+	  STR2AVAL(s->tcUrl, ss->ss_kept[ss->ss_nKept - 1]);
+	}
+    }
+
+  // User defined seek offset
+  if (ss->ss_start > 0)
+    {
+      // Live stream
+      if (s->bLiveStream)
+	{
+	  Log(LOGWARNING,
+	      "Can't seek in a live stream, ignoring --start option");
+	  ss->ss_start = 0;
+	}
+    }
+
+  if (ss->ss_parallel > 1 && (s->bLiveStream || s->bStdoutMode))
+    {
+      Log(LOGWARNING,
+	  "Can't split a live stream or stdout, ignoring --parallel option");
+      ss->ss_parallel = 1;
+    }
+
+  if (!InitSockets())
+    {
+      SessionError(ss,
+		   "Couldn't load sockets support on your platform, exiting!");
+      return RD_FAILED;
+    }
+#ifndef WIN32
+  pthread_once(&sigpipeOnce, IgnoreSigpipe);
+#endif
+
+#ifdef _DEBUG
+  netstackdump = fopen("netstackdump", "wb");
+  netstackdump_read = fopen("netstackdump_read", "wb");
+#endif
+
+  part = SessionParts(ss, 1, &ss->ss_start, &ss->ss_stop);
+  if (ss->ss_parallel > 1)
+    nStatus = DownloadParallel(s, ss->ss_file, ss->ss_resume, ss->ss_start,
+			       ss->ss_stop, ss->ss_parallel, part, &percent);
+  else
+    nStatus = DownloadFile(s, ss->ss_file, ss->ss_resume, ss->ss_start,
+			   ss->ss_stop, true, part, &percent);
+
+  if (nStatus == RD_SUCCESS)
+    {
+      LogPrintf("Download complete\n");
+    }
+  else if (nStatus == RD_INCOMPLETE)
+    {
+      LogPrintf
+	("Download may be incomplete (downloaded about %.2f%%), try resuming\n",
+	 percent);
+    }
+
+  CleanupSockets();
+
+#ifdef _DEBUG
+  if (netstackdump != 0)
+    fclose(netstackdump);
+  if (netstackdump_read != 0)
+    fclose(netstackdump_read);
+#endif
+  return nStatus;
+}
+
+int
+FLVSession_Run(FLVSession * ss)
+{
+  int nStatus;
+
+  if (OUTPUT_GET(ss->ss_state) != FLV_IDLE)
+    {
+      Log(LOGERROR, "%s: a session is run only once", __FUNCTION__);
+      return RD_FAILED;
+    }
+  OUTPUT_SET(ss->ss_startTime, RTMP_GetTime());
+  OUTPUT_SET(ss->ss_state, FLV_RUNNING);
+
+  nStatus = SessionDownload(ss);
+
+  OUTPUT_SET(ss->ss_endTime, RTMP_GetTime());
+  OUTPUT_SET(ss->ss_status, nStatus);
+  OUTPUT_SET(ss->ss_state, FLV_DONE);
+  if (ss->ss_callbacks.complete)
+    {
+      SESSION_LOCK(ss, ss_callbackLock);
+      ss->ss_callbacks.complete(ss->ss_ctx, nStatus);
+      SESSION_UNLOCK(ss, ss_callbackLock);
+    }
+  return nStatus;
+}
+
+#ifndef WIN32
+static void *
+SessionThread(void *arg)
+{
+  FLVSession_Run(arg);
+  return NULL;
+}
+#endif
+
+int
+FLVSession_Start(FLVSession * ss)
+{
+#ifdef WIN32
+  FLVSession_Run(ss);
+#else
+  if (ss->ss_threaded
+      || pthread_create(&ss->ss_thread, NULL, SessionThread, ss))
+    {
+      Log(LOGERROR, "%s: couldn't start the download thread", __FUNCTION__);
+      return 0;
+    }
+  ss->ss_threaded = true;
+#endif
+  return 1;
+}
+
+int
+FLVSession_Wait(FLVSession * ss)
+{
+#ifndef WIN32
+  if (ss->ss_threaded)
+    {
+      pthread_join(ss->ss_thread, NULL);
+      ss->ss_threaded = false;
+    }
+#endif
+  if (OUTPUT_GET(ss->ss_state) != FLV_DONE)
+    return RD_FAILED;
+  return OUTPUT_GET(ss->ss_status);
+}
+
+void
+FLVSession_Query(FLVSession * ss, FLVSessionInfo * info)
+{
+  SessionStats(ss, info);
+}
+
+/* The command line: the options go into a session, which is run on
+ * this thread.
+ */
 int
 flvstreamer(int argc, char **argv)
 {
   extern char *optarg;
 
+  FLVSession *ss;
   int nStatus = RD_SUCCESS;
-  double percent = 0;
-  double duration = 0.0;
 
   int nSkipKeyFrames = 0;	// skip this number of keyframes when resuming
 
@@ -1163,32 +3939,20 @@ flvstreamer(int argc, char **argv)
   bool bStdoutMode = true;	// if true print the stream directly to stdout, messages go to stderr
 
   bool bResume = false;		// true in resume mode
-  uint32_t dSeek = 0;		// seek position in resume mode, 0 otherwise
   uint32_t bufferTime = 10 * 60 * 60 * 1000;	// 10 hours as default
 
-  // meta header and initial frame for the resume mode (they are read from the file and compared with
-  // the stream we are trying to continue
-  char *metaHeader = 0;
-  uint32_t nMetaHeaderSize = 0;
-
-  // video keyframe for matching
-  char *initialFrame = 0;
-  uint32_t nInitialFrameSize = 0;
-  int initialFrameType = 0;	// tye: audio or video
-
   char *hostname = 0;
   AVal playpath = { 0, 0 };
   AVal subscribepath = { 0, 0 };
   int port = -1;
   int protocol = RTMP_PROTOCOL_UNDEFINED;
-  int retries = 0;
   bool bLiveStream = false;	// is it a live stream? then we can't seek/resume
   bool bHashes = false;		// display byte counters not hashes by default
 
   long int timeout = 120;	// timeout connection after 120 seconds
   uint32_t dStartOffset = 0;	// seek position in non-live mode
   uint32_t dStopOffset = 0;
-  uint32_t dLength = 0;		// length to play from stream - calculated from seek position and dStopOffset
+  int nParallel = 1;		// connections to download over
 
   char *rtmpurl = 0;
   AVal swfUrl = { 0, 0 };
@@ -1199,21 +3963,12 @@ flvstreamer(int argc, char **argv)
   AVal swfHash = { 0, 0 };
   uint32_t swfSize = 0;
   AVal flashVer = { 0, 0 };
-  AVal token = { 0, 0 };
-  char *sockshost = 0;
-  AMFObject extras = {0};
-  int edepth = 0;
-
-  char *flvFile = 0;
-
-#undef OSS
-#ifdef WIN32
-#define	OSS	"WIN"
-#else
-#define OSS	"LNX"
-#endif
+  AVal token = { 0, 0 };
+  char *sockshost = 0;
+  AMFObject *extras;
+  int edepth = 0;
 
-  char DEFAULT_FLASH_VER[] = OSS " 10,0,22,87";
+  char *flvFile = 0;
 
   signal(SIGINT, sigIntHandler);
   signal(SIGTERM, sigIntHandler);
@@ -1237,12 +3992,10 @@ flvstreamer(int argc, char **argv)
   LogPrintf
     ("(c) 2010 Andrej Stepanchuk, Howard Chu, The Flvstreamer Team; license: GPL\n");
 
-  if (!InitSockets())
-    {
-      Log(LOGERROR,
-	  "Couldn't load sockets support on your platform, exiting!");
-      return RD_FAILED;
-    }
+  ss = SessionAlloc();
+  if (!ss)
+    return RD_FAILED;
+  extras = &ss->ss_stream.extras;
 
   /* sleep(30); */
 
@@ -1271,6 +4024,7 @@ flvstreamer(int argc, char **argv)
     {"subscribe", 1, NULL, 'd'},
     {"start", 1, NULL, 'A'},
     {"stop", 1, NULL, 'B'},
+    {"parallel", 1, NULL, 'P'},
     {"token", 1, NULL, 'T'},
     {"hashes", 0, NULL, '#'},
     {"debug", 0, NULL, 'z'},
@@ -1279,11 +4033,12 @@ flvstreamer(int argc, char **argv)
     {0, 0, 0, 0}
   };
 
+  OPTIONS_LOCK();
   optind = 0; // added
 
   while ((opt =
 	  getopt_long(argc, argv,
-		      "hVveqzr:s:t:p:a:b:f:o:u:C:n:c:l:y:m:k:d:A:B:T:w:x:W:X:S:#",
+		      "hVveqzr:s:t:p:a:b:f:o:u:C:n:c:l:y:m:k:d:A:B:P:T:w:x:W:X:S:#",
 		      longopts, NULL)) != -1)
     {
       switch (opt)
@@ -1335,6 +4090,9 @@ flvstreamer(int argc, char **argv)
 	    ("--start|-A num          Start at num seconds into stream (not valid when using --live)\n");
 	  LogPrintf
 	    ("--stop|-B num           Stop at num seconds into stream\n");
+	  LogPrintf
+	    ("--parallel|-P num       Download a recorded stream over num connections at once (max %d)\n",
+	     MAX_SEGMENTS);
 	  LogPrintf
 	    ("--token|-T key          Key for SecureToken response\n");
 	  LogPrintf
@@ -1352,6 +4110,8 @@ flvstreamer(int argc, char **argv)
 	  LogPrintf
 	    ("If you don't pass parameters for swfUrl, pageUrl, or auth these properties will not be included in the connect ");
 	  LogPrintf("packet.\n\n");
+	  OPTIONS_UNLOCK();
+	  FLVSession_Free(ss);
 	  return RD_SUCCESS;
 	case 'k':
 	  nSkipKeyFrames = atoi(optarg);
@@ -1401,6 +4161,8 @@ flvstreamer(int argc, char **argv)
 	      && protocol != RTMP_PROTOCOL_RTMPE)
 	    {
 	      Log(LOGERROR, "Unknown protocol specified: %d", protocol);
+	      OPTIONS_UNLOCK();
+	      FLVSession_Free(ss);
 	      return RD_FAILED;
 	    }
 	  break;
@@ -1411,10 +4173,8 @@ flvstreamer(int argc, char **argv)
 	  {
 	    rtmpurl = optarg;
 
-	    char *parsedHost = 0;
+	    char *parsedHost = 0, *parsedPlaypath = 0, *parsedApp = 0;
 	    unsigned int parsedPort = 0;
-	    char *parsedPlaypath = 0;
-	    char *parsedApp = 0;
 	    int parsedProtocol = RTMP_PROTOCOL_UNDEFINED;
 
 	    if (!ParseUrl
@@ -1443,6 +4203,9 @@ flvstreamer(int argc, char **argv)
 		    STR2AVAL(app, parsedApp);
 		  }
 	      }
+	    SessionKeep(ss, parsedHost);
+	    SessionKeep(ss, parsedPlaypath);
+	    SessionKeep(ss, parsedApp);
 	    break;
 	  }
 	case 's':
@@ -1473,9 +4236,11 @@ flvstreamer(int argc, char **argv)
 	  STR2AVAL(auth, optarg);
 	  break;
         case 'C':
-          if (parseAMF(&extras, optarg, &edepth))
+          if (parseAMF(extras, optarg, &edepth))
             {
               Log(LOGERROR, "Invalid AMF parameter: %s", optarg);
+	      OPTIONS_UNLOCK();
+	      FLVSession_Free(ss);
               return RD_FAILED;
             }
           break;
@@ -1488,6 +4253,16 @@ flvstreamer(int argc, char **argv)
 	case 'B':
 	  dStopOffset = (int) (atof(optarg) * 1000.0);
 	  break;
+	case 'P':
+	  nParallel = atoi(optarg);
+	  if (nParallel < 1 || nParallel > MAX_SEGMENTS)
+	    {
+	      Log(LOGERROR,
+		  "Number of connections must be between 1 and %d, using one!",
+		  MAX_SEGMENTS);
+	      nParallel = 1;
+	    }
+	  break;
 	case 'T':
 	  STR2AVAL(token, optarg);
 	  break;
@@ -1511,36 +4286,8 @@ flvstreamer(int argc, char **argv)
 	  break;
 	}
     }
+  OPTIONS_UNLOCK();
 
-  if (hostname == 0)
-    {
-      Log(LOGERROR,
-	  "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
-      return RD_FAILED;
-    }
-  if (playpath.av_len == 0)
-    {
-      Log(LOGERROR,
-	  "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
-      return RD_FAILED;
-    }
-
-  if (port == -1)
-    {
-      Log(LOGWARNING,
-	  "You haven't specified a port (--port) or rtmp url (-r), using default port 1935");
-      port = 1935;
-    }
-  if (port == 0)
-    {
-      port = 1935;
-    }
-  if (protocol == RTMP_PROTOCOL_UNDEFINED)
-    {
-      Log(LOGWARNING,
-	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
-      protocol = RTMP_PROTOCOL_RTMP;
-    }
   if (flvFile == 0)
     {
       Log(LOGWARNING,
@@ -1548,266 +4295,36 @@ flvstreamer(int argc, char **argv)
       bStdoutMode = true;
     }
 
-  if (bStdoutMode && bResume)
-    {
-      Log(LOGWARNING,
-	  "Can't resume in stdout mode, ignoring --resume option");
-      bResume = false;
-    }
-
-  if (bLiveStream && bResume)
-    {
-      Log(LOGWARNING, "Can't resume live stream, ignoring --resume option");
-      bResume = false;
-    }
-
-  if (flashVer.av_len == 0)
-    {
-      STR2AVAL(flashVer, DEFAULT_FLASH_VER);
-    }
-
-
-  if (tcUrl.av_len == 0 && app.av_len != 0)
-    {
-      char str[512] = { 0 };
-
-      snprintf(str, 511, "%s://%s:%d/%s", RTMPProtocolStringsLower[protocol],
-	       hostname, port, app.av_val);
-      tcUrl.av_len = strlen(str);
-      tcUrl.av_val = (char *) malloc(tcUrl.av_len + 1);
-      strcpy(tcUrl.av_val, str);
-    }
-
-  int first = 1;
-
-  // User defined seek offset
-  if (dStartOffset > 0)
-    {
-      // Live stream
-      if (bLiveStream)
-	{
-	  Log(LOGWARNING,
-	      "Can't seek in a live stream, ignoring --start option");
-	  dStartOffset = 0;
-	}
-    }
-
-  RTMP rtmp = { 0 };
-  RTMP_Init(&rtmp);
-  RTMP_SetupStream(&rtmp, protocol, hostname, port, sockshost, &playpath,
-		   &tcUrl, &swfUrl, &pageUrl, &app, &auth, &swfHash, swfSize,
-		   &flashVer, &subscribepath, dSeek, 0, bLiveStream, timeout);
-
-  /* backward compatibility, we always sent this as true before */
-  if (auth.av_len)
-    rtmp.Link.authflag = true;
-
-  rtmp.Link.extras = extras;
-  rtmp.Link.token = token;
-  off_t size = 0;
-
-  // ok, we have to get the timestamp of the last keyframe (only keyframes are seekable) / last audio frame (audio only streams)
-  if (bResume)
-    {
-      nStatus =
-	OpenResumeFile(flvFile, &file, &size, &metaHeader, &nMetaHeaderSize,
-		       &duration);
-      if (nStatus == RD_FAILED)
-	goto clean;
-
-      if (!file)
-	{
-	  // file does not exist, so go back into normal mode
-	  bResume = false;	// we are back in fresh file mode (otherwise finalizing file won't be done)
-	}
-      else
-	{
-	  nStatus = GetLastKeyframe(file, nSkipKeyFrames,
-				    &dSeek, &initialFrame,
-				    &initialFrameType, &nInitialFrameSize);
-	  if (nStatus == RD_FAILED)
-	    {
-	      Log(LOGDEBUG, "Failed to get last keyframe.");
-	      goto clean;
-	    }
-
-	  if (dSeek == 0)
-	    {
-	      Log(LOGDEBUG,
-		  "Last keyframe is first frame in stream, switching from resume to normal mode!");
-	      bResume = false;
-	    }
-	}
-    }
-
-  if (!file)
-    {
-      if (bStdoutMode)
-	{
-	  file = stdout;
-	  SET_BINMODE(file);
-	}
-      else
-	{
-	  file = fopen(flvFile, "w+b");
-	  if (file == 0)
-	    {
-	      LogPrintf("Failed to open file! %s\n", flvFile);
-	      return RD_FAILED;
-	    }
-	}
-    }
-
-#ifdef _DEBUG
-  netstackdump = fopen("netstackdump", "wb");
-  netstackdump_read = fopen("netstackdump_read", "wb");
-#endif
-
-  while (!RTMP_ctrlC)
-    {
-      Log(LOGDEBUG, "Setting buffer time to: %dms", bufferTime);
-      RTMP_SetBufferMS(&rtmp, bufferTime);
-
-      if (first)
-	{
-	  first = 0;
-	  LogPrintf("Connecting ...\n");
-
-	  if (!RTMP_Connect(&rtmp, NULL))
-	    {
-	      nStatus = RD_FAILED;
-	      break;
-	    }
-
-	  Log(LOGINFO, "Connected...");
-
-	  // User defined seek offset
-	  if (dStartOffset > 0)
-	    {
-	      // Don't need the start offset if resuming an existing file
-	      if (bResume)
-		{
-		  Log(LOGWARNING,
-		      "Can't seek a resumed stream, ignoring --start option");
-		  dStartOffset = 0;
-		}
-	      else
-		{
-		  dSeek = dStartOffset;
-		}
-	    }
-
-	  // Calculate the length of the stream to still play
-	  if (dStopOffset > 0)
-	    {
-	      dLength = dStopOffset - dSeek;
-
-	      // Quit if start seek is past required stop offset
-	      if (dLength <= 0)
-		{
-		  LogPrintf("Already Completed\n");
-		  nStatus = RD_SUCCESS;
-		  break;
-		}
-	    }
-
-	  if (!RTMP_ConnectStream(&rtmp, dSeek, dLength))
-	    {
-	      nStatus = RD_FAILED;
-	      break;
-	    }
-	}
-      else
-	{
-	  nInitialFrameSize = 0;
-
-          if (retries)
-            {
-	      Log(LOGERROR, "Failed to resume the stream\n\n");
-	      if (!RTMP_IsTimedout(&rtmp))
-	        nStatus = RD_FAILED;
-	      else
-	        nStatus = RD_INCOMPLETE;
-	      break;
-            }
-	  Log(LOGINFO, "Connection timed out, trying to resume.\n\n");
-          /* Did we already try pausing, and it still didn't work? */
-          if (rtmp.m_pausing == 3)
-            {
-              /* Only one try at reconnecting... */
-              retries = 1;
-              dSeek = rtmp.m_pauseStamp;
-              if (dStopOffset > 0)
-                {
-                  dLength = dStopOffset - dSeek;
-                  if (dLength <= 0)
-                    {
-                      LogPrintf("Already Completed\n");
-		      nStatus = RD_SUCCESS;
-		      break;
-                    }
-                }
-              if (!RTMP_ReconnectStream(&rtmp, bufferTime, dSeek, dLength))
-                {
-	          Log(LOGERROR, "Failed to resume the stream\n\n");
-	          if (!RTMP_IsTimedout(&rtmp))
-		    nStatus = RD_FAILED;
-	          else
-		    nStatus = RD_INCOMPLETE;
-	          break;
-                }
-            }
-	  else if (!RTMP_ToggleStream(&rtmp))
-	    {
-	      Log(LOGERROR, "Failed to resume the stream\n\n");
-	      if (!RTMP_IsTimedout(&rtmp))
-		nStatus = RD_FAILED;
-	      else
-		nStatus = RD_INCOMPLETE;
-	      break;
-	    }
-	  bResume = true;
-	}
-
-      nStatus = Download(&rtmp, file, dSeek, dLength, duration, bResume,
-			 metaHeader, nMetaHeaderSize, initialFrame,
-			 initialFrameType, nInitialFrameSize,
-			 nSkipKeyFrames, bStdoutMode, bLiveStream, bHashes,
-			 bOverrideBufferTime, bufferTime, &percent);
-      free(initialFrame);
-      initialFrame = NULL;
-
-      /* If we succeeded, we're done.
-       */
-      if (nStatus != RD_INCOMPLETE || !RTMP_IsTimedout(&rtmp) || bLiveStream)
-	break;
-    }
-
-  if (nStatus == RD_SUCCESS)
-    {
-      LogPrintf("Download complete\n");
-    }
-  else if (nStatus == RD_INCOMPLETE)
-    {
-      LogPrintf
-	("Download may be incomplete (downloaded about %.2f%%), try resuming\n",
-	 percent);
-    }
-
-clean:
-  Log(LOGDEBUG, "Closing connection.\n");
-  RTMP_Close(&rtmp);
-
-  if (file != 0)
-    fclose(file);
-
-  CleanupSockets();
-
-#ifdef _DEBUG
-  if (netstackdump != 0)
-    fclose(netstackdump);
-  if (netstackdump_read != 0)
-    fclose(netstackdump_read);
-#endif
+  ss->ss_stream.protocol = protocol;
+  ss->ss_stream.hostname = hostname;
+  ss->ss_stream.port = port;
+  ss->ss_stream.sockshost = sockshost;
+  ss->ss_stream.playpath = playpath;
+  ss->ss_stream.tcUrl = tcUrl;
+  ss->ss_stream.swfUrl = swfUrl;
+  ss->ss_stream.pageUrl = pageUrl;
+  ss->ss_stream.app = app;
+  ss->ss_stream.auth = auth;
+  ss->ss_stream.swfHash = swfHash;
+  ss->ss_stream.swfSize = swfSize;
+  ss->ss_stream.flashVer = flashVer;
+  ss->ss_stream.subscribepath = subscribepath;
+  ss->ss_stream.token = token;
+  ss->ss_stream.bLiveStream = bLiveStream;
+  ss->ss_stream.timeout = timeout;
+  ss->ss_stream.bufferTime = bufferTime;
+  ss->ss_stream.bOverrideBufferTime = bOverrideBufferTime;
+  ss->ss_stream.nSkipKeyFrames = nSkipKeyFrames;
+  ss->ss_stream.bStdoutMode = bStdoutMode;
+  ss->ss_stream.bHashes = bHashes;
+  ss->ss_stream.session = ss;
+  ss->ss_file = bStdoutMode ? NULL : flvFile;
+  ss->ss_resume = bResume;
+  ss->ss_start = dStartOffset;
+  ss->ss_stop = dStopOffset;
+  ss->ss_parallel = nParallel;
+
+  nStatus = FLVSession_Run(ss);
+  FLVSession_Free(ss);
   return nStatus;
 }
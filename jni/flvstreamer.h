@@ -28,5 +28,91 @@
 
 #ifndef FLVSTREAMER_H
 #define FLVSTREAMER_H
+
+#include <stdint.h>
+
 int flvstreamer(int, char **);
+
+/* What a download ends with, also what flvstreamer() returns */
+#define FLV_SUCCESS	0
+#define FLV_FAILED	1
+#define FLV_INCOMPLETE	2	/* resume to get the rest */
+
+/* A download set up in C, for running several in one process. A
+ * session is run once, either on the calling thread with FLVSession_Run
+ * or on a thread of its own with FLVSession_Start. FLVSession_Cancel and
+ * FLVSession_Query may be called from any thread at any time until
+ * FLVSession_Free.
+ */
+typedef struct FLVSession FLVSession;
+
+enum { FLV_IDLE, FLV_RUNNING, FLV_DONE };
+
+/* A snapshot of a session. The download keeps its counters up to date
+ * without locks, taking one costs it nothing.
+ */
+typedef struct FLVSessionInfo {
+  int state;			/* FLV_IDLE, FLV_RUNNING or FLV_DONE */
+  int status;			/* once FLV_DONE */
+  double percent;		/* of the part asked for, -1 if unknown */
+  uint64_t bytes;		/* in the output, with what was resumed */
+  uint32_t timestamp;		/* ms into the stream got to */
+  uint32_t duration;		/* of the stream in ms, 0 if unknown */
+  uint32_t bitrate;		/* kbit/s over the last second */
+  uint32_t avgBitrate;		/* kbit/s since the session started */
+  uint32_t elapsed;		/* ms since the session started */
+  uint32_t stalls;		/* times no data came for 2 seconds */
+  uint32_t reconnects;		/* after the connection timed out */
+} FLVSessionInfo;
+
+/* Each may be NULL. They are called from the threads of the download,
+ * one at a time, and get the ctx of the request.
+ */
+typedef struct FLVCallbacks {
+  /* a few times a second while data comes in */
+  void (*progress)(void *ctx, const FLVSessionInfo *info);
+  /* something went wrong, the download ends or retries */
+  void (*error)(void *ctx, const char *message);
+  /* the session ended with FLV_SUCCESS, FLV_FAILED or FLV_INCOMPLETE,
+   * the last call */
+  void (*complete)(void *ctx, int status);
+} FLVCallbacks;
+
+/* What to download and where to. Strings are copied by FLVSession_New;
+ * NULL or 0 leaves a field out or to its default. hostname, port, app
+ * and playpath override the parts of url.
+ */
+typedef struct FLVRequest {
+  const char *url;		/* rtmp://host[:port]/app/playpath */
+  const char *hostname;
+  int port;			/* default 1935 */
+  const char *app;
+  const char *playpath;
+  const char *tcUrl;		/* default rtmp://host:port/app */
+  const char *swfUrl;
+  const char *pageUrl;
+  const char *flashVer;
+  const char *auth;
+  const char *token;		/* key for SecureToken */
+  const char *subscribepath;	/* live streams, default playpath */
+  const char *outfile;		/* "-" or NULL for stdout */
+  int live;
+  int resume;			/* continue outfile if it is there */
+  int parallel;			/* connections, recorded streams only */
+  uint32_t start;		/* ms into the stream */
+  uint32_t stop;		/* ms into the stream, 0 for the end */
+  long timeout;			/* seconds, default 120 */
+  uint32_t bufferTime;		/* ms, default the duration */
+  int skipKeyFrames;		/* when resuming */
+  FLVCallbacks callbacks;
+  void *ctx;
+} FLVRequest;
+
+FLVSession *FLVSession_New(const FLVRequest *req);
+void FLVSession_Free(FLVSession *ss);
+int FLVSession_Run(FLVSession *ss);
+int FLVSession_Start(FLVSession *ss);	/* 0 if no thread could be started */
+int FLVSession_Wait(FLVSession *ss);	/* after FLVSession_Start, once */
+void FLVSession_Cancel(FLVSession *ss);
+void FLVSession_Query(FLVSession *ss, FLVSessionInfo *info);
 #endif
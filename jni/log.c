@@ -24,22 +24,55 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <android/log.h>
 
 #include "log.h"
 
-#define MAX_PRINT_LEN	2048
+/* The messages that pass the level check are formatted straight into a
+ * ring of fixed size slots and written out by a thread of their own,
+ * so that a download never waits for logcat or a file. Any thread may
+ * add to the ring: a slot is claimed by moving head on with a compare
+ * and swap and handed to the writer by storing its sequence number.
+ * When the ring is full the message is dropped and counted, the writer
+ * reports how many it missed.
+ *
+ * Only the writer thread keeps neednl, the state of the status line.
+ */
+#define LOG_SLOTS	256	/* must be a power of two */
+#define LOG_TEXT	1024	/* longer messages are cut */
+
+enum { LOG_PRINTF, LOG_STATUS, LOG_LINE };
+
+typedef struct LogSlot {
+	unsigned int seq;	/* == position: free, position + 1: filled */
+	int kind;
+	int level;
+	char text[LOG_TEXT];
+} LogSlot;
 
 AMF_LogLevel debuglevel = LOGERROR;
 
+static LogSlot ring[LOG_SLOTS];
+static unsigned int head;	/* next position to claim */
+static unsigned int tail;	/* next position to write out */
+static unsigned int dropped;
+static sem_t filled;
+static int threaded;		/* 0: write out on the caller's thread */
+static pthread_once_t startOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+
 static int neednl;
 
-static FILE *fmsg;
+static FILE *fmsg;		/* NULL for logcat */
 
 static const char *levels[] = {
   "CRIT", "ERROR", "WARNING", "INFO",
@@ -48,98 +81,214 @@ static const char *levels[] = {
 
 void LogSetOutput(FILE *file)
 {
-	fmsg = file;
+	__atomic_store_n(&fmsg, file, __ATOMIC_RELEASE);
 }
 
-void LogPrintf(const char *format, ...)
+static void Emit(FILE *f, const char *str)
 {
-	char str[MAX_PRINT_LEN]="";
-        int len;
-	va_list args;
-	va_start(args, format);
-	len = vsnprintf(str, MAX_PRINT_LEN-1, format, args);
-	va_end(args);
-
-	if ( debuglevel==LOGCRIT )
-		return;
+	if (f)
+		fputs(str, f);
+	else
+		__android_log_write(ANDROID_LOG_DEBUG, "TAG", str);
+}
 
-	if ( !fmsg ) fmsg = stderr;
+/* Write out one message, as the old synchronous functions did. */
+static void Write(LogSlot *slot)
+{
+	char line[LOG_TEXT + 16];
+	size_t len = strlen(slot->text);
+	FILE *f = __atomic_load_n(&fmsg, __ATOMIC_ACQUIRE);
 
-	if (neednl) {
-	  //putc('\n', fmsg);
-	  __android_log_write(ANDROID_LOG_DEBUG, "TAG", "\n");
+	if (neednl && slot->kind != LOG_STATUS) {
+		Emit(f, "\n");
 		neednl = 0;
 	}
+	switch (slot->kind) {
+	case LOG_PRINTF:
+		Emit(f, slot->text);
+		if (len > 0 && slot->text[len-1] == '\n' && !f)
+			Emit(f, "\n");
+		break;
+	case LOG_STATUS:
+		Emit(f, slot->text);
+		neednl = 1;
+		break;
+	default:
+		snprintf(line, sizeof(line), "%s: %s\n", levels[slot->level], slot->text);
+		Emit(f, line);
+	}
+}
+
+static void *Writer(void *arg)
+{
+	LogSlot *slot;
+	unsigned int n;
+	FILE *f;
+
+	for (;;) {
+		sem_wait(&filled);
+		slot = &ring[tail & (LOG_SLOTS-1)];
+		/* another thread may have posted for a later slot first */
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			sched_yield();
+
+		if ((n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED))) {
+			LogSlot note = { 0, LOG_LINE, LOGWARNING };
+			snprintf(note.text, LOG_TEXT, "%u log messages dropped", n);
+			Write(&note);
+		}
+		Write(slot);
+
+		__atomic_store_n(&slot->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+
+		f = __atomic_load_n(&fmsg, __ATOMIC_ACQUIRE);
+		if (f && __atomic_load_n(&head, __ATOMIC_RELAXED) == tail)
+			fflush(f);
+	}
+	return NULL;
+}
 
-        if (len > MAX_PRINT_LEN-1)
-          len = MAX_PRINT_LEN-1;
-	//fprintf(fmsg, "%s", str);
-	__android_log_print(ANDROID_LOG_DEBUG, "TAG", "%s", str);
-        if (str[len-1] == '\n') {
-	  __android_log_write(ANDROID_LOG_DEBUG, "TAG", "\n");
-	  //fflush(fmsg);
+static void Start(void)
+{
+	pthread_t thread;
+	unsigned int i;
+
+	for (i = 0; i < LOG_SLOTS; i++)
+		ring[i].seq = i;
+	if (sem_init(&filled, 0, 0) == 0
+	    && pthread_create(&thread, NULL, Writer, NULL) == 0) {
+		pthread_detach(thread);
+		threaded = 1;
+		atexit(LogFlush);
 	}
 }
 
-void LogStatus(const char *format, ...)
+/* Claim the next slot, NULL if the ring is full. */
+static LogSlot *Claim(unsigned int *pos)
 {
-	char str[MAX_PRINT_LEN]="";
-	va_list args;
-	va_start(args, format);
-	vsnprintf(str, MAX_PRINT_LEN-1, format, args);
-	va_end(args);
+	LogSlot *slot;
+	unsigned int p = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	int diff;
+
+	for (;;) {
+		slot = &ring[p & (LOG_SLOTS-1)];
+		diff = (int) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - p);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&head, &p, p + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			p = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+	*pos = p;
+	return slot;
+}
 
-	if ( debuglevel==LOGCRIT )
+static void Queue(int kind, int level, const char *format, va_list args)
+{
+	LogSlot *slot;
+	unsigned int pos;
+
+	pthread_once(&startOnce, Start);
+
+	if (!threaded) {
+		/* no writer thread, do it the old way */
+		LogSlot line;
+		line.kind = kind;
+		line.level = level;
+		vsnprintf(line.text, LOG_TEXT, format, args);
+		pthread_mutex_lock(&syncLock);
+		Write(&line);
+		pthread_mutex_unlock(&syncLock);
 		return;
+	}
+
+	slot = Claim(&pos);
+	if (!slot) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	slot->kind = kind;
+	slot->level = level;
+	vsnprintf(slot->text, LOG_TEXT, format, args);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&filled);
+}
 
-	if ( !fmsg ) fmsg = stderr;
+/* Wait a little for the writer to catch up, for messages logged just
+ * before the process exits.
+ */
+void LogFlush(void)
+{
+	FILE *f;
+	int i;
 
-	//fprintf(fmsg, "%s", str);
-	__android_log_print(ANDROID_LOG_DEBUG, "TAG", "%s", str);
-	//fflush(fmsg);
-	neednl = 1;
+	if (!threaded)
+		return;
+	for (i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&tail, __ATOMIC_ACQUIRE)
+		    == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+			break;
+		usleep(1000);
+	}
+	f = __atomic_load_n(&fmsg, __ATOMIC_ACQUIRE);
+	if (f)
+		fflush(f);
 }
 
-void Log(int level, const char *format, ...)
+void AMF_LogPrintf(const char *format, ...)
 {
-	char str[MAX_PRINT_LEN]="";
 	va_list args;
 	va_start(args, format);
-	vsnprintf(str, MAX_PRINT_LEN-1, format, args);
+	Queue(LOG_PRINTF, 0, format, args);
 	va_end(args);
+}
 
-	// Filter out 'no-name'
-	if ( debuglevel<LOGALL && strstr(str, "no-name" ) != NULL )
-		return;
-
-	if ( !fmsg ) fmsg = stderr;
+void AMF_LogStatus(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	Queue(LOG_STATUS, 0, format, args);
+	va_end(args);
+}
 
-	if ( level <= debuglevel ) {
-		if (neednl) {
-		  //putc('\n', fmsg);
-		  __android_log_write(ANDROID_LOG_DEBUG, "TSG", "\n");
-			neednl = 0;
-		}
-		//fprintf(fmsg, "%s: %s\n", levels[level], str);
-		__android_log_print(ANDROID_LOG_DEBUG, "TAG", "%s: %s\n", levels[level], str);
-#ifdef _DEBUG
-		//fflush(fmsg);
-#endif
-	}
+void AMF_Log(int level, const char *format, ...)
+{
+	va_list args;
+	if (level > LOGDEBUG2)
+		level = LOGDEBUG2;
+	va_start(args, format);
+	Queue(LOG_LINE, level, format, args);
+	va_end(args);
 }
 
-void LogHex(int level, const char *data, unsigned long len)
+/* One message for each 16 bytes, not for each byte. The level is
+ * checked here as well, for callers that don't go through LogHex.
+ */
+void AMF_LogHex(int level, const char *data, unsigned long len)
 {
+	char line[16*3 + 2];
 	unsigned long i;
-	if ( level > debuglevel )
+	int n = 0;
+
+	if (!LOG_ENABLED(level))
 		return;
 	for(i=0; i<len; i++) {
-		LogPrintf("%02X ", (unsigned char)data[i]);
+		n += sprintf(line + n, "%02X ", (unsigned char)data[i]);
+		if (i % 16 == 15 || i == len-1) {
+			AMF_LogPrintf("%s%s", line, i == len-1 ? "\n" : "");
+			n = 0;
+		}
 	}
-	LogPrintf("\n");
+	if (!len)
+		AMF_LogPrintf("\n");
 }
 
-void LogHexString(int level, const char *data, unsigned long len)
+void AMF_LogHexString(int level, const char *data, unsigned long len)
 {
 	static const char hexdig[] = "0123456789abcdef";
 #define BP_OFFSET 9
@@ -148,7 +297,7 @@ void LogHexString(int level, const char *data, unsigned long len)
 	char	line[BP_LEN];
 	unsigned long i;
 
-	if ( !data || level > debuglevel )
+	if ( !data || !LOG_ENABLED(level) )
 		return;
 	/* in case len is zero */
 	line[0] = '\n';
@@ -159,7 +308,7 @@ void LogHexString(int level, const char *data, unsigned long len)
 		unsigned off;
 
 		if( !n ) {
-			if( i ) LogPrintf( "%s", line );
+			if( i ) AMF_LogPrintf( "%s", line );
 			memset( line, ' ', sizeof(line)-2 );
 			line[sizeof(line)-2] = '\n';
 			line[sizeof(line)-1] = '\0';
@@ -186,5 +335,5 @@ void LogHexString(int level, const char *data, unsigned long len)
 		}
 	}
 
-	LogPrintf( "%s", line );
+	AMF_LogPrintf( "%s", line );
 }
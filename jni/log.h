@@ -39,22 +39,40 @@ typedef enum
   LOGDEBUG, LOGDEBUG2, LOGALL
 } AMF_LogLevel;
 
-#define Log	AMF_Log
-#define LogHex	AMF_LogHex
-#define LogHexString	AMF_LogHexString
-#define LogPrintf	AMF_LogPrintf
-#define LogSetOutput	AMF_LogSetOutput
-#define LogStatus	AMF_LogStatus
+/* Messages above LOG_MAX_LEVEL are compiled out; the others are only
+ * formatted when debuglevel lets them through. The arguments of a
+ * dropped message are not evaluated.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL	LOGALL
+#endif
+
 #define debuglevel	AMF_debuglevel
 
+#define LOG_ENABLED(level)	((level) <= LOG_MAX_LEVEL && (level) <= debuglevel)
+
+#define Log(level, ...) \
+  do { if (LOG_ENABLED(level)) AMF_Log(level, __VA_ARGS__); } while (0)
+#define LogPrintf(...) \
+  do { if (debuglevel != LOGCRIT) AMF_LogPrintf(__VA_ARGS__); } while (0)
+#define LogStatus(...) \
+  do { if (debuglevel != LOGCRIT) AMF_LogStatus(__VA_ARGS__); } while (0)
+#define LogHex(level, data, len) \
+  do { if (LOG_ENABLED(level)) AMF_LogHex(level, data, len); } while (0)
+#define LogHexString(level, data, len) \
+  do { if (LOG_ENABLED(level)) AMF_LogHexString(level, data, len); } while (0)
+#define LogSetOutput	AMF_LogSetOutput
+#define LogFlush	AMF_LogFlush
+
 extern AMF_LogLevel debuglevel;
 
 void LogSetOutput(FILE *file);
-void LogPrintf(const char *format, ...);
-void LogStatus(const char *format, ...);
-void Log(int level, const char *format, ...);
-void LogHex(int level, const char *data, unsigned long len);
-void LogHexString(int level, const char *data, unsigned long len);
+void LogFlush(void);
+void AMF_LogPrintf(const char *format, ...);
+void AMF_LogStatus(const char *format, ...);
+void AMF_Log(int level, const char *format, ...);
+void AMF_LogHex(int level, const char *data, unsigned long len);
+void AMF_LogHexString(int level, const char *data, unsigned long len);
 
 #ifdef __cplusplus
 }
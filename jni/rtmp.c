@@ -25,6 +25,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifndef WIN32
+#include <fcntl.h>
+#endif
 
 #include "rtmp.h"
 #include "log.h"
@@ -89,9 +92,13 @@ static void HandleClientBW(RTMP * r, const RTMPPacket * packet);
 
 static int ReadN(RTMP * r, char *buffer, int n);
 static bool WriteN(RTMP * r, const char *buffer, int n);
+static bool WriteV(RTMP * r, struct iovec *iov, int iovcnt);
 
 static void DecodeTEA(AVal *key, AVal *text);
 
+static RTMPChannel *GetChannel(RTMP * r, int nChannel, bool create);
+static void FreeChannels(RTMP * r);
+
 uint32_t
 RTMP_GetTime()
 {
@@ -118,13 +125,18 @@ RTMPPacket_Reset(RTMPPacket * p)
   p->m_nBytesRead = 0;
 }
 
+/* every body is preceded by its block header and RTMP_MAX_HEADER_SIZE
+ * bytes of slack */
+#define BODY_OFFSET	(sizeof(RTMPPoolBlock) + RTMP_MAX_HEADER_SIZE)
+
 bool
 RTMPPacket_Alloc(RTMPPacket * p, int nSize)
 {
-  char *ptr = calloc(1, nSize+RTMP_MAX_HEADER_SIZE);
-  if (!ptr)
+  RTMPPoolBlock *b = calloc(1, BODY_OFFSET + nSize);
+  if (!b)
     return false;
-  p->m_body = ptr + RTMP_MAX_HEADER_SIZE;
+  b->pb_class = -1;
+  p->m_body = (char *)b + BODY_OFFSET;
   p->m_nBytesRead = 0;
   return true;
 }
@@ -134,11 +146,96 @@ RTMPPacket_Free(RTMPPacket * p)
 {
   if (p->m_body)
     {
-      free(p->m_body-RTMP_MAX_HEADER_SIZE);
+      RTMPPoolBlock *b = (RTMPPoolBlock *)(p->m_body - BODY_OFFSET);
+      RTMPPool *pool = b->pb_pool;
+
+      if (pool && pool->rp_active
+	  && pool->rp_count[b->pb_class] < RTMP_POOL_DEPTH)
+	{
+	  b->pb_next = pool->rp_free[b->pb_class];
+	  pool->rp_free[b->pb_class] = b;
+	  pool->rp_count[b->pb_class]++;
+	}
+      else
+	free(b);
       p->m_body = NULL;
     }
 }
 
+/* the body goes back to the heap when freed, from any thread and even
+ * after its connection is gone */
+void
+RTMPPacket_Unpool(RTMPPacket * p)
+{
+  if (p->m_body)
+    ((RTMPPoolBlock *)(p->m_body - BODY_OFFSET))->pb_pool = NULL;
+}
+
+/* Like RTMPPacket_Alloc, but the body is taken from the pool and is not
+ * zeroed. */
+bool
+RTMPPool_Alloc(RTMPPool *pool, RTMPPacket * p, int nSize)
+{
+  RTMPPoolBlock *b;
+  int c = 0;
+
+  while (c < RTMP_POOL_CLASSES && (1 << (c + RTMP_POOL_MIN_SHIFT)) < nSize)
+    c++;
+
+  pool->rp_active = true;
+  if (c < RTMP_POOL_CLASSES && pool->rp_free[c])
+    {
+      b = pool->rp_free[c];
+      pool->rp_free[c] = b->pb_next;
+      pool->rp_count[c]--;
+      pool->rp_hits++;
+    }
+  else
+    {
+      if (c < RTMP_POOL_CLASSES)
+	b = malloc(BODY_OFFSET + (1 << (c + RTMP_POOL_MIN_SHIFT)));
+      else
+	b = malloc(BODY_OFFSET + nSize);
+      if (!b)
+	return false;
+      if (c < RTMP_POOL_CLASSES)
+	{
+	  b->pb_pool = pool;
+	  b->pb_class = c;
+	}
+      else
+	{
+	  b->pb_pool = NULL;
+	  b->pb_class = -1;
+	}
+      pool->rp_misses++;
+    }
+  p->m_body = (char *)b + BODY_OFFSET;
+  p->m_nBytesRead = 0;
+  return true;
+}
+
+/* Release all cached blocks. Blocks still held by packets are freed
+ * outright when those packets are freed. */
+void
+RTMPPool_Trim(RTMPPool *pool)
+{
+  int c;
+
+  for (c = 0; c < RTMP_POOL_CLASSES; c++)
+    {
+      RTMPPoolBlock *b, *next;
+      for (b = pool->rp_free[c]; b; b = next)
+	{
+	  next = b->pb_next;
+	  free(b);
+	}
+      pool->rp_free[c] = NULL;
+      pool->rp_count[c] = 0;
+    }
+  pool->rp_active = false;
+}
+
 void
 RTMPPacket_Dump(RTMPPacket * p)
 {
@@ -151,15 +248,14 @@ RTMPPacket_Dump(RTMPPacket * p)
 void
 RTMP_Init(RTMP * r)
 {
-  int i;
-  for (i = 0; i < RTMP_CHANNELS; i++)
-    {
-      r->m_vecChannelsIn[i] = NULL;
-      r->m_vecChannelsOut[i] = NULL;
-    }
+  memset(&r->m_channels, 0, sizeof(r->m_channels));
+  memset(&r->m_pool, 0, sizeof(r->m_pool));
+  r->m_wbuf = NULL;
   RTMP_Close(r);
   r->m_nBufferMS = 300;
   r->m_fDuration = 0;
+  r->m_fFilesize = 0;
+  r->m_fDatarate = 0;
   r->m_stream_id = -1;
   r->m_pBufferStart = NULL;
   r->m_fAudioCodecs = 3191.0;
@@ -176,6 +272,99 @@ RTMP_GetDuration(RTMP * r)
   return r->m_fDuration;
 }
 
+/* Expected size of the stream in bytes: the filesize the server
+ * announced, or else an estimate from the data rates and the duration.
+ * 0 if unknown.
+ */
+double
+RTMP_GetFilesize(RTMP * r)
+{
+  if (r->m_fFilesize > 0)
+    return r->m_fFilesize;
+  if (r->m_fDatarate > 0 && r->m_fDuration > 0)
+    return r->m_fDatarate * 1000.0 / 8.0 * r->m_fDuration;
+  return 0;
+}
+
+uint32_t
+RTMP_GetChannelTimestamp(RTMP * r, int nChannel)
+{
+  RTMPChannel *ch = GetChannel(r, nChannel, false);
+  return ch ? ch->ch_timestamp : 0;
+}
+
+/* Packet bodies the pool served from its free lists and ones it had to
+ * malloc, since RTMP_Init. */
+void
+RTMP_GetPoolStats(RTMP * r, uint32_t * hits, uint32_t * misses)
+{
+  *hits = r->m_pool.rp_hits;
+  *misses = r->m_pool.rp_misses;
+}
+
+/* Look up the state of a chunk stream, optionally creating it.
+ * Channels are linked into cm_used so that Close only visits the
+ * ones this connection actually touched.
+ */
+static RTMPChannel *
+GetChannel(RTMP * r, int nChannel, bool create)
+{
+  RTMPChannelMap *cm = &r->m_channels;
+  RTMPChannel *ch;
+
+  if (nChannel < RTMP_DENSE_CHANNELS)
+    {
+      ch = &cm->cm_dense[nChannel];
+      if (ch->ch_active)
+	return ch;
+      if (!create)
+	return NULL;
+    }
+  else
+    {
+      int h = nChannel & (RTMP_CHANNEL_BUCKETS - 1);
+      for (ch = cm->cm_buckets[h]; ch; ch = ch->ch_next)
+	if (ch->ch_id == nChannel)
+	  return ch;
+      if (!create)
+	return NULL;
+      ch = calloc(1, sizeof(RTMPChannel));
+      if (!ch)
+	return NULL;
+      ch->ch_next = cm->cm_buckets[h];
+      cm->cm_buckets[h] = ch;
+    }
+  ch->ch_id = nChannel;
+  ch->ch_active = true;
+  ch->ch_used = cm->cm_used;
+  cm->cm_used = ch;
+  return ch;
+}
+
+static void
+FreeChannels(RTMP * r)
+{
+  RTMPChannelMap *cm = &r->m_channels;
+  RTMPChannel *ch, *next;
+
+  for (ch = cm->cm_used; ch; ch = next)
+    {
+      next = ch->ch_used;
+      if (ch->ch_in)
+	{
+	  RTMPPacket_Free(ch->ch_in);
+	  free(ch->ch_in);
+	}
+      free(ch->ch_out);
+      if (ch->ch_id < RTMP_DENSE_CHANNELS)
+	memset(ch, 0, sizeof(RTMPChannel));
+      else
+	free(ch);
+    }
+  memset(cm->cm_buckets, 0, sizeof(cm->cm_buckets));
+  cm->cm_used = NULL;
+}
+
 bool
 RTMP_IsConnected(RTMP * r)
 {
@@ -317,6 +506,8 @@ RTMP_Connect0(RTMP *r, struct sockaddr *service)
   r->m_bTimedout = false;
   r->m_pausing = 0;
   r->m_fDuration = 0.0;
+  r->m_fFilesize = 0.0;
+  r->m_fDatarate = 0.0;
 
   r->m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (r->m_socket != -1)
@@ -566,7 +757,7 @@ RTMP_GetNextMediaPacket(RTMP * r, RTMPPacket * packet)
   if (bHasMediaPacket)
     r->m_bPlaying = true;
   else if (r->m_bTimedout && !r->m_pausing)
-    r->m_pauseStamp = r->m_channelTimestamp[r->m_mediaChannel];
+    r->m_pauseStamp = RTMP_GetChannelTimestamp(r, r->m_mediaChannel);
 
   return bHasMediaPacket;
 }
@@ -745,19 +936,37 @@ ReadN(RTMP * r, char *buffer, int n)
   while (n > 0)
     {
       int nBytes = 0, nRead;
-      if (r->m_nBufferSize == 0)
-	if (RTMPSockBuf_Fill(&r->m_sb)<1)
-	  {
-	    if (!r->m_bTimedout)
-	      RTMP_Close(r);
-	    return 0;
-	  }
-      nRead = ((n < r->m_nBufferSize) ? n : r->m_nBufferSize);
+      if (r->m_nBufferSize == 0 && n >= RTMP_DIRECT_READ_SIZE)
+	{
+	  /* nothing buffered and a large read: recv() straight into the
+	   * caller's buffer instead of staging it in sb_buf */
+	  nRead = RTMPSockBuf_Recv(&r->m_sb, ptr, n);
+	  if (nRead < 1)
+	    {
+	      if (!r->m_bTimedout)
+		RTMP_Close(r);
+	      return nOriginalSize - n;
+	    }
+	}
+      else
+	{
+	  if (r->m_nBufferSize == 0)
+	    if (RTMPSockBuf_Fill(&r->m_sb)<1)
+	      {
+		if (!r->m_bTimedout)
+		  RTMP_Close(r);
+		return nOriginalSize - n;
+	      }
+	  nRead = ((n < r->m_nBufferSize) ? n : r->m_nBufferSize);
+	  if (nRead > 0)
+	    {
+	      memcpy(ptr, r->m_pBufferStart, nRead);
+	      r->m_pBufferStart += nRead;
+	      r->m_nBufferSize -= nRead;
+	    }
+	}
       if (nRead > 0)
 	{
-	  memcpy(ptr, r->m_pBufferStart, nRead);
-	  r->m_pBufferStart += nRead;
-	  r->m_nBufferSize -= nRead;
 	  nBytes = nRead;
 	  r->m_nBytesIn += nRead;
 	  if (r->m_bSendCounter && r->m_nBytesIn > r->m_nBytesInSent + r->m_nClientBW / 2)
@@ -787,6 +996,13 @@ ReadN(RTMP * r, char *buffer, int n)
 static bool
 WriteN(RTMP * r, const char *buffer, int n)
 {
+#ifndef WIN32
+  struct iovec iov;
+
+  iov.iov_base = (char *) buffer;
+  iov.iov_len = n;
+  return WriteV(r, &iov, 1);
+#else
   const char *ptr = buffer;
 
   while (n > 0)
@@ -801,12 +1017,13 @@ WriteN(RTMP * r, const char *buffer, int n)
       if (nBytes < 0)
 	{
 	  int sockerr = GetSockError();
-	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
-	      sockerr, n);
 
 	  if (sockerr == EINTR && !RTMP_ctrlC)
 	    continue;
 
+	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, n);
+
 	  RTMP_Close(r);
 	  n = 1;
 	  break;
@@ -820,6 +1037,165 @@ WriteN(RTMP * r, const char *buffer, int n)
     }
 
   return n == 0;
+#endif
+}
+
+#ifndef WIN32
+/* whether the socket was made non-blocking, by a caller with an event
+ * loop; a short read or write is then carried on later, not an error */
+static bool
+IsNonBlocking(int sockfd)
+{
+  return (fcntl(sockfd, F_GETFL, 0) & O_NONBLOCK) != 0;
+}
+
+/* keeps what the socket didn't take, after what already waits */
+static bool
+KeepPending(RTMP * r, struct iovec *iov, int iovcnt)
+{
+  int i, len = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  if (r->m_wbufStart + r->m_wbufLen + len > r->m_wbufSize)
+    {
+      if (r->m_wbufStart)
+	{
+	  memmove(r->m_wbuf, r->m_wbuf + r->m_wbufStart, r->m_wbufLen);
+	  r->m_wbufStart = 0;
+	}
+      if (r->m_wbufLen + len > r->m_wbufSize)
+	{
+	  int size = r->m_wbufSize ? r->m_wbufSize : 4096;
+	  char *buf;
+
+	  while (size < r->m_wbufLen + len)
+	    size *= 2;
+	  buf = realloc(r->m_wbuf, size);
+	  if (!buf)
+	    {
+	      Log(LOGERROR, "%s, no memory for %d bytes", __FUNCTION__, size);
+	      RTMP_Close(r);
+	      return false;
+	    }
+	  r->m_wbuf = buf;
+	  r->m_wbufSize = size;
+	}
+    }
+
+  for (i = 0; i < iovcnt; i++)
+    {
+      memcpy(r->m_wbuf + r->m_wbufStart + r->m_wbufLen, iov[i].iov_base,
+	     iov[i].iov_len);
+      r->m_wbufLen += iov[i].iov_len;
+    }
+  return true;
+}
+#endif
+
+int
+RTMP_SendPending(RTMP * r)
+{
+#ifndef WIN32
+  while (r->m_wbufLen > 0)
+    {
+      int nBytes = send(r->m_socket, r->m_wbuf + r->m_wbufStart,
+			r->m_wbufLen, 0);
+
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+	  if (sockerr == EWOULDBLOCK || sockerr == EAGAIN)
+	    return 0;
+
+	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, r->m_wbufLen);
+	  RTMP_Close(r);
+	  return -1;
+	}
+
+      r->m_wbufStart += nBytes;
+      r->m_wbufLen -= nBytes;
+    }
+  r->m_wbufStart = 0;
+#endif
+  return 1;
+}
+
+/* Gathered write; iov is consumed as data goes out. */
+static bool
+WriteV(RTMP * r, struct iovec *iov, int iovcnt)
+{
+#ifdef _DEBUG
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    fwrite(iov[i].iov_base, 1, iov[i].iov_len, netstackdump);
+#endif
+
+#ifdef WIN32
+  for (; iovcnt > 0; iov++, iovcnt--)
+    if (!WriteN(r, iov->iov_base, iov->iov_len))
+      return false;
+#else
+  /* nothing goes ahead of what already waits */
+  if (r->m_wbufLen > 0)
+    {
+      int rc = RTMP_SendPending(r);
+      if (rc < 0)
+	return false;
+      if (rc == 0)
+	return KeepPending(r, iov, iovcnt);
+    }
+
+  while (iovcnt > 0)
+    {
+      struct msghdr msg;
+      int nBytes;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      nBytes = sendmsg(r->m_socket, &msg, 0);
+
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+
+	  /* the rest goes once there is room, see RTMP_SendPending */
+	  if ((sockerr == EWOULDBLOCK || sockerr == EAGAIN)
+	      && IsNonBlocking(r->m_socket))
+	    return KeepPending(r, iov, iovcnt);
+
+	  Log(LOGERROR, "%s, RTMP sendmsg error %d (%d iovecs)", __FUNCTION__,
+	      sockerr, iovcnt);
+	  RTMP_Close(r);
+	  return false;
+	}
+
+      if (nBytes == 0)
+	return false;
+
+      while (iovcnt > 0 && nBytes >= (int) iov->iov_len)
+	{
+	  nBytes -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (nBytes)
+	{
+	  iov->iov_base = (char *) iov->iov_base + nBytes;
+	  iov->iov_len -= nBytes;
+	}
+    }
+#endif
+  return true;
 }
 
 #define SAVC(x)	static const AVal av_##x = AVC(#x)
@@ -1649,6 +2025,9 @@ DumpMetaData(AMFObject * obj)
 
 SAVC(onMetaData);
 SAVC(duration);
+SAVC(filesize);
+SAVC(videodatarate);
+SAVC(audiodatarate);
 
 static bool
 HandleMetadata(RTMP * r, char *body, unsigned int len)
@@ -1681,6 +2060,16 @@ HandleMetadata(RTMP * r, char *body, unsigned int len)
 	  r->m_fDuration = prop.p_vu.p_number;
 	  //Log(LOGDEBUG, "Set duration: %.2f", m_fDuration);
 	}
+      if (RTMP_FindFirstMatchingProperty(&obj, &av_filesize, &prop)
+	  && prop.p_type == AMF_NUMBER)
+	r->m_fFilesize = prop.p_vu.p_number;
+      r->m_fDatarate = 0;
+      if (RTMP_FindFirstMatchingProperty(&obj, &av_videodatarate, &prop)
+	  && prop.p_type == AMF_NUMBER)
+	r->m_fDatarate += prop.p_vu.p_number;
+      if (RTMP_FindFirstMatchingProperty(&obj, &av_audiodatarate, &prop)
+	  && prop.p_type == AMF_NUMBER)
+	r->m_fDatarate += prop.p_vu.p_number;
       ret = true;
     }
   AMF_Reset(&obj);
@@ -1756,7 +2145,7 @@ HandleCtrl(RTMP * r, const RTMPPacket * packet)
 	  Log(LOGDEBUG, "%s, Stream BufferEmpty %d", __FUNCTION__, tmp);
 	  if (!r->m_pausing)
 	    {
-	      r->m_pauseStamp = r->m_channelTimestamp[r->m_mediaChannel];
+	      r->m_pauseStamp = RTMP_GetChannelTimestamp(r, r->m_mediaChannel);
 	      RTMP_SendPause(r, true, r->m_pauseStamp);
 	      r->m_pausing = 1;
 	    }
@@ -1835,9 +2224,22 @@ bool
 RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 {
   char hbuf[RTMP_MAX_HEADER_SIZE] = { 0 }, *header = hbuf;
+  RTMPChannel *ch;
+  int nToRead, nChunk, nRead;
 
   Log(LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_socket);
 
+  if (r->m_nChunkLeft)
+    {
+      /* the rest of a chunk body, its header was read already */
+      ch = GetChannel(r, r->m_nChunkChannel, false);
+      if (!ch || !ch->ch_in)
+	return false;
+      memcpy(packet, ch->ch_in, sizeof(RTMPPacket));
+      nChunk = r->m_nChunkLeft;
+      goto body;
+    }
+
   if (ReadN(r, hbuf, 1) == 0)
     {
       Log(LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
@@ -1855,7 +2257,7 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 	      __FUNCTION__);
 	  return false;
 	}
-      packet->m_nChannel = (unsigned) hbuf[1];
+      packet->m_nChannel = (unsigned char) hbuf[1];
       packet->m_nChannel += 64;
       header++;
     }
@@ -1868,12 +2270,20 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 	      __FUNCTION__);
 	  return false;
 	}
-      tmp = (((unsigned) hbuf[2]) << 8) + (unsigned) hbuf[1];
+      tmp = (((unsigned char) hbuf[2]) << 8) + (unsigned char) hbuf[1];
       packet->m_nChannel = tmp + 64;
       Log(LOGDEBUG, "%s, m_nChannel: %0x", __FUNCTION__, packet->m_nChannel);
       header += 2;
     }
 
+  ch = GetChannel(r, packet->m_nChannel, true);
+  if (!ch)
+    {
+      Log(LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__,
+	  packet->m_nChannel);
+      return false;
+    }
+
   int nSize = packetSize[packet->m_headerType], hSize;
 
   if (nSize == RTMP_LARGE_HEADER_SIZE)	// if we get a full header the timestamp is absolute
@@ -1881,9 +2291,8 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 
   else if (nSize < RTMP_LARGE_HEADER_SIZE)
     {				// using values from the last message of this channel
-      if (r->m_vecChannelsIn[packet->m_nChannel])
-	memcpy(packet, r->m_vecChannelsIn[packet->m_nChannel],
-	       sizeof(RTMPPacket));
+      if (ch->ch_in)
+	memcpy(packet, ch->ch_in, sizeof(RTMPPacket));
     }
 
   nSize--;
@@ -1935,7 +2344,7 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
   bool didAlloc = false;
   if (packet->m_nBodySize > 0 && packet->m_body == NULL)
     {
-      if (!RTMPPacket_Alloc(packet, packet->m_nBodySize))
+      if (!RTMPPool_Alloc(&r->m_pool, packet, packet->m_nBodySize))
 	{
 	  Log(LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	  return false;
@@ -1944,8 +2353,8 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
       packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
     }
 
-  int nToRead = packet->m_nBodySize - packet->m_nBytesRead;
-  int nChunk = r->m_inChunkSize;
+  nToRead = packet->m_nBodySize - packet->m_nBytesRead;
+  nChunk = r->m_inChunkSize;
   if (nToRead < nChunk)
     nChunk = nToRead;
 
@@ -1958,21 +2367,40 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
       packet->m_chunk->c_chunkSize = nChunk;
     }
 
-  if (ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk) != nChunk)
+body:
+  nRead = ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk);
+  r->m_nChunkLeft = 0;
+  if (nRead != nChunk)
     {
-      Log(LOGERROR, "%s, failed to read RTMP packet body. len: %lu",
-	  __FUNCTION__, packet->m_nBodySize);
-      return false;
+#ifndef WIN32
+      if (!r->m_bTimedout || !RTMP_IsConnected(r)
+	  || !IsNonBlocking(r->m_socket))
+#endif
+	{
+	  Log(LOGERROR, "%s, failed to read RTMP packet body. len: %lu",
+	      __FUNCTION__, packet->m_nBodySize);
+	  return false;
+	}
+      /* the rest is read by the next call, once there is more */
+      r->m_nChunkLeft = nChunk - nRead;
+      r->m_nChunkChannel = packet->m_nChannel;
     }
 
-  LogHexString(LOGDEBUG2, packet->m_body+packet->m_nBytesRead, nChunk);
+  LogHexString(LOGDEBUG2, packet->m_body+packet->m_nBytesRead, nRead);
 
-  packet->m_nBytesRead += nChunk;
+  packet->m_nBytesRead += nRead;
 
   // keep the packet as ref for other packets on this channel
-  if (!r->m_vecChannelsIn[packet->m_nChannel])
-    r->m_vecChannelsIn[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsIn[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  if (!ch->ch_in)
+    {
+      ch->ch_in = malloc(sizeof(RTMPPacket));
+      if (!ch->ch_in)
+	{
+	  Log(LOGERROR, "%s, failed to allocate channel packet", __FUNCTION__);
+	  return false;
+	}
+    }
+  memcpy(ch->ch_in, packet, sizeof(RTMPPacket));
 
   if (RTMPPacket_IsReady(packet))
     {
@@ -1980,15 +2408,15 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 
       // make packet's timestamp absolute
       if (!packet->m_hasAbsTimestamp)
-	packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];	// timestamps seem to be always relative!!
+	packet->m_nTimeStamp += ch->ch_timestamp;	// timestamps seem to be always relative!!
 
-      r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+      ch->ch_timestamp = packet->m_nTimeStamp;
 
       // reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel
       // arrives and requests to re-use some info (small packet header)
-      r->m_vecChannelsIn[packet->m_nChannel]->m_body = NULL;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_nBytesRead = 0;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_hasAbsTimestamp = false;	// can only be false if we reuse header
+      ch->ch_in->m_body = NULL;
+      ch->ch_in->m_nBytesRead = 0;
+      ch->ch_in->m_hasAbsTimestamp = false;	// can only be false if we reuse header
     }
   else
     {
@@ -1998,6 +2426,61 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
   return true;
 }
 
+int
+RTMP_ChunkLength(RTMP * r)
+{
+  const unsigned char *p = (const unsigned char *) r->m_pBufferStart;
+  int n = r->m_nBufferSize, hSize = 1, nSize, nChannel, nChunk;
+  uint32_t nBodySize = 0, nBytesRead = 0;
+  RTMPChannel *ch;
+
+  if (r->m_nChunkLeft)
+    return r->m_nChunkLeft;
+  if (n < 1)
+    return 0;
+
+  nChannel = p[0] & 0x3f;
+  if (nChannel == 0)
+    {
+      if (n < 2)
+	return 0;
+      nChannel = p[1] + 64;
+      hSize = 2;
+    }
+  else if (nChannel == 1)
+    {
+      if (n < 3)
+	return 0;
+      nChannel = (p[2] << 8) + p[1] + 64;
+      hSize = 3;
+    }
+
+  nSize = packetSize[p[0] >> 6] - 1;
+  if (n < hSize + nSize)
+    return 0;
+
+  // the same choices RTMP_ReadPacket makes
+  if (nSize >= 6)
+    nBodySize = AMF_DecodeInt24((const char *) p + hSize + 3);
+  else
+    {
+      ch = GetChannel(r, nChannel, false);
+      if (ch && ch->ch_in)
+	{
+	  nBodySize = ch->ch_in->m_nBodySize;
+	  nBytesRead = ch->ch_in->m_nBytesRead;
+	}
+    }
+  if (nSize >= 3 && AMF_DecodeInt24((const char *) p + hSize) == 0xffffff)
+    nSize += 4;
+
+  nChunk = nBodySize - nBytesRead;
+  if (nChunk > r->m_inChunkSize)
+    nChunk = r->m_inChunkSize;
+
+  return hSize + nSize + nChunk;
+}
+
 static bool
 HandShake(RTMP * r, bool FP9HandShake)
 {
@@ -2126,82 +2609,94 @@ SHandShake(RTMP * r)
 bool
 RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
 {
-  bool wrote;
-  char hbuf[RTMP_MAX_HEADER_SIZE];
+  struct iovec iov[2];
+  int n = 0;
 
   Log(LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_socket, chunk->c_chunkSize);
   LogHexString(LOGDEBUG2, chunk->c_header, chunk->c_headerSize);
+
+  /* the header goes out from its own buffer, the chunk is left untouched */
+  iov[n].iov_base = chunk->c_header;
+  iov[n++].iov_len = chunk->c_headerSize;
   if (chunk->c_chunkSize)
     {
-      char *ptr = chunk->c_chunk - chunk->c_headerSize;
       LogHexString(LOGDEBUG2, chunk->c_chunk, chunk->c_chunkSize);
-      /* save header bytes we're about to overwrite */
-      memcpy(hbuf, ptr, chunk->c_headerSize);
-      memcpy(ptr, chunk->c_header, chunk->c_headerSize);
-      wrote = WriteN(r, ptr, chunk->c_headerSize + chunk->c_chunkSize);
-      memcpy(ptr, hbuf, chunk->c_headerSize);
+      iov[n].iov_base = chunk->c_chunk;
+      iov[n++].iov_len = chunk->c_chunkSize;
     }
-  else
-    wrote = WriteN(r, chunk->c_header, chunk->c_headerSize);
-  return wrote;
+  return WriteV(r, iov, n);
 }
 
-bool
-RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
-{
-  const RTMPPacket *prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
-  if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
-    {
-      // compress a bit by using the prev packet's attributes
-      if (prevPacket->m_nBodySize == packet->m_nBodySize
-	  && packet->m_headerType == RTMP_PACKET_SIZE_MEDIUM)
-	packet->m_headerType = RTMP_PACKET_SIZE_SMALL;
+/* Collects chunk headers and body slices for one or more messages so
+ * they can be handed to the kernel in a single sendmsg() call. The
+ * headers live in w_hdr; packet bodies are never written to.
+ */
+#define RTMP_MAX_IOV	512
 
-      if (prevPacket->m_nInfoField2 == packet->m_nInfoField2
-	  && packet->m_headerType == RTMP_PACKET_SIZE_SMALL)
-	packet->m_headerType = RTMP_PACKET_SIZE_MINIMUM;
+typedef struct RTMPWriter
+{
+  RTMP *w_rtmp;
+  int w_niov;
+  int w_nhdr;
+  struct iovec w_iov[RTMP_MAX_IOV];
+  char w_hdr[RTMP_MAX_IOV * 8];
+} RTMPWriter;
 
-    }
+static bool
+Writer_Flush(RTMPWriter *w)
+{
+  bool ret = true;
 
-  if (packet->m_headerType > 3)	// sanity
-    {
-      Log(LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
-	  (unsigned char) packet->m_headerType);
-      return false;
-    }
+  if (w->w_niov)
+    ret = WriteV(w->w_rtmp, w->w_iov, w->w_niov);
+  w->w_niov = 0;
+  w->w_nhdr = 0;
+  return ret;
+}
 
-  int nSize = packetSize[packet->m_headerType];
-  int hSize = nSize, cSize = 0;
-  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+/* make room for niov more iovecs and return hlen bytes of header space */
+static char *
+Writer_Reserve(RTMPWriter *w, int niov, int hlen)
+{
+  char *ptr;
 
-  if (packet->m_body)
+  if (w->w_niov + niov > RTMP_MAX_IOV
+      || w->w_nhdr + hlen > (int) sizeof(w->w_hdr))
     {
-      header = packet->m_body - nSize;
-      hend = packet->m_body;
+      if (!Writer_Flush(w))
+	return NULL;
     }
-  else
+  ptr = w->w_hdr + w->w_nhdr;
+  w->w_nhdr += hlen;
+  return ptr;
+}
+
+static void
+Writer_Add(RTMPWriter *w, char *base, int len)
+{
+  if (len > 0)
     {
-      header = hbuf+6;
-      hend = hbuf+sizeof(hbuf);
+      w->w_iov[w->w_niov].iov_base = base;
+      w->w_iov[w->w_niov++].iov_len = len;
     }
+}
+
+/* Encode the chunk header that starts packet into hbuf, and the one
+ * continuing it into cont; returns the size of the first. */
+static int
+EncodeChunkHeader(const RTMPPacket *packet, char *hbuf, char *cont,
+		  int *contSize)
+{
+  int nSize = packetSize[packet->m_headerType];
+  int cSize = 0;
+  char *hend = hbuf + RTMP_MAX_HEADER_SIZE, *hptr, c;
 
   if (packet->m_nChannel > 319)
     cSize = 2;
   else if (packet->m_nChannel > 63)
     cSize = 1;
-  if (cSize)
-    {
-      header -= cSize;
-      hSize += cSize;
-    }
 
-  if (nSize > 1 && packet->m_nInfoField1 >= 0xffffff)
-    {
-      header -= 4;
-      hSize += 4;
-    }
-
-  hptr = header;
+  hptr = hbuf;
   c = packet->m_headerType << 6;
   switch(cSize)
     {
@@ -2215,13 +2710,15 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
       break;
     }
   *hptr++ = c;
+  cont[0] = (0xc0 | c);
   if (cSize)
     {
       int tmp = packet->m_nChannel - 64;
-      *hptr++ = tmp & 0xff;
+      *hptr++ = cont[1] = tmp & 0xff;
       if (cSize == 2)
-        *hptr++ = tmp >> 8;
+        *hptr++ = cont[2] = tmp >> 8;
     }
+  *contSize = 1 + cSize;
 
   if (nSize > 1)
     {
@@ -2243,55 +2740,87 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
   if (nSize > 1 && packet->m_nInfoField1 >= 0xffffff)
     hptr = AMF_EncodeInt32(hptr, hend, packet->m_nInfoField1);
 
+  return hptr - hbuf;
+}
+
+static bool
+Writer_AddPacket(RTMPWriter *w, RTMPPacket *packet, bool queue)
+{
+  RTMP *r = w->w_rtmp;
+  RTMPChannel *ch = GetChannel(r, packet->m_nChannel, true);
+  if (!ch)
+    {
+      Log(LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__,
+	  packet->m_nChannel);
+      return false;
+    }
+
+  const RTMPPacket *prevPacket = ch->ch_out;
+  if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
+    {
+      // compress a bit by using the prev packet's attributes
+      if (prevPacket->m_nBodySize == packet->m_nBodySize
+	  && prevPacket->m_packetType == packet->m_packetType
+	  && packet->m_headerType == RTMP_PACKET_SIZE_MEDIUM)
+	packet->m_headerType = RTMP_PACKET_SIZE_SMALL;
+
+      if (prevPacket->m_nInfoField2 == packet->m_nInfoField2
+	  && packet->m_headerType == RTMP_PACKET_SIZE_SMALL)
+	packet->m_headerType = RTMP_PACKET_SIZE_MINIMUM;
+
+    }
+
+  if (packet->m_headerType > 3)	// sanity
+    {
+      Log(LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
+	  (unsigned char) packet->m_headerType);
+      return false;
+    }
+
+  int nSize, hSize, contSize;
+  char hbuf[RTMP_MAX_HEADER_SIZE], cont[3], *header, *contp;
+
+  hSize = EncodeChunkHeader(packet, hbuf, cont, &contSize);
+
   nSize = packet->m_nBodySize;
   char *buffer = packet->m_body;
   int nChunkSize = r->m_outChunkSize;
 
   Log(LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_socket, nSize);
-  while (nSize+hSize)
-    {
-      int wrote;
 
+  header = Writer_Reserve(w, 2, hSize + contSize);
+  if (!header)
+    return false;
+  memcpy(header, hbuf, hSize);
+  contp = header + hSize;
+  memcpy(contp, cont, contSize);
+
+  LogHexString(LOGDEBUG2, header, hSize);
+  Writer_Add(w, header, hSize);
+  while (1)
+    {
       if (nSize < nChunkSize)
 	nChunkSize = nSize;
 
-      if (header)
-	{
-          LogHexString(LOGDEBUG2, header, hSize);
-          LogHexString(LOGDEBUG2, buffer, nChunkSize);
-	  wrote = WriteN(r, header, nChunkSize + hSize);
-	  header = NULL;
-          hSize = 0;
-	}
-      else
-	{
-          LogHexString(LOGDEBUG2, buffer, nChunkSize);
-	  wrote = WriteN(r, buffer, nChunkSize);
-	}
-      if (!wrote)
-	return false;
+      LogHexString(LOGDEBUG2, buffer, nChunkSize);
+      Writer_Add(w, buffer, nChunkSize);
 
       nSize -= nChunkSize;
       buffer += nChunkSize;
 
-      if (nSize > 0)
+      if (nSize <= 0)
+	break;
+
+      if (w->w_niov + 2 > RTMP_MAX_IOV)
 	{
-	  header = buffer - 1;
-	  hSize = 1;
-          if (cSize)
-            {
-              header -= cSize;
-              hSize += cSize;
-            }
-	  *header = (0xc0 | c);
-          if (cSize)
-            {
-              int tmp = packet->m_nChannel - 64;
-              header[1] = tmp & 0xff;
-              if (cSize == 2)
-                header[2] = tmp >> 8;
-            }
+	  /* flushing recycles the header space, so copy the
+	   * continuation header again */
+	  contp = Writer_Reserve(w, 2, contSize);
+	  if (!contp)
+	    return false;
+	  memcpy(contp, cont, contSize);
 	}
+      Writer_Add(w, contp, contSize);
     }
 
   /* we invoked a remote method */
@@ -2305,12 +2834,89 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
         AV_queue(&r->m_methodCalls, &r->m_numCalls, &method);
     }
 
-  if (!r->m_vecChannelsOut[packet->m_nChannel])
-    r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  if (!ch->ch_out)
+    {
+      ch->ch_out = malloc(sizeof(RTMPPacket));
+      if (!ch->ch_out)
+	return false;
+    }
+  memcpy(ch->ch_out, packet, sizeof(RTMPPacket));
   return true;
 }
 
+bool
+RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
+{
+  return RTMP_SendPackets(r, &packet, 1, queue);
+}
+
+/* Send several messages back to back, all chunks in as few sendmsg()
+ * calls as the iovec limit allows. */
+bool
+RTMP_SendPackets(RTMP * r, RTMPPacket ** packets, int nPackets, bool queue)
+{
+  RTMPWriter w;
+  int i;
+
+  w.w_rtmp = r;
+  w.w_niov = 0;
+  w.w_nhdr = 0;
+
+  for (i = 0; i < nPackets; i++)
+    {
+      if (!Writer_AddPacket(&w, packets[i], queue))
+	return false;
+    }
+  return Writer_Flush(&w);
+}
+
+/* Chunk packet with the given chunk size into buf, exactly as it would
+ * go out. Returns the length, or the size buf needs if size is less.
+ * Give it a full header and the bytes can be sent on any connection
+ * with that output chunk size, by RTMP_SendRaw. */
+int
+RTMPPacket_Serialize(const RTMPPacket *packet, int chunkSize, char *buf,
+		     int size)
+{
+  char hbuf[RTMP_MAX_HEADER_SIZE], cont[3], *ptr = buf;
+  const char *body = packet->m_body;
+  int hSize, contSize, nChunks, len, n, left = packet->m_nBodySize;
+
+  if (packet->m_headerType > 3 || chunkSize < 1)
+    return -1;
+
+  hSize = EncodeChunkHeader(packet, hbuf, cont, &contSize);
+  nChunks = left ? (left + chunkSize - 1) / chunkSize : 1;
+  len = hSize + left + (nChunks - 1) * contSize;
+  if (len > size)
+    return len;
+
+  memcpy(ptr, hbuf, hSize);
+  ptr += hSize;
+  while (1)
+    {
+      n = left < chunkSize ? left : chunkSize;
+      memcpy(ptr, body, n);
+      ptr += n;
+      body += n;
+      left -= n;
+      if (left <= 0)
+	break;
+      memcpy(ptr, cont, contSize);
+      ptr += contSize;
+    }
+  return len;
+}
+
+/* Send bytes already chunked by RTMPPacket_Serialize. The channels they
+ * use are not tracked, so the next packet sent on one of them with
+ * RTMP_SendPacket should have a full header. */
+bool
+RTMP_SendRaw(RTMP * r, struct iovec *iov, int iovcnt)
+{
+  return WriteV(r, iov, iovcnt);
+}
+
 bool
 RTMP_Serve(RTMP *r)
 {
@@ -2320,13 +2926,17 @@ RTMP_Serve(RTMP *r)
 void
 RTMP_Close(RTMP * r)
 {
-  int i;
-
   if (RTMP_IsConnected(r))
     closesocket(r->m_socket);
 
   r->m_stream_id = -1;
   r->m_socket = 0;
+  free(r->m_wbuf);
+  r->m_wbuf = NULL;
+  r->m_wbufSize = 0;
+  r->m_wbufStart = 0;
+  r->m_wbufLen = 0;
+  r->m_nChunkLeft = 0;
   r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
   r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
   r->m_nBWCheckCounter = 0;
@@ -2336,20 +2946,11 @@ RTMP_Close(RTMP * r)
   r->m_nClientBW2 = 2;
   r->m_nServerBW = 2500000;
 
-  for (i = 0; i < RTMP_CHANNELS; i++)
-    {
-      if (r->m_vecChannelsIn[i])
-	{
-	  RTMPPacket_Free(r->m_vecChannelsIn[i]);
-	  free(r->m_vecChannelsIn[i]);
-	  r->m_vecChannelsIn[i] = NULL;
-	}
-      if (r->m_vecChannelsOut[i])
-	{
-	  free(r->m_vecChannelsOut[i]);
-	  r->m_vecChannelsOut[i] = NULL;
-	}
-    }
+  FreeChannels(r);
+  if (r->m_pool.rp_hits || r->m_pool.rp_misses)
+    Log(LOGDEBUG, "%s, packet pool: %u hits, %u misses", __FUNCTION__,
+	r->m_pool.rp_hits, r->m_pool.rp_misses);
+  RTMPPool_Trim(&r->m_pool);
   AV_clear(r->m_methodCalls, r->m_numCalls);
   r->m_methodCalls = NULL;
   r->m_numCalls = 0;
@@ -2359,6 +2960,8 @@ RTMP_Close(RTMP * r)
 
 }
 
+/* Read what the socket has into the buffer, after what is left in it.
+ * Returns the number of bytes read, 0 on timeout or EOF, -1 on error. */
 int
 RTMPSockBuf_Fill(RTMPSockBuf *sb)
 {
@@ -2366,16 +2969,32 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
 
   if (!sb->sb_size)
     sb->sb_start = sb->sb_buf;
+  else if (sb->sb_start + sb->sb_size == sb->sb_buf + sizeof(sb->sb_buf))
+    {
+      /* no room after what is left, move it to the front */
+      memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
+      sb->sb_start = sb->sb_buf;
+    }
+
+  nBytes = sizeof(sb->sb_buf) - sb->sb_size - (sb->sb_start - sb->sb_buf);
+  nBytes = RTMPSockBuf_Recv(sb, sb->sb_start+sb->sb_size, nBytes);
+  if (nBytes > 0)
+    sb->sb_size += nBytes;
+
+  return nBytes;
+}
+
+/* recv() into an arbitrary buffer with the same EINTR/timeout handling
+ * as RTMPSockBuf_Fill. Returns 0 on timeout or EOF, -1 on error. */
+int
+RTMPSockBuf_Recv(RTMPSockBuf *sb, char *buf, int len)
+{
+  int nBytes;
 
   while (1)
     {
-      nBytes = sizeof(sb->sb_buf) - sb->sb_size - (sb->sb_start - sb->sb_buf);
-      nBytes = recv(sb->sb_socket, sb->sb_start+sb->sb_size, nBytes, 0);
-      if (nBytes != -1)
-        {
-          sb->sb_size += nBytes;
-        }
-      else
+      nBytes = recv(sb->sb_socket, buf, len, 0);
+      if (nBytes == -1)
         {
           int sockerr = GetSockError();
           Log(LOGDEBUG, "%s, recv returned %d. GetSockError(): %d (%s)",
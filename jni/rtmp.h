@@ -32,10 +32,12 @@
 #define msleep(n)	Sleep(n)
 #define socklen_t	int
 #define SET_RCVTIMEO(tv,s)	int tv = s*1000
+struct iovec { void *iov_base; size_t iov_len; };
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/times.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -64,9 +66,15 @@
 #define RTMP_DEFAULT_CHUNKSIZE	128
 
 #define RTMP_BUFFER_CACHE_SIZE (16*1024) // needs to fit largest number of bytes recv() may return
+#define RTMP_DIRECT_READ_SIZE	1024	// reads this large bypass the socket buffer when it is empty
 
 #define	RTMP_CHANNELS	65600
 
+/* chunk stream ids below this use the 1-byte basic header and are kept
+ * in a dense array; extended ids (64..65599) go to a small hash table */
+#define RTMP_DENSE_CHANNELS	64
+#define RTMP_CHANNEL_BUCKETS	16	/* must be a power of 2 */
+
 extern const char RTMPProtocolStringsLower[][7];
 extern bool RTMP_ctrlC;
 
@@ -103,6 +111,40 @@ typedef struct RTMPPacket
   char *m_body;
 } RTMPPacket;
 
+/* Packet bodies read by RTMP_ReadPacket come from a per-connection pool
+ * of power-of-two size classes. Blocks are returned to their pool by
+ * RTMPPacket_Free, so a packet must be freed on the thread that reads
+ * from the connection, unless RTMPPacket_Unpool was called on it first.
+ * The pool lives in the RTMP struct: a pooled packet must be freed or
+ * unpooled before that struct is freed. After RTMP_Close its blocks go
+ * to the heap when freed, but they still look at the struct to tell.
+ * Bodies larger than the biggest class are plain heap allocations.
+ */
+#define RTMP_POOL_MIN_SHIFT	7	/* smallest size class, 128 bytes */
+#define RTMP_POOL_CLASSES	10	/* largest size class, 64 KB */
+#define RTMP_POOL_DEPTH		4	/* free blocks kept per class */
+
+struct RTMPPool;
+
+typedef struct RTMPPoolBlock
+{
+  struct RTMPPool *pb_pool;	/* NULL if not pooled */
+  struct RTMPPoolBlock *pb_next;
+  int pb_class;
+} RTMPPoolBlock;
+
+typedef struct RTMPPool
+{
+  RTMPPoolBlock *rp_free[RTMP_POOL_CLASSES];
+  int rp_count[RTMP_POOL_CLASSES];
+  bool rp_active;		/* false after RTMPPool_Trim, frees bypass the pool */
+  uint32_t rp_hits;		/* allocations served from a free list */
+  uint32_t rp_misses;		/* allocations that went to malloc */
+} RTMPPool;
+
+bool RTMPPool_Alloc(RTMPPool *pool, RTMPPacket *p, int nSize);
+void RTMPPool_Trim(RTMPPool *pool);
+
 typedef struct RTMPSockBuf
 {
   int sb_socket;
@@ -116,9 +158,30 @@ void RTMPPacket_Reset(RTMPPacket *p);
 void RTMPPacket_Dump(RTMPPacket *p);
 bool RTMPPacket_Alloc(RTMPPacket *p, int nSize);
 void RTMPPacket_Free(RTMPPacket *p);
+void RTMPPacket_Unpool(RTMPPacket *p);
+int RTMPPacket_Serialize(const RTMPPacket *p, int chunkSize, char *buf,
+			 int size);
 
 #define RTMPPacket_IsReady(a)	((a)->m_nBytesRead == (a)->m_nBodySize)
 
+typedef struct RTMPChannel
+{
+  int ch_id;
+  bool ch_active;
+  uint32_t ch_timestamp;	/* abs timestamp of last packet */
+  RTMPPacket *ch_in;		/* last packet read on this channel */
+  RTMPPacket *ch_out;		/* last packet sent on this channel */
+  struct RTMPChannel *ch_next;	/* hash bucket chain, extended ids only */
+  struct RTMPChannel *ch_used;	/* list of channels in use */
+} RTMPChannel;
+
+typedef struct RTMPChannelMap
+{
+  RTMPChannel cm_dense[RTMP_DENSE_CHANNELS];
+  RTMPChannel *cm_buckets[RTMP_CHANNEL_BUCKETS];
+  RTMPChannel *cm_used;
+} RTMPChannelMap;
+
 typedef struct RTMP_LNK
 {
   const char *hostname;
@@ -172,15 +235,23 @@ typedef struct RTMP
   int m_numCalls;
 
   RTMP_LNK Link;
-  RTMPPacket *m_vecChannelsIn[RTMP_CHANNELS];
-  RTMPPacket *m_vecChannelsOut[RTMP_CHANNELS];
-  int m_channelTimestamp[RTMP_CHANNELS];	// abs timestamp of last packet
+  RTMPChannelMap m_channels;	/* per chunk stream state */
+  RTMPPool m_pool;		/* packet body allocator */
+
+  char *m_wbuf;			/* what a non-blocking socket didn't take yet */
+  int m_wbufSize;
+  int m_wbufStart;
+  int m_wbufLen;
+  int m_nChunkLeft;		/* of a chunk body read in pieces, see RTMP_ReadPacket */
+  int m_nChunkChannel;
 
   double m_fAudioCodecs;	// audioCodecs for the connect packet
   double m_fVideoCodecs;	// videoCodecs for the connect packet
   double m_fEncoding;		/* AMF0 or AMF3 */
 
   double m_fDuration;		// duration of stream in seconds
+  double m_fFilesize;		// filesize from onMetaData, in bytes
+  double m_fDatarate;		// video + audio datarate from onMetaData, in kbit/s
 
   RTMPSockBuf m_sb;
 #define m_socket	m_sb.sb_socket
@@ -215,12 +286,31 @@ bool RTMP_Connect0(RTMP *r, struct sockaddr *svc);
 bool RTMP_Connect1(RTMP *r, RTMPPacket *cp);
 bool RTMP_Serve(RTMP *r);
 
+/* On a non-blocking socket, a chunk whose body isn't all there yet is
+ * read as far as it goes; the packet isn't ready, m_bTimedout is set,
+ * and the next call carries on with it. */
 bool RTMP_ReadPacket(RTMP * r, RTMPPacket * packet);
+/* Bytes the next chunk takes, header and body, judging by what is in
+ * the socket buffer; 0 if too little of its header is there to tell.
+ * Once that many are buffered RTMP_ReadPacket won't touch the socket.
+ * For a chunk read in part, what is left of its body. */
+int RTMP_ChunkLength(RTMP * r);
+/* What a non-blocking socket doesn't take is kept, in order, and the
+ * sends still succeed; it goes out with RTMP_SendPending, once the
+ * socket is writable again. Returns 1 when all of it is out, 0 when
+ * some still waits and -1 if the connection failed. */
+int RTMP_SendPending(RTMP * r);
+#define RTMP_WritePending(r)	((r)->m_wbufLen > 0)
 bool RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue);
+bool RTMP_SendPackets(RTMP * r, RTMPPacket ** packets, int nPackets, bool queue);
 bool RTMP_SendChunk(RTMP * r, RTMPChunk *chunk);
+bool RTMP_SendRaw(RTMP * r, struct iovec *iov, int iovcnt);
 bool RTMP_IsConnected(RTMP *r);
 bool RTMP_IsTimedout(RTMP *r);
 double RTMP_GetDuration(RTMP *r);
+double RTMP_GetFilesize(RTMP *r);
+uint32_t RTMP_GetChannelTimestamp(RTMP *r, int nChannel);
+void RTMP_GetPoolStats(RTMP *r, uint32_t *hits, uint32_t *misses);
 bool RTMP_ToggleStream(RTMP *r);
 
 bool RTMP_ConnectStream(RTMP *r, double seekTime, uint32_t dLength);
@@ -237,6 +327,7 @@ bool RTMP_SendPause(RTMP *r, bool DoPause, double dTime);
 bool RTMP_FindFirstMatchingProperty(AMFObject *obj, const AVal *name,
 				      AMFObjectProperty *p);
 
-bool RTMPSockBuf_Fill(RTMPSockBuf *sb);
+int RTMPSockBuf_Fill(RTMPSockBuf *sb);
+int RTMPSockBuf_Recv(RTMPSockBuf *sb, char *buf, int len);
 
 #endif
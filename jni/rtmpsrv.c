@@ -19,10 +19,14 @@
  *
  */
 
-/* This is just a stub for an RTMP server. It doesn't do anything
- * beyond obtaining the connection parameters from the client.
+/* A simple RTMP server. It plays FLV files on demand, from a directory
+ * given with -d, and relays live streams from their publishers to any
+ * number of players. Plays of anything else just print the connection
+ * parameters of the client, as a flvstreamer command line.
  */
 
+#define _FILE_OFFSET_BITS	64
+
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
@@ -32,9 +36,13 @@
 #include <getopt.h>
 
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "rtmp.h"
 #include "parseurl.h"
+#include "flv.h"
 
 #include "thread.h"
 
@@ -48,6 +56,18 @@
 
 #define PACKET_SIZE 1024*1024
 
+#define SERVE_CHUNK	(64*1024)	/* our chunk size, fewer headers the bigger */
+#define SEND_TAGS	64		/* at most this many tags per write */
+#define SEND_BYTES	(512*1024)	/* and not many more bytes than this */
+#define VOD_FILES	64		/* files kept open and indexed while unused */
+#define AUDIO_SPACING	1000		/* ms between the seek points without video */
+#define HEAD_TAGS	4		/* metadata and sequence headers resent on seeks */
+#define LIVE_STREAM	1		/* the stream id live messages are chunked for */
+#define LIVE_HEADER	12		/* their first header, the stream id ends it */
+#define LIVE_QUEUE	1024		/* messages a player may fall behind by */
+#define LIVE_BYTES	(2*1024*1024)	/* and bytes */
+#define LIVE_BATCH	64		/* messages per write to a player */
+
 #ifdef WIN32
 #define InitSockets()	{\
         WORD version;			\
@@ -74,14 +94,125 @@ typedef struct
 {
   int socket;
   int state;
-  int streamID;
-  char *connect;
-
+  const char *media;		/* where the files played are, NULL for none */
 } STREAMING_SERVER;
 
+/* A place to seek to, a video keyframe, or an audio tag if there is no
+ * video */
+typedef struct Kpoint
+{
+  uint32_t k_stamp;
+  off_t k_offset;
+} Kpoint;
+
+/* An FLV file being served. The tags are walked once, by the first play,
+ * to find where seeks may go to. The index is kept for the plays after
+ * it, for as long as the file stays the same. Every session maps the
+ * file on its own, the pages are shared.
+ */
+typedef struct Vfile
+{
+  struct Vfile *v_next;
+  char *v_path;
+  int v_fd;
+  off_t v_size;			/* with these, to notice the file changed */
+  time_t v_mtime;
+  ino_t v_ino;
+  int v_refs;			/* sessions playing it */
+  bool v_ready;			/* indexed, see vodCond */
+  bool v_gone;			/* out of vodFiles, freed when unplayed */
+  uint32_t v_duration;		/* ms, the stamp of the last tag */
+  off_t v_head[HEAD_TAGS];	/* metadata and sequence headers */
+  int v_nhead;
+  Kpoint *v_keys;
+  int v_nkeys;
+} Vfile;
+
+static pthread_mutex_t vodLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vodCond = PTHREAD_COND_INITIALIZER;	/* a file got indexed */
+static Vfile *vodFiles;		/* most recently played first */
+
+/* A message of a live stream, chunked once, with SERVE_CHUNK and a full
+ * header for LIVE_STREAM, and shared by the players it is queued for.
+ */
+typedef struct Lmsg
+{
+  int m_refs;			/* under liveLock */
+  bool m_key;			/* a player that fell behind may start here */
+  bool m_header;		/* metadata, sequence headers and status, never skipped */
+  int m_len;
+  char *m_data;
+} Lmsg;
+
+/* A player of a live stream. What it has yet to be sent is queued by
+ * the publisher's thread, and written out by the player's own, so a
+ * slow player holds up no one else. One that falls LIVE_QUEUE messages
+ * or LIVE_BYTES behind loses its queue, and picks up again at the next
+ * keyframe.
+ */
+typedef struct Lsub
+{
+  struct Lsub *l_next;
+  Lmsg *l_queue[LIVE_QUEUE];	/* a ring, under liveLock as the rest */
+  int l_head;
+  int l_count;
+  int l_bytes;
+  bool l_skipping;		/* to the next keyframe */
+  uint32_t l_skipped;
+  int l_wake[2];		/* written to when the queue gets something */
+} Lsub;
+
+/* A live stream, by app and name. It lives as long as it is published
+ * or played; players may wait for a publisher that is yet to come, or
+ * come back. Late players are sent the metadata, sequence headers and
+ * last keyframe first.
+ */
+typedef struct Lstream
+{
+  struct Lstream *ls_next;
+  char *ls_name;
+  bool ls_published;
+  bool ls_video;		/* keyframes to skip to, else any audio does */
+  Lsub *ls_subs;
+  Lmsg *ls_meta;
+  Lmsg *ls_avc;
+  Lmsg *ls_aac;
+  Lmsg *ls_key;
+} Lstream;
+
+static pthread_mutex_t liveLock = PTHREAD_MUTEX_INITIALIZER;
+static Lstream *liveStreams;
+
+/* A connection, served on a thread of its own. */
+typedef struct
+{
+  STREAMING_SERVER *server;
+  int socket;
+  int streamID;
+  char *connect;		/* the connect body, r->Link points into it */
+
+  Vfile *file;			/* being played */
+  FLVFile flv;
+  FLVCursor cursor;		/* the next tag to send */
+  uint32_t stream;		/* the player's */
+  uint32_t base;		/* stamp of the keyframe played from */
+  uint32_t stop;		/* stamp to stop after, if bounded */
+  bool bounded;
+  bool single;			/* just the frame at the start */
+  bool playing;
+  bool paused;
+
+  Lstream *live;		/* published or played */
+  Lsub *sub;			/* if played */
+  uint32_t liveStream;		/* the publisher's stream */
+} STREAMING_SESSION;
+
+static void StopLive(STREAMING_SESSION *s);
+
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
 
-STREAMING_SERVER *startStreaming(const char *address, int port);
+STREAMING_SERVER *startStreaming(const char *address, int port,
+  const char *media);
 void stopStreaming(STREAMING_SERVER * server);
 
 typedef struct
@@ -151,6 +282,34 @@ SAVC(level);
 SAVC(code);
 SAVC(description);
 SAVC(secureToken);
+SAVC(onStatus);
+SAVC(status);
+SAVC(error);
+SAVC(details);
+SAVC(pause);
+SAVC(closeStream);
+SAVC(deleteStream);
+SAVC(publish);
+SAVC(FCUnpublish);
+SAVC(onMetaData);
+static const AVal av_setDataFrame = AVC("@setDataFrame");
+static const AVal av_NetStream_Play_Start = AVC("NetStream.Play.Start");
+static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
+static const AVal av_NetStream_Play_Complete = AVC("NetStream.Play.Complete");
+static const AVal av_NetStream_Play_StreamNotFound =
+AVC("NetStream.Play.StreamNotFound");
+static const AVal av_NetStream_Play_Failed = AVC("NetStream.Play.Failed");
+static const AVal av_NetStream_Pause_Notify = AVC("NetStream.Pause.Notify");
+static const AVal av_NetStream_Unpause_Notify = AVC("NetStream.Unpause.Notify");
+static const AVal av_NetStream_Publish_Start = AVC("NetStream.Publish.Start");
+static const AVal av_NetStream_Publish_BadName =
+AVC("NetStream.Publish.BadName");
+static const AVal av_NetStream_Unpublish_Success =
+AVC("NetStream.Unpublish.Success");
+static const AVal av_NetStream_Play_PublishNotify =
+AVC("NetStream.Play.PublishNotify");
+static const AVal av_NetStream_Play_UnpublishNotify =
+AVC("NetStream.Play.UnpublishNotify");
 
 static bool
 SendConnectResult(RTMP *r, double txn)
@@ -280,9 +439,1005 @@ dumpAMF(AMFObject *obj)
     }
 }
 
+static void
+FreeVfile(Vfile *v)
+{
+  if (v->v_fd >= 0)
+    close(v->v_fd);
+  free(v->v_keys);
+  free(v->v_path);
+  free(v);
+}
+
+/* under vodLock, as is DetachVfile */
+static void
+UnlinkVfile(Vfile *v)
+{
+  Vfile **vp;
+
+  for (vp = &vodFiles; *vp; vp = &(*vp)->v_next)
+    if (*vp == v)
+      {
+        *vp = v->v_next;
+        break;
+      }
+  v->v_next = NULL;
+}
+
+/* v is no longer found by new plays, it goes when the last one playing
+ * it stops */
+static void
+DetachVfile(Vfile *v)
+{
+  UnlinkVfile(v);
+  v->v_gone = true;
+  if (!v->v_refs)
+    FreeVfile(v);
+}
+
+static void
+ReleaseVfile(Vfile *v)
+{
+  pthread_mutex_lock(&vodLock);
+  if (!--v->v_refs && v->v_gone)
+    FreeVfile(v);
+  pthread_mutex_unlock(&vodLock);
+}
+
+static bool
+AddKpoint(Kpoint **keys, int *num, uint32_t stamp, off_t offset)
+{
+  if (!(*num & (*num - 1)))	/* full at 0, 1, 2, 4, ... */
+    {
+      Kpoint *k = realloc(*keys, (*num ? *num * 2 : 1) * sizeof(Kpoint));
+      if (!k)
+        return false;
+      *keys = k;
+    }
+  (*keys)[*num].k_stamp = stamp;
+  (*keys)[*num].k_offset = offset;
+  (*num)++;
+  return true;
+}
+
+/* Walks the tags of the file once, noting the keyframes to seek to, and
+ * the metadata and sequence headers a player needs wherever it starts.
+ * Files without video may be sought to every AUDIO_SPACING ms.
+ */
+static bool
+IndexVfile(Vfile *v)
+{
+  FLVFile f;
+  FLVCursor c;
+  Kpoint *audio = NULL;
+  int naudio = 0;
+  bool media = false, avcHeader = false, aacHeader = false, ok;
+  off_t end = 0;
+
+  if (!FLV_Open(&f, v->v_fd))
+    return false;
+
+  for (ok = FLV_First(&f, &c); ok; ok = FLV_Next(&c))
+    {
+      uint8_t b0 = c.c_size ? c.c_body[0] : 0;
+      bool seqHeader = c.c_size > 1 && c.c_body[1] == 0
+        && ((c.c_type == 0x09 && (b0 & 0x0f) == 7)
+          || (c.c_type == 0x08 && (b0 >> 4) == 10));
+
+      end = c.c_offset + 11 + c.c_size + 4;
+      if (c.c_timestamp > v->v_duration)
+        v->v_duration = c.c_timestamp;
+
+      if ((c.c_type == 0x12 && !media) || (seqHeader
+          && !(c.c_type == 0x09 ? avcHeader : aacHeader)))
+        {
+          if (v->v_nhead < HEAD_TAGS)
+            v->v_head[v->v_nhead++] = c.c_offset;
+          if (c.c_type == 0x09)
+            avcHeader = true;
+          else if (c.c_type == 0x08)
+            aacHeader = true;
+          continue;
+        }
+      if (c.c_type == 0x09 && (b0 >> 4) == 1 && !seqHeader)
+        ok = AddKpoint(&v->v_keys, &v->v_nkeys, c.c_timestamp, c.c_offset);
+      else if (c.c_type == 0x08 && !seqHeader && (!naudio
+          || c.c_timestamp >= audio[naudio-1].k_stamp + AUDIO_SPACING))
+        ok = AddKpoint(&audio, &naudio, c.c_timestamp, c.c_offset);
+      if (!ok)
+        {
+          Log(LOGERROR, "%s, out of memory indexing %s", __FUNCTION__,
+              v->v_path);
+          break;
+        }
+      media |= c.c_type == 0x08 || c.c_type == 0x09;
+    }
+  FLV_Close(&f);
+
+  if (!v->v_nkeys)
+    {
+      v->v_keys = audio;
+      v->v_nkeys = naudio;
+      audio = NULL;
+    }
+  free(audio);
+
+  if (end < v->v_size)
+    Log(LOGWARNING, "%s, %s: tags end at %llu of %llu bytes", __FUNCTION__,
+        v->v_path, (unsigned long long) end, (unsigned long long) v->v_size);
+  Log(LOGDEBUG, "%s, %s: %d seek points, %d headers, %u ms", __FUNCTION__,
+      v->v_path, v->v_nkeys, v->v_nhead, v->v_duration);
+  return end > 0;
+}
+
+/* The file at path, indexed, or NULL. The first play of a file indexes
+ * it, others playing it meanwhile wait for that. Release with
+ * ReleaseVfile.
+ */
+static Vfile *
+OpenVfile(const char *path)
+{
+  struct stat st;
+  Vfile *v, *w;
+  bool indexed = false;
+  int n;
+
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+    return NULL;
+
+  pthread_mutex_lock(&vodLock);
+  for (v = vodFiles; v; v = v->v_next)
+    if (!strcmp(v->v_path, path))
+      break;
+  if (v && v->v_ready
+    && (v->v_size != st.st_size || v->v_mtime != st.st_mtime
+      || v->v_ino != st.st_ino))
+    {
+      Log(LOGDEBUG, "%s, %s changed, indexing it again", __FUNCTION__, path);
+      DetachVfile(v);
+      v = NULL;
+    }
+  if (v)
+    {
+      v->v_refs++;
+      while (!v->v_ready && !v->v_gone)
+        pthread_cond_wait(&vodCond, &vodLock);
+      if (v->v_gone)
+        {
+          if (!--v->v_refs)
+            FreeVfile(v);
+          v = NULL;
+        }
+      else
+        {
+          /* most recently played first */
+          UnlinkVfile(v);
+          v->v_next = vodFiles;
+          vodFiles = v;
+        }
+      pthread_mutex_unlock(&vodLock);
+      return v;
+    }
+
+  v = calloc(1, sizeof(Vfile));
+  if (!v || !(v->v_path = strdup(path)))
+    {
+      free(v);
+      pthread_mutex_unlock(&vodLock);
+      return NULL;
+    }
+  v->v_fd = -1;
+  v->v_size = st.st_size;
+  v->v_mtime = st.st_mtime;
+  v->v_ino = st.st_ino;
+  v->v_refs = 1;
+  v->v_next = vodFiles;
+  vodFiles = v;
+  pthread_mutex_unlock(&vodLock);
+
+  v->v_fd = open(path, O_RDONLY);
+  if (v->v_fd < 0)
+    Log(LOGERROR, "%s, couldn't open %s", __FUNCTION__, path);
+  else if (!(indexed = IndexVfile(v)))
+    Log(LOGERROR, "%s, %s is not an FLV file", __FUNCTION__, path);
+
+  pthread_mutex_lock(&vodLock);
+  v->v_ready = indexed;
+  if (!indexed)
+    {
+      v->v_refs--;
+      DetachVfile(v);
+      v = NULL;
+    }
+  pthread_cond_broadcast(&vodCond);
+
+  /* close the files least recently played, beyond VOD_FILES */
+  for (n = 0, w = vodFiles; w; w = w->v_next)
+    n++;
+  while (n-- > VOD_FILES)
+    {
+      Vfile *unused = NULL;
+      for (w = vodFiles; w; w = w->v_next)
+        if (!w->v_refs && w->v_ready)
+          unused = w;
+      if (!unused)
+        break;
+      DetachVfile(unused);
+    }
+  pthread_mutex_unlock(&vodLock);
+  return v;
+}
+
+/* offset of the last seek point at or before stamp, -1 if there is none */
+static off_t
+SeekVfile(Vfile *v, uint32_t stamp)
+{
+  int lo = 0, hi = v->v_nkeys;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (v->v_keys[mid].k_stamp <= stamp)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo ? v->v_keys[lo-1].k_offset : -1;
+}
+
+/* the file for a playpath, which must stay inside the media directory */
+static bool
+VodPath(STREAMING_SERVER *server, const AVal *playpath, char *path, int size)
+{
+  const char *p = playpath->av_val, *ext = "";
+  int len = playpath->av_len, i, n;
+
+  if (!server->media || !p)
+    return false;
+  if (len > 4 && !strncmp(p, "flv:", 4))
+    {
+      p += 4;
+      len -= 4;
+    }
+  if (!len || p[0] == '/' || memchr(p, '\0', len) || memchr(p, '\\', len))
+    return false;
+  for (i = 0; i + 1 < len; i++)
+    if (p[i] == '.' && p[i+1] == '.')
+      return false;
+  if (len < 4 || strncasecmp(p + len - 4, ".flv", 4))
+    ext = ".flv";
+  n = snprintf(path, size, "%s/%.*s%s", server->media, len, p, ext);
+  return n > 0 && n < size;
+}
+
+/* Fills in an onStatus message for stream, the body in pbuf, which
+ * should have room for 512 bytes. */
+static void
+StatusPacket(RTMPPacket *packet, char *pbuf, uint32_t stream,
+  const AVal *level, const AVal *code, const AVal *details)
+{
+  char *pend = pbuf + 512;
+
+  memset(packet, 0, sizeof(RTMPPacket));
+  packet->m_nChannel = 0x05;
+  packet->m_headerType = 0; /* RTMP_PACKET_SIZE_LARGE */
+  packet->m_packetType = 0x14;   // INVOKE
+  packet->m_nInfoField1 = 0;
+  packet->m_nInfoField2 = stream;
+  packet->m_hasAbsTimestamp = 0;
+  packet->m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  char *enc = packet->m_body;
+  enc = AMF_EncodeString(enc, pend, &av_onStatus);
+  enc = AMF_EncodeNumber(enc, pend, 0.0);
+  *enc++ = AMF_NULL;
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedString(enc, pend, &av_level, level);
+  enc = AMF_EncodeNamedString(enc, pend, &av_code, code);
+  if (details && details->av_len < 256)
+    enc = AMF_EncodeNamedString(enc, pend, &av_details, details);
+  *enc++ = 0;
+  *enc++ = 0;
+  *enc++ = AMF_OBJECT_END;
+
+  packet->m_nBodySize = enc - packet->m_body;
+}
+
+static bool
+SendStatus(RTMP *r, uint32_t stream, const AVal *level, const AVal *code,
+  const AVal *details)
+{
+  RTMPPacket packet;
+  char pbuf[512];
+
+  StatusPacket(&packet, pbuf, stream, level, code, details);
+  return RTMP_SendPacket(r, &packet, false);
+}
+
+static bool
+SendChunkSize(RTMP *r, int size)
+{
+  RTMPPacket packet;
+  char pbuf[RTMP_MAX_HEADER_SIZE + 4], *pend = pbuf+sizeof(pbuf);
+
+  packet.m_nChannel = 0x02;     // control channel
+  packet.m_headerType = 1; /* RTMP_PACKET_SIZE_MEDIUM; */
+  packet.m_packetType = 0x01;   // chunk size
+  packet.m_nInfoField1 = 0;
+  packet.m_nInfoField2 = 0;
+  packet.m_hasAbsTimestamp = 0;
+  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+  packet.m_nBodySize = 4;
+  AMF_EncodeInt32(packet.m_body, pend, size);
+
+  if (!RTMP_SendPacket(r, &packet, false))
+    return false;
+  r->m_outChunkSize = size;
+  return true;
+}
+
+/* The tag under c as a message for the player. The body is sent from
+ * the mapping as it is. As with FMS, the timestamps start over from the
+ * keyframe a play started at, the player adds its start to them.
+ */
+static void
+TagPacket(STREAMING_SESSION *s, RTMPPacket *packet, FLVCursor *c)
+{
+  memset(packet, 0, sizeof(RTMPPacket));
+  packet->m_headerType = 0; /* RTMP_PACKET_SIZE_LARGE */
+  packet->m_packetType = c->c_type;
+  if (c->c_type == 0x08)
+    packet->m_nChannel = 0x04;
+  else if (c->c_type == 0x09)
+    packet->m_nChannel = 0x06;
+  else
+    packet->m_nChannel = 0x05;
+  packet->m_nInfoField1 = c->c_timestamp > s->base
+    ? c->c_timestamp - s->base : 0;
+  packet->m_nInfoField2 = s->stream;
+  packet->m_nTimeStamp = packet->m_nInfoField1;
+  packet->m_hasAbsTimestamp = true;
+  packet->m_nBodySize = c->c_size;
+  packet->m_nBytesRead = c->c_size;
+  packet->m_body = c->c_body;
+}
+
+static void
+StopPlay(STREAMING_SESSION *s)
+{
+  if (s->file)
+    {
+      FLV_Close(&s->flv);
+      ReleaseVfile(s->file);
+      s->file = NULL;
+    }
+  s->playing = false;
+  s->paused = false;
+}
+
+static bool
+EndPlay(STREAMING_SESSION *s, RTMP *r, bool complete)
+{
+  StopPlay(s);
+  /* StreamEOF */
+  return RTMP_SendCtrl(r, 1, s->stream, 0)
+    && SendStatus(r, s->stream, &av_status, complete
+      ? &av_NetStream_Play_Complete : &av_NetStream_Play_Stop, NULL);
+}
+
+/* Puts the cursor on the seek point at or before stamp. Unless the
+ * player has them already, what it would miss of the metadata and
+ * sequence headers is sent first.
+ */
+static bool
+SeekPlay(STREAMING_SESSION *s, RTMP *r, uint32_t stamp, bool heads)
+{
+  off_t offset = stamp ? SeekVfile(s->file, stamp) : -1;
+  int i;
+
+  if (offset < 0)
+    return FLV_First(&s->flv, &s->cursor);
+
+  for (i = 0; heads && i < s->file->v_nhead && s->file->v_head[i] < offset;
+    i++)
+    {
+      RTMPPacket packet;
+      FLVCursor c;
+
+      if (!FLV_Seek(&s->flv, &c, s->file->v_head[i]))
+        return false;
+      TagPacket(s, &packet, &c);
+      if (!RTMP_SendPacket(r, &packet, false))
+        return false;
+    }
+  return FLV_Seek(&s->flv, &s->cursor, offset);
+}
+
+/* Answers a play of a file. The start and length are in ms, playing
+ * starts at the keyframe at or before the start, and stops after the
+ * last tag within the length. A length of 0 plays just that keyframe.
+ * Returns false if there is no such file.
+ */
+static bool
+StartPlay(STREAMING_SESSION *s, RTMP *r, AMFObject *obj, uint32_t stream)
+{
+  char path[PATH_MAX];
+  double start = 0, len = -1;
+
+  StopPlay(s);		/* a play replaces the one going on */
+  StopLive(s);
+  if (!VodPath(s->server, &r->Link.playpath, path, sizeof(path))
+    || !(s->file = OpenVfile(path)))
+    {
+      Log(LOGWARNING, "%s, no file for %.*s", __FUNCTION__,
+          r->Link.playpath.av_len, r->Link.playpath.av_val);
+      return false;
+    }
+
+  if (obj->o_num > 4 && AMFProp_GetType(&obj->o_props[4]) == AMF_NUMBER)
+    start = AMFProp_GetNumber(&obj->o_props[4]);
+  if (obj->o_num > 5 && AMFProp_GetType(&obj->o_props[5]) == AMF_NUMBER)
+    len = AMFProp_GetNumber(&obj->o_props[5]);
+  if (start < 0)		/* -1 and -2 are for live streams */
+    start = 0;
+
+  s->stream = stream;
+  s->single = len == 0;
+  s->bounded = len > 0;
+  s->stop = s->bounded ? start + len : 0;
+  Log(LOGDEBUG, "%s, playing %s from %.0f ms, length %.0f ms",
+      __FUNCTION__, path, start, len);
+
+  if (!FLV_Open(&s->flv, s->file->v_fd))
+    {
+      ReleaseVfile(s->file);
+      s->file = NULL;
+      SendStatus(r, stream, &av_error, &av_NetStream_Play_Failed,
+        &r->Link.playpath);
+      return true;
+    }
+  /* StreamBegin */
+  RTMP_SendCtrl(r, 0, stream, 0);
+  SendStatus(r, stream, &av_status, &av_NetStream_Play_Start,
+    &r->Link.playpath);
+  s->base = 0;
+  if (!SeekPlay(s, r, start, true))
+    EndPlay(s, r, true);	/* nothing there */
+  else
+    {
+      s->base = start > 0 ? s->cursor.c_timestamp : 0;
+      s->playing = true;
+    }
+  return true;
+}
+
+/* Sends on from the cursor, one write of at most SEND_TAGS tags. The
+ * bodies go from the mapping, so the write is done before the cursor
+ * would move the mapping on. Returns false if the player is gone.
+ */
+static bool
+SendTags(STREAMING_SESSION *s, RTMP *r)
+{
+  RTMPPacket packets[SEND_TAGS], *pp[SEND_TAGS];
+  FLVCursor *c = &s->cursor;
+  int n = 0, end = 0;		/* 1 stopped, 2 complete */
+  uint32_t bytes = 0;
+  bool full = false;
+
+  while (!end && !full)
+    {
+      if (s->bounded && c->c_timestamp > s->stop)
+        {
+          end = 1;
+          break;
+        }
+      TagPacket(s, &packets[n], c);
+      pp[n] = &packets[n];
+      n++;
+      bytes += c->c_size;
+      if (s->single && c->c_type == 0x09)
+        end = 1;
+      else
+        {
+          full = n == SEND_TAGS || bytes >= SEND_BYTES || !FLV_NextMapped(c);
+          if (full && !RTMP_SendPackets(r, pp, n, false))
+            return false;
+          if (full)
+            n = 0;
+          if (!FLV_Next(c))
+            end = 2;
+        }
+    }
+  if (n && !RTMP_SendPackets(r, pp, n, false))
+    return false;
+  if (end == 2 && c->c_offset + 11 + c->c_size + 4 < s->file->v_size)
+    Log(LOGWARNING, "%s, %s: stopped at a broken tag at %llu", __FUNCTION__,
+        s->file->v_path,
+        (unsigned long long) (c->c_offset + 11 + c->c_size + 4));
+  if (end)
+    return EndPlay(s, r, end == 2);
+  return true;
+}
+
+/* whether the player sent something, to be read before sending on */
+static bool
+Pending(RTMP *r)
+{
+  struct pollfd pfd;
+
+  if (r->m_nBufferSize > 0)
+    return true;
+  pfd.fd = r->m_socket;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/* The key of a live stream, app/name, without the query of the name */
+static bool
+LiveName(RTMP *r, const AVal *name, char *buf, int size)
+{
+  const char *q;
+  int len = name->av_len, n;
+
+  if (!name->av_val || !len)
+    return false;
+  if ((q = memchr(name->av_val, '?', len)))
+    len = q - name->av_val;
+  n = snprintf(buf, size, "%.*s/%.*s", r->Link.app.av_len,
+    r->Link.app.av_val ? r->Link.app.av_val : "", len, name->av_val);
+  return len > 0 && n > 0 && n < size;
+}
+
+/* Chunks packet for the players of live streams. The caller holds the
+ * one reference there is. */
+static Lmsg *
+NewLmsg(RTMPPacket *packet)
+{
+  int len = RTMPPacket_Serialize(packet, SERVE_CHUNK, NULL, 0);
+  Lmsg *m;
+
+  if (len < LIVE_HEADER || !(m = malloc(sizeof(Lmsg) + len)))
+    return NULL;
+  m->m_refs = 1;
+  m->m_key = false;
+  m->m_header = false;
+  m->m_data = (char *) (m + 1);
+  m->m_len = RTMPPacket_Serialize(packet, SERVE_CHUNK, m->m_data, len);
+  return m;
+}
+
+/* The functions from here to PlayLive are called under liveLock. */
+
+static void
+ReleaseLmsg(Lmsg *m)
+{
+  if (m && !--m->m_refs)
+    free(m);
+}
+
+static void
+CacheLmsg(Lmsg **slot, Lmsg *m)
+{
+  ReleaseLmsg(*slot);
+  if (m)
+    m->m_refs++;
+  *slot = m;
+}
+
+/* the player left, or went to play something else */
+static void
+FreeLsub(Lsub *l)
+{
+  for (; l->l_count; l->l_count--)
+    {
+      ReleaseLmsg(l->l_queue[l->l_head]);
+      l->l_head = (l->l_head + 1) % LIVE_QUEUE;
+    }
+  close(l->l_wake[0]);
+  close(l->l_wake[1]);
+  free(l);
+}
+
+/* the player has fallen too far behind, it is sent only what it can't
+ * do without until the next keyframe */
+static void
+DropLsub(Lsub *l)
+{
+  int i, n = 0;
+
+  for (i = 0; i < l->l_count; i++)
+    {
+      Lmsg *m = l->l_queue[(l->l_head + i) % LIVE_QUEUE];
+      if (m->m_header)
+        l->l_queue[(l->l_head + n++) % LIVE_QUEUE] = m;
+      else
+        {
+          l->l_bytes -= m->m_len;
+          l->l_skipped++;
+          ReleaseLmsg(m);
+        }
+    }
+  l->l_count = n;
+  if (!l->l_skipping)
+    Log(LOGDEBUG, "%s, a player fell behind, skipping to a keyframe",
+        __FUNCTION__);
+  l->l_skipping = true;
+}
+
+static void
+QueueLmsg(Lsub *l, Lmsg *m)
+{
+  if (!m->m_header)
+    {
+      if (l->l_count == LIVE_QUEUE || l->l_bytes + m->m_len > LIVE_BYTES)
+        DropLsub(l);
+      if (l->l_skipping && !m->m_key)
+        {
+          l->l_skipped++;
+          return;
+        }
+      if (l->l_skipping && l->l_skipped)
+        Log(LOGDEBUG, "%s, a player skipped %u messages", __FUNCTION__,
+            l->l_skipped);
+      l->l_skipping = false;
+      l->l_skipped = 0;
+    }
+  if (l->l_count == LIVE_QUEUE)	/* of headers, it can't be helped */
+    return;
+
+  m->m_refs++;
+  l->l_queue[(l->l_head + l->l_count) % LIVE_QUEUE] = m;
+  l->l_bytes += m->m_len;
+  if (++l->l_count == 1
+    && write(l->l_wake[1], "", 1) < 0 && errno != EAGAIN)
+    Log(LOGERROR, "%s, can't wake a player: %s", __FUNCTION__,
+        strerror(errno));
+}
+
+static Lstream *
+FindLstream(const char *name, bool create)
+{
+  Lstream *ls;
+
+  for (ls = liveStreams; ls; ls = ls->ls_next)
+    if (!strcmp(ls->ls_name, name))
+      return ls;
+  if (!create || !(ls = calloc(1, sizeof(Lstream))))
+    return NULL;
+  if (!(ls->ls_name = strdup(name)))
+    {
+      free(ls);
+      return NULL;
+    }
+  ls->ls_next = liveStreams;
+  liveStreams = ls;
+  return ls;
+}
+
+/* forgets what late players would be sent, the publisher is gone */
+static void
+ClearLstream(Lstream *ls)
+{
+  CacheLmsg(&ls->ls_meta, NULL);
+  CacheLmsg(&ls->ls_avc, NULL);
+  CacheLmsg(&ls->ls_aac, NULL);
+  CacheLmsg(&ls->ls_key, NULL);
+  ls->ls_video = false;
+}
+
+static void
+PruneLstream(Lstream *ls)
+{
+  Lstream **p;
+
+  if (ls->ls_published || ls->ls_subs)
+    return;
+  for (p = &liveStreams; *p != ls; p = &(*p)->ls_next)
+    ;
+  *p = ls->ls_next;
+  ClearLstream(ls);
+  free(ls->ls_name);
+  free(ls);
+}
+
+/* queues a status message for all the players */
+static void
+NotifyLive(Lstream *ls, const AVal *code)
+{
+  RTMPPacket packet;
+  char pbuf[512];
+  AVal name;
+  Lsub *l;
+  Lmsg *m;
+
+  STR2AVAL(name, ls->ls_name);
+  StatusPacket(&packet, pbuf, LIVE_STREAM, &av_status, code, &name);
+  if (!(m = NewLmsg(&packet)))
+    return;
+  m->m_header = true;
+  for (l = ls->ls_subs; l; l = l->l_next)
+    QueueLmsg(l, m);
+  ReleaseLmsg(m);
+}
+
+static void
+StopLive(STREAMING_SESSION *s)
+{
+  Lstream *ls = s->live;
+
+  if (!ls)
+    return;
+  pthread_mutex_lock(&liveLock);
+  if (s->sub)
+    {
+      Lsub **p;
+
+      for (p = &ls->ls_subs; *p != s->sub; p = &(*p)->l_next)
+        ;
+      *p = s->sub->l_next;
+      FreeLsub(s->sub);
+      s->sub = NULL;
+    }
+  else
+    {
+      Log(LOGINFO, "%s, %s unpublished", __FUNCTION__, ls->ls_name);
+      ls->ls_published = false;
+      ClearLstream(ls);
+      NotifyLive(ls, &av_NetStream_Play_UnpublishNotify);
+    }
+  PruneLstream(ls);
+  pthread_mutex_unlock(&liveLock);
+  s->live = NULL;
+}
+
+/* Plays the live stream of the playpath, if it is being published, or
+ * if wait, from when it is. Returns false if it isn't played.
+ */
+static bool
+PlayLive(STREAMING_SESSION *s, RTMP *r, uint32_t stream, bool wait)
+{
+  char name[512];
+  Lstream *ls;
+  Lsub *l;
+
+  if (!LiveName(r, &r->Link.playpath, name, sizeof(name)))
+    return false;
+  StopPlay(s);
+  StopLive(s);
+  if (!(l = calloc(1, sizeof(Lsub))))
+    return false;
+  if (pipe(l->l_wake) < 0)
+    {
+      Log(LOGERROR, "%s, pipe: %s", __FUNCTION__, strerror(errno));
+      free(l);
+      return false;
+    }
+  fcntl(l->l_wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(l->l_wake[1], F_SETFL, O_NONBLOCK);
+
+  pthread_mutex_lock(&liveLock);
+  ls = FindLstream(name, wait);
+  if (!ls || !(ls->ls_published || wait))
+    {
+      pthread_mutex_unlock(&liveLock);
+      FreeLsub(l);
+      return false;
+    }
+  l->l_next = ls->ls_subs;
+  ls->ls_subs = l;
+  if (ls->ls_meta)
+    QueueLmsg(l, ls->ls_meta);
+  if (ls->ls_avc)
+    QueueLmsg(l, ls->ls_avc);
+  if (ls->ls_aac)
+    QueueLmsg(l, ls->ls_aac);
+  if (ls->ls_key)
+    QueueLmsg(l, ls->ls_key);
+  /* what follows the last keyframe is no use without what came between */
+  l->l_skipping = ls->ls_video;
+  s->live = ls;
+  s->sub = l;
+  s->stream = stream;
+  Log(LOGDEBUG, "%s, playing %s%s", __FUNCTION__, name,
+      ls->ls_published ? "" : ", waiting for it");
+  pthread_mutex_unlock(&liveLock);
+
+  /* the chunks are shared, so all players get them the same size */
+  if (r->m_outChunkSize != SERVE_CHUNK)
+    SendChunkSize(r, SERVE_CHUNK);
+  /* StreamBegin */
+  RTMP_SendCtrl(r, 0, stream, 0);
+  SendStatus(r, stream, &av_status, &av_NetStream_Play_Start,
+    &r->Link.playpath);
+  return true;
+}
+
+static void
+StartPublish(STREAMING_SESSION *s, RTMP *r, AMFObject *obj, uint32_t stream)
+{
+  char name[512];
+  AVal path = {0};
+  Lstream *ls = NULL;
+
+  StopPlay(s);
+  StopLive(s);
+  if (obj->o_num > 3)
+    AMFProp_GetString(AMF_GetProp(obj, NULL, 3), &path);
+  if (LiveName(r, &path, name, sizeof(name)))
+    {
+      pthread_mutex_lock(&liveLock);
+      ls = FindLstream(name, true);
+      if (ls && ls->ls_published)
+        ls = NULL;		/* someone else's */
+      else if (ls)
+        {
+          ls->ls_published = true;
+          NotifyLive(ls, &av_NetStream_Play_PublishNotify);
+        }
+      pthread_mutex_unlock(&liveLock);
+    }
+  if (!ls)
+    {
+      Log(LOGWARNING, "%s, can't publish %.*s", __FUNCTION__, path.av_len,
+          path.av_val);
+      SendStatus(r, stream, &av_error, &av_NetStream_Publish_BadName, &path);
+      return;
+    }
+  Log(LOGINFO, "%s, %s published", __FUNCTION__, name);
+  s->live = ls;
+  s->liveStream = stream;
+  SendStatus(r, stream, &av_status, &av_NetStream_Publish_Start, &path);
+}
+
+/* Relays a message of the publisher. It is chunked here, once, and the
+ * chunks queued for every player. */
+static void
+PublishPacket(STREAMING_SESSION *s, RTMPPacket *packet)
+{
+  Lstream *ls = s->live;
+  RTMPPacket lp;
+  Lsub *l;
+  Lmsg *m;
+  char *body = packet->m_body;
+  uint32_t size = packet->m_nBodySize;
+  uint8_t type = packet->m_packetType;
+  bool meta = false, avc = false, aac = false, key = false;
+
+  if (!ls || s->sub || !size)
+    return;
+  if (type == 0x12)
+    {
+      /* players get the metadata without what it is to be set with */
+      if (size > 3 + av_setDataFrame.av_len && body[0] == AMF_STRING
+        && AMF_DecodeInt16(body + 1) == av_setDataFrame.av_len
+        && !memcmp(body + 3, av_setDataFrame.av_val, av_setDataFrame.av_len))
+        {
+          body += 3 + av_setDataFrame.av_len;
+          size -= 3 + av_setDataFrame.av_len;
+        }
+      meta = size > 3 + av_onMetaData.av_len && body[0] == AMF_STRING
+        && AMF_DecodeInt16(body + 1) == av_onMetaData.av_len
+        && !memcmp(body + 3, av_onMetaData.av_val, av_onMetaData.av_len);
+    }
+  else if (type == 0x09)
+    {
+      avc = (body[0] & 0x0f) == 7 && size > 1 && body[1] == 0;
+      key = !avc && (body[0] >> 4) == 1;
+    }
+  else if (type == 0x08)
+    aac = (body[0] >> 4) == 10 && size > 1 && body[1] == 0;
+
+  memset(&lp, 0, sizeof(lp));
+  lp.m_headerType = 0; /* RTMP_PACKET_SIZE_LARGE */
+  lp.m_packetType = type;
+  if (type == 0x08)
+    lp.m_nChannel = 0x04;
+  else if (type == 0x09)
+    lp.m_nChannel = 0x06;
+  else
+    lp.m_nChannel = 0x05;
+  lp.m_nInfoField1 = packet->m_nTimeStamp;
+  lp.m_nInfoField2 = LIVE_STREAM;
+  lp.m_nBodySize = size;
+  lp.m_body = body;
+  if (!(m = NewLmsg(&lp)))
+    {
+      Log(LOGERROR, "%s, out of memory for %u bytes", __FUNCTION__, size);
+      return;
+    }
+  m->m_header = meta || avc || aac;
+
+  pthread_mutex_lock(&liveLock);
+  if (type == 0x09)
+    ls->ls_video = true;
+  m->m_key = key || (type == 0x08 && !aac && !ls->ls_video);
+  if (meta)
+    CacheLmsg(&ls->ls_meta, m);
+  else if (avc)
+    CacheLmsg(&ls->ls_avc, m);
+  else if (aac)
+    CacheLmsg(&ls->ls_aac, m);
+  else if (key)
+    CacheLmsg(&ls->ls_key, m);
+  for (l = ls->ls_subs; l; l = l->l_next)
+    QueueLmsg(l, m);
+  ReleaseLmsg(m);
+  pthread_mutex_unlock(&liveLock);
+}
+
+/* Writes out what is queued for a live player, at most LIVE_BATCH
+ * messages, or if there is nothing, waits for something to write or
+ * read. Returns false if the player is gone.
+ */
+static bool
+SendLive(STREAMING_SESSION *s, RTMP *r)
+{
+  Lsub *l = s->sub;
+  Lmsg *batch[LIVE_BATCH];
+  struct iovec iov[2 * LIVE_BATCH];
+  char hdrs[LIVE_BATCH][LIVE_HEADER];
+  int i, n = 0, niov = 0;
+  bool ret;
+
+  pthread_mutex_lock(&liveLock);
+  for (; n < LIVE_BATCH && l->l_count; n++)
+    {
+      batch[n] = l->l_queue[l->l_head];
+      l->l_head = (l->l_head + 1) % LIVE_QUEUE;
+      l->l_count--;
+      l->l_bytes -= batch[n]->m_len;
+    }
+  pthread_mutex_unlock(&liveLock);
+
+  if (!n)
+    {
+      struct pollfd pfd[2];
+      char buf[64];
+
+      pfd[0].fd = r->m_socket;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = l->l_wake[0];
+      pfd[1].events = POLLIN;
+      if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+        return false;
+      while (read(l->l_wake[0], buf, sizeof(buf)) > 0)
+        ;
+      return true;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      char *data = batch[i]->m_data;
+      int len = batch[i]->m_len;
+
+      if (s->stream != LIVE_STREAM)
+        {
+          /* the player's stream id, in a copy of the header */
+          memcpy(hdrs[i], data, LIVE_HEADER);
+          hdrs[i][8] = s->stream & 0xff;
+          hdrs[i][9] = (s->stream >> 8) & 0xff;
+          hdrs[i][10] = (s->stream >> 16) & 0xff;
+          hdrs[i][11] = s->stream >> 24;
+          iov[niov].iov_base = hdrs[i];
+          iov[niov++].iov_len = LIVE_HEADER;
+          data += LIVE_HEADER;
+          len -= LIVE_HEADER;
+        }
+      iov[niov].iov_base = data;
+      iov[niov++].iov_len = len;
+    }
+  ret = RTMP_SendRaw(r, iov, niov);
+
+  pthread_mutex_lock(&liveLock);
+  for (i = 0; i < n; i++)
+    ReleaseLmsg(batch[i]);
+  pthread_mutex_unlock(&liveLock);
+  return ret;
+}
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 int
-ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int offset)
+ServeInvoke(STREAMING_SESSION *s, RTMP * r, RTMPPacket *packet, unsigned int offset)
 {
   const char *body;
   unsigned int nBodySize;
@@ -318,7 +1473,7 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
       AVal pname, pval;
       int i;
 
-      server->connect = packet->m_body;
+      s->connect = packet->m_body;
       packet->m_body = NULL;
 
       AMFProp_GetObject(AMF_GetProp(&obj, NULL, 2), &cobj);
@@ -376,15 +1531,69 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
           memcpy(r->Link.extras.o_props, obj.o_props+3, i*sizeof(AMFObjectProperty));
           obj.o_num = 3;
         }
+      if (s->server->media)
+        SendChunkSize(r, SERVE_CHUNK);
       SendConnectResult(r, txn);
     }
   else if (AVMATCH(&method, &av_createStream))
     {
-      SendResultNumber(r, txn, ++server->streamID);
+      SendResultNumber(r, txn, ++s->streamID);
     }
   else if (AVMATCH(&method, &av_getStreamLength))
     {
-      SendResultNumber(r, txn, 10.0);
+      char path[PATH_MAX];
+      AVal playpath = {0};
+      Vfile *v = NULL;
+      double length = 10.0;
+
+      if (obj.o_num > 3)
+        AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &playpath);
+      if (VodPath(s->server, &playpath, path, sizeof(path))
+        && (v = OpenVfile(path)))
+        {
+          length = v->v_duration / 1000.0;
+          ReleaseVfile(v);
+        }
+      SendResultNumber(r, txn, length);
+    }
+  else if (AVMATCH(&method, &av_pause))
+    {
+      bool pause = obj.o_num > 3
+        && AMFProp_GetBoolean(AMF_GetProp(&obj, NULL, 3));
+      double stamp = 0;
+
+      if (obj.o_num > 4)
+        stamp = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 4));
+      if (s->file && pause && !s->paused)
+        {
+          s->paused = true;
+          SendStatus(r, s->stream, &av_status, &av_NetStream_Pause_Notify,
+            &r->Link.playpath);
+        }
+      else if (s->file && !pause && s->paused)
+        {
+          /* from the keyframe before where the player is, it skips what
+           * it has */
+          s->paused = false;
+          SendStatus(r, s->stream, &av_status, &av_NetStream_Unpause_Notify,
+            &r->Link.playpath);
+          if (!SeekPlay(s, r, s->base + (stamp > 0 ? stamp : 0), false))
+            EndPlay(s, r, true);
+        }
+    }
+  else if (AVMATCH(&method, &av_publish))
+    {
+      StartPublish(s, r, &obj, packet->m_nInfoField2);
+    }
+  else if (AVMATCH(&method, &av_closeStream)
+    || AVMATCH(&method, &av_deleteStream)
+    || AVMATCH(&method, &av_FCUnpublish))
+    {
+      if (s->live && !s->sub)
+        SendStatus(r, s->liveStream, &av_status,
+          &av_NetStream_Unpublish_Success, NULL);
+      StopPlay(s);
+      StopLive(s);
     }
   else if (AVMATCH(&method, &av_play))
     {
@@ -393,6 +1602,26 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
       r->Link.seekTime = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 4));
       if (obj.o_num > 5)
         r->Link.length = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 5));
+      double start = 0;
+
+      if (obj.o_num > 4 && AMFProp_GetType(&obj.o_props[4]) == AMF_NUMBER)
+        start = AMFProp_GetNumber(&obj.o_props[4]);
+      /* what is published goes first, unless there is a seek; -1 is
+       * live only, -2 live or recorded, both wait for a publisher */
+      if (start <= 0 && PlayLive(s, r, packet->m_nInfoField2, false))
+        {
+          AMF_Reset(&obj);
+          return 0;
+        }
+      if (s->server->media)
+        {
+          if (!(start != -1000 && StartPlay(s, r, &obj, packet->m_nInfoField2))
+            && !(start < 0 && PlayLive(s, r, packet->m_nInfoField2, true)))
+            SendStatus(r, packet->m_nInfoField2, &av_error,
+              &av_NetStream_Play_StreamNotFound, &r->Link.playpath);
+          AMF_Reset(&obj);
+          return 0;
+        }
       if (r->Link.tcUrl.av_len)
         {
           printf("\nflvstreamer -r \"%s\"", r->Link.tcUrl.av_val);
@@ -416,8 +1645,8 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
             r->Link.playpath.av_len, r->Link.playpath.av_val);
           fflush(stdout);
         }
-      pc.m_body = server->connect;
-      server->connect = NULL;
+      pc.m_body = s->connect;
+      s->connect = NULL;
       RTMPPacket_Free(&pc);
       ret = 1;
     }
@@ -426,7 +1655,7 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
 }
 
 int
-ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
+ServePacket(STREAMING_SESSION *s, RTMP *r, RTMPPacket *packet)
 {
   int ret = 0;
 
@@ -437,7 +1666,8 @@ ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
     {
     case 0x01:
       // chunk size
-//      HandleChangeChunkSize(r, packet);
+      if (packet->m_nBodySize >= 4)
+        r->m_inChunkSize = AMF_DecodeInt32(packet->m_body);
       break;
 
     case 0x03:
@@ -462,11 +1692,13 @@ ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
     case 0x08:
       // audio data
       //Log(LOGDEBUG, "%s, received: audio %lu bytes", __FUNCTION__, packet.m_nBodySize);
+      PublishPacket(s, packet);
       break;
 
     case 0x09:
       // video data
       //Log(LOGDEBUG, "%s, received: video %lu bytes", __FUNCTION__, packet.m_nBodySize);
+      PublishPacket(s, packet);
       break;
 
     case 0x0F:			// flex stream send
@@ -491,11 +1723,12 @@ ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
 
 	   obj.Dump(); */
 
-	ServeInvoke(server, r, packet, 1);
+	ServeInvoke(s, r, packet, 1);
 	break;
       }
     case 0x12:
       // metadata (notify)
+      PublishPacket(s, packet);
       break;
 
     case 0x13:
@@ -508,7 +1741,7 @@ ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
 	  packet->m_nBodySize);
       //LogHex(packet.m_body, packet.m_nBodySize);
 
-      if (ServeInvoke(server, r, packet, 0))
+      if (ServeInvoke(s, r, packet, 0))
         RTMP_Close(r);
       break;
 
@@ -547,32 +1780,35 @@ controlServerThread(void *unused)
 }
 
 
-void doServe(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-  int sockfd	// client connection socket
-  )
+TFTYPE
+doServe(void *arg)
 {
-  server->state = STREAMING_IN_PROGRESS;
+  STREAMING_SESSION *s = arg;
+  int sockfd = s->socket;
 
   RTMP rtmp = { 0 };		/* our session with the real client */
   RTMPPacket packet = { 0 };
 
   // timeout for http requests
-  fd_set fds;
+  struct pollfd pfd;
   struct timeval tv;
 
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
+  pfd.fd = sockfd;
+  pfd.events = POLLIN;
 
-  FD_ZERO(&fds);
-  FD_SET(sockfd, &fds);
-
-  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
+  if (poll(&pfd, 1, 5000) <= 0)
     {
-      Log(LOGERROR, "Request timeout/select failed, ignoring request");
+      Log(LOGERROR, "Request timeout/poll failed, ignoring request");
+      closesocket(sockfd);
       goto quit;
     }
   else
     {
+      /* a player that stops reading is given up on */
+      memset(&tv, 0, sizeof(struct timeval));
+      tv.tv_sec = defaultRTMPRequest.timeout;
+      setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &tv, sizeof(tv));
+
       RTMP_Init(&rtmp);
       rtmp.m_socket = sockfd;
       if (!RTMP_Serve(&rtmp))
@@ -581,16 +1817,40 @@ void doServe(STREAMING_SERVER * server,	// server socket and state (our listenin
           goto cleanup;
         }
     }
-  while (RTMP_IsConnected(&rtmp) && RTMP_ReadPacket(&rtmp, &packet))
+  while (RTMP_IsConnected(&rtmp))
     {
+      /* playing goes on as long as the player has nothing to say */
+      if (s->sub && !Pending(&rtmp))
+        {
+          if (!SendLive(s, &rtmp))
+            break;
+          continue;
+        }
+      if (s->playing && !s->paused && !Pending(&rtmp))
+        {
+          if (!SendTags(s, &rtmp))
+            break;
+          continue;
+        }
+      if (!RTMP_ReadPacket(&rtmp, &packet))
+        break;
       if (!RTMPPacket_IsReady(&packet))
         continue;
-      ServePacket(server, &rtmp, &packet);
+      ServePacket(s, &rtmp, &packet);
       RTMPPacket_Free(&packet);
     }
 
 cleanup:
   LogPrintf("Closing connection... ");
+  StopPlay(s);
+  StopLive(s);
+  if (s->connect)
+    {
+      RTMPPacket pc = {0};
+      pc.m_body = s->connect;
+      RTMPPacket_Free(&pc);
+      AMF_Reset(&rtmp.Link.extras);
+    }
   RTMP_Close(&rtmp);
   /* Should probably be done by RTMP_Close() ... */
   rtmp.Link.playpath.av_val = NULL;
@@ -603,10 +1863,8 @@ cleanup:
   LogPrintf("done!\n\n");
 
 quit:
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
-
-  return;
+  free(s);
+  TFRET();
 }
 
 TFTYPE
@@ -637,8 +1895,20 @@ serverThread(void *arg)
 	      inet_ntoa(addr.sin_addr));
 #endif
 	  /* Create a new thread and transfer the control to that */
-	  doServe(server, sockfd);
-	  Log(LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+	  STREAMING_SESSION *s = calloc(1, sizeof(STREAMING_SESSION));
+	  if (!s)
+	    {
+	      Log(LOGERROR, "%s: out of memory", __FUNCTION__);
+	      closesocket(sockfd);
+	      continue;
+	    }
+	  s->server = server;
+	  s->socket = sockfd;
+	  if (!ThreadCreate(doServe, s))
+	    {
+	      closesocket(sockfd);
+	      free(s);
+	    }
 	}
       else
 	{
@@ -650,7 +1920,7 @@ serverThread(void *arg)
 }
 
 STREAMING_SERVER *
-startStreaming(const char *address, int port)
+startStreaming(const char *address, int port, const char *media)
 {
   struct sockaddr_in addr;
   int sockfd, tmp;
@@ -679,7 +1949,7 @@ startStreaming(const char *address, int port)
       return 0;
     }
 
-  if (listen(sockfd, 10) == -1)
+  if (listen(sockfd, 128) == -1)
     {
       Log(LOGERROR, "%s, listen failed", __FUNCTION__);
       closesocket(sockfd);
@@ -688,6 +1958,7 @@ startStreaming(const char *address, int port)
 
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
+  server->media = media;
 
   ThreadCreate(serverThread, server);
 
@@ -739,14 +2010,40 @@ main(int argc, char **argv)
 
   char *rtmpStreamingDevice = DEFAULT_HTTP_STREAMING_DEVICE;	// streaming device, default 0.0.0.0
   int nRtmpStreamingPort = 1935;	// port
+  char *media = NULL;		/* directory of the files played */
+  int opt;
 
   LogPrintf("RTMP Server %s\n", FLVSTREAMER_VERSION);
   LogPrintf("(c) 2010 Andrej Stepanchuk, Howard Chu; license: GPL\n\n");
 
   debuglevel = LOGINFO;
 
-  if (argc > 1 && !strcmp(argv[1], "-z"))
-    debuglevel = LOGALL;
+  while ((opt = getopt(argc, argv, "zd:p:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'z':
+	  debuglevel = LOGALL;
+	  break;
+	case 'd':
+	  media = optarg;
+	  break;
+	case 'p':
+	  nRtmpStreamingPort = atoi(optarg);
+	  if (nRtmpStreamingPort <= 0 || nRtmpStreamingPort > 65535)
+	    {
+	      Log(LOGERROR, "Invalid port: %s", optarg);
+	      return RD_FAILED;
+	    }
+	  break;
+	default:
+	  LogPrintf("Usage: %s [-z] [-d dir] [-p port]\n", argv[0]);
+	  LogPrintf("  -d dir   play the FLV files in dir, a playpath of foo is dir/foo.flv\n");
+	  LogPrintf("  -p port  listen on port instead of 1935\n");
+	  LogPrintf("  -z       debug logging\n");
+	  return RD_FAILED;
+	}
+    }
 
   // init request
   memset(&defaultRTMPRequest, 0, sizeof(RTMP_REQUEST));
@@ -776,13 +2073,15 @@ main(int argc, char **argv)
 
   // start http streaming
   if ((rtmpServer =
-       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort)) == 0)
+       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort, media)) == 0)
     {
       Log(LOGERROR, "Failed to start RTMP server, exiting!");
       return RD_FAILED;
     }
   LogPrintf("Streaming on rtmp://%s:%d\n", rtmpStreamingDevice,
 	    nRtmpStreamingPort);
+  if (media)
+    LogPrintf("Playing the files in %s\n", media);
 
   while (rtmpServer->state != STREAMING_STOPPED)
     {
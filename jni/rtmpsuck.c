@@ -33,6 +33,10 @@
 
 #include <assert.h>
 
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
 #include "rtmp.h"
 #include "parseurl.h"
 
@@ -40,6 +44,7 @@
 
 #ifdef linux
 #include <linux/netfilter_ipv4.h>
+#include <linux/sockios.h>
 #endif
 
 #define RD_SUCCESS		0
@@ -62,6 +67,25 @@
 #define	CleanupSockets()
 #endif
 
+#define MAX_EVENTS	64	/* events taken per epoll_wait */
+#define MAX_FILLS	16	/* socket reads per wakeup, so one session can't hold up the others */
+#define MAX_BATCH	64	/* packets per gathered write */
+#define QUEUE_BYTES	(512*1024)	/* held for a side that can't keep up, then the other waits */
+#define RECORD_BYTES	(32*1024*1024)	/* waiting for the disk, then tags are dropped */
+#define RECORD_LAG	1000	/* ms a tag may wait for the disk before it's reported */
+#define CACHE_CHUNK	4096	/* chunk size for playing back recordings */
+#define FLV_HEADER_SIZE	13	/* with the first prevTagSize */
+#define MAX_DUPS	256	/* names tried for a playpath recorded already */
+
+/* the server state is read by the event loop and the setup threads */
+#ifdef __ATOMIC_SEQ_CST
+#define STATE_GET(v)		__atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define STATE_SET(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#else
+#define STATE_GET(v)		(__sync_synchronize(), (v))
+#define STATE_SET(v, x)	do { __sync_synchronize(); (v) = (x); __sync_synchronize(); } while (0)
+#endif
+
 enum
 {
   STREAMING_ACCEPTING,
@@ -70,35 +94,161 @@ enum
   STREAMING_STOPPED
 };
 
+enum
+{
+  SESSION_SETUP,	/* handshake and origin connect, on a thread of its own */
+  SESSION_RELAYING,	/* in the event loop */
+  SESSION_CLOSED	/* to be freed once the current events are handled */
+};
+
+/* what a recording is good for, see Clist */
+enum
+{
+  CACHE_RECORDING,	/* being written */
+  CACHE_COMPLETE,	/* the whole stream, played back instead of the origin */
+  CACHE_PARTIAL,	/* the start of a recorded stream, the origin has the rest */
+  CACHE_UNUSABLE	/* gaps, write errors or a live stream */
+};
+
+/* what an epoll event is for */
+enum
+{
+  HANDLE_LISTEN,
+  HANDLE_WAKE,
+  HANDLE_CLIENT,
+  HANDLE_ORIGIN
+};
+
+/* A recording a later player of the same tcUrl and playpath may get
+ * instead of the origin. The entries live as long as the server, the
+ * recorder sets c_state once it closed the file.
+ */
+typedef struct Clist
+{
+  struct Clist *c_next;
+  AVal c_tcUrl, c_playpath;
+  char *c_file;
+  int c_state;
+  uint32_t c_stamp;	/* of the last tag written */
+  off_t c_size;		/* of the file */
+} Clist;
+
 typedef struct Flist
 {
   struct Flist *f_next;
   FILE *f_file;
   AVal f_path;
+  Clist *f_cache;	/* if it may be played back later */
+  bool f_complete;	/* the origin got to the end */
+  bool f_gap;		/* tags were dropped */
 } Flist;
 
 typedef struct Plist
 {
   struct Plist *p_next;
+  int p_refs;		/* the queue it's in and the recorder */
   RTMPPacket p_pkt;
 } Plist;
 
+/* a tag for the recorder to write, or with no r_pkt a file to close */
+typedef struct Rlist
+{
+  struct Rlist *r_next;
+  FILE *r_file;
+  Plist *r_pkt;
+  uint32_t r_queued;	/* when it was handed over */
+  Clist *r_cache;
+  int r_state;		/* for r_cache once the file is closed */
+} Rlist;
+
+typedef struct STREAMING_SERVER STREAMING_SERVER;
+typedef struct STREAMING_SESSION STREAMING_SESSION;
+
 typedef struct
 {
-  int socket;
+  int kind;
+  STREAMING_SESSION *session;	/* for HANDLE_CLIENT and HANDLE_ORIGIN */
+} STREAMING_HANDLE;
+
+/* A player and the origin it asked for. Chunk sizes, pausing and the
+ * recordings are kept per session, any number of them are relayed at
+ * once.
+ */
+struct STREAMING_SESSION
+{
+  STREAMING_SESSION *prev, *next;
+  STREAMING_SERVER *server;
   int state;
-  uint32_t stamp;
-  RTMP rs;
-  RTMP rc;
-  Plist *rs_pkt[2];	/* head, tail */
-  Plist *rc_pkt[2];	/* head, tail */
+  uint32_t active;	/* last time either side had something */
+  uint32_t pauseTime;	/* when the origin was asked to pause */
+  bool pausing;		/* waiting to resume the origin */
+  bool paused;		/* resumed, skipping what it sends again */
+  RTMP rs;		/* the player */
+  RTMP rc;		/* the origin */
+  RTMPPacket ps, pc;	/* being read from each */
+  STREAMING_HANDLE client, origin;
+  uint32_t clientEvents, originEvents;	/* what epoll watches for */
+  Plist *rs_pkt[2];	/* head, tail: from the player, for the origin */
+  Plist *rc_pkt[2];	/* head, tail: from the origin, for the player */
+  unsigned int rs_bytes, rc_bytes;	/* held in each */
   Flist *f_head, *f_tail;
   Flist *f_cur;
+  AVal tcUrl;		/* a copy, the connect packet is gone by the play */
+  FILE *cache;		/* a recording played back instead of the origin */
+  Clist *playing;	/* what it is */
+  off_t cacheLeft;	/* of its tags still to send */
+  uint32_t cacheStream;	/* the player's stream */
+  uint32_t resumeStamp;	/* what the origin sends up to here was played back */
+  bool resuming;	/* dropping the origin's media up to resumeStamp */
+  bool spliced;		/* the origin follows a playback, its headers go out in full */
+};
 
-} STREAMING_SERVER;
+/* Writes the recordings on a thread of its own, so relaying never waits
+ * on the disk. The tags share the packets forwarded to the players. The
+ * lock also guards the recordings that may be played back.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t written;	/* a batch is done */
+  Rlist *head, *tail;
+  uint32_t batches;		/* written so far */
+  unsigned int bytes;		/* of the tags waiting */
+  uint32_t lag;			/* ms the slowest tag waited since the last report */
+  uint32_t writing;		/* when the oldest tag being written was queued */
+  bool busy;
+  uint32_t dropped;		/* tags the disk couldn't keep up with */
+  uint32_t reported;		/* dropped as of the last report */
+  bool stop, stopped;
+  Clist *recordings;		/* what may be played back, see Clist */
+} STREAMING_RECORDER;
+
+/* Relays all sessions from one epoll loop, where the sockets are
+ * non-blocking. The handshake and the connect to the origin do block,
+ * so each session does those on a thread of its own first.
+ */
+struct STREAMING_SERVER
+{
+  int socket;
+  int state;
+  int epfd;
+  int wake[2];			/* pipe to break out of epoll_wait */
+  STREAMING_HANDLE listen, waker;
+  STREAMING_SESSION *dead;	/* closed, freed after the current events */
+
+  pthread_mutex_t lock;		/* for the lists below, the recordings, stopped and writing to wake */
+  STREAMING_SESSION *sessions;	/* being relayed */
+  STREAMING_SESSION *setup;	/* on setup threads */
+  STREAMING_SESSION *ready;	/* set up, for the loop to take */
+  bool stopped;			/* the loop has exited */
+
+  STREAMING_RECORDER recorder;
+};
 
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
 
+
 STREAMING_SERVER *startStreaming(const char *address, int port);
 void stopStreaming(STREAMING_SERVER * server);
 
@@ -140,6 +290,8 @@ SAVC(code);
 SAVC(secureToken);
 SAVC(onStatus);
 SAVC(close);
+SAVC(status);
+SAVC(error);
 static const AVal av_NetStream_Failed = AVC("NetStream.Failed");
 static const AVal av_NetStream_Play_Failed = AVC("NetStream.Play.Failed");
 static const AVal av_NetStream_Play_StreamNotFound =
@@ -152,9 +304,14 @@ static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
 
 static const char *cst[] = { "client", "server" };
 
+static bool PlayRecording(STREAMING_SESSION *session, RTMPPacket *pack,
+                          AMFObject *obj, Clist **cl);
+static bool RecordingUses(STREAMING_SERVER *server, const char *file, Clist *cl);
+static void AddRecording(STREAMING_SESSION *session, FILE *out, Clist *cl);
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 int
-ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *body)
+ServeInvoke(STREAMING_SESSION *session, int which, RTMPPacket *pack, const char *body)
 {
   int ret = 0, nRes;
   int nBodySize = pack->m_nBodySize;
@@ -201,17 +358,17 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
             }
           if (AVMATCH(&pname, &av_app))
             {
-              server->rc.Link.app = pval;
+              session->rc.Link.app = pval;
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_flashVer))
             {
-              server->rc.Link.flashVer = pval;
+              session->rc.Link.flashVer = pval;
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_swfUrl))
             {
-              server->rc.Link.swfUrl = pval;
+              session->rc.Link.swfUrl = pval;
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_tcUrl))
@@ -219,7 +376,10 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
               char *r1 = NULL, *r2;
               int len;
 
-              server->rc.Link.tcUrl = pval;
+              session->rc.Link.tcUrl = pval;
+              session->tcUrl.av_val = malloc(pval.av_len);
+              memcpy(session->tcUrl.av_val, pval.av_val, pval.av_len);
+              session->tcUrl.av_len = pval.av_len;
               if ((pval.av_val[0] | 0x40) == 'r' &&
                   (pval.av_val[1] | 0x40) == 't' &&
                   (pval.av_val[2] | 0x40) == 'm' &&
@@ -227,12 +387,12 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
                 {
                   if (pval.av_val[4] == ':')
                     {
-                      server->rc.Link.protocol = RTMP_PROTOCOL_RTMP;
+                      session->rc.Link.protocol = RTMP_PROTOCOL_RTMP;
                       r1 = pval.av_val+7;
                     }
                   else if ((pval.av_val[4] | 0x40) == 'e' && pval.av_val[5] == ':')
                     {
-                      server->rc.Link.protocol = RTMP_PROTOCOL_RTMPE;
+                      session->rc.Link.protocol = RTMP_PROTOCOL_RTMPE;
                       r1 = pval.av_val+8;
                     }
                   r2 = strchr(r1, '/');
@@ -240,37 +400,37 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
                   r2 = malloc(len+1);
                   memcpy(r2, r1, len);
                   r2[len] = '\0';
-                  server->rc.Link.hostname = (const char *)r2;
-                  r1 = strrchr(server->rc.Link.hostname, ':');
+                  session->rc.Link.hostname = (const char *)r2;
+                  r1 = strrchr(session->rc.Link.hostname, ':');
                   if (r1)
                     {
                       *r1++ = '\0';
-                      server->rc.Link.port = atoi(r1);
+                      session->rc.Link.port = atoi(r1);
                     }
                   else
                     {
-                      server->rc.Link.port = 1935;
+                      session->rc.Link.port = 1935;
                     }
                 }
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_pageUrl))
             {
-              server->rc.Link.pageUrl = pval;
+              session->rc.Link.pageUrl = pval;
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_audioCodecs))
             {
-              server->rc.m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
+              session->rc.m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
             }
           else if (AVMATCH(&pname, &av_videoCodecs))
             {
-              server->rc.m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
+              session->rc.m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
             }
           else if (AVMATCH(&pname, &av_objectEncoding))
             {
-              server->rc.m_fEncoding = cobj.o_props[i].p_vu.p_number;
-              server->rc.m_bSendEncoding = true;
+              session->rc.m_fEncoding = cobj.o_props[i].p_vu.p_number;
+              session->rc.m_bSendEncoding = true;
             }
           /* Dup'd a string we didn't recognize? */
           if (pval.av_val)
@@ -278,23 +438,26 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
         }
       if (obj.o_num > 3)
         {
-          server->rc.Link.authflag = AMFProp_GetBoolean(&obj.o_props[3]);
+          session->rc.Link.authflag = AMFProp_GetBoolean(&obj.o_props[3]);
           if (obj.o_num > 4)
           {
-            AMFProp_GetString(&obj.o_props[4], &server->rc.Link.auth);
+            AMFProp_GetString(&obj.o_props[4], &session->rc.Link.auth);
           }
         }
 
-      if (!RTMP_Connect(&server->rc, pack))
+      if (!RTMP_Connect(&session->rc, pack))
         {
           /* failed */
           return 1;
         }
-      server->rc.m_bSendCounter = false;
+      session->rc.m_bSendCounter = false;
     }
   else if (AVMATCH(&method, &av_play))
     {
+      STREAMING_SERVER *server = session->server;
+      STREAMING_SESSION *other;
       Flist *fl;
+      Clist *cl;
       AVal av;
       FILE *out;
       char *file, *p, *q;
@@ -303,20 +466,36 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
          0x00, 0x00, 0x00, 0x09,
          0x00, 0x00, 0x00, 0x00      // first prevTagSize=0
        };
-      int count = 0, flen;
+      int count = 0, tries;
 
-      server->rc.m_stream_id = pack->m_nInfoField2;
+      session->rc.m_stream_id = pack->m_nInfoField2;
       AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &av);
-      server->rc.Link.playpath = av;
+      session->rc.Link.playpath = av;
       if (!av.av_val)
         goto out;
 
-      /* check for duplicates */
-      for (fl = server->f_head; fl; fl=fl->f_next)
+      pthread_mutex_lock(&server->lock);
+      /* a recording may stand in for the origin */
+      if (PlayRecording(session, pack, &obj, &cl))
+        {
+          pthread_mutex_unlock(&server->lock);
+          goto out;
+        }
+
+      /* check for duplicates, the other sessions record to the same
+       * directory */
+      for (fl = session->f_head; fl; fl=fl->f_next)
         {
           if (AVMATCH(&av, &fl->f_path))
             count++;
         }
+      for (other = server->sessions; other; other = other->next)
+        if (other != session)
+          for (fl = other->f_head; fl; fl=fl->f_next)
+            {
+              if (AVMATCH(&av, &fl->f_path))
+                count++;
+            }
       /* strip trailing URL parameters */
       q = memchr(av.av_val, '?', av.av_len);
       if (q)
@@ -336,44 +515,57 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
           av.av_val++;
           av.av_len--;
         }
-      flen = av.av_len;
-      /* hope there aren't more than 255 dups */
-      if (count)
-        flen += 2;
-      file = malloc(flen+1);
-
-      memcpy(file, av.av_val, av.av_len);
-      if (count)
-        sprintf(file+av.av_len, "%02x", count);
+      /* with room for any count in hex */
+      file = malloc(av.av_len + sizeof(count) * 2 + 1);
+      for (tries = 0; file && tries < MAX_DUPS; tries++, count++)
+        {
+          memcpy(file, av.av_val, av.av_len);
+          if (count)
+            sprintf(file+av.av_len, "%02x", count);
+          else
+            file[av.av_len] = '\0';
+          for (p=file; *p; p++)
+            if (*p == ':')
+              *p = '_';
+          /* nor over a recording that may be played back */
+          if (!RecordingUses(server, file, cl))
+            break;
+        }
+      if (file && tries == MAX_DUPS)
+        {
+          Log(LOGERROR, "%s, no unused name to record %.*s to", __FUNCTION__,
+            av.av_len, av.av_val);
+          free(file);
+          file = NULL;
+        }
+      out = NULL;
+      if (file)
+        {
+          LogPrintf("Playpath: %.*s\nSaving as: %s\n",
+            session->rc.Link.playpath.av_len,
+            session->rc.Link.playpath.av_val, file);
+          out = fopen(file, "wb");
+        }
+      if (cl)
+        {
+          pthread_mutex_lock(&server->recorder.lock);
+          free(cl->c_file);
+          cl->c_file = file;
+          cl->c_state = out ? CACHE_RECORDING : CACHE_UNUSABLE;
+          cl->c_stamp = 0;
+          cl->c_size = 0;
+          pthread_mutex_unlock(&server->recorder.lock);
+        }
       else
-        file[av.av_len] = '\0';
-      for (p=file; *p; p++)
-        if (*p == ':')
-          *p = '_';
-      LogPrintf("Playpath: %.*s\nSaving as: %s\n",
-        server->rc.Link.playpath.av_len, server->rc.Link.playpath.av_val,
-        file);
-      out = fopen(file, "wb");
-      free(file);
+        free(file);
       if (!out)
         ret = 1;
       else
         {
           fwrite(flvHeader, 1, sizeof(flvHeader), out);
-          av = server->rc.Link.playpath;
-          fl = malloc(sizeof(Flist)+av.av_len+1);
-          fl->f_file = out;
-          fl->f_path.av_len = av.av_len;
-          fl->f_path.av_val = (char *)(fl+1);
-          memcpy(fl->f_path.av_val, av.av_val, av.av_len);
-          fl->f_path.av_val[av.av_len] = '\0';
-          fl->f_next = NULL;
-          if (server->f_tail)
-            server->f_tail->f_next = fl;
-          else
-            server->f_head = fl;
-          server->f_tail = fl;
+          AddRecording(session, out, cl);
         }
+      pthread_mutex_unlock(&server->lock);
     }
   else if (AVMATCH(&method, &av_onStatus))
     {
@@ -395,20 +587,23 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       if (AVMATCH(&code, &av_NetStream_Play_Start))
 	{
           /* set up the next stream */
-          if (server->f_cur)
-            server->f_cur = server->f_cur->f_next;
+          if (session->f_cur)
+            session->f_cur = session->f_cur->f_next;
           else
             {
-              for (server->f_cur = server->f_head; server->f_cur &&
-                    !server->f_cur->f_file; server->f_cur = server->f_cur->f_next) ;
+              for (session->f_cur = session->f_head; session->f_cur &&
+                    !session->f_cur->f_file; session->f_cur = session->f_cur->f_next) ;
             }
-	  server->rc.m_bPlaying = true;
+	  session->rc.m_bPlaying = true;
 	}
 
       // Return 1 if this is a Play.Complete or Play.Stop
       if (AVMATCH(&code, &av_NetStream_Play_Complete)
 	  || AVMATCH(&code, &av_NetStream_Play_Stop))
 	{
+	  /* the recording has all of it */
+	  if (which == 1 && session->f_cur)
+	    session->f_cur->f_complete = true;
 	  ret = 1;
 	}
     }
@@ -418,7 +613,7 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
     }
   else if (AVMATCH(&method, &av_close))
     {
-      RTMP_Close(&server->rc);
+      RTMP_Close(&session->rc);
       ret = 1;
     }
 out:
@@ -427,7 +622,7 @@ out:
 }
 
 int
-ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
+ServePacket(STREAMING_SESSION *session, int which, RTMPPacket *packet)
 {
   int ret = 0;
 
@@ -478,7 +673,7 @@ ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
 
     case 0x11:			// flex message
       {
-	ret = ServeInvoke(server, which, packet, packet->m_body + 1);
+	ret = ServeInvoke(session, which, packet, packet->m_body + 1);
 	break;
       }
     case 0x12:
@@ -491,7 +686,7 @@ ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
 
     case 0x14:
       // invoke
-      ret = ServeInvoke(server, which, packet, packet->m_body);
+      ret = ServeInvoke(session, which, packet, packet->m_body);
       break;
 
     case 0x16:
@@ -674,10 +869,12 @@ WriteStream(char **buf,	// target pointer, maybe preallocated
 TFTYPE
 controlServerThread(void *unused)
 {
-  char ich;
+  int ich;
   while (1)
     {
       ich = getchar();
+      if (ich == EOF)
+	break;			/* no terminal, don't spin on it */
       switch (ich)
 	{
 	case 'q':
@@ -693,309 +890,1409 @@ controlServerThread(void *unused)
   TFRET();
 }
 
-void doServe(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-  int sockfd	// client connection socket
-  )
+static void
+SetBlocking(int sockfd, bool blocking)
 {
-  RTMPPacket pc = { 0 }, ps = { 0 };
-  RTMPChunk rk = { 0 };
-  char *buf;
-  unsigned int buflen = 131072;
-  bool paused = false;
+  int flags = fcntl(sockfd, F_GETFL, 0);
 
-  // timeout for http requests
-  fd_set rfds;
-  struct timeval tv;
+  if (blocking)
+    flags &= ~O_NONBLOCK;
+  else
+    flags |= O_NONBLOCK;
+  fcntl(sockfd, F_SETFL, flags);
+}
 
-  server->state = STREAMING_IN_PROGRESS;
+/* a ready packet, taken from packet; NULL if out of memory, and the
+ * packet is dropped */
+static Plist *
+NewPlist(RTMPPacket *packet)
+{
+  Plist *p = malloc(sizeof(Plist));
 
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
+  if (!p)
+    {
+      Log(LOGERROR, "%s, out of memory, dropping a packet of type 0x%02x",
+          __FUNCTION__, packet->m_packetType);
+      RTMPPacket_Free(packet);
+      return NULL;
+    }
+  p->p_next = NULL;
+  p->p_refs = 1;
+  p->p_pkt = *packet;
+  packet->m_body = NULL;
+  return p;
+}
 
-  FD_ZERO(&rfds);
-  FD_SET(sockfd, &rfds);
+static void
+ReleasePlist(Plist *p)
+{
+  if (__sync_sub_and_fetch(&p->p_refs, 1) == 0)
+    {
+      RTMPPacket_Free(&p->p_pkt);
+      free(p);
+    }
+}
 
-  if (select(sockfd + 1, &rfds, NULL, NULL, &tv) <= 0)
+static void
+DropQueue(Plist **q, unsigned int *bytes)
+{
+  while (q[0])
     {
-      Log(LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      Plist *p = q[0];
+      q[0] = p->p_next;
+      ReleasePlist(p);
     }
+  q[1] = NULL;
+  *bytes = 0;
+}
+
+/* hold a packet for the other side */
+static void
+Enqueue(Plist **q, unsigned int *bytes, Plist *p)
+{
+  __sync_add_and_fetch(&p->p_refs, 1);
+  if (q[1])
+    q[1]->p_next = p;
   else
+    q[0] = p;
+  q[1] = p;
+  *bytes += sizeof(Plist) + p->p_pkt.m_nBodySize;
+}
+
+/* about how much more the socket takes without blocking */
+static int
+SendRoom(int sockfd)
+{
+  int size = 0, queued = 0;
+  socklen_t len = sizeof(size);
+
+  getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char *) &size, &len);
+#ifdef SIOCOUTQ
+  ioctl(sockfd, SIOCOUTQ, &queued);
+#endif
+  /* the kernel doubles SO_SNDBUF for its bookkeeping */
+  return size / 2 - queued;
+}
+
+/* Sends what q holds to r in gathered writes, as much as the socket
+ * takes without waiting; with force at least one batch, epoll said
+ * there's room. What the socket doesn't take of a batch waits in r and
+ * goes out first the next time. A chunk size change applies to what is
+ * sent after it.
+ */
+static void
+FlushQueue(RTMP *r, Plist **q, unsigned int *bytes, bool force)
+{
+  int room;
+
+  if (RTMP_WritePending(r) && RTMP_SendPending(r) == 0)
+    return;
+  if (!RTMP_IsConnected(r))
+    {
+      DropQueue(q, bytes);
+      return;
+    }
+
+  room = SendRoom(r->m_socket);
+  while (q[0] && (room > 0 || force) && !RTMP_WritePending(r))
     {
-      RTMP_Init(&server->rs);
-      RTMP_Init(&server->rc);
-      server->rs.m_socket = sockfd;
-      if (!RTMP_Serve(&server->rs))
+      RTMPPacket *batch[MAX_BATCH];
+      Plist *p;
+      bool ok;
+      int i, n = 0;
+
+      for (p = q[0]; p && n < MAX_BATCH; p = p->p_next)
         {
-          Log(LOGERROR, "Handshake failed");
-          goto cleanup;
+          if (n && (int) p->p_pkt.m_nBodySize > room)
+            break;
+          batch[n++] = &p->p_pkt;
+          room -= p->p_pkt.m_nBodySize + RTMP_MAX_HEADER_SIZE;
+          if (p->p_pkt.m_packetType == 0x01)
+            break;
+        }
+      force = false;
+
+      ok = RTMP_SendPackets(r, batch, n, false);
+      for (i = 0; i < n; i++)
+        {
+          p = q[0];
+          q[0] = p->p_next;
+          if (p->p_pkt.m_packetType == 0x01 && p->p_pkt.m_nBodySize >= 4)
+            r->m_outChunkSize = AMF_DecodeInt32(p->p_pkt.m_body);
+          *bytes -= sizeof(Plist) + p->p_pkt.m_nBodySize;
+          ReleasePlist(p);
+        }
+      if (!q[0])
+        q[1] = NULL;
+      if (!ok)
+        {
+          DropQueue(q, bytes);
+          break;
         }
     }
+}
 
-  buf = malloc(buflen);
+static void
+WatchSocket(STREAMING_SESSION *s, RTMP *r, STREAMING_HANDLE *h,
+  uint32_t *watched, bool reading, bool writing)
+{
+  struct epoll_event ev = { 0 };
+
+  if (!RTMP_IsConnected(r))
+    return;
+  ev.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+  if (ev.events == *watched)
+    return;
+  ev.data.ptr = h;
+  epoll_ctl(s->server->epfd, EPOLL_CTL_MOD, r->m_socket, &ev);
+  *watched = ev.events;
+}
 
-  /* Just process the Connect request */
-  while (RTMP_IsConnected(&server->rs) && RTMP_ReadPacket(&server->rs, &ps))
+/* each side is read until what it sends is held up, and written to
+ * while something waits for it; a recording played back comes first */
+static void
+WatchSession(STREAMING_SESSION *s)
+{
+  WatchSocket(s, &s->rs, &s->client, &s->clientEvents,
+    s->rs_bytes < QUEUE_BYTES,
+    s->rc_pkt[0] != NULL || s->cache != NULL || RTMP_WritePending(&s->rs));
+  WatchSocket(s, &s->rc, &s->origin, &s->originEvents,
+    s->rc_bytes < QUEUE_BYTES && !s->cache,
+    s->rs_pkt[0] != NULL || RTMP_WritePending(&s->rc));
+}
+
+static void
+AddRecord(STREAMING_RECORDER *rec, Rlist *r)
+{
+  r->r_next = NULL;
+  r->r_queued = RTMP_GetTime();
+  if (rec->tail)
+    rec->tail->r_next = r;
+  else
+    rec->head = r;
+  rec->tail = r;
+  pthread_cond_signal(&rec->cond);
+}
+
+/* Close a recording once all of it is written. What can be played back
+ * of it goes to cache, which is in state unless the file turned out bad.
+ */
+static void
+CloseRecord(STREAMING_RECORDER *rec, FILE *file, Clist *cache, int state)
+{
+  off_t size = ftello(file);
+
+  if (ferror(file) || size <= FLV_HEADER_SIZE)
+    state = CACHE_UNUSABLE;
+  if (fclose(file))
+    state = CACHE_UNUSABLE;
+  if (cache)
     {
-      if (!RTMPPacket_IsReady(&ps))
-        continue;
-      ServePacket(server, 0, &ps);
-      RTMPPacket_Free(&ps);
-      if (RTMP_IsConnected(&server->rc))
-        break;
+      pthread_mutex_lock(&rec->lock);
+      cache->c_size = size;
+      cache->c_state = state;
+      pthread_mutex_unlock(&rec->lock);
+    }
+}
+
+/* hand a tag to the recorder, unless the disk is too far behind */
+static void
+RecordPacket(STREAMING_SESSION *s, Plist *p)
+{
+  STREAMING_RECORDER *rec = &s->server->recorder;
+  Rlist *r;
+
+  pthread_mutex_lock(&rec->lock);
+  if (rec->bytes >= RECORD_BYTES)
+    {
+      rec->dropped++;
+      s->f_cur->f_gap = true;
+      pthread_mutex_unlock(&rec->lock);
+      return;
+    }
+  r = malloc(sizeof(Rlist));
+  if (!r)
+    {
+      Log(LOGERROR, "%s, out of memory, dropping a tag", __FUNCTION__);
+      rec->dropped++;
+      s->f_cur->f_gap = true;
+      pthread_mutex_unlock(&rec->lock);
+      return;
     }
+  r->r_file = s->f_cur->f_file;
+  r->r_pkt = p;
+  r->r_cache = s->f_cur->f_cache;
+  /* the recorder may let go of it last */
+  RTMPPacket_Unpool(&p->p_pkt);
+  __sync_add_and_fetch(&p->p_refs, 1);
+  rec->bytes += p->p_pkt.m_nBodySize;
+  AddRecord(rec, r);
+  pthread_mutex_unlock(&rec->lock);
+}
+
+/* The file is closed once what was handed over before is written. A
+ * recording that stopped short is only good to start with if the origin
+ * can seek, which it can for a stream with a duration.
+ */
+static void
+CloseRecording(STREAMING_SESSION *s, Flist *fl)
+{
+  STREAMING_RECORDER *rec = &s->server->recorder;
+  Rlist *r = malloc(sizeof(Rlist));
+  int state;
+
+  if (fl->f_gap)
+    state = CACHE_UNUSABLE;
+  else if (fl->f_complete)
+    state = CACHE_COMPLETE;
+  else if (s->spliced || s->rc.m_fDuration > 0)
+    state = CACHE_PARTIAL;
+  else
+    state = CACHE_UNUSABLE;
+
+  pthread_mutex_lock(&rec->lock);
+  if (!r)
+    {
+      /* the batch being written and the one waiting may have tags of
+       * it, the file is closed here once they're done */
+      uint32_t batch = rec->batches + rec->busy + (rec->head != NULL);
+
+      Log(LOGERROR, "%s, out of memory, closing the recording here",
+          __FUNCTION__);
+      while ((int32_t) (rec->batches - batch) < 0 && !rec->stopped)
+        pthread_cond_wait(&rec->written, &rec->lock);
+      pthread_mutex_unlock(&rec->lock);
+      CloseRecord(rec, fl->f_file, fl->f_cache, state);
+      fl->f_file = NULL;
+      return;
+    }
+  r->r_file = fl->f_file;
+  r->r_pkt = NULL;
+  r->r_cache = fl->f_cache;
+  r->r_state = state;
+  fl->f_file = NULL;
+  AddRecord(rec, r);
+  pthread_mutex_unlock(&rec->lock);
+}
 
-  pc.m_chunk = &rk;
+TFTYPE
+recorderThread(void *arg)
+{
+  STREAMING_RECORDER *rec = arg;
+  char *buf = NULL;
+  unsigned int buflen = 0;
+  uint32_t stamp;
 
-  /* We have our own timeout in select() */
-  server->rc.Link.timeout = 10;
-  server->rs.Link.timeout = 10;
-  while (RTMP_IsConnected(&server->rs) || RTMP_IsConnected(&server->rc))
+  pthread_mutex_lock(&rec->lock);
+  while (1)
     {
-      int n;
-      int sr, cr;
+      Rlist *r, *next;
+      unsigned int bytes = 0;
+      uint32_t lag = 0;
 
-      cr = server->rc.m_nBufferSize;
-      sr = server->rs.m_nBufferSize;
+      while (!rec->head && !rec->stop)
+        pthread_cond_wait(&rec->cond, &rec->lock);
+      if (!rec->head)
+        break;
+      r = rec->head;
+      rec->head = rec->tail = NULL;
+      rec->writing = r->r_queued;
+      rec->busy = true;
+      pthread_mutex_unlock(&rec->lock);
 
-      if (cr || sr)
-        {
-        }
-      else
+      for (; r; r = next)
         {
-          n = server->rs.m_socket;
-	  if (server->rc.m_socket > n)
-	    n = server->rc.m_socket;
-	  FD_ZERO(&rfds);
-	  if (RTMP_IsConnected(&server->rs))
-	    FD_SET(sockfd, &rfds);
-	  if (RTMP_IsConnected(&server->rc))
-	    FD_SET(server->rc.m_socket, &rfds);
-
-          /* give more time to start up if we're not playing yet */
-	  tv.tv_sec = server->f_cur ? 30 : 60;
-	  tv.tv_usec = 0;
-
-	  if (select(n + 1, &rfds, NULL, NULL, &tv) <= 0)
-	    {
-              if (server->f_cur && server->rc.m_mediaChannel && !paused)
+          next = r->r_next;
+          if (!r->r_pkt)
+            CloseRecord(rec, r->r_file, r->r_cache, r->r_state);
+          else
+            {
+              RTMPPacket *packet = &r->r_pkt->p_pkt;
+              uint32_t now = RTMP_GetTime();
+
+              /* a file that failed once gets nothing more */
+              if (!ferror(r->r_file))
                 {
-                  server->rc.m_pauseStamp = server->rc.m_channelTimestamp[server->rc.m_mediaChannel];
-                  if (RTMP_ToggleStream(&server->rc))
+                  int len = WriteStream(&buf, &buflen, &stamp, packet);
+                  if (len > 0 && fwrite(buf, 1, len, r->r_file) != len)
+                    Log(LOGERROR, "%s, couldn't write a recording, error %d",
+                        __FUNCTION__, errno);
+                  else if (len > 0 && r->r_cache)
                     {
-                      paused = true;
-                      continue;
+                      pthread_mutex_lock(&rec->lock);
+                      r->r_cache->c_stamp = stamp;
+                      pthread_mutex_unlock(&rec->lock);
                     }
                 }
-	      Log(LOGERROR, "Request timeout/select failed, ignoring request");
-	      goto cleanup;
-	    }
-          if (FD_ISSET(server->rs.m_socket, &rfds))
-            sr = 1;
-          if (FD_ISSET(server->rc.m_socket, &rfds))
-            cr = 1;
+              if (now - r->r_queued > lag)
+                lag = now - r->r_queued;
+              bytes += packet->m_nBodySize;
+              ReleasePlist(r->r_pkt);
+            }
+          free(r);
+        }
+
+      pthread_mutex_lock(&rec->lock);
+      rec->bytes -= bytes;
+      rec->busy = false;
+      rec->batches++;
+      pthread_cond_broadcast(&rec->written);
+      if (lag > rec->lag)
+        rec->lag = lag;
+    }
+  rec->stopped = true;
+  pthread_cond_signal(&rec->cond);
+  pthread_mutex_unlock(&rec->lock);
+  free(buf);
+  TFRET();
+}
+
+static void
+ReportRecorder(STREAMING_RECORDER *rec)
+{
+  uint32_t lag, dropped;
+  unsigned int bytes;
+
+  pthread_mutex_lock(&rec->lock);
+  lag = rec->lag;
+  rec->lag = 0;
+  /* a slow disk may still be on what it took long ago */
+  if (rec->busy && RTMP_GetTime() - rec->writing > lag)
+    lag = RTMP_GetTime() - rec->writing;
+  dropped = rec->dropped;
+  bytes = rec->bytes;
+  pthread_mutex_unlock(&rec->lock);
+
+  if (lag >= RECORD_LAG || dropped != rec->reported)
+    {
+      Log(LOGWARNING, "Recorder is %u ms behind with %u KB to write, %u tags dropped",
+          lag, bytes / 1024, dropped);
+      rec->reported = dropped;
+    }
+}
+
+/* writes what it was handed and exits */
+static void
+StopRecorder(STREAMING_RECORDER *rec)
+{
+  pthread_mutex_lock(&rec->lock);
+  rec->stop = true;
+  pthread_cond_signal(&rec->cond);
+  while (!rec->stopped)
+    pthread_cond_wait(&rec->cond, &rec->lock);
+  pthread_mutex_unlock(&rec->lock);
+  if (rec->dropped)
+    LogPrintf("Recorder dropped %u tags, the disk couldn't keep up\n",
+              rec->dropped);
+  while (rec->recordings)
+    {
+      Clist *cl = rec->recordings;
+      rec->recordings = cl->c_next;
+      free(cl->c_file);
+      free(cl);
+    }
+}
+
+/* a message of our own for the player, with a body of size to fill in */
+static bool
+NewMessage(RTMPPacket *packet, int type, uint32_t stream, uint32_t stamp,
+  int size)
+{
+  memset(packet, 0, sizeof(RTMPPacket));
+  if (!RTMPPacket_Alloc(packet, size))
+    return false;
+  packet->m_headerType = 0; /* RTMP_PACKET_SIZE_LARGE */
+  packet->m_packetType = type;
+  if (type == 0x01 || type == 0x04)
+    packet->m_nChannel = 0x02;	/* control */
+  else if (type == 0x08)
+    packet->m_nChannel = 0x04;
+  else if (type == 0x09)
+    packet->m_nChannel = 0x06;
+  else
+    packet->m_nChannel = 0x05;
+  packet->m_nInfoField1 = stamp;
+  packet->m_nInfoField2 = stream;
+  packet->m_nTimeStamp = stamp;
+  packet->m_hasAbsTimestamp = true;
+  packet->m_nBodySize = size;
+  packet->m_nBytesRead = size;
+  return true;
+}
+
+static void
+QueueMessage(STREAMING_SESSION *s, int type, uint32_t stream,
+  const char *body, int size)
+{
+  RTMPPacket packet;
+  Plist *p;
+
+  if (!NewMessage(&packet, type, stream, 0, size))
+    return;
+  memcpy(packet.m_body, body, size);
+  p = NewPlist(&packet);
+  if (!p)
+    return;
+  Enqueue(s->rc_pkt, &s->rc_bytes, p);
+  ReleasePlist(p);
+}
+
+static void
+QueueStatus(STREAMING_SESSION *s, const AVal *level, const AVal *code)
+{
+  char pbuf[256], *pend = pbuf+sizeof(pbuf), *enc = pbuf;
+
+  enc = AMF_EncodeString(enc, pend, &av_onStatus);
+  enc = AMF_EncodeNumber(enc, pend, 0.0);
+  *enc++ = AMF_NULL;
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedString(enc, pend, &av_level, level);
+  enc = AMF_EncodeNamedString(enc, pend, &av_code, code);
+  *enc++ = 0;
+  *enc++ = 0;
+  *enc++ = AMF_OBJECT_END;
+  QueueMessage(s, 0x14, s->cacheStream, pbuf, enc - pbuf);
+}
+
+/* a play from the start to the end, what a recording may stand in for */
+static bool
+PlaysWhole(AMFObject *obj)
+{
+  double start = -2, len = -1;
+
+  if (obj->o_num > 4 && AMFProp_GetType(&obj->o_props[4]) == AMF_NUMBER)
+    start = AMFProp_GetNumber(&obj->o_props[4]);
+  if (obj->o_num > 5 && AMFProp_GetType(&obj->o_props[5]) == AMF_NUMBER)
+    len = AMFProp_GetNumber(&obj->o_props[5]);
+  return (start == 0 || start == -2) && len < 0;
+}
+
+/* the player's play, asking the origin for what comes after stamp */
+static bool
+ResumePlay(RTMPPacket *pack, const AVal *playpath, double txn, uint32_t stamp)
+{
+  RTMPPacket packet = *pack;
+  char pbuf[1024], *pend = pbuf+sizeof(pbuf), *enc = pbuf;
+
+  enc = AMF_EncodeString(enc, pend, &av_play);
+  enc = AMF_EncodeNumber(enc, pend, txn);
+  *enc++ = AMF_NULL;
+  enc = AMF_EncodeString(enc, pend, playpath);
+  if (enc)
+    enc = AMF_EncodeNumber(enc, pend, stamp);
+  if (!enc || !RTMPPacket_Alloc(&packet, enc - pbuf))
+    return false;
+  memcpy(packet.m_body, pbuf, enc - pbuf);
+  packet.m_packetType = 0x14;
+  packet.m_nBodySize = enc - pbuf;
+  packet.m_nBytesRead = enc - pbuf;
+  RTMPPacket_Free(pack);
+  *pack = packet;
+  return true;
+}
+
+/* the player gets the recording instead of the origin, see SendCache */
+static void
+StartPlayback(STREAMING_SESSION *s, Clist *cl, FILE *in, off_t size,
+  uint32_t stream)
+{
+  char buf[6], *pend = buf+sizeof(buf);
+
+  s->cache = in;
+  s->cacheLeft = size - FLV_HEADER_SIZE;
+  s->cacheStream = stream;
+  s->playing = cl;
+  fseeko(in, FLV_HEADER_SIZE, SEEK_SET);
+
+  AMF_EncodeInt32(buf, pend, CACHE_CHUNK);
+  QueueMessage(s, 0x01, 0, buf, 4);
+  /* StreamBegin */
+  AMF_EncodeInt16(buf, pend, 0);
+  AMF_EncodeInt32(buf+2, pend, stream);
+  QueueMessage(s, 0x04, 0, buf, 6);
+  QueueStatus(s, &av_status, &av_NetStream_Play_Start);
+}
+
+/* Answers a play from a recording where there is one, under the server
+ * lock. A complete one is played back and the origin left. One cut short
+ * is played back up to where it ends, the origin is asked for the rest
+ * and that goes on to the same file. Otherwise *clp is where to note a
+ * new recording, NULL when it's not to be played back. Returns true if
+ * the play was taken care of.
+ */
+static bool
+PlayRecording(STREAMING_SESSION *session, RTMPPacket *pack, AMFObject *obj,
+  Clist **clp)
+{
+  STREAMING_RECORDER *rec = &session->server->recorder;
+  AVal playpath = session->rc.Link.playpath;
+  Clist *cl;
+  FILE *in, *out = NULL;
+  off_t size;
+  uint32_t stamp;
+  int state;
+
+  *clp = NULL;
+  if (!session->tcUrl.av_val || !PlaysWhole(obj))
+    return false;
+
+  pthread_mutex_lock(&rec->lock);
+  for (cl = rec->recordings; cl; cl = cl->c_next)
+    if (AVMATCH(&cl->c_tcUrl, &session->tcUrl)
+      && AVMATCH(&cl->c_playpath, &playpath))
+      break;
+  if (!cl)
+    {
+      cl = calloc(1, sizeof(Clist) + session->tcUrl.av_len + playpath.av_len);
+      cl->c_tcUrl.av_val = (char *)(cl+1);
+      cl->c_tcUrl.av_len = session->tcUrl.av_len;
+      memcpy(cl->c_tcUrl.av_val, session->tcUrl.av_val, session->tcUrl.av_len);
+      cl->c_playpath.av_val = cl->c_tcUrl.av_val + cl->c_tcUrl.av_len;
+      cl->c_playpath.av_len = playpath.av_len;
+      memcpy(cl->c_playpath.av_val, playpath.av_val, playpath.av_len);
+      cl->c_state = CACHE_UNUSABLE;
+      cl->c_next = rec->recordings;
+      rec->recordings = cl;
+    }
+  state = cl->c_state;
+  stamp = cl->c_stamp;
+  size = cl->c_size;
+  /* one player extends a partial recording, the others relay */
+  if (state != CACHE_COMPLETE)
+    cl->c_state = CACHE_RECORDING;
+  pthread_mutex_unlock(&rec->lock);
+
+  if (state == CACHE_RECORDING)
+    return false;
+  if (state == CACHE_UNUSABLE)
+    {
+      *clp = cl;
+      return false;
+    }
+
+  in = fopen(cl->c_file, "rb");
+  if (state == CACHE_PARTIAL)
+    {
+      *clp = cl;
+      if (in)
+        out = fopen(cl->c_file, "ab");
+      if (!out || !ResumePlay(pack, &playpath,
+            AMFProp_GetNumber(AMF_GetProp(obj, NULL, 1)), stamp))
+        {
+          if (in)
+            fclose(in);
+          if (out)
+            fclose(out);
+          return false;
         }
-      if (sr)
+      /* stamp is ms, what players send too */
+      LogPrintf("Playpath: %.*s\nPlaying back: %s up to %u ms, then the origin\n",
+        playpath.av_len, playpath.av_val, cl->c_file, stamp);
+      StartPlayback(session, cl, in, size, pack->m_nInfoField2);
+      session->resumeStamp = stamp;
+      session->resuming = true;
+      session->spliced = true;
+      AddRecording(session, out, cl);
+      return true;
+    }
+
+  if (!in)
+    {
+      /* gone from the disk, record it again */
+      pthread_mutex_lock(&rec->lock);
+      if (cl->c_state == CACHE_COMPLETE)
         {
-          while (RTMP_ReadPacket(&server->rs, &ps))
-            if (RTMPPacket_IsReady(&ps))
-              {
-                /* change chunk size */
-                if (ps.m_packetType == 0x01)
-                  {
-                    if (ps.m_nBodySize >= 4)
-                      {
-                        server->rs.m_inChunkSize = AMF_DecodeInt32(ps.m_body);
-                        Log(LOGDEBUG, "%s, client: chunk size change to %d", __FUNCTION__,
-                            server->rs.m_inChunkSize);
-                        server->rc.m_outChunkSize = server->rs.m_inChunkSize;
-                      }
-                  }
-                /* bytes received */
-                else if (ps.m_packetType == 0x03)
-                  {
-                    if (ps.m_nBodySize >= 4)
-                      {
-                        int count = AMF_DecodeInt32(ps.m_body);
-                        Log(LOGDEBUG, "%s, client: bytes received = %d", __FUNCTION__,
-                            count);
-                      }
-                  }
-                /* ctrl */
-                else if (ps.m_packetType == 0x04)
-                  {
-                    short nType = AMF_DecodeInt16(ps.m_body);
-                    /* UpdateBufferMS */
-                    if (nType == 0x03)
-                      {
-                        char *ptr = ps.m_body+2;
-                        int id;
-                        int len;
-                        id = AMF_DecodeInt32(ptr);
-                        /* Assume the interesting media is on a non-zero stream */
-                        if (id)
-                          {
-                            len = AMF_DecodeInt32(ptr+4);
-#if 1
-                            /* request a big buffer */
-                            if (len < BUFFERTIME)
-                              {
-                                AMF_EncodeInt32(ptr+4, ptr+8, BUFFERTIME);
-                              }
-#endif
-                            Log(LOGDEBUG, "%s, client: BufferTime change in stream %d to %d", __FUNCTION__,
-                                id, len);
-                          }
-                      }
-                  }
-                else if (ps.m_packetType == 0x11 || ps.m_packetType == 0x14)
-                  if (ServePacket(server, 0, &ps) && server->f_cur)
-                    {
-                      fclose(server->f_cur->f_file);
-                      server->f_cur->f_file = NULL;
-                      server->f_cur = NULL;
-                    }
-                RTMP_SendPacket(&server->rc, &ps, false);
-                RTMPPacket_Free(&ps);
-                break;
-              }
+          cl->c_state = CACHE_RECORDING;
+          *clp = cl;
+        }
+      pthread_mutex_unlock(&rec->lock);
+      return false;
+    }
+  LogPrintf("Playpath: %.*s\nPlaying back: %s\n",
+    playpath.av_len, playpath.av_val, cl->c_file);
+  StartPlayback(session, cl, in, size, pack->m_nInfoField2);
+  RTMP_Close(&session->rc);
+  return true;
+}
+
+/* a file another recording that may be played back is in */
+static bool
+RecordingUses(STREAMING_SERVER *server, const char *file, Clist *cl)
+{
+  STREAMING_RECORDER *rec = &server->recorder;
+  Clist *other;
+  bool used = false;
+
+  pthread_mutex_lock(&rec->lock);
+  for (other = rec->recordings; other && !used; other = other->c_next)
+    used = other != cl && other->c_file && other->c_state != CACHE_UNUSABLE
+      && !strcmp(other->c_file, file);
+  pthread_mutex_unlock(&rec->lock);
+  return used;
+}
+
+static void
+AddRecording(STREAMING_SESSION *session, FILE *out, Clist *cl)
+{
+  AVal av = session->rc.Link.playpath;
+  Flist *fl = calloc(1, sizeof(Flist)+av.av_len+1);
+
+  fl->f_file = out;
+  fl->f_cache = cl;
+  fl->f_path.av_len = av.av_len;
+  fl->f_path.av_val = (char *)(fl+1);
+  memcpy(fl->f_path.av_val, av.av_val, av.av_len);
+  fl->f_path.av_val[av.av_len] = '\0';
+  if (session->f_tail)
+    session->f_tail->f_next = fl;
+  else
+    session->f_head = fl;
+  session->f_tail = fl;
+}
+
+static void
+EndPlayback(STREAMING_SESSION *s, bool ok)
+{
+  char buf[6], *pend = buf+sizeof(buf);
+
+  fclose(s->cache);
+  s->cache = NULL;
+  if (!ok)
+    {
+      STREAMING_RECORDER *rec = &s->server->recorder;
+      Flist *fl;
+
+      /* not to be played back again */
+      Log(LOGERROR, "%s, a recording played back is damaged", __FUNCTION__);
+      for (fl = s->f_head; fl; fl = fl->f_next)
+        if (fl->f_cache == s->playing)
+          fl->f_gap = true;
+      if (!s->resuming)
+        {
+          pthread_mutex_lock(&rec->lock);
+          s->playing->c_state = CACHE_UNUSABLE;
+          pthread_mutex_unlock(&rec->lock);
         }
-      if (cr)
+      RTMP_Close(&s->rc);
+    }
+  if (!ok || (s->resuming && !RTMP_IsConnected(&s->rc)))
+    QueueStatus(s, &av_error, &av_NetStream_Failed);
+  else if (!s->resuming)
+    {
+      /* StreamEOF */
+      AMF_EncodeInt16(buf, pend, 1);
+      AMF_EncodeInt32(buf+2, pend, s->cacheStream);
+      QueueMessage(s, 0x04, 0, buf, 6);
+      QueueStatus(s, &av_status, &av_NetStream_Play_Stop);
+    }
+  s->playing = NULL;
+}
+
+/* Plays back what's left of the recording, as much as the player takes
+ * now. The tags go out as they were recorded, with full headers. Where
+ * the origin has more, it's read from again afterwards.
+ */
+static void
+SendCache(STREAMING_SESSION *s)
+{
+  int rounds;
+
+  for (rounds = 0; s->cache && rounds < MAX_FILLS; rounds++)
+    {
+      while (s->cache && s->rc_bytes < QUEUE_BYTES)
         {
-          while (RTMP_ReadPacket(&server->rc, &pc))
+          RTMPPacket packet;
+          unsigned char hdr[11];
+          uint32_t size, stamp;
+          Plist *p;
+
+          if (s->cacheLeft == 0)
             {
-              int sendit = 1;
-              if (RTMPPacket_IsReady(&pc))
-                {
-                  if (paused)
-                    {
-                      if (pc.m_nTimeStamp <= server->rc.m_mediaStamp)
-                        continue;
-                      paused = 0;
-                      server->rc.m_pausing = 0;
-                    }
-                  /* change chunk size */
-                  if (pc.m_packetType == 0x01)
-                    {
-                      if (pc.m_nBodySize >= 4)
-                        {
-                          server->rc.m_inChunkSize = AMF_DecodeInt32(pc.m_body);
-                          Log(LOGDEBUG, "%s, server: chunk size change to %d", __FUNCTION__,
-                              server->rc.m_inChunkSize);
-                          server->rs.m_outChunkSize = server->rc.m_inChunkSize;
-                        }
-                    }
-                  else if (pc.m_packetType == 0x04)
-                    {
-                      short nType = AMF_DecodeInt16(pc.m_body);
-                      /* SWFverification */
-                      if (nType == 0x1a)
-                        /* The session will certainly fail right after this */
-                        Log(LOGERROR, "%s, server requested SWF verification, need CRYPTO support! ", __FUNCTION__);
-                    }
-                  else if (server->f_cur && (
-                       pc.m_packetType == 0x08 ||
-                       pc.m_packetType == 0x09 ||
-                       pc.m_packetType == 0x12 ||
-                       pc.m_packetType == 0x16) &&
-                       RTMP_ClientPacket(&server->rc, &pc))
-                    {
-                      int len = WriteStream(&buf, &buflen, &server->stamp, &pc);
-                      if (len > 0 && fwrite(buf, 1, len, server->f_cur->f_file) != len)
-                        goto cleanup;
-                    }
-                  else if ( pc.m_packetType == 0x11 || pc.m_packetType == 0x14)
-                    {
-                      if (ServePacket(server, 1, &pc) && server->f_cur)
-                        {
-                          fclose(server->f_cur->f_file);
-                          server->f_cur->f_file = NULL;
-                          server->f_cur = NULL;
-                        }
-                    }
-                }
-              if (sendit && RTMP_IsConnected(&server->rs))
-                RTMP_SendChunk(&server->rs, &rk);
-              if (RTMPPacket_IsReady(&pc))
-                  RTMPPacket_Free(&pc);
+              EndPlayback(s, true);
+              break;
+            }
+          if (s->cacheLeft < 15 || fread(hdr, 1, 11, s->cache) != 11
+            || (hdr[0] != 0x08 && hdr[0] != 0x09 && hdr[0] != 0x12))
+            {
+              EndPlayback(s, false);
+              break;
+            }
+          size = AMF_DecodeInt24((char *) hdr + 1);
+          stamp = AMF_DecodeInt24((char *) hdr + 4) | (hdr[7] << 24);
+          if (size + 15 > s->cacheLeft
+            || !NewMessage(&packet, hdr[0], s->cacheStream, stamp, size))
+            {
+              EndPlayback(s, false);
+              break;
+            }
+          /* with the prevTagSize after it */
+          if (fread(packet.m_body, 1, size, s->cache) != size
+            || fread(hdr, 1, 4, s->cache) != 4)
+            {
+              RTMPPacket_Free(&packet);
+              EndPlayback(s, false);
               break;
             }
+          s->cacheLeft -= size + 15;
+          p = NewPlist(&packet);
+          if (!p)
+            continue;
+          Enqueue(s->rc_pkt, &s->rc_bytes, p);
+          ReleasePlist(p);
         }
-      if (!RTMP_IsConnected(&server->rs) && RTMP_IsConnected(&server->rc)
-        && !server->f_cur)
-        RTMP_Close(&server->rc);
+      FlushQueue(&s->rs, s->rc_pkt, &s->rc_bytes, false);
+      if (!RTMP_IsConnected(&s->rs))
+        break;
+      if (s->rc_pkt[0] || RTMP_WritePending(&s->rs))
+        break;			/* the player is full, EPOLLOUT brings us back */
     }
+}
 
-cleanup:
-  LogPrintf("Closing connection... ");
-  RTMP_Close(&server->rs);
-  RTMP_Close(&server->rc);
-  while (server->f_head)
+static void
+FreeSession(STREAMING_SESSION *s)
+{
+  RTMPPacket_Free(&s->ps);
+  RTMPPacket_Free(&s->pc);
+  DropQueue(s->rs_pkt, &s->rs_bytes);
+  DropQueue(s->rc_pkt, &s->rc_bytes);
+  RTMP_Close(&s->rs);
+  RTMP_Close(&s->rc);
+  while (s->f_head)
     {
-      Flist *fl = server->f_head;
-      server->f_head = fl->f_next;
+      Flist *fl = s->f_head;
+      s->f_head = fl->f_next;
       if (fl->f_file)
-        fclose(fl->f_file);
+        CloseRecording(s, fl);
       free(fl);
     }
-  server->f_tail = NULL;
-  server->f_cur = NULL;
-  free(buf);
+  if (s->cache)
+    fclose(s->cache);
   /* Should probably be done by RTMP_Close() ... */
-  free((void *)server->rc.Link.hostname);
-  server->rc.Link.hostname = NULL;
-  server->rc.Link.tcUrl.av_val = NULL;
-  server->rc.Link.swfUrl.av_val = NULL;
-  server->rc.Link.pageUrl.av_val = NULL;
-  server->rc.Link.app.av_val = NULL;
-  server->rc.Link.auth.av_val = NULL;
-  server->rc.Link.flashVer.av_val = NULL;
+  free((void *)s->rc.Link.hostname);
+  free(s->tcUrl.av_val);
+  free(s);
+}
+
+static void
+CloseSession(STREAMING_SESSION *s)
+{
+  STREAMING_SERVER *server = s->server;
+
+  LogPrintf("Closing connection... ");
+  /* closing the sockets takes them out of the epoll set */
+  RTMP_Close(&s->rs);
+  RTMP_Close(&s->rc);
+  s->state = SESSION_CLOSED;
+
+  pthread_mutex_lock(&server->lock);
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    server->sessions = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  pthread_mutex_unlock(&server->lock);
+
+  s->next = server->dead;
+  server->dead = s;
   LogPrintf("done!\n\n");
+}
+
+/* Reads the next chunk from r without waiting for one. Returns 1 when
+ * it read one, 0 when there's nothing more for now and -1 once r closed.
+ */
+static int
+ReadChunk(RTMP *r, RTMPPacket *packet, int *nFills)
+{
+  while (RTMP_IsConnected(r))
+    {
+      int len = RTMP_ChunkLength(r);
+
+      if (len && len <= r->m_nBufferSize)
+        return RTMP_ReadPacket(r, packet) ? 1 : -1;
+
+      if (len > RTMP_BUFFER_CACHE_SIZE)
+        {
+          /* a chunk larger than the socket buffer is read in pieces,
+           * as they come; RTMP_ReadPacket keeps its place in it */
+          r->m_bTimedout = false;
+          if (!RTMP_ReadPacket(r, packet))
+            return -1;
+          if (r->m_bTimedout)
+            return 0;
+          return 1;
+        }
+
+      if ((*nFills)++ == MAX_FILLS)
+        return 0;		/* still readable, epoll brings us back */
+      r->m_bTimedout = false;
+      if (RTMPSockBuf_Fill(&r->m_sb) > 0)
+        continue;
+      if (r->m_bTimedout)
+        return 0;
+      Log(LOGDEBUG, "%s, connection closed", __FUNCTION__);
+      RTMP_Close(r);
+    }
+  return -1;
+}
+
+/* forward what the player sent to the origin, all that's there in one
+ * go unless the origin is held up */
+static void
+RelayClient(STREAMING_SESSION *s)
+{
+  RTMPPacket *ps = &s->ps;
+  int nFills = 0;
+
+  while (s->rs_bytes < QUEUE_BYTES && ReadChunk(&s->rs, ps, &nFills) > 0)
+    {
+      if (!RTMPPacket_IsReady(ps))
+        continue;
+
+      /* change chunk size */
+      if (ps->m_packetType == 0x01)
+        {
+          if (ps->m_nBodySize >= 4)
+            {
+              s->rs.m_inChunkSize = AMF_DecodeInt32(ps->m_body);
+              Log(LOGDEBUG, "%s, client: chunk size change to %d", __FUNCTION__,
+                  s->rs.m_inChunkSize);
+            }
+        }
+      /* bytes received */
+      else if (ps->m_packetType == 0x03)
+        {
+          if (ps->m_nBodySize >= 4)
+            {
+              int count = AMF_DecodeInt32(ps->m_body);
+              Log(LOGDEBUG, "%s, client: bytes received = %d", __FUNCTION__,
+                  count);
+            }
+        }
+      /* ctrl */
+      else if (ps->m_packetType == 0x04)
+        {
+          short nType = AMF_DecodeInt16(ps->m_body);
+          /* UpdateBufferMS */
+          if (nType == 0x03)
+            {
+              char *ptr = ps->m_body+2;
+              int id;
+              int len;
+              id = AMF_DecodeInt32(ptr);
+              /* Assume the interesting media is on a non-zero stream */
+              if (id)
+                {
+                  len = AMF_DecodeInt32(ptr+4);
+#if 1
+                  /* request a big buffer */
+                  if (len < BUFFERTIME)
+                    {
+                      AMF_EncodeInt32(ptr+4, ptr+8, BUFFERTIME);
+                    }
+#endif
+                  Log(LOGDEBUG, "%s, client: BufferTime change in stream %d to %d", __FUNCTION__,
+                      id, len);
+                }
+            }
+        }
+      else if (ps->m_packetType == 0x11 || ps->m_packetType == 0x14)
+        if (ServePacket(s, 0, ps) && s->f_cur)
+          {
+            CloseRecording(s, s->f_cur);
+            s->f_cur = NULL;
+          }
+      if (RTMP_IsConnected(&s->rc))
+        {
+          Plist *p = NewPlist(ps);
+          if (!p)
+            continue;
+          Enqueue(s->rs_pkt, &s->rs_bytes, p);
+          ReleasePlist(p);
+          if (s->rs_bytes >= QUEUE_BYTES)
+            FlushQueue(&s->rc, s->rs_pkt, &s->rs_bytes, false);
+        }
+      else
+        RTMPPacket_Free(ps);
+    }
+  FlushQueue(&s->rc, s->rs_pkt, &s->rs_bytes, false);
+}
+
+/* forward what the origin sent to the player, recording the media on
+ * the way; the packets go out together once all that's there is read */
+static void
+RelayOrigin(STREAMING_SESSION *s)
+{
+  RTMPPacket *pc = &s->pc;
+  int nFills = 0;
+
+  /* the origin waits while the start of the stream is played back */
+  while (!s->cache && s->rc_bytes < QUEUE_BYTES
+    && ReadChunk(&s->rc, pc, &nFills) > 0)
+    {
+      if (RTMPPacket_IsReady(pc))
+        {
+          bool record = false;
+          Plist *p;
+
+          if (s->paused)
+            {
+              if (pc->m_nTimeStamp <= s->rc.m_mediaStamp)
+                {
+                  RTMPPacket_Free(pc);
+                  continue;
+                }
+              s->paused = false;
+              s->rc.m_pausing = 0;
+            }
+          /* the origin seeks to a keyframe before where the playback
+           * ended */
+          if (s->resuming && (pc->m_packetType == 0x08 ||
+              pc->m_packetType == 0x09 || pc->m_packetType == 0x12 ||
+              pc->m_packetType == 0x16))
+            {
+              if (pc->m_nTimeStamp <= s->resumeStamp)
+                {
+                  RTMPPacket_Free(pc);
+                  continue;
+                }
+              s->resuming = false;
+            }
+          /* change chunk size */
+          if (pc->m_packetType == 0x01)
+            {
+              if (pc->m_nBodySize >= 4)
+                {
+                  s->rc.m_inChunkSize = AMF_DecodeInt32(pc->m_body);
+                  Log(LOGDEBUG, "%s, server: chunk size change to %d", __FUNCTION__,
+                      s->rc.m_inChunkSize);
+                }
+            }
+          else if (pc->m_packetType == 0x04)
+            {
+              short nType = AMF_DecodeInt16(pc->m_body);
+              /* SWFverification */
+              if (nType == 0x1a)
+                /* The session will certainly fail right after this */
+                Log(LOGERROR, "%s, server requested SWF verification, need CRYPTO support! ", __FUNCTION__);
+            }
+          else if (s->f_cur && (
+                   pc->m_packetType == 0x08 ||
+                   pc->m_packetType == 0x09 ||
+                   pc->m_packetType == 0x12 ||
+                   pc->m_packetType == 0x16) &&
+                   RTMP_ClientPacket(&s->rc, pc))
+            {
+              record = true;
+            }
+          else if (pc->m_packetType == 0x11 || pc->m_packetType == 0x14)
+            {
+              if (ServePacket(s, 1, pc) && s->f_cur)
+                {
+                  CloseRecording(s, s->f_cur);
+                  s->f_cur = NULL;
+                }
+            }
+
+          /* the player's channels went on from the playback, not from
+           * what the origin sent on them */
+          if (s->spliced)
+            {
+              pc->m_headerType = 0; /* RTMP_PACKET_SIZE_LARGE */
+              pc->m_nInfoField1 = pc->m_nTimeStamp;
+            }
 
-quit:
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+          p = NewPlist(pc);
+          if (!p)
+            {
+              if (record)
+                s->f_cur->f_gap = true;
+              continue;
+            }
+          if (record)
+            RecordPacket(s, p);
+          if (RTMP_IsConnected(&s->rs))
+            {
+              Enqueue(s->rc_pkt, &s->rc_bytes, p);
+              if (s->rc_bytes >= QUEUE_BYTES)
+                FlushQueue(&s->rs, s->rc_pkt, &s->rc_bytes, false);
+            }
+          ReleasePlist(p);
+        }
+    }
+  FlushQueue(&s->rs, s->rc_pkt, &s->rc_bytes, false);
+}
 
-  return;
+/* a session ends once both sides have gone, or the player has and
+ * there's nothing being recorded */
+static void
+CheckSession(STREAMING_SESSION *s)
+{
+  if (s->state != SESSION_RELAYING)
+    return;
+  if (!RTMP_IsConnected(&s->rs) && RTMP_IsConnected(&s->rc)
+    && !s->f_cur)
+    RTMP_Close(&s->rc);
+  if (!RTMP_IsConnected(&s->rs) && !RTMP_IsConnected(&s->rc))
+    CloseSession(s);
+  else
+    WatchSession(s);
 }
 
+static void
+SessionEvent(STREAMING_SESSION *s, int kind, uint32_t events)
+{
+  bool client = kind == HANDLE_CLIENT;
+  uint32_t watched = client ? s->clientEvents : s->originEvents;
+
+  s->active = RTMP_GetTime();
+  /* gone both ways while not read from, what it sent can't be answered */
+  if ((events & (EPOLLERR | EPOLLHUP)) && !(watched & EPOLLIN))
+    RTMP_Close(client ? &s->rs : &s->rc);
+
+  /* room again, what the other side held back can go on */
+  if (events & EPOLLOUT)
+    {
+      if (client)
+        {
+          FlushQueue(&s->rs, s->rc_pkt, &s->rc_bytes, true);
+          if (s->cache)
+            SendCache(s);
+          if (!(s->originEvents & EPOLLIN))
+            RelayOrigin(s);
+        }
+      else
+        {
+          FlushQueue(&s->rc, s->rs_pkt, &s->rs_bytes, true);
+          if (!(s->clientEvents & EPOLLIN))
+            RelayClient(s);
+        }
+    }
+
+  if ((events & ~EPOLLOUT) && s->state == SESSION_RELAYING)
+    {
+      if (client)
+        RelayClient(s);
+      else
+        RelayOrigin(s);
+    }
+  CheckSession(s);
+}
+
+/* Does the handshake and connects to the origin the player names, on a
+ * thread of its own as both block. The session then goes to the event
+ * loop.
+ */
 TFTYPE
-serverThread(void *arg)
+setupThread(void *arg)
 {
-  STREAMING_SERVER *server = arg;
-  server->state = STREAMING_ACCEPTING;
+  STREAMING_SESSION *s = arg;
+  STREAMING_SERVER *server = s->server;
+  STREAMING_SESSION **sp;
+  int sockfd = s->rs.m_socket;
+
+  // timeout for http requests
+  fd_set rfds;
+  struct timeval tv;
+
+  memset(&tv, 0, sizeof(struct timeval));
+  tv.tv_sec = 5;
+
+  FD_ZERO(&rfds);
+  FD_SET(sockfd, &rfds);
+
+  if (select(sockfd + 1, &rfds, NULL, NULL, &tv) <= 0)
+    {
+      Log(LOGERROR, "Request timeout/select failed, ignoring request");
+      RTMP_Close(&s->rs);
+    }
+  else
+    {
+      /* don't let a stalled player hold the thread forever */
+      tv.tv_sec = 10;
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
+      if (!RTMP_Serve(&s->rs))
+        {
+          Log(LOGERROR, "Handshake failed");
+          RTMP_Close(&s->rs);
+        }
+    }
+
+  /* Just process the Connect request */
+  while (RTMP_IsConnected(&s->rs) && RTMP_ReadPacket(&s->rs, &s->ps))
+    {
+      if (!RTMPPacket_IsReady(&s->ps))
+        continue;
+      ServePacket(s, 0, &s->ps);
+      RTMPPacket_Free(&s->ps);
+      if (RTMP_IsConnected(&s->rc))
+        break;
+    }
 
-  while (server->state == STREAMING_ACCEPTING)
+  pthread_mutex_lock(&server->lock);
+  for (sp = &server->setup; *sp != s; sp = &(*sp)->next) ;
+  *sp = s->next;
+  if (!server->stopped)
     {
+      s->next = server->ready;
+      server->ready = s;
+      write(server->wake[1], "", 1);
+    }
+  else				/* the server stopped meanwhile */
+    FreeSession(s);		/* before the recorder stops */
+  pthread_mutex_unlock(&server->lock);
+  TFRET();
+}
+
+static void
+AcceptSessions(STREAMING_SERVER *server)
+{
+  while (1)
+    {
+      STREAMING_SESSION *s;
       struct sockaddr_in addr;
       socklen_t addrlen = sizeof(struct sockaddr_in);
       int sockfd =
 	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
 
-      if (sockfd > 0)
+      if (sockfd < 0)
 	{
+	  int err = GetSockError();
+	  if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR)
+	    Log(LOGERROR, "%s: accept failed", __FUNCTION__);
+	  break;
+	}
 #ifdef linux
-          struct sockaddr_in dest;
-	  char destch[16];
-          socklen_t destlen = sizeof(struct sockaddr_in);
-	  getsockopt(sockfd, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen);
-          strcpy(destch, inet_ntoa(dest.sin_addr));
-	  Log(LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr), destch);
+      struct sockaddr_in dest;
+      char destch[16];
+      socklen_t destlen = sizeof(struct sockaddr_in);
+      getsockopt(sockfd, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen);
+      strcpy(destch, inet_ntoa(dest.sin_addr));
+      Log(LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
+	  inet_ntoa(addr.sin_addr), destch);
 #else
-	  Log(LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr));
+      Log(LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
+	  inet_ntoa(addr.sin_addr));
 #endif
-	  /* Create a new thread and transfer the control to that */
-	  doServe(server, sockfd);
-	  Log(LOGDEBUG, "%s: processed request\n", __FUNCTION__);
-	}
+      s = calloc(1, sizeof(STREAMING_SESSION));
+      s->server = server;
+      s->state = SESSION_SETUP;
+      s->client.kind = HANDLE_CLIENT;
+      s->client.session = s;
+      s->origin.kind = HANDLE_ORIGIN;
+      s->origin.session = s;
+      RTMP_Init(&s->rs);
+      RTMP_Init(&s->rc);
+      s->rs.m_socket = sockfd;
+
+      pthread_mutex_lock(&server->lock);
+      s->next = server->setup;
+      server->setup = s;
+      pthread_mutex_unlock(&server->lock);
+
+      /* Create a new thread and transfer the control to that */
+      ThreadCreate(setupThread, s);
+    }
+}
+
+static void
+StartRelay(STREAMING_SESSION *s)
+{
+  STREAMING_SERVER *server = s->server;
+  struct epoll_event ev = { 0 };
+
+  s->state = SESSION_RELAYING;
+  s->active = RTMP_GetTime();
+
+  /* We have our own timeout in the event loop */
+  s->rc.Link.timeout = 10;
+  s->rs.Link.timeout = 10;
+
+  pthread_mutex_lock(&server->lock);
+  s->prev = NULL;
+  s->next = server->sessions;
+  if (s->next)
+    s->next->prev = s;
+  server->sessions = s;
+  pthread_mutex_unlock(&server->lock);
+
+  ev.events = EPOLLIN;
+  if (RTMP_IsConnected(&s->rs))
+    {
+      SetBlocking(s->rs.m_socket, false);
+      ev.data.ptr = &s->client;
+      epoll_ctl(server->epfd, EPOLL_CTL_ADD, s->rs.m_socket, &ev);
+      s->clientEvents = ev.events;
+    }
+  if (RTMP_IsConnected(&s->rc))
+    {
+      SetBlocking(s->rc.m_socket, false);
+      ev.data.ptr = &s->origin;
+      epoll_ctl(server->epfd, EPOLL_CTL_ADD, s->rc.m_socket, &ev);
+      s->originEvents = ev.events;
+    }
+
+  /* the setup may have left packets in the socket buffers */
+  RelayClient(s);
+  if (s->state == SESSION_RELAYING)
+    RelayOrigin(s);
+  CheckSession(s);
+}
+
+/* sessions back from setup threads */
+static void
+TakeReady(STREAMING_SERVER *server)
+{
+  STREAMING_SESSION *s, *next;
+  char buf[64];
+
+  while (read(server->wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&server->lock);
+  s = server->ready;
+  server->ready = NULL;
+  pthread_mutex_unlock(&server->lock);
+
+  for (; s; s = next)
+    {
+      next = s->next;
+      if (STATE_GET(server->state) != STREAMING_ACCEPTING
+        || (!RTMP_IsConnected(&s->rs) && !RTMP_IsConnected(&s->rc)))
+        FreeSession(s);
       else
+        StartRelay(s);
+    }
+}
+
+/* Sessions idle for too long pause the origin, or close. The pause is
+ * RTMP_ToggleStream in two steps, as its sleep would hold up the loop.
+ */
+static void
+SweepSessions(STREAMING_SERVER *server)
+{
+  STREAMING_SESSION *s, *next;
+  uint32_t now = RTMP_GetTime();
+
+  for (s = server->sessions; s; s = next)
+    {
+      next = s->next;
+      if (s->pausing)
+        {
+          if (now - s->pauseTime < 1000)
+            continue;
+          s->pausing = false;
+          if (RTMP_SendPause(&s->rc, false, s->rc.m_pauseStamp))
+            {
+              s->rc.m_pausing = 3;
+              s->paused = true;
+              s->active = now;
+              continue;
+            }
+        }
+      /* give more time to start up if we're not playing yet */
+      else if (now - s->active < (s->f_cur ? 30000 : 60000))
+        continue;
+      else if (s->f_cur && s->rc.m_mediaChannel && !s->paused)
+        {
+          s->rc.m_pauseStamp = RTMP_GetChannelTimestamp(&s->rc, s->rc.m_mediaChannel);
+          if (s->rc.m_pausing || RTMP_SendPause(&s->rc, true, s->rc.m_pauseStamp))
+            {
+              if (!s->rc.m_pausing)
+                s->rc.m_pausing = 1;
+              s->pausing = true;
+              s->pauseTime = now;
+              continue;
+            }
+        }
+      Log(LOGERROR, "Request timeout/select failed, ignoring request");
+      CloseSession(s);
+    }
+}
+
+static void
+FreeDead(STREAMING_SERVER *server)
+{
+  while (server->dead)
+    {
+      STREAMING_SESSION *s = server->dead;
+      server->dead = s->next;
+      FreeSession(s);
+    }
+}
+
+TFTYPE
+serverThread(void *arg)
+{
+  STREAMING_SERVER *server = arg;
+  struct epoll_event events[MAX_EVENTS];
+  uint32_t lastSweep = RTMP_GetTime();
+  bool busy;
+
+  while (STATE_GET(server->state) == STREAMING_ACCEPTING)
+    {
+      int i, n = epoll_wait(server->epfd, events, MAX_EVENTS, 1000);
+
+      if (n < 0 && GetSockError() != EINTR)
 	{
-	  Log(LOGERROR, "%s: accept failed", __FUNCTION__);
+	  Log(LOGERROR, "%s: epoll_wait failed, error: %d", __FUNCTION__,
+	      GetSockError());
+	  break;
 	}
+
+      for (i = 0; i < n; i++)
+	{
+	  STREAMING_HANDLE *h = events[i].data.ptr;
+	  switch (h->kind)
+	    {
+	    case HANDLE_LISTEN:
+	      AcceptSessions(server);
+	      break;
+	    case HANDLE_WAKE:
+	      TakeReady(server);
+	      break;
+	    default:
+	      if (h->session->state == SESSION_RELAYING)
+		SessionEvent(h->session, h->kind, events[i].events);
+	      break;
+	    }
+	}
+
+      if (RTMP_GetTime() - lastSweep >= 1000)
+	{
+	  SweepSessions(server);
+	  ReportRecorder(&server->recorder);
+	  lastSweep = RTMP_GetTime();
+	}
+
+      FreeDead(server);
     }
-  server->state = STREAMING_STOPPED;
+
+  /* from here on setup threads clean up after themselves, they end
+   * within their timeouts */
+  pthread_mutex_lock(&server->lock);
+  server->stopped = true;
+  pthread_mutex_unlock(&server->lock);
+  do
+    {
+      pthread_mutex_lock(&server->lock);
+      busy = server->setup != NULL;
+      pthread_mutex_unlock(&server->lock);
+      if (busy)
+	msleep(10);
+    }
+  while (busy);
+  TakeReady(server);
+
+  while (server->sessions)
+    CloseSession(server->sessions);
+  FreeDead(server);
+  StopRecorder(&server->recorder);
+  close(server->epfd);
+  close(server->wake[0]);
+  close(server->wake[1]);
+
+  STATE_SET(server->state, STREAMING_STOPPED);
   TFRET();
 }
 
@@ -1003,6 +2300,7 @@ STREAMING_SERVER *
 startStreaming(const char *address, int port)
 {
   struct sockaddr_in addr;
+  struct epoll_event ev = { 0 };
   int sockfd, tmp;
   STREAMING_SERVER *server;
 
@@ -1029,16 +2327,43 @@ startStreaming(const char *address, int port)
       return 0;
     }
 
-  if (listen(sockfd, 10) == -1)
+  if (listen(sockfd, SOMAXCONN) == -1)
     {
       Log(LOGERROR, "%s, listen failed", __FUNCTION__);
       closesocket(sockfd);
       return 0;
     }
+  SetBlocking(sockfd, false);
 
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
+  server->listen.kind = HANDLE_LISTEN;
+  server->waker.kind = HANDLE_WAKE;
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_mutex_init(&server->recorder.lock, NULL);
+  pthread_cond_init(&server->recorder.cond, NULL);
+  pthread_cond_init(&server->recorder.written, NULL);
+
+  server->epfd = epoll_create(MAX_EVENTS);
+  if (server->epfd == -1 || pipe(server->wake) == -1)
+    {
+      Log(LOGERROR, "%s, couldn't create the event loop, error: %d",
+	  __FUNCTION__, GetSockError());
+      closesocket(sockfd);
+      free(server);
+      return 0;
+    }
+  SetBlocking(server->wake[0], false);
+  SetBlocking(server->wake[1], false);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &server->listen;
+  epoll_ctl(server->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+  ev.data.ptr = &server->waker;
+  epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->wake[0], &ev);
 
+  STATE_SET(server->state, STREAMING_ACCEPTING);
+  ThreadCreate(recorderThread, &server->recorder);
   ThreadCreate(serverThread, server);
 
   return server;
@@ -1049,24 +2374,21 @@ stopStreaming(STREAMING_SERVER * server)
 {
   assert(server);
 
-  if (server->state != STREAMING_STOPPED)
+  if (STATE_GET(server->state) != STREAMING_STOPPED)
     {
-      int fd = server->socket;
-      server->socket = 0;
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
+      STATE_SET(server->state, STREAMING_STOPPING);
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
+      /* wait for the event loop to close the sessions and exit */
+      pthread_mutex_lock(&server->lock);
+      if (!server->stopped)
+	write(server->wake[1], "", 1);
+      pthread_mutex_unlock(&server->lock);
+      while (STATE_GET(server->state) != STREAMING_STOPPED)
+	msleep(1);
 
-      if (fd && closesocket(fd))
+      if (closesocket(server->socket))
 	Log(LOGERROR, "%s: Failed to close listening socket, error %d",
-	    GetSockError());
-
-      server->state = STREAMING_STOPPED;
+	    __FUNCTION__, GetSockError());
     }
 }
 
@@ -1125,7 +2447,7 @@ main(int argc, char **argv)
   LogPrintf("Streaming on rtmp://%s:%d\n", rtmpStreamingDevice,
 	    nRtmpStreamingPort);
 
-  while (rtmpServer->state != STREAMING_STOPPED)
+  while (STATE_GET(rtmpServer->state) != STREAMING_STOPPED)
     {
       sleep(1);
     }
@@ -28,6 +28,13 @@
 
 #include <assert.h>
 
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
 #include "rtmp.h"
 #include "parseurl.h"
 
@@ -37,7 +44,25 @@
 #define RD_FAILED		1
 #define RD_INCOMPLETE		2
 
-#define PACKET_SIZE 1024*1024
+#define MAX_EVENTS	64	// events taken per epoll_wait
+#define ACCEPT_BATCH	16	// connections taken per wakeup, the other reactors get the rest
+#define MAX_FILLS	16	// upstream reads per wakeup, so one stream can't hold up the others
+#define MAX_IOV		64	// buffers per writev to a client
+#define OUT_HIGH	(1024*1024)	// stop reading a private upstream with this much unsent to the client
+#define OUT_LOW		(256*1024)	// and read again once below this
+#define RING_TAGS	1024	// FLV tags a channel keeps, must be a power of 2
+#define REQUEST_TIMEOUT	5000	// ms to wait for the request header
+#define MAX_KEPT	32	// strings a request may allocate
+#define CACHE_MB	1024	// default size of the VOD cache
+
+// the server state is read by every event loop
+#ifdef __ATOMIC_SEQ_CST
+#define STATE_GET(v)		__atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define STATE_SET(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#else
+#define STATE_GET(v)		(__sync_synchronize(), (v))
+#define STATE_SET(v, x)	do { __sync_synchronize(); (v) = (x); __sync_synchronize(); } while (0)
+#endif
 
 #ifdef WIN32
 #define InitSockets()	{\
@@ -56,17 +81,90 @@
 enum
 {
   STREAMING_ACCEPTING,
-  STREAMING_IN_PROGRESS,
   STREAMING_STOPPING,
   STREAMING_STOPPED
 };
 
+// what a client connection waits for
+enum
+{
+  CONN_REQUEST,			// the request header
+  CONN_STREAMING,		// its channel's tags, or room to send them
+  CONN_DRAINING,		// room to send the rest of the reply
+  CONN_CLOSED			// to be freed once the current events are handled
+};
+
+// what a channel waits for
+enum
+{
+  CHANNEL_CONNECTING,		// the upstream connect, done on a thread of its own
+  CHANNEL_PLAYING,		// upstream data
+  CHANNEL_DONE,			// its viewers to take the rest
+  CHANNEL_CLOSED		// to be freed once the current events are handled
+};
+
+// what an epoll event is for
+enum
+{
+  HANDLE_LISTEN,
+  HANDLE_WAKE,
+  HANDLE_CLIENT,
+  HANDLE_UPSTREAM
+};
+
+typedef struct STREAMING_SERVER STREAMING_SERVER;
+typedef struct STREAMING_REACTOR STREAMING_REACTOR;
+typedef struct STREAMING_CHANNEL STREAMING_CHANNEL;
+typedef struct STREAMING_CONN STREAMING_CONN;
+
 typedef struct
+{
+  int kind;
+  STREAMING_CONN *conn;		// for HANDLE_CLIENT
+  STREAMING_CHANNEL *channel;	// for HANDLE_UPSTREAM
+} STREAMING_HANDLE;
+
+/* One FLV tag as a channel's clients get it, prevTagSize included.
+ * Shared by the ring and any client part way through sending it. */
+typedef struct
+{
+  int refs;
+  uint64_t pos;			// where it starts in the channel's stream
+  uint32_t size;
+  char data[];
+} STREAMING_TAG;
+
+/* An epoll loop on a thread of its own, one per core. Each one accepts
+ * from the shared listening socket and serves the clients it accepted
+ * until they close. Nothing blocks in the loop: the client and upstream
+ * sockets are non-blocking, and only the upstream connect, with its
+ * name lookup and handshake, is handed to a thread.
+ */
+struct STREAMING_REACTOR
+{
+  STREAMING_SERVER *server;
+  int epfd;
+  int wake[2];			// pipe to break out of epoll_wait
+  STREAMING_HANDLE listen, waker;
+  STREAMING_CONN *conns;	// clients it serves
+  STREAMING_CONN *dead;		// closed, freed after the current events
+  STREAMING_CHANNEL *deadChannels;
+
+  pthread_mutex_t lock;		// for connected, incoming, stopped and writing to wake
+  STREAMING_CHANNEL *connected;	// handed back by connect threads
+  STREAMING_CONN *incoming;	// clients of a channel it runs, from other reactors
+  bool stopped;			// the loop has exited
+};
+
+struct STREAMING_SERVER
 {
   int socket;
   int state;
 
-} STREAMING_SERVER;
+  STREAMING_REACTOR *reactors;
+  int nReactors;
+  int running;			// reactors that haven't exited yet
+};
 
 STREAMING_SERVER *httpServer = 0;	// server structure pointer
 
@@ -108,6 +206,108 @@ typedef struct
 
 } RTMP_REQUEST;
 
+/* An upstream stream and the FLV tags it made lately, for the clients
+ * watching it. A live stream is shared, by all the clients asking for
+ * the same url and playpath; anything else gets a channel of its own.
+ * A channel and its clients are all served by the same reactor, so none
+ * of it needs locking.
+ */
+struct STREAMING_CHANNEL
+{
+  STREAMING_REACTOR *reactor;
+  STREAMING_CHANNEL *next;	// handed back by the connect thread, or dead
+  STREAMING_CHANNEL *shareNext;	// in sharedChannels
+  char *key;			// shared channels only
+  int state;
+  STREAMING_HANDLE upstream;
+  bool reading;			// upstream socket is watched for reading
+  bool writing;			// and for room, while sends wait
+  bool failed;			// the upstream connect failed
+
+  RTMP_REQUEST req;		// of the client that opened it
+  char *kept[MAX_KEPT];		// strings req points into, ours to free
+  int nKept;
+  uint32_t dSeek;		// can be used to start from a later point in the stream
+  uint64_t rangeStart;		// of its client, until onMetaData maps it to dSeek
+  RTMP rtmp;
+  RTMPPacket packet;		// the one being read, chunk by chunk
+  char *buf;			// FLV of the last packet
+  unsigned int bufSize;
+
+  STREAMING_TAG *ring[RING_TAGS];
+  uint64_t head;		// tags added so far, the next goes to ring[head % RING_TAGS]
+  uint64_t keyframe;		// the latest video keyframe, if hasKeyframe
+  bool hasKeyframe;
+  uint64_t bytes;		// in the tags added so far
+  STREAMING_TAG *meta, *audioConfig, *videoConfig;	// what a decoder needs first
+
+  STREAMING_CONN *viewers;
+  int nViewers;			// it closes when the last one leaves
+
+  int cacheFd;			// the cache file it fills, or -1; its viewers read that instead of the ring
+  uint64_t cacheHash;
+  off_t cached;			// bytes in the cache file so far
+  bool complete;		// upstream got to the end of the stream
+};
+
+struct STREAMING_CONN
+{
+  STREAMING_REACTOR *reactor;
+  STREAMING_CONN *next, *prev;	// on the reactor's list
+  int state;
+  int sockfd;			// client connection socket
+  uint32_t accepted;		// RTMP_GetTime() at accept
+  STREAMING_HANDLE client;
+  bool writing;			// waiting for room to send to the client
+
+  char header[2048];		// request header
+  size_t nHeader;
+
+  RTMP_REQUEST req;		// handed to the channel it opens
+  char *kept[MAX_KEPT];		// strings req points into, ours to free
+  int nKept;
+  uint32_t dSeek;
+  uint64_t rangeStart;		// from a Range header, 0 if none
+  uint64_t rangeEnd;		// its last byte, 0 if to the end
+  unsigned long sizeEnd;	// size to stop at for that, 0 if none
+
+  STREAMING_CHANNEL *channel;	// the one it watches
+  STREAMING_CONN *viewNext, *viewPrev;	// on the channel's list
+  uint64_t seq;			// the next tag of the channel to send
+  STREAMING_TAG *tag;		// the one before that, if only partly sent
+  uint32_t offset;		// into tag
+
+  char *out;			// reply header and the like, sent before any tags
+  size_t outSize, outStart, outEnd;
+  unsigned long size;		// bytes sent, with the reply header
+
+  int fileFd;			// cache file it's sent, after out; -1 if none
+  off_t filePos, fileEnd;	// fileEnd if it's complete, else what its channel has cached
+};
+
+// live channels new clients may join
+static STREAMING_CHANNEL *sharedChannels;
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A complete FLV in the cache directory, named by the hash of the key
+ * of the request it was relayed for. */
+typedef struct STREAMING_CACHED
+{
+  struct STREAMING_CACHED *next, *prev;	// most recently used first
+  uint64_t hash;
+  off_t size;
+} STREAMING_CACHED;
+
+static char *cacheDir;		// NULL if there's no cache
+static uint64_t cacheMax = (uint64_t) CACHE_MB * 1024 * 1024;
+static STREAMING_CACHED *cacheHead, *cacheTail;
+static uint64_t cacheSize;	// of all the files in the list
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// ends the status line of every reply
+static const char srvhead[] =
+  "\r\nServer:HTTP-RTMP Stream Server \r\nContent-Type: Video/MPEG \r\n\r\n";
+
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
 
 int
@@ -292,37 +492,38 @@ WriteHeader(char **buf,		// target pointer, maybe preallocated
   return size;
 }
 
+// turns a packet RTMP_ClientPacket returned rtnGetNextMediaPacket for into FLV
 int
-WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
+WritePacket(RTMPPacket * packet,	// ready packet
+	    int rtnGetNextMediaPacket,	// what RTMP_ClientPacket returned for it
+	    char **buf,		// target pointer, maybe preallocated
 	    unsigned int len,	// length of buffer if preallocated
 	    uint32_t * nTimeStamp)
 {
   uint32_t prevTagSize = 0;
-  int rtnGetNextMediaPacket = 0, ret = -1;
-  RTMPPacket packet = { 0 };
+  int ret = -1;
 
-  rtnGetNextMediaPacket = RTMP_GetNextMediaPacket(rtmp, &packet);
   while (rtnGetNextMediaPacket)
     {
-      char *packetBody = packet.m_body;
-      unsigned int nPacketLen = packet.m_nBodySize;
+      char *packetBody = packet->m_body;
+      unsigned int nPacketLen = packet->m_nBodySize;
 
       // skip video info/command packets
-      if (packet.m_packetType == 0x09 &&
+      if (packet->m_packetType == 0x09 &&
 	  nPacketLen == 2 && ((*packetBody & 0xf0) == 0x50))
 	{
 	  ret = 0;
 	  break;
 	}
 
-      if (packet.m_packetType == 0x09 && nPacketLen <= 5)
+      if (packet->m_packetType == 0x09 && nPacketLen <= 5)
 	{
 	  Log(LOGWARNING, "ignoring too small video packet: size: %d",
 	      nPacketLen);
 	  ret = 0;
 	  break;
 	}
-      if (packet.m_packetType == 0x08 && nPacketLen <= 1)
+      if (packet->m_packetType == 0x08 && nPacketLen <= 1)
 	{
 	  Log(LOGWARNING, "ignoring too small audio packet: size: %d",
 	      nPacketLen);
@@ -330,17 +531,17 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 	  break;
 	}
 #ifdef _DEBUG
-      Log(LOGDEBUG, "type: %02X, size: %d, TS: %d ms", packet.m_packetType,
-	  nPacketLen, packet.m_nTimeStamp);
-      if (packet.m_packetType == 0x09)
+      Log(LOGDEBUG, "type: %02X, size: %d, TS: %d ms", packet->m_packetType,
+	  nPacketLen, packet->m_nTimeStamp);
+      if (packet->m_packetType == 0x09)
 	Log(LOGDEBUG, "frametype: %02X", (*packetBody & 0xf0));
 #endif
 
       // calculate packet size and reallocate buffer if necessary
       unsigned int size = nPacketLen
 	+
-	((packet.m_packetType == 0x08 || packet.m_packetType == 0x09
-	  || packet.m_packetType == 0x12) ? 11 : 0) + (packet.m_packetType !=
+	((packet->m_packetType == 0x08 || packet->m_packetType == 0x09
+	  || packet->m_packetType == 0x12) ? 11 : 0) + (packet->m_packetType !=
 						       0x16 ? 4 : 0);
 
       if (size + 4 > len)
@@ -357,16 +558,16 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 
       // audio (0x08), video (0x09) or metadata (0x12) packets :
       // construct 11 byte header then add rtmp packet's data
-      if (packet.m_packetType == 0x08 || packet.m_packetType == 0x09
-	  || packet.m_packetType == 0x12)
+      if (packet->m_packetType == 0x08 || packet->m_packetType == 0x09
+	  || packet->m_packetType == 0x12)
 	{
 	  // set data type
-	  //*dataType |= (((packet.m_packetType == 0x08)<<2)|(packet.m_packetType == 0x09));
+	  //*dataType |= (((packet->m_packetType == 0x08)<<2)|(packet->m_packetType == 0x09));
 
-	  (*nTimeStamp) = packet.m_nTimeStamp;
+	  (*nTimeStamp) = packet->m_nTimeStamp;
 	  prevTagSize = 11 + nPacketLen;
 
-	  *ptr++ = packet.m_packetType;
+	  *ptr++ = packet->m_packetType;
 	  ptr = AMF_EncodeInt24(ptr, pend, nPacketLen);
 	  ptr = AMF_EncodeInt24(ptr, pend, *nTimeStamp);
 	  *ptr = (char) (((*nTimeStamp) & 0xFF000000) >> 24);
@@ -380,7 +581,7 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
       unsigned int len = nPacketLen;
 
       // correct tagSize and obtain timestamp if we have an FLV stream
-      if (packet.m_packetType == 0x16)
+      if (packet->m_packetType == 0x16)
 	{
 	  unsigned int pos = 0;
 
@@ -431,172 +632,1708 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 			  dataSize + 11);
 #endif
 
-		      prevTagSize = dataSize + 11;
-		      AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend, prevTagSize);
-		    }
-		}
+		      prevTagSize = dataSize + 11;
+		      AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend, prevTagSize);
+		    }
+		}
+
+	      pos += prevTagSize + 4;	//(11+dataSize+4);
+	    }
+	}
+      ptr += len;
+
+      if (packet->m_packetType != 0x16)
+	{			// FLV tag packets contain their own prevTagSize
+	  AMF_EncodeInt32(ptr, pend, prevTagSize);
+	  //ptr += 4;
+	}
+
+      // Return 0 if this was completed nicely with invoke message Play.Stop or Play.Complete
+      if (rtnGetNextMediaPacket == 2)
+	{
+	  Log(LOGDEBUG,
+	      "Got Play.Complete or Play.Stop from server. Assuming stream is complete");
+	  ret = 0;
+	  break;
+	}
+
+      ret = size;
+      break;
+    }
+
+  return ret;			// no more media packets
+}
+
+TFTYPE
+controlServerThread(void *unused)
+{
+  int ich;
+  while (1)
+    {
+      ich = getchar();
+      if (ich == EOF)
+	break;			// no terminal, don't spin on it
+      switch (ich)
+	{
+	case 'q':
+	  LogPrintf("Exiting\n");
+	  stopStreaming(httpServer);
+	  exit(0);
+	  break;
+	default:
+	  LogPrintf("Unknown command \'%c\', ignoring\n", ich);
+	}
+    }
+  TFRET();
+}
+
+/*
+ssize_t readHTTPLine(int sockfd, char *buffer, size_t length)
+{
+	size_t i=0;
+
+	while(i < length-1) {
+		char c;
+		int n = read(sockfd, &c, 1);
+
+		if(n == 0)
+			break;
+
+		buffer[i] = c;
+		i++;
+
+		if(c == '\n')
+			break;
+	}
+	buffer[i]='\0';
+	i++;
+
+	return i;
+}
+
+bool isHTTPRequestEOF(char *line, size_t length)
+{
+	if(length < 2)
+		return true;
+
+	if(line[0]=='\r' && line[1]=='\n')
+		return true;
+
+	return false;
+}
+*/
+
+#define HASH_START	0xcbf29ce484222325ULL
+
+// FNV-1a, going on from hash
+static uint64_t
+HashBytes(uint64_t hash, const char *data, size_t len)
+{
+  while (len--)
+    {
+      hash ^= (unsigned char) *data++;
+      hash *= 0x100000001b3ULL;
+    }
+  return hash;
+}
+
+// cache files are named by it
+static uint64_t
+HashKey(const char *key)
+{
+  return HashBytes(HASH_START, key, strlen(key));
+}
+
+static void
+CachePath(char *path, uint64_t hash, const char *ext)
+{
+  snprintf(path, PATH_MAX, "%s/%016llx%s", cacheDir,
+	   (unsigned long long) hash, ext);
+}
+
+static void
+UnlinkCached(STREAMING_CACHED * c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    cacheHead = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    cacheTail = c->prev;
+  cacheSize -= c->size;
+}
+
+static void
+LinkCached(STREAMING_CACHED * c)
+{
+  c->prev = NULL;
+  c->next = cacheHead;
+  if (cacheHead)
+    cacheHead->prev = c;
+  else
+    cacheTail = c;
+  cacheHead = c;
+  cacheSize += c->size;
+}
+
+// drop the least recently used files until the cache fits, call locked
+static void
+EvictCached(void)
+{
+  char path[PATH_MAX];
+
+  while (cacheSize > cacheMax && cacheTail)
+    {
+      STREAMING_CACHED *c = cacheTail;
+      UnlinkCached(c);
+      CachePath(path, c->hash, ".flv");
+      Log(LOGDEBUG, "%s: evicting %s", __FUNCTION__, path);
+      unlink(path);		// those sending it keep it open
+      free(c);
+    }
+}
+
+static void
+AddCached(uint64_t hash, off_t size)
+{
+  STREAMING_CACHED *c;
+
+  pthread_mutex_lock(&cacheLock);
+  for (c = cacheHead; c; c = c->next)
+    if (c->hash == hash)
+      break;
+  if (c)
+    UnlinkCached(c);
+  else
+    c = malloc(sizeof(STREAMING_CACHED));
+  if (c)
+    {
+      c->hash = hash;
+      c->size = size;
+      LinkCached(c);
+    }
+  EvictCached();
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// open the cached file for hash, if there is one
+static int
+OpenCached(uint64_t hash, off_t * size)
+{
+  STREAMING_CACHED *c;
+  char path[PATH_MAX];
+  int fd = -1;
+
+  pthread_mutex_lock(&cacheLock);
+  for (c = cacheHead; c; c = c->next)
+    if (c->hash == hash)
+      break;
+  if (c)
+    {
+      CachePath(path, hash, ".flv");
+      UnlinkCached(c);
+      fd = open(path, O_RDONLY);
+      if (fd >= 0)
+	{
+	  LinkCached(c);
+	  *size = c->size;
+	}
+      else
+	free(c);		// removed behind our back
+    }
+  pthread_mutex_unlock(&cacheLock);
+  return fd;
+}
+
+typedef struct
+{
+  time_t mtime;
+  uint64_t hash;
+  off_t size;
+} CACHE_FILE;
+
+static int
+CompareMtime(const void *a, const void *b)
+{
+  const CACHE_FILE *fa = a, *fb = b;
+
+  return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+/* Take over what an earlier run left in the cache directory, the most
+ * recently written first in line. Partly filled files are removed. */
+static bool
+LoadCache(void)
+{
+  DIR *dir = opendir(cacheDir);
+  struct dirent *de;
+  CACHE_FILE *files = NULL;
+  int n = 0, max = 0, i;
+
+  if (!dir)
+    {
+      Log(LOGERROR, "Can't open the cache directory %s", cacheDir);
+      return false;
+    }
+
+  while ((de = readdir(dir)) != NULL)
+    {
+      char path[PATH_MAX];
+      struct stat st;
+
+      if (strspn(de->d_name, "0123456789abcdef") != 16)
+	continue;
+
+      snprintf(path, PATH_MAX, "%s/%s", cacheDir, de->d_name);
+      if (strcmp(de->d_name + 16, ".part") == 0)
+	{
+	  unlink(path);
+	  continue;
+	}
+      if (strcmp(de->d_name + 16, ".flv") != 0 || stat(path, &st) != 0
+	  || !S_ISREG(st.st_mode))
+	continue;
+
+      if (n == max)
+	{
+	  CACHE_FILE *more;
+	  max = max ? max * 2 : 64;
+	  more = realloc(files, max * sizeof(CACHE_FILE));
+	  if (!more)
+	    break;
+	  files = more;
+	}
+      files[n].mtime = st.st_mtime;
+      files[n].hash = strtoull(de->d_name, NULL, 16);
+      files[n].size = st.st_size;
+      n++;
+    }
+  closedir(dir);
+
+  if (n)
+    qsort(files, n, sizeof(CACHE_FILE), CompareMtime);
+  for (i = 0; i < n; i++)
+    AddCached(files[i].hash, files[i].size);
+  free(files);
+
+  LogPrintf("Cache %s: %d files, %.1f MB\n", cacheDir, n,
+	    (double) cacheSize / (1024.0 * 1024.0));
+  return true;
+}
+
+static void
+SetBlocking(int sockfd, bool blocking)
+{
+  int flags = fcntl(sockfd, F_GETFL, 0);
+
+  if (blocking)
+    flags &= ~O_NONBLOCK;
+  else
+    flags |= O_NONBLOCK;
+  fcntl(sockfd, F_SETFL, flags);
+}
+
+// false once the reactor has exited, it mustn't be touched then
+static bool
+WakeReactor(STREAMING_REACTOR * reactor)
+{
+  bool ok;
+
+  pthread_mutex_lock(&reactor->lock);
+  ok = !reactor->stopped;
+  if (ok)
+    write(reactor->wake[1], "", 1);
+  pthread_mutex_unlock(&reactor->lock);
+  return ok;
+}
+
+static void
+LinkConn(STREAMING_CONN * conn)
+{
+  STREAMING_REACTOR *reactor = conn->reactor;
+
+  conn->prev = NULL;
+  conn->next = reactor->conns;
+  if (reactor->conns)
+    reactor->conns->prev = conn;
+  reactor->conns = conn;
+}
+
+static void
+UnlinkConn(STREAMING_CONN * conn)
+{
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    conn->reactor->conns = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  conn->next = conn->prev = NULL;
+}
+
+static void
+ReleaseTag(STREAMING_TAG * tag)
+{
+  if (tag && --tag->refs == 0)
+    free(tag);
+}
+
+// keep tag in *cache instead of what was there
+static void
+CacheTag(STREAMING_TAG ** cache, STREAMING_TAG * tag)
+{
+  tag->refs++;
+  ReleaseTag(*cache);
+  *cache = tag;
+}
+
+/* Have ch write the stream to the cache, its viewers send it from there.
+ * The file only goes into the cache once upstream got to the end. */
+static bool
+StartCache(STREAMING_CHANNEL * ch, const char *key)
+{
+  char path[PATH_MAX], header[13], *ptr = header;
+  int nRead = WriteHeader(&ptr, sizeof(header));
+
+  ch->cacheHash = HashKey(key);
+  CachePath(path, ch->cacheHash, ".part");
+  ch->cacheFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ch->cacheFd < 0)
+    {
+      Log(LOGERROR, "%s, can't create %s", __FUNCTION__, path);
+      return false;
+    }
+  if (nRead <= 0 || write(ch->cacheFd, header, nRead) != nRead)
+    {
+      Log(LOGERROR, "%s, can't write to %s", __FUNCTION__, path);
+      close(ch->cacheFd);
+      ch->cacheFd = -1;
+      unlink(path);
+      return false;
+    }
+  ch->cached = nRead;
+  return true;
+}
+
+static bool
+WriteCached(STREAMING_CHANNEL * ch, const char *data, int len)
+{
+  while (len > 0)
+    {
+      ssize_t nWritten = write(ch->cacheFd, data, len);
+      if (nWritten < 0 && errno == EINTR)
+	continue;
+      if (nWritten <= 0)
+	{
+	  Log(LOGERROR, "%s, writing the cache file failed, error: %d",
+	      __FUNCTION__, errno);
+	  return false;
+	}
+      data += nWritten;
+      len -= nWritten;
+      ch->cached += nWritten;
+    }
+  return true;
+}
+
+// the file goes into the cache if it's complete, else it's dropped
+static void
+FinishCache(STREAMING_CHANNEL * ch)
+{
+  char part[PATH_MAX], path[PATH_MAX];
+
+  if (ch->cacheFd < 0)
+    return;
+
+  close(ch->cacheFd);
+  ch->cacheFd = -1;
+  CachePath(part, ch->cacheHash, ".part");
+  CachePath(path, ch->cacheHash, ".flv");
+  if (ch->complete && rename(part, path) == 0)
+    {
+      LogPrintf("Cached %s (%.3f KB)\n", ch->key,
+		(double) ch->cached / 1024.0);
+      AddCached(ch->cacheHash, ch->cached);
+    }
+  else
+    unlink(part);		// its viewers keep it open
+}
+
+static void
+FreeChannel(STREAMING_CHANNEL * ch)
+{
+  int i;
+
+  FinishCache(ch);
+  while (ch->nKept)
+    free(ch->kept[--ch->nKept]);
+  RTMPPacket_Free(&ch->packet);
+  RTMP_Close(&ch->rtmp);
+  for (i = 0; i < RING_TAGS; i++)
+    ReleaseTag(ch->ring[i]);
+  ReleaseTag(ch->meta);
+  ReleaseTag(ch->audioConfig);
+  ReleaseTag(ch->videoConfig);
+  free(ch->buf);
+  free(ch->key);
+  free(ch);
+}
+
+// new clients won't join it any more
+static void
+UnshareChannel(STREAMING_CHANNEL * ch)
+{
+  STREAMING_CHANNEL **p;
+
+  if (!ch->key)
+    return;
+
+  pthread_mutex_lock(&sharedLock);
+  for (p = &sharedChannels; *p; p = &(*p)->shareNext)
+    if (*p == ch)
+      {
+	*p = ch->shareNext;
+	break;
+      }
+  pthread_mutex_unlock(&sharedLock);
+}
+
+// the last viewer has left
+static void
+CloseChannel(STREAMING_CHANNEL * ch)
+{
+  UnshareChannel(ch);
+
+  // the connect thread still has it, it is freed when handed back
+  if (ch->state == CHANNEL_CONNECTING)
+    return;
+
+  if (ch->key)
+    LogPrintf("Closing shared upstream %s\n", ch->key);
+  RTMPPacket_Free(&ch->packet);
+  RTMP_Close(&ch->rtmp);	// closing the socket takes it out of the set
+  ch->reading = false;
+  ch->writing = false;
+  ch->state = CHANNEL_CLOSED;
+  ch->next = ch->reactor->deadChannels;
+  ch->reactor->deadChannels = ch;
+}
+
+// upstream is done, the viewers get what is in the ring
+static void
+EndStream(STREAMING_CHANNEL * ch)
+{
+  FinishCache(ch);
+  UnshareChannel(ch);
+  RTMP_Close(&ch->rtmp);
+  ch->reading = false;
+  ch->writing = false;
+  ch->state = CHANNEL_DONE;
+}
+
+static void
+Unview(STREAMING_CONN * conn)
+{
+  STREAMING_CHANNEL *ch = conn->channel;
+
+  if (conn->viewPrev)
+    conn->viewPrev->viewNext = conn->viewNext;
+  else
+    ch->viewers = conn->viewNext;
+  if (conn->viewNext)
+    conn->viewNext->viewPrev = conn->viewPrev;
+  conn->viewNext = conn->viewPrev = NULL;
+
+  ReleaseTag(conn->tag);
+  conn->tag = NULL;
+  conn->channel = NULL;
+
+  if (--ch->nViewers == 0)
+    CloseChannel(ch);
+}
+
+static void
+FreeConn(STREAMING_CONN * conn)
+{
+  while (conn->nKept)
+    free(conn->kept[--conn->nKept]);
+  ReleaseTag(conn->tag);
+  if (conn->sockfd)
+    closesocket(conn->sockfd);
+  if (conn->fileFd >= 0)
+    close(conn->fileFd);
+  free(conn->out);
+  free(conn);
+}
+
+/* Close the client. The memory stays until the reactor is done with the
+ * events it got, some of them may still be for this connection. */
+static void
+CloseConn(STREAMING_CONN * conn)
+{
+  STREAMING_REACTOR *reactor = conn->reactor;
+
+  if (conn->state == CONN_CLOSED)
+    return;
+
+  if (conn->state != CONN_REQUEST)
+    LogPrintf("Closing connection (%.3f KB sent)... ",
+	      (double) conn->size / 1024.0);
+
+  if (conn->channel)
+    Unview(conn);
+  closesocket(conn->sockfd);
+  conn->sockfd = 0;
+
+  if (conn->state != CONN_REQUEST)
+    LogPrintf("done!\n\n");
+
+  UnlinkConn(conn);
+  conn->state = CONN_CLOSED;
+  conn->next = reactor->dead;
+  reactor->dead = conn;
+}
+
+// make room for len more bytes after outEnd
+static bool
+ReserveOut(STREAMING_CONN * conn, size_t len)
+{
+  if (conn->outStart == conn->outEnd)
+    conn->outStart = conn->outEnd = 0;
+
+  if (conn->outSize - conn->outEnd >= len)
+    return true;
+
+  if (conn->outStart)
+    {
+      memmove(conn->out, conn->out + conn->outStart,
+	      conn->outEnd - conn->outStart);
+      conn->outEnd -= conn->outStart;
+      conn->outStart = 0;
+      if (conn->outSize - conn->outEnd >= len)
+	return true;
+    }
+
+  size_t size = conn->outSize * 2;
+  if (size < conn->outEnd + len)
+    size = conn->outEnd + len;
+  char *out = realloc(conn->out, size);
+  if (!out)
+    {
+      Log(LOGERROR, "Couldn't reallocate memory!");
+      return false;
+    }
+  conn->out = out;
+  conn->outSize = size;
+  return true;
+}
+
+static void
+QueueOut(STREAMING_CONN * conn, const char *buf, size_t len)
+{
+  if (ReserveOut(conn, len))
+    {
+      memcpy(conn->out + conn->outEnd, buf, len);
+      conn->outEnd += len;
+    }
+}
+
+// the FLV header every stream a client gets starts with
+static void
+QueueHeader(STREAMING_CONN * conn)
+{
+  char *ptr;
+  int nRead;
+
+  if (!ReserveOut(conn, 13))
+    return;
+  ptr = conn->out + conn->outEnd;
+  nRead = WriteHeader(&ptr, conn->outSize - conn->outEnd);
+  if (nRead > 0)
+    conn->outEnd += nRead;
+}
+
+static void
+WatchClient(STREAMING_CONN * conn, bool writing)
+{
+  struct epoll_event ev = { 0 };
+
+  if (conn->writing == writing)
+    return;
+
+  ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = &conn->client;
+  epoll_ctl(conn->reactor->epfd, EPOLL_CTL_MOD, conn->sockfd, &ev);
+  conn->writing = writing;
+}
+
+static void
+WatchUpstream(STREAMING_CHANNEL * ch, bool reading)
+{
+  struct epoll_event ev = { 0 };
+  bool writing = RTMP_WritePending(&ch->rtmp);
+  int op;
+
+  if (ch->reading == reading && ch->writing == writing)
+    return;
+
+  ev.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = &ch->upstream;
+  if (!ch->reading && !ch->writing)
+    op = EPOLL_CTL_ADD;
+  else if (!reading && !writing)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+  epoll_ctl(ch->reactor->epfd, op, ch->rtmp.m_socket, &ev);
+  ch->reading = reading;
+  ch->writing = writing;
+}
+
+// bytes and tags the client has yet to get of what its channel has
+static bool
+Behind(STREAMING_CONN * conn, uint64_t bytes, uint64_t tags)
+{
+  STREAMING_CHANNEL *ch = conn->channel;
+  uint64_t pos;
+
+  if (ch->head - conn->seq > tags)
+    return true;
+
+  if (conn->tag)
+    pos = conn->tag->pos + conn->offset;
+  else if (conn->seq < ch->head)
+    pos = ch->ring[conn->seq & (RING_TAGS - 1)]->pos;
+  else
+    pos = ch->bytes;
+  return ch->bytes - pos + (conn->outEnd - conn->outStart) > bytes;
+}
+
+// account for nWritten bytes of what FlushClient gave writev
+static void
+Sent(STREAMING_CONN * conn, size_t nWritten)
+{
+  STREAMING_CHANNEL *ch = conn->channel;
+  size_t len = conn->outEnd - conn->outStart;
+
+  conn->size += nWritten;
+
+  if (len)
+    {
+      if (nWritten < len)
+	{
+	  conn->outStart += nWritten;
+	  return;
+	}
+      nWritten -= len;
+      conn->outStart = conn->outEnd = 0;
+    }
+
+  if (conn->tag)
+    {
+      len = conn->tag->size - conn->offset;
+      if (nWritten < len)
+	{
+	  conn->offset += nWritten;
+	  return;
+	}
+      nWritten -= len;
+      ReleaseTag(conn->tag);
+      conn->tag = NULL;
+    }
+
+  while (nWritten)
+    {
+      STREAMING_TAG *tag = ch->ring[conn->seq++ & (RING_TAGS - 1)];
+      if (nWritten < tag->size)
+	{
+	  // the ring may drop it before the rest is out
+	  tag->refs++;
+	  conn->tag = tag;
+	  conn->offset = nWritten;
+	  return;
+	}
+      nWritten -= tag->size;
+    }
+}
+
+// the first len bytes of iov, how many of its n it takes
+static int
+ClipIov(struct iovec *iov, int n, size_t len)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (iov[i].iov_len >= len)
+	{
+	  iov[i].iov_len = len;
+	  return i + 1;
+	}
+      len -= iov[i].iov_len;
+    }
+  return n;
+}
+
+/* Send what the socket takes: the reply so far, then the tags of the
+ * channel or what there is of the cache file. Closes the client once
+ * everything is out and nothing more will come. */
+static void
+FlushClient(STREAMING_CONN * conn)
+{
+  STREAMING_CHANNEL *ch = conn->channel;
+
+  while (1)
+    {
+      struct iovec iov[MAX_IOV];
+      uint64_t seq;
+      int n = 0, nWritten;
+
+      if (ch && ch->head - conn->seq > RING_TAGS)
+	{
+	  // so far behind its tags are gone, go on from the latest keyframe
+	  seq = ch->head;
+	  if (ch->hasKeyframe && ch->head - ch->keyframe <= RING_TAGS)
+	    seq = ch->keyframe;
+	  Log(LOGWARNING, "%s, client too slow, skipping %llu tags",
+	      __FUNCTION__, (unsigned long long) (seq - conn->seq));
+	  conn->seq = seq;
+	}
+
+      if (conn->outStart < conn->outEnd)
+	{
+	  iov[n].iov_base = conn->out + conn->outStart;
+	  iov[n++].iov_len = conn->outEnd - conn->outStart;
+	}
+      if (conn->tag)
+	{
+	  iov[n].iov_base = conn->tag->data + conn->offset;
+	  iov[n++].iov_len = conn->tag->size - conn->offset;
+	}
+      for (seq = conn->seq; ch && seq < ch->head && n < MAX_IOV; seq++)
+	{
+	  STREAMING_TAG *tag = ch->ring[seq & (RING_TAGS - 1)];
+	  iov[n].iov_base = tag->data;
+	  iov[n++].iov_len = tag->size;
+	}
+      if (conn->sizeEnd)
+	{
+	  if (conn->size >= conn->sizeEnd)
+	    {
+	      // the end of its range
+	      CloseConn(conn);
+	      return;
+	    }
+	  n = ClipIov(iov, n, conn->sizeEnd - conn->size);
+	}
+      if (!n)
+	break;
+
+      nWritten = writev(conn->sockfd, iov, n);
+      if (nWritten < 0)
+	{
+	  int sockerr = GetSockError();
+	  if (sockerr == EINTR)
+	    continue;
+	  if (sockerr == EAGAIN || sockerr == EWOULDBLOCK)
+	    {
+	      WatchClient(conn, true);
+	      return;
+	    }
+	  Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
+	      sockerr);
+	  CloseConn(conn);
+	  return;
+	}
+      Sent(conn, nWritten);
+    }
+
+  // straight from the page cache
+  while (conn->fileFd >= 0)
+    {
+      off_t end = ch ? ch->cached : conn->fileEnd;
+      ssize_t nWritten;
+
+      if (conn->filePos >= end)
+	break;
+      nWritten = sendfile(conn->sockfd, conn->fileFd, &conn->filePos,
+			  end - conn->filePos);
+      if (nWritten <= 0)
+	{
+	  int sockerr = GetSockError();
+	  if (nWritten < 0 && sockerr == EINTR)
+	    continue;
+	  if (nWritten < 0 && (sockerr == EAGAIN || sockerr == EWOULDBLOCK))
+	    {
+	      WatchClient(conn, true);
+	      return;
+	    }
+	  Log(LOGERROR, "%s, sending the cache file failed, error: %d",
+	      __FUNCTION__, nWritten < 0 ? sockerr : 0);
+	  CloseConn(conn);
+	  return;
+	}
+      conn->size += nWritten;
+    }
+
+  if (conn->state == CONN_DRAINING || (ch && ch->state == CHANNEL_DONE))
+    CloseConn(conn);
+  else
+    WatchClient(conn, false);
+}
+
+/* The channel's FLV tags, as WritePacket made them, to the ring. Keeps
+ * the latest of what a decoder needs before it can start, and where the
+ * latest keyframe is. */
+static void
+AddTags(STREAMING_CHANNEL * ch, const char *data, int len)
+{
+  while (len >= 11 + 4)
+    {
+      uint32_t nBodySize = AMF_DecodeInt24(data + 1);
+      uint32_t size = 11 + nBodySize + 4;
+      STREAMING_TAG *tag, **slot;
+      const char *body;
+
+      if (size > (uint32_t) len)
+	{
+	  Log(LOGWARNING, "%s, truncated FLV tag, dropped", __FUNCTION__);
+	  break;
+	}
+
+      tag = malloc(sizeof(STREAMING_TAG) + size);
+      if (!tag)
+	{
+	  Log(LOGERROR, "%s, out of memory", __FUNCTION__);
+	  break;
+	}
+      tag->refs = 1;
+      tag->pos = ch->bytes;
+      tag->size = size;
+      memcpy(tag->data, data, size);
+
+      body = tag->data + 11;
+      switch (data[0])
+	{
+	case 0x12:
+	  if (nBodySize > 13 && memcmp(body, "\002\000\012onMetaData", 13) == 0)
+	    CacheTag(&ch->meta, tag);
+	  break;
+	case 0x08:		// AAC sequence header
+	  if (nBodySize > 1 && ((body[0] & 0xf0) >> 4) == 10 && body[1] == 0)
+	    CacheTag(&ch->audioConfig, tag);
+	  break;
+	case 0x09:		// AVC sequence header, or a keyframe
+	  if (nBodySize > 1 && (body[0] & 0x0f) == 7 && body[1] == 0)
+	    CacheTag(&ch->videoConfig, tag);
+	  else if (nBodySize > 0 && (body[0] & 0xf0) == 0x10)
+	    {
+	      ch->keyframe = ch->head;
+	      ch->hasKeyframe = true;
+	    }
+	  break;
+	}
+
+      slot = &ch->ring[ch->head & (RING_TAGS - 1)];
+      ReleaseTag(*slot);
+      *slot = tag;
+      ch->head++;
+      ch->bytes += size;
+
+      data += size;
+      len -= size;
+    }
+}
+
+static const AVal av_duration = AVC("duration");
+static const AVal av_filesize = AVC("filesize");
+static const AVal av_videodatarate = AVC("videodatarate");
+static const AVal av_audiodatarate = AVC("audiodatarate");
+static const AVal av_keyframes = AVC("keyframes");
+static const AVal av_filepositions = AVC("filepositions");
+static const AVal av_times = AVC("times");
+
+static double
+MetaNumber(AMFObject * obj, const AVal * name)
+{
+  AMFObjectProperty prop;
+
+  if (RTMP_FindFirstMatchingProperty(obj, name, &prop)
+      && prop.p_type == AMF_NUMBER)
+    return AMFProp_GetNumber(&prop);
+  return 0;
+}
+
+/* Map byte pos of a recorded stream to a time in ms, with the onMetaData
+ * body: the last keyframe at or before pos if it has a keyframes object,
+ * an estimate from the filesize or data rates if not. total is the size
+ * of the whole stream, 0 if unknown. */
+static bool
+RangeToTime(const char *body, int size, uint64_t pos, uint32_t * time,
+	    uint64_t * total)
+{
+  AMFObject obj, positions, times;
+  AMFObjectProperty prop;
+  double duration, rate;
+  bool found = false;
+  int i;
+
+  if (AMF_Decode(&obj, body, size, false) < 0)
+    {
+      Log(LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
+      return false;
+    }
+
+  duration = MetaNumber(&obj, &av_duration);	// s
+  rate = MetaNumber(&obj, &av_videodatarate)
+    + MetaNumber(&obj, &av_audiodatarate);	// kbit/s
+  *total = MetaNumber(&obj, &av_filesize);
+  if (!*total && duration > 0 && rate > 0)
+    *total = duration * rate * 1000 / 8;
+  if (*total && pos >= *total)
+    goto out;
+
+  if (RTMP_FindFirstMatchingProperty(&obj, &av_keyframes, &prop)
+      && prop.p_type == AMF_OBJECT)
+    {
+      AMFObject keyframes;
+      AMFObjectProperty *p, *t;
+
+      AMFProp_GetObject(&prop, &keyframes);
+      p = AMF_GetProp(&keyframes, &av_filepositions, -1);
+      t = AMF_GetProp(&keyframes, &av_times, -1);
+      if (p->p_type == AMF_OBJECT && t->p_type == AMF_OBJECT)
+	{
+	  AMFProp_GetObject(p, &positions);
+	  AMFProp_GetObject(t, &times);
+	  *time = 0;
+	  found = true;
+	  for (i = 0; i < positions.o_num && i < times.o_num; i++)
+	    {
+	      if (AMFProp_GetNumber(AMF_GetProp(&positions, NULL, i)) > pos)
+		break;
+	      *time = AMFProp_GetNumber(AMF_GetProp(&times, NULL, i)) * 1000;
+	    }
+	}
+    }
+  if (!found && duration > 0 && *total)
+    {
+      *time = pos * duration * 1000 / *total;
+      found = true;
+    }
+out:
+  AMF_Reset(&obj);
+  return found;
+}
+
+static void
+StartChannel(STREAMING_CHANNEL * ch);
+
+/* Sees the first tags of a channel whose client asked for a byte range.
+ * Once onMetaData maps the range to a time the client gets a 206 and a
+ * new FLV header, and upstream starts over from that time. True if the
+ * stream is there already and the tags go on to the ring. */
+static bool
+SeekRange(STREAMING_CHANNEL * ch, const char *data, int len)
+{
+  STREAMING_CONN *conn = ch->viewers;
+  unsigned long long start = ch->rangeStart, end;
+  uint64_t total = 0;
+  uint32_t time = 0;
+  bool found = false, media = false;
+  char buf[512];
+
+  while (len >= 11 + 4 && !found && !media)
+    {
+      uint32_t nBodySize = AMF_DecodeInt24(data + 1);
+      if (11 + nBodySize + 4 > (uint32_t) len)
+	break;
+      if (data[0] == 0x12 && nBodySize > 13
+	  && memcmp(data + 11, "\002\000\012onMetaData", 13) == 0)
+	{
+	  if (!RangeToTime(data + 11, nBodySize, start, &time, &total))
+	    break;
+	  found = true;
+	}
+      else if (data[0] == 0x08 || data[0] == 0x09)
+	media = true;		// too late for onMetaData
+      data += 11 + nBodySize + 4;
+      len -= 11 + nBodySize + 4;
+    }
+
+  if (!found && !media && len >= 11 + 4)
+    media = true;		// onMetaData that can't be used
+  if (!found)
+    {
+      if (!media)
+	return false;		// wait for it
+      LogPrintf("%s, Range from byte %llu can't be mapped to a seek\n",
+		__FUNCTION__, start);
+      sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s",
+	      srvhead);
+      QueueOut(conn, buf, strlen(buf));
+      conn->state = CONN_DRAINING;
+      EndStream(ch);
+      return false;
+    }
+
+  end = conn->rangeEnd;
+  if (total && (!end || end > total - 1))
+    end = total - 1;
+  if (total)
+    sprintf(buf,
+	    "HTTP/1.0 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu%s",
+	    start, end, (unsigned long long) total, srvhead);
+  else if (end)
+    sprintf(buf,
+	    "HTTP/1.0 206 Partial Content\r\nContent-Range: bytes %llu-%llu/*%s",
+	    start, end, srvhead);
+  else
+    sprintf(buf, "HTTP/1.0 206 Partial Content%s", srvhead);
+  QueueOut(conn, buf, strlen(buf));
+  // no more than the range says, whatever the stream from the seek has
+  if (conn->rangeEnd)
+    conn->sizeEnd = conn->size + conn->outEnd - conn->outStart
+      + (end - start + 1);
+  QueueHeader(conn);
+  ch->rangeStart = 0;
+
+  LogPrintf("Range from byte %llu, starting at TS: %u ms\n", start, time);
+  if (time == ch->dSeek)
+    return true;
+
+  // the packet goes back to the pool of the connection it came from
+  RTMPPacket_Free(&ch->packet);
+  RTMP_Close(&ch->rtmp);
+  ch->reading = false;
+  ch->writing = false;
+  ch->dSeek = time;
+  ch->state = CHANNEL_CONNECTING;
+  StartChannel(ch);
+  return false;
+}
+
+static void
+RelayPacket(STREAMING_CHANNEL * ch)
+{
+  RTMP *rtmp = &ch->rtmp;
+  RTMPPacket *packet = &ch->packet;
+  RTMP_REQUEST *req = &ch->req;
+  int rtn, nRead;
+
+  rtn = RTMP_ClientPacket(rtmp, packet);
+  if (rtn)
+    {
+      rtmp->m_bPlaying = true;
+
+      // the largest FLV a packet makes, so WritePacket never reallocates
+      if (packet->m_nBodySize + 11 + 4 + 4 > ch->bufSize)
+	{
+	  unsigned int size = packet->m_nBodySize + 11 + 4 + 4;
+	  char *buf = realloc(ch->buf, size);
+	  if (!buf)
+	    {
+	      Log(LOGERROR, "Couldn't reallocate memory!");
+	      EndStream(ch);
+	      goto done;
+	    }
+	  ch->buf = buf;
+	  ch->bufSize = size;
+	}
+      nRead = WritePacket(packet, rtn, &ch->buf, ch->bufSize,
+			  &req->nTimeStamp);
+      if (nRead < 0)
+	{
+	  EndStream(ch);
+	  goto done;
+	}
+      if (ch->rangeStart && !SeekRange(ch, ch->buf, nRead))
+	goto done;		// upstream starts over, or the range can't be had
+      if (ch->cacheFd < 0)
+	AddTags(ch, ch->buf, nRead);
+      else if (!WriteCached(ch, ch->buf, nRead))
+	{
+	  EndStream(ch);
+	  goto done;
+	}
+
+      if (rtn == 2)
+	{
+	  ch->complete = true;
+	  EndStream(ch);
+	  goto done;
+	}
+
+      // Force clean close if a specified stop offset is reached
+      if (req->dStopOffset && req->nTimeStamp >= req->dStopOffset)
+	{
+	  LogPrintf("\nStop offset has been reached at %.2f seconds\n",
+		    (double) req->dStopOffset / 1000.0);
+	  EndStream(ch);
+	}
+    }
+done:
+  RTMPPacket_Free(packet);
+}
+
+// read and relay whatever upstream has, never waiting for more
+static void
+ReadUpstream(STREAMING_CHANNEL * ch)
+{
+  RTMP *rtmp = &ch->rtmp;
+  STREAMING_CONN *conn, *next;
+  int nFills = 0;
+
+  while (ch->state == CHANNEL_PLAYING)
+    {
+      bool ok;
+      int len;
+
+      // a client of a shared channel that can't keep up skips ahead,
+      // the only client of any other holds upstream back
+      if (!ch->key && Behind(ch->viewers, OUT_HIGH, RING_TAGS / 2))
+	{
+	  WatchUpstream(ch, false);
+	  break;
+	}
+      WatchUpstream(ch, true);
+
+      len = RTMP_ChunkLength(rtmp);
+      if (len && len <= rtmp->m_nBufferSize)
+	ok = RTMP_ReadPacket(rtmp, &ch->packet);
+      else if (len > RTMP_BUFFER_CACHE_SIZE)
+	{
+	  // a chunk larger than the socket buffer is read in pieces, as
+	  // they come; RTMP_ReadPacket keeps its place in it
+	  rtmp->m_bTimedout = false;
+	  ok = RTMP_ReadPacket(rtmp, &ch->packet);
+	  if (ok && rtmp->m_bTimedout)
+	    break;		// nothing more for now
+	}
+      else
+	{
+	  if (nFills++ == MAX_FILLS)
+	    break;		// still readable, epoll brings us back
+	  rtmp->m_bTimedout = false;
+	  if (RTMPSockBuf_Fill(&rtmp->m_sb) > 0)
+	    continue;
+	  if (rtmp->m_bTimedout)
+	    break;		// nothing more for now
+	  Log(LOGDEBUG, "%s, upstream closed the connection", __FUNCTION__);
+	  ok = false;
+	}
+
+      if (!ok)
+	EndStream(ch);
+      else if (RTMPPacket_IsReady(&ch->packet))
+	RelayPacket(ch);
+    }
+
+  // what the reads answered may still wait for room
+  if (ch->state == CHANNEL_PLAYING)
+    WatchUpstream(ch, ch->reading);
+
+  // the last one to leave closes the channel
+  for (conn = ch->viewers; conn; conn = next)
+    {
+      next = conn->viewNext;
+      FlushClient(conn);
+    }
+}
+
+/* Connects upstream, on a thread of its own, as connecting blocks.
+ * The channel goes back to its reactor when done. */
+TFTYPE
+connectThread(void *arg)
+{
+  STREAMING_CHANNEL *ch = arg;
+  STREAMING_REACTOR *reactor = ch->reactor;
+  RTMP_REQUEST *req = &ch->req;
+  RTMP *rtmp = &ch->rtmp;
+
+  Log(LOGDEBUG, "Setting buffer time to: %dms", req->bufferTime);
+  RTMP_Init(rtmp);
+  RTMP_SetBufferMS(rtmp, req->bufferTime);
+  RTMP_SetupStream(rtmp, req->protocol, req->hostname, req->rtmpport, NULL,	// sockshost
+		   &req->playpath, &req->tcUrl, &req->swfUrl, &req->pageUrl, &req->app, &req->auth, &req->swfHash, req->swfSize, &req->flashVer, &req->subscribepath, ch->dSeek, -1,	// length
+		   req->bLiveStream, req->timeout);
+  /* backward compatibility, we always sent this as true before */
+  if (req->auth.av_len)
+    rtmp->Link.authflag = true;
+
+  rtmp->Link.extras = req->extras;
+  rtmp->Link.token = req->token;
+
+  LogPrintf("Connecting ... port: %d, app: %s\n", req->rtmpport,
+	    req->app.av_val);
+  if (!RTMP_Connect(rtmp, NULL))
+    {
+      LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      ch->failed = true;
+    }
+  else
+    SetBlocking(rtmp->m_socket, false);
+
+  pthread_mutex_lock(&reactor->lock);
+  if (!reactor->stopped)
+    {
+      ch->next = reactor->connected;
+      reactor->connected = ch;
+      write(reactor->wake[1], "", 1);
+      ch = NULL;
+    }
+  pthread_mutex_unlock(&reactor->lock);
+
+  if (ch)			// the server stopped meanwhile
+    FreeChannel(ch);
+  TFRET();
+}
+
+// back from connectThread
+static void
+Connected(STREAMING_CHANNEL * ch)
+{
+  STREAMING_CONN *conn, *next;
+
+  if (!ch->nViewers)
+    {
+      FreeChannel(ch);
+      return;
+    }
+
+  if (ch->failed || STATE_GET(ch->reactor->server->state) != STREAMING_ACCEPTING)
+    {
+      EndStream(ch);
+      for (conn = ch->viewers; conn; conn = next)
+	{
+	  next = conn->viewNext;
+	  FlushClient(conn);
+	}
+      return;
+    }
+
+  // the handshake may have left packets in the socket buffer
+  ch->state = CHANNEL_PLAYING;
+  ReadUpstream(ch);
+}
+
+// start sending ch to conn, from the latest keyframe if it has one
+static void
+View(STREAMING_CONN * conn, STREAMING_CHANNEL * ch)
+{
+  conn->channel = ch;
+  conn->viewPrev = NULL;
+  conn->viewNext = ch->viewers;
+  if (ch->viewers)
+    ch->viewers->viewPrev = conn;
+  ch->viewers = conn;
+  ch->nViewers++;
+
+  // write FLV header first, for a range once it's mapped to a seek; the
+  // cache file starts with one
+  if (ch->cacheFd >= 0)
+    {
+      char path[PATH_MAX];
+      CachePath(path, ch->cacheHash, ".part");
+      conn->fileFd = open(path, O_RDONLY);
+      if (conn->fileFd < 0)
+	{
+	  Log(LOGERROR, "%s, can't open %s", __FUNCTION__, path);
+	  CloseConn(conn);
+	  return;
+	}
+    }
+  else if (!ch->rangeStart)
+    QueueHeader(conn);
+  if (ch->meta)
+    QueueOut(conn, ch->meta->data, ch->meta->size);
+  if (ch->audioConfig)
+    QueueOut(conn, ch->audioConfig->data, ch->audioConfig->size);
+  if (ch->videoConfig)
+    QueueOut(conn, ch->videoConfig->data, ch->videoConfig->size);
+
+  conn->seq = ch->head;
+  if (ch->hasKeyframe && ch->head - ch->keyframe <= RING_TAGS)
+    conn->seq = ch->keyframe;
+
+  if (ch->key)
+    LogPrintf("%s: %d client(s) on %s\n", __FUNCTION__, ch->nViewers,
+	      ch->key);
+  if (ch->state != CHANNEL_CONNECTING)
+    FlushClient(conn);
+}
+
+// a channel for the request of conn, to be found under key if not NULL
+static STREAMING_CHANNEL *
+OpenChannel(STREAMING_CONN * conn, char *key)
+{
+  STREAMING_CHANNEL *ch = calloc(1, sizeof(STREAMING_CHANNEL));
+
+  if (!ch)
+    {
+      Log(LOGERROR, "%s: out of memory", __FUNCTION__);
+      free(key);
+      return NULL;
+    }
+  ch->reactor = conn->reactor;
+  ch->key = key;
+  ch->cacheFd = -1;
+  ch->state = CHANNEL_CONNECTING;
+  ch->upstream.kind = HANDLE_UPSTREAM;
+  ch->upstream.channel = ch;
+
+  // the request and the strings it points into are the channel's now
+  memcpy(&ch->req, &conn->req, sizeof(RTMP_REQUEST));
+  memcpy(ch->kept, conn->kept, sizeof(ch->kept));
+  ch->nKept = conn->nKept;
+  conn->nKept = 0;
+  ch->dSeek = conn->dSeek;
+  ch->rangeStart = conn->rangeStart;
+  return ch;
+}
+
+// connecting blocks, so it's done on a thread
+static void
+StartChannel(STREAMING_CHANNEL * ch)
+{
+  if (!ThreadCreate(connectThread, ch))
+    {
+      ch->failed = true;
+      Connected(ch);
+    }
+}
+
+// move conn to the reactor that runs the channel it wants
+static void
+MoveConn(STREAMING_CONN * conn, STREAMING_REACTOR * to)
+{
+  epoll_ctl(conn->reactor->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+  UnlinkConn(conn);
+  conn->writing = false;
+
+  pthread_mutex_lock(&to->lock);
+  if (!to->stopped)
+    {
+      conn->reactor = to;
+      conn->next = to->incoming;
+      to->incoming = conn;
+      write(to->wake[1], "", 1);
+      conn = NULL;
+    }
+  pthread_mutex_unlock(&to->lock);
+
+  if (conn)
+    FreeConn(conn);
+}
+
+/* What channels are shared and streams cached by: where the stream is,
+ * and a hash of what else the origin may answer differently to, the
+ * connect and play parameters as filled in with their defaults. False
+ * if there's no telling, the request then gets a channel of its own. */
+static bool
+ChannelKey(RTMP_REQUEST * req, char *key, size_t size)
+{
+  AVal *params[] = { &req->tcUrl, &req->swfUrl, &req->pageUrl,
+    &req->flashVer, &req->auth, &req->token, &req->swfHash,
+    req->subscribepath.av_len ? &req->subscribepath : &req->playpath
+  };
+  uint64_t hash = HASH_START;
+  char extras[4096], *end;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(params) / sizeof(params[0]); i++)
+    {
+      // with its length, so that no two lists hash alike by running on
+      hash = HashBytes(hash, (char *) &params[i]->av_len, sizeof(int));
+      hash = HashBytes(hash, params[i]->av_val, params[i]->av_len);
+    }
+  hash = HashBytes(hash, (char *) &req->swfSize, sizeof(req->swfSize));
+  // the conn arguments, as they are sent
+  for (i = 0; i < (unsigned int) req->extras.o_num; i++)
+    {
+      end = AMFProp_Encode(&req->extras.o_props[i], extras,
+			   extras + sizeof(extras));
+      if (!end)
+	{
+	  Log(LOGWARNING, "%s, conn argument %u too large to share by",
+	      __FUNCTION__, i + 1);
+	  return false;
+	}
+      hash = HashBytes(hash, extras, end - extras);
+    }
+
+  snprintf(key, size, "%s://%s:%d/%.*s/%.*s%s #%016llx",
+	   RTMPProtocolStringsLower[req->protocol], req->hostname,
+	   req->rtmpport, req->app.av_len, req->app.av_val,
+	   req->playpath.av_len, req->playpath.av_val,
+	   req->bLiveStream ? " live" : "", (unsigned long long) hash);
+  return true;
+}
+
+/* Join the channel with the url and playpath conn asks for, or open it:
+ * a live one, or a recorded one while it fills the cache, where those
+ * joining later find its start. Its clients all go to the reactor that
+ * runs it. */
+static void
+ShareChannel(STREAMING_CONN * conn)
+{
+  RTMP_REQUEST *req = &conn->req;
+  STREAMING_CHANNEL *ch;
+  char key[1024];
 
-	      pos += prevTagSize + 4;	//(11+dataSize+4);
-	    }
+  if (!ChannelKey(req, key, sizeof(key)))
+    {
+      ch = OpenChannel(conn, NULL);
+      if (!ch)
+	{
+	  CloseConn(conn);
+	  return;
 	}
-      ptr += len;
+      View(conn, ch);
+      StartChannel(ch);
+      return;
+    }
 
-      if (packet.m_packetType != 0x16)
-	{			// FLV tag packets contain their own prevTagSize
-	  AMF_EncodeInt32(ptr, pend, prevTagSize);
-	  //ptr += 4;
-	}
+  pthread_mutex_lock(&sharedLock);
+  for (ch = sharedChannels; ch; ch = ch->shareNext)
+    if (strcmp(ch->key, key) == 0)
+      break;
 
-      // Return 0 if this was completed nicely with invoke message Play.Stop or Play.Complete
-      if (rtnGetNextMediaPacket == 2)
+  if (ch && ch->reactor != conn->reactor)
+    {
+      STREAMING_REACTOR *to = ch->reactor;
+      pthread_mutex_unlock(&sharedLock);
+      MoveConn(conn, to);
+      return;
+    }
+
+  if (!ch)
+    {
+      ch = OpenChannel(conn, strdup(key));
+      if (!ch)
 	{
-	  Log(LOGDEBUG,
-	      "Got Play.Complete or Play.Stop from server. Assuming stream is complete");
-	  ret = 0;
-	  break;
+	  pthread_mutex_unlock(&sharedLock);
+	  CloseConn(conn);
+	  return;
 	}
+      if (!req->bLiveStream && !StartCache(ch, key))
+	{
+	  // no cache file, so nobody else can join
+	  pthread_mutex_unlock(&sharedLock);
+	  free(ch->key);
+	  ch->key = NULL;
+	  View(conn, ch);
+	  StartChannel(ch);
+	  return;
+	}
+      ch->shareNext = sharedChannels;
+      sharedChannels = ch;
+      pthread_mutex_unlock(&sharedLock);
 
-      ret = size;
-      break;
+      View(conn, ch);
+      StartChannel(ch);
+      return;
     }
+  pthread_mutex_unlock(&sharedLock);
 
-  RTMPPacket_Free(&packet);
-  return ret;			// no more media packets
+  View(conn, ch);
 }
 
-TFTYPE
-controlServerThread(void *unused)
+/* Send the stream conn asks for from the cache, if it's there: no
+ * upstream, the file goes out with sendfile. */
+static bool
+ServeCached(STREAMING_CONN * conn)
 {
-  char ich;
-  while (1)
+  unsigned long long start = conn->rangeStart;
+  char key[1024], buf[512];
+  off_t size;
+  int fd;
+
+  if (!ChannelKey(&conn->req, key, sizeof(key)))
+    return false;
+  fd = OpenCached(HashKey(key), &size);
+  if (fd < 0)
+    return false;
+
+  LogPrintf("Sending %s from the cache\n", key);
+  conn->fileFd = fd;
+  conn->fileEnd = size;
+  if (start)
     {
-      ich = getchar();
-      switch (ich)
+      // the reply header waited for this, the range is exact here
+      if (start >= (unsigned long long) size)
 	{
-	case 'q':
-	  LogPrintf("Exiting\n");
-	  stopStreaming(httpServer);
-	  exit(0);
-	  break;
-	default:
-	  LogPrintf("Unknown command \'%c\', ignoring\n", ich);
+	  sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s",
+		  srvhead);
+	  conn->filePos = size;
+	}
+      else
+	{
+	  unsigned long long end = size - 1;
+	  if (conn->rangeEnd && conn->rangeEnd < end)
+	    end = conn->rangeEnd;
+	  sprintf(buf,
+		  "HTTP/1.0 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu%s",
+		  start, end, (unsigned long long) size, srvhead);
+	  conn->filePos = start;
+	  conn->fileEnd = end + 1;
 	}
+      QueueOut(conn, buf, strlen(buf));
     }
-  TFRET();
+  conn->state = CONN_DRAINING;
+  FlushClient(conn);
+  return true;
 }
 
-/*
-ssize_t readHTTPLine(int sockfd, char *buffer, size_t length)
+// get conn the stream its request asks for
+static void
+ServeStream(STREAMING_CONN * conn)
 {
-	size_t i=0;
-
-	while(i < length-1) {
-		char c;
-		int n = read(sockfd, &c, 1);
-
-		if(n == 0)
-			break;
+  RTMP_REQUEST *req = &conn->req;
+  STREAMING_CHANNEL *ch;
 
-		buffer[i] = c;
-		i++;
+  conn->state = CONN_STREAMING;
+  if (req->bLiveStream && !req->dStopOffset)
+    {
+      ShareChannel(conn);
+      return;
+    }
 
-		if(c == '\n')
-			break;
+  // only recorded streams relayed from start to end are cached
+  if (cacheDir && !conn->dSeek && !req->dStopOffset)
+    {
+      if (ServeCached(conn))
+	return;
+      if (!conn->rangeStart)
+	{
+	  ShareChannel(conn);
+	  return;
 	}
-	buffer[i]='\0';
-	i++;
+    }
 
-	return i;
+  ch = OpenChannel(conn, NULL);
+  if (!ch)
+    {
+      CloseConn(conn);
+      return;
+    }
+  View(conn, ch);
+  StartChannel(ch);
 }
 
-bool isHTTPRequestEOF(char *line, size_t length)
+// hand str over to the connection, to be freed with it
+static char *
+KeepString(STREAMING_CONN * conn, char *str)
 {
-	if(length < 2)
-		return true;
+  if (str && conn->nKept < MAX_KEPT)
+    conn->kept[conn->nKept++] = str;
+  else if (str)
+    {
+      Log(LOGERROR, "%s: too many strings", __FUNCTION__);
+      free(str);
+      str = NULL;
+    }
+  return str;
+}
 
-	if(line[0]=='\r' && line[1]=='\n')
-		return true;
+// hand obj's array and those of its objects from prop from on to conn
+static bool
+KeepAMF(STREAMING_CONN * conn, AMFObject * obj, int from)
+{
+  int i;
 
-	return false;
+  for (i = from; i < obj->o_num; i++)
+    if (obj->o_props[i].p_type == AMF_OBJECT
+	&& !KeepAMF(conn, &obj->o_props[i].p_vu.p_object, 0))
+      return false;
+  return !obj->o_props || KeepString(conn, (char *) obj->o_props);
 }
-*/
 
-void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-		       int sockfd	// client connection socket
-  )
+/* Put the conn args of the request after the default ones, in arrays
+ * that go with conn like the strings they point into. */
+static bool
+AddExtras(STREAMING_CONN * conn)
+{
+  RTMP_REQUEST *req = &conn->req;
+  AMFObject own = req->extras;
+  int i, from = 0;
+
+  req->extras = defaultRTMPRequest.extras;
+  req->edepth = defaultRTMPRequest.edepth;
+  if (!own.o_num)
+    {
+      free(own.o_props);
+      return true;
+    }
+  if (req->extras.o_num)
+    {
+      AMFObject all = { 0, NULL };
+      for (i = 0; i < req->extras.o_num; i++)
+	AMF_AddProp(&all, &req->extras.o_props[i]);
+      for (i = 0; i < own.o_num; i++)
+	AMF_AddProp(&all, &own.o_props[i]);
+      from = req->extras.o_num;
+      free(own.o_props);
+      own = all;
+    }
+  req->extras = own;
+  return KeepAMF(conn, &req->extras, from);
+}
+
+static void
+ProcessRequest(STREAMING_CONN * conn)
 {
   char buf[512] = { 0 };	// answer buffer
-  char header[2048] = { 0 };	// request header
+  char *header = conn->header;	// request header
   char *filename = NULL;	// GET request: file name //512 not enuf
-  char *buffer = NULL;		// stream buffer
   char *ptr = NULL;		// header pointer
 
-  size_t nRead = 0;
-
-  char srvhead[] =
-    "\r\nServer:HTTP-RTMP Stream Server \r\nContent-Type: Video/MPEG \r\n\r\n";
-
-  server->state = STREAMING_IN_PROGRESS;
-
-  RTMP rtmp = { 0 };
-  uint32_t dSeek = 0;		// can be used to start from a later point in the stream
+  size_t nRead = conn->nHeader;
 
   // reset RTMP options to defaults specified upon invokation of streams
-  RTMP_REQUEST req;
-  memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
+  RTMP_REQUEST *req = &conn->req;
+  memcpy(req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
 
-  // timeout for http requests
-  fd_set fds;
-  struct timeval tv;
+  Log(LOGDEBUG, "%s: header: %s", __FUNCTION__, header);
 
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
-
-  // go through request lines
-  //do {
-  FD_ZERO(&fds);
-  FD_SET(sockfd, &fds);
-
-  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
-    {
-      Log(LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
-    }
-  else
+  // a range from byte n on becomes a seek, see SeekRange(); one from
+  // byte 0 gets the whole stream
+  if ((ptr = strstr(header, "Range: bytes=")) != 0)
     {
-      nRead = recv(sockfd, header, 2047, 0);
-      header[2047] = '\0';
-
-      Log(LOGDEBUG, "%s: header: %s", __FUNCTION__, header);
-
-      if (strstr(header, "Range: bytes=") != 0)
+      char *end;
+      conn->rangeStart = strtoull(ptr + 13, &end, 10);
+      if (end != ptr + 13 && *end == '-' && end[1] >= '0' && end[1] <= '9')
+	conn->rangeEnd = strtoull(end + 1, NULL, 10);
+      if (!conn->rangeStart)
+	conn->rangeEnd = 0;
+      if (end == ptr + 13 || *end != '-'
+	  || (conn->rangeEnd && conn->rangeEnd < conn->rangeStart))
 	{
-	  // TODO check range starts from 0 and asking till the end.
 	  LogPrintf("%s, Range request not supported\n", __FUNCTION__);
 	  sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s",
 		  srvhead);
-	  send(sockfd, buf, (int) strlen(buf), 0);
-	  goto quit;
+	  goto reply;
 	}
+    }
 
-      if (strncmp(header, "GET", 3) == 0 && nRead > 4)
-	{
-	  filename = header + 4;
+  if (strncmp(header, "GET", 3) == 0 && nRead > 4)
+    {
+      filename = header + 4;
 
-	  // filter " HTTP/..." from end of request
-	  char *p = filename;
-	  while (*p != '\0')
+      // filter " HTTP/..." from end of request
+      char *p = filename;
+      while (*p != '\0')
+	{
+	  if (*p == ' ')
 	    {
-	      if (*p == ' ')
-		{
-		  *p = '\0';
-		  break;
-		}
-	      p++;
+	      *p = '\0';
+	      break;
 	    }
+	  p++;
 	}
     }
-  //} while(!isHTTPRequestEOF(header, nRead));
 
   // if we got a filename from the GET method
   if (filename != NULL)
@@ -612,12 +2349,22 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 	      ptr++;
 	      int len = strlen(ptr);
 
+	      // conn args of the request are gathered apart from the defaults
+	      memset(&req->extras, 0, sizeof(req->extras));
+	      req->edepth = 0;
+
 	      while (len >= 2)
 		{
 		  char ich = *ptr;
+		  if (len > 6 && strncmp(ptr, "start=", 6) == 0)
+		    {
+		      ich = 0;	// the one long parameter, start time in ms
+		      ptr += 4;
+		      len -= 4;
+		    }
 		  ptr++;
 		  if (*ptr != '=')
-		    goto filenotfound;	// long parameters not (yet) supported
+		    goto filenotfound;	// other long parameters not (yet) supported
 
 		  ptr++;
 		  len -= 2;
@@ -631,7 +2378,11 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 		      nArgLen = temp - ptr;
 		    }
 
-		  char *arg = (char *) malloc((nArgLen + 1) * sizeof(char));
+		  char *arg = KeepString(conn,
+					 (char *) malloc((nArgLen + 1) *
+							 sizeof(char)));
+		  if (!arg)
+		    goto filenotfound;
 		  memcpy(arg, ptr, nArgLen * sizeof(char));
 		  arg[nArgLen] = '\0';
 
@@ -639,13 +2390,18 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 		  http_unescape(arg);
 
 		  Log(LOGDEBUG, "%s: parameter: %c, arg: %s", __FUNCTION__,
-		      ich, arg);
+		      ich ? ich : '-', arg);
 
 		  ptr += nArgLen + 1;
 		  len -= nArgLen + 1;
 
-		  ParseOption(ich, arg, &req);
+		  if (ich)
+		    ParseOption(ich, arg, req);
+		  else
+		    req->dStartOffset = strtoul(arg, NULL, 10);
 		}
+	      if (!AddExtras(conn))
+		goto filenotfound;
 	    }
 	}
       else
@@ -660,232 +2416,365 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
     }
 
   // do necessary checks right here to make sure the combined request of default values and GET parameters is correct
-  if (req.hostname == 0)
+  if (req->hostname == 0)
     {
       Log(LOGERROR,
 	  "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
       goto filenotfound;
     }
-  if (req.playpath.av_len == 0)
+  if (req->playpath.av_len == 0)
     {
       Log(LOGERROR,
 	  "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
       goto filenotfound;;
     }
 
-  if (req.rtmpport == -1)
+  if (req->rtmpport == -1)
     {
       Log(LOGWARNING,
 	  "You haven't specified a port (--port) or rtmp url (-r), using default port 1935");
-      req.rtmpport = 1935;
+      req->rtmpport = 1935;
     }
-  if (req.protocol == RTMP_PROTOCOL_UNDEFINED)
+  if (req->protocol == RTMP_PROTOCOL_UNDEFINED)
     {
       Log(LOGWARNING,
 	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
-      req.protocol = RTMP_PROTOCOL_RTMP;
+      req->protocol = RTMP_PROTOCOL_RTMP;
     }
 
-  if (req.flashVer.av_len == 0)
+  if (req->flashVer.av_len == 0)
     {
-      STR2AVAL(req.flashVer, DEFAULT_FLASH_VER);
+      STR2AVAL(req->flashVer, DEFAULT_FLASH_VER);
     }
 
-  if (req.tcUrl.av_len == 0 && req.app.av_len != 0)
+  if (req->tcUrl.av_len == 0 && req->app.av_len != 0)
     {
       char str[512] = { 0 };
-      snprintf(str, 511, "%s://%s/%s", RTMPProtocolStringsLower[req.protocol],
-	       req.hostname, req.app.av_val);
-      req.tcUrl.av_len = strlen(str);
-      req.tcUrl.av_val = (char *) malloc(req.tcUrl.av_len + 1);
-      strcpy(req.tcUrl.av_val, str);
+      snprintf(str, 511, "%s://%s/%s", RTMPProtocolStringsLower[req->protocol],
+	       req->hostname, req->app.av_val);
+      req->tcUrl.av_len = strlen(str);
+      req->tcUrl.av_val =
+	KeepString(conn, (char *) malloc(req->tcUrl.av_len + 1));
+      if (!req->tcUrl.av_val)
+	goto filenotfound;
+      strcpy(req->tcUrl.av_val, str);
     }
 
-  if (req.rtmpport == 0)
-    req.rtmpport = 1935;
+  if (req->rtmpport == 0)
+    req->rtmpport = 1935;
 
-  // after validation of the http request send response header
-  sprintf(buf, "HTTP/1.0 200 OK%s", srvhead);
-  send(sockfd, buf, (int) strlen(buf), 0);
+  if (conn->rangeStart && req->bLiveStream)
+    {
+      Log(LOGWARNING, "Can't seek in a live stream, ignoring Range header");
+      conn->rangeStart = 0;
+    }
 
-  // send the packets
-  buffer = (char *) calloc(PACKET_SIZE, 1);
+  // after validation of the http request send response header, that of
+  // a range once it's mapped to a seek
+  if (!conn->rangeStart)
+    {
+      sprintf(buf, "HTTP/1.0 200 OK%s", srvhead);
+      QueueOut(conn, buf, strlen(buf));
+    }
 
   // User defined seek offset
-  if (req.dStartOffset > 0)
+  if (req->dStartOffset > 0)
     {
-      if (req.bLiveStream)
+      if (req->bLiveStream)
 	Log(LOGWARNING,
 	    "Can't seek in a live stream, ignoring --seek option");
       else
-	dSeek += req.dStartOffset;
+	conn->dSeek += req->dStartOffset;
     }
 
-  if (dSeek != 0)
+  if (conn->dSeek != 0)
     {
-      LogPrintf("Starting at TS: %d ms\n", req.nTimeStamp);
+      LogPrintf("Starting at TS: %d ms\n", req->nTimeStamp);
     }
 
-  Log(LOGDEBUG, "Setting buffer time to: %dms", req.bufferTime);
-  RTMP_Init(&rtmp);
-  RTMP_SetBufferMS(&rtmp, req.bufferTime);
-  RTMP_SetupStream(&rtmp, req.protocol, req.hostname, req.rtmpport, NULL,	// sockshost
-		   &req.playpath, &req.tcUrl, &req.swfUrl, &req.pageUrl, &req.app, &req.auth, &req.swfHash, req.swfSize, &req.flashVer, &req.subscribepath, dSeek, -1,	// length
-		   req.bLiveStream, req.timeout);
-  /* backward compatibility, we always sent this as true before */
-  if (req.auth.av_len)
-    rtmp.Link.authflag = true;
+  ServeStream(conn);
+  return;
+
+filenotfound:
+  LogPrintf("%s, File not found, %s\n", __FUNCTION__, filename);
+  sprintf(buf, "HTTP/1.0 404 File Not Found%s", srvhead);
+reply:
+  QueueOut(conn, buf, strlen(buf));
+  conn->state = CONN_DRAINING;
+  FlushClient(conn);
+}
 
-  rtmp.Link.extras = req.extras;
-  rtmp.Link.token = req.token;
+static void
+ReadRequest(STREAMING_CONN * conn)
+{
+  int nRead = recv(conn->sockfd, conn->header + conn->nHeader,
+		   sizeof(conn->header) - 1 - conn->nHeader, 0);
 
-  LogPrintf("Connecting ... port: %d, app: %s\n", req.rtmpport, req.app);
-  if (!RTMP_Connect(&rtmp, NULL))
+  if (nRead < 0)
     {
-      LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      int sockerr = GetSockError();
+      if (sockerr != EAGAIN && sockerr != EWOULDBLOCK && sockerr != EINTR)
+	CloseConn(conn);
+      return;
     }
-  else
+  if (nRead == 0)
     {
-      unsigned long size = 0;
-      double percent = 0;
-      double duration = 0.0;
+      CloseConn(conn);
+      return;
+    }
 
-      int nWritten = 0;
-      int nRead = 0;
+  conn->nHeader += nRead;
+  conn->header[conn->nHeader] = '\0';
 
-      // write FLV header first
-      nRead = WriteHeader(&buffer, PACKET_SIZE);
-      if (nRead > 0)
-	{
-	  nWritten = send(sockfd, buffer, nRead, 0);
-	  if (nWritten < 0)
-	    {
-	      Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
-		  GetSockError());
-	      goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
-	    }
+  // the whole header, or as much of it as fits
+  if (strstr(conn->header, "\r\n\r\n") || strstr(conn->header, "\n\n")
+      || conn->nHeader == sizeof(conn->header) - 1)
+    ProcessRequest(conn);
+}
+
+static void
+AcceptClients(STREAMING_REACTOR * reactor)
+{
+  int i;
+
+  for (i = 0; i < ACCEPT_BATCH; i++)
+    {
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof(struct sockaddr_in);
+      struct epoll_event ev = { 0 };
+      STREAMING_CONN *conn;
+      int sockfd =
+	accept(reactor->server->socket, (struct sockaddr *) &addr, &addrlen);
 
-	  size += nRead;
+      if (sockfd < 0)
+	{
+	  int sockerr = GetSockError();
+	  if (sockerr != EAGAIN && sockerr != EWOULDBLOCK && sockerr != EINTR)
+	    Log(LOGERROR, "%s: accept failed", __FUNCTION__);
+	  break;
 	}
-      else
+
+      Log(LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
+	  inet_ntoa(addr.sin_addr));
+
+      conn = calloc(1, sizeof(STREAMING_CONN));
+      if (!conn)
 	{
-	  Log(LOGERROR, "%s: Couldn't obtain FLV header, exiting!",
-	      __FUNCTION__);
-	  goto cleanup;
+	  Log(LOGERROR, "%s: out of memory", __FUNCTION__);
+	  closesocket(sockfd);
+	  break;
 	}
+      SetBlocking(sockfd, false);
+      conn->reactor = reactor;
+      conn->sockfd = sockfd;
+      conn->fileFd = -1;
+      conn->accepted = RTMP_GetTime();
+      conn->client.kind = HANDLE_CLIENT;
+      conn->client.conn = conn;
+      LinkConn(conn);
+
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.ptr = &conn->client;
+      epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    }
+}
 
-      // get the rest of the stream
-      do
+static void
+ClientEvent(STREAMING_CONN * conn, uint32_t events)
+{
+  if (conn->state == CONN_REQUEST)
+    {
+      ReadRequest(conn);
+      return;
+    }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+      // nothing more is expected from the client but it closing
+      char buf[512];
+      int nRead = recv(conn->sockfd, buf, sizeof(buf), 0);
+      if (nRead == 0 || (nRead < 0 && GetSockError() != EAGAIN
+			 && GetSockError() != EWOULDBLOCK
+			 && GetSockError() != EINTR))
 	{
-	  nRead = WriteStream(&rtmp, &buffer, PACKET_SIZE, &req.nTimeStamp);
+	  Log(LOGDEBUG, "%s, client closed the connection", __FUNCTION__);
+	  CloseConn(conn);
+	  return;
+	}
+    }
 
-	  if (nRead > 0)
-	    {
-	      nWritten = send(sockfd, buffer, nRead, 0);
-	      //Log(LOGDEBUG, "written: %d", nWritten);
-	      if (nWritten < 0)
-		{
-		  Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
-		      GetSockError());
-		  goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
-		}
+  if (events & EPOLLOUT)
+    {
+      STREAMING_CHANNEL *ch;
 
-	      size += nRead;
+      FlushClient(conn);
+      ch = conn->channel;	// none once closed
+      if (ch && !ch->key && ch->state == CHANNEL_PLAYING && !ch->reading
+	  && !Behind(conn, OUT_LOW, RING_TAGS / 4))
+	ReadUpstream(ch);
+    }
+}
 
-	      //LogPrintf("write %dbytes (%.1f KB)\n", nRead, nRead/1024.0);
-	      if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
-		duration = RTMP_GetDuration(&rtmp);
+static void
+UpstreamEvent(STREAMING_CHANNEL * ch, uint32_t events)
+{
+  if ((events & EPOLLOUT) && RTMP_SendPending(&ch->rtmp) < 0)
+    {
+      // the viewers still get what is in the ring
+      Log(LOGDEBUG, "%s, upstream closed the connection", __FUNCTION__);
+      EndStream(ch);
+      ReadUpstream(ch);
+      return;
+    }
+  if (events & ~EPOLLOUT)
+    ReadUpstream(ch);
+  else
+    WatchUpstream(ch, ch->reading);
+}
 
-	      if (duration > 0)
-		{
-		  percent =
-		    ((double) (dSeek + req.nTimeStamp)) / (duration *
-							   1000.0) * 100.0;
-		  percent = ((double) (int) (percent * 10.0)) / 10.0;
-		  LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
-			    (double) size / 1024.0,
-			    (double) (req.nTimeStamp) / 1000.0, percent);
-		}
-	      else
-		{
-		  LogStatus("\r%.3f KB / %.2f sec", (double) size / 1024.0,
-			    (double) (req.nTimeStamp) / 1000.0);
-		}
-	    }
-#ifdef _DEBUG
-	  else
-	    {
-	      Log(LOGDEBUG, "zero read!");
-	    }
-#endif
+// channels back from connect threads, clients from other reactors
+static void
+TakeConnected(STREAMING_REACTOR * reactor)
+{
+  STREAMING_CHANNEL *ch, *nextCh;
+  STREAMING_CONN *conn, *next;
+  char buf[64];
 
-	  // Force clean close if a specified stop offset is reached
-	  if (req.dStopOffset && req.nTimeStamp >= req.dStopOffset)
-	    {
-	      LogPrintf("\nStop offset has been reached at %.2f seconds\n",
-			(double) req.dStopOffset / 1000.0);
-	      nRead = 0;
-	      RTMP_Close(&rtmp);
-	    }
+  while (read(reactor->wake[0], buf, sizeof(buf)) > 0)
+    ;
 
-	}
-      while (server->state == STREAMING_IN_PROGRESS && nRead > -1
-	     && RTMP_IsConnected(&rtmp) && nWritten >= 0);
-    }
-cleanup:
-  LogPrintf("Closing connection... ");
-  RTMP_Close(&rtmp);
-  LogPrintf("done!\n\n");
+  pthread_mutex_lock(&reactor->lock);
+  ch = reactor->connected;
+  reactor->connected = NULL;
+  conn = reactor->incoming;
+  reactor->incoming = NULL;
+  pthread_mutex_unlock(&reactor->lock);
 
-quit:
-  if (buffer)
+  for (; ch; ch = nextCh)
     {
-      free(buffer);
-      buffer = NULL;
+      nextCh = ch->next;
+      Connected(ch);
     }
 
-  if (sockfd)
-    closesocket(sockfd);
+  for (; conn; conn = next)
+    {
+      struct epoll_event ev = { 0 };
+
+      next = conn->next;
+      LinkConn(conn);
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.ptr = &conn->client;
+      epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, conn->sockfd, &ev);
+
+      // the channel may have closed meanwhile, then this opens it again,
+      // or finds the stream in the cache
+      if (STATE_GET(reactor->server->state) == STREAMING_ACCEPTING)
+	ServeStream(conn);
+      else
+	CloseConn(conn);
+    }
+}
 
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+static void
+SweepRequests(STREAMING_REACTOR * reactor)
+{
+  STREAMING_CONN *conn, *next;
+  uint32_t now = RTMP_GetTime();
 
-  return;
+  for (conn = reactor->conns; conn; conn = next)
+    {
+      next = conn->next;
+      if (conn->state == CONN_REQUEST
+	  && now - conn->accepted > REQUEST_TIMEOUT)
+	{
+	  Log(LOGERROR, "Request timeout/select failed, ignoring request");
+	  CloseConn(conn);
+	}
+    }
+}
 
-filenotfound:
-  LogPrintf("%s, File not found, %s\n", __FUNCTION__, filename);
-  sprintf(buf, "HTTP/1.0 404 File Not Found%s", srvhead);
-  send(sockfd, buf, (int) strlen(buf), 0);
-  goto quit;
+static void
+FreeDead(STREAMING_REACTOR * reactor)
+{
+  while (reactor->dead)
+    {
+      STREAMING_CONN *conn = reactor->dead;
+      reactor->dead = conn->next;
+      FreeConn(conn);
+    }
+  while (reactor->deadChannels)
+    {
+      STREAMING_CHANNEL *ch = reactor->deadChannels;
+      reactor->deadChannels = ch->next;
+      FreeChannel(ch);
+    }
 }
 
 TFTYPE
 serverThread(void *arg)
 {
-  STREAMING_SERVER *server = arg;
-  server->state = STREAMING_ACCEPTING;
+  STREAMING_REACTOR *reactor = arg;
+  STREAMING_SERVER *server = reactor->server;
+  struct epoll_event events[MAX_EVENTS];
+  uint32_t lastSweep = RTMP_GetTime();
 
-  while (server->state == STREAMING_ACCEPTING)
+  while (STATE_GET(server->state) == STREAMING_ACCEPTING)
     {
-      struct sockaddr_in addr;
-      socklen_t addrlen = sizeof(struct sockaddr_in);
-      int sockfd =
-	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
+      int i, n = epoll_wait(reactor->epfd, events, MAX_EVENTS, 1000);
 
-      if (sockfd > 0)
+      if (n < 0 && GetSockError() != EINTR)
 	{
-	  // Create a new process and transfer the control to that
-	  Log(LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr));
-	  processTCPrequest(server, sockfd);
-	  Log(LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+	  Log(LOGERROR, "%s: epoll_wait failed, error: %d", __FUNCTION__,
+	      GetSockError());
+	  break;
 	}
-      else
+
+      for (i = 0; i < n; i++)
+	{
+	  STREAMING_HANDLE *h = events[i].data.ptr;
+	  switch (h->kind)
+	    {
+	    case HANDLE_LISTEN:
+	      AcceptClients(reactor);
+	      break;
+	    case HANDLE_WAKE:
+	      TakeConnected(reactor);
+	      break;
+	    case HANDLE_CLIENT:
+	      if (h->conn->state != CONN_CLOSED)
+		ClientEvent(h->conn, events[i].events);
+	      break;
+	    case HANDLE_UPSTREAM:
+	      if (h->channel->state == CHANNEL_PLAYING)
+		UpstreamEvent(h->channel, events[i].events);
+	      break;
+	    }
+	}
+
+      if (RTMP_GetTime() - lastSweep >= 1000)
 	{
-	  Log(LOGERROR, "%s: accept failed", __FUNCTION__);
+	  SweepRequests(reactor);
+	  lastSweep = RTMP_GetTime();
 	}
+
+      FreeDead(reactor);
     }
-  server->state = STREAMING_STOPPED;
+
+  // from here on connect threads clean up after themselves
+  pthread_mutex_lock(&reactor->lock);
+  reactor->stopped = true;
+  pthread_mutex_unlock(&reactor->lock);
+  TakeConnected(reactor);
+
+  while (reactor->conns)
+    CloseConn(reactor->conns);
+  FreeDead(reactor);
+  close(reactor->epfd);
+  close(reactor->wake[0]);
+  close(reactor->wake[1]);
+
+  if (__sync_sub_and_fetch(&server->running, 1) == 0)
+    STATE_SET(server->state, STREAMING_STOPPED);
   TFRET();
 }
 
@@ -893,8 +2782,9 @@ STREAMING_SERVER *
 startStreaming(const char *address, int port)
 {
   struct sockaddr_in addr;
-  int sockfd;
+  int sockfd, i;
   STREAMING_SERVER *server;
+  long nCores = sysconf(_SC_NPROCESSORS_ONLN);
 
   sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (sockfd == -1)
@@ -903,6 +2793,10 @@ startStreaming(const char *address, int port)
       return 0;
     }
 
+  // closed connections linger in TIME_WAIT, don't let them block a restart
+  int on = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
   addr.sin_port = htons(port);
@@ -915,17 +2809,85 @@ startStreaming(const char *address, int port)
       return 0;
     }
 
-  if (listen(sockfd, 10) == -1)
+  if (listen(sockfd, SOMAXCONN) == -1)
     {
       Log(LOGERROR, "%s, listen failed", __FUNCTION__);
       closesocket(sockfd);
       return 0;
     }
+  SetBlocking(sockfd, false);
+
+  if (nCores < 1)
+    nCores = 1;
 
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
+  STATE_SET(server->state, STREAMING_ACCEPTING);
+  server->reactors = calloc(nCores, sizeof(STREAMING_REACTOR));
 
-  ThreadCreate(serverThread, server);
+  for (i = 0; i < nCores; i++)
+    {
+      STREAMING_REACTOR *reactor = &server->reactors[i];
+      struct epoll_event ev = { 0 };
+
+      reactor->server = server;
+      reactor->listen.kind = HANDLE_LISTEN;
+      reactor->waker.kind = HANDLE_WAKE;
+      pthread_mutex_init(&reactor->lock, NULL);
+
+      reactor->epfd = epoll_create(MAX_EVENTS);
+      if (reactor->epfd == -1 || pipe(reactor->wake) == -1)
+	{
+	  Log(LOGERROR, "%s, couldn't create the event loop, error: %d",
+	      __FUNCTION__, GetSockError());
+	  break;
+	}
+      SetBlocking(reactor->wake[0], false);
+      SetBlocking(reactor->wake[1], false);
+
+      ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+      ev.events |= EPOLLEXCLUSIVE;	// wake one reactor per connection, not all
+#endif
+      ev.data.ptr = &reactor->listen;
+      epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+      ev.events = EPOLLIN;
+      ev.data.ptr = &reactor->waker;
+      epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wake[0], &ev);
+    }
+  if (i < nCores)
+    {
+      closesocket(sockfd);
+      return 0;
+    }
+
+  server->nReactors = nCores;
+  for (i = 0; i < nCores; i++)
+    {
+      STREAMING_REACTOR *reactor = &server->reactors[i];
+
+      // counted before it starts, nothing stops it before we return
+      __sync_add_and_fetch(&server->running, 1);
+      if (ThreadCreate(serverThread, reactor))
+	continue;
+
+      // a loop that never ran: keep wakers and movers away from it
+      __sync_sub_and_fetch(&server->running, 1);
+      Log(LOGERROR, "%s, couldn't start event loop %d", __FUNCTION__, i + 1);
+      reactor->stopped = true;
+      close(reactor->epfd);
+      close(reactor->wake[0]);
+      close(reactor->wake[1]);
+    }
+  if (!server->running)
+    {
+      closesocket(sockfd);
+      free(server->reactors);
+      free(server);
+      return 0;
+    }
+  Log(LOGDEBUG, "%s: %d event loops", __FUNCTION__, server->running);
 
   return server;
 }
@@ -933,28 +2895,26 @@ startStreaming(const char *address, int port)
 void
 stopStreaming(STREAMING_SERVER * server)
 {
+  int i;
+
   assert(server);
 
-  if (server->state != STREAMING_STOPPED)
+  if (STATE_GET(server->state) != STREAMING_STOPPED)
     {
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
+      STATE_SET(server->state, STREAMING_STOPPING);
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
+      // wait for the event loops to close their connections and exit
+      for (i = 0; i < server->nReactors; i++)
+	WakeReactor(&server->reactors[i]);
+      while (STATE_GET(server->state) != STREAMING_STOPPED)
+	msleep(1);
 
       if (closesocket(server->socket))
 	Log(LOGERROR, "%s: Failed to close listening socket, error %d",
-	    GetSockError());
-
-      server->state = STREAMING_STOPPED;
+	    __FUNCTION__, GetSockError());
     }
 }
 
-
 void
 sigIntHandler(int sig)
 {
@@ -1074,7 +3034,7 @@ ParseOption(char opt, char *arg, RTMP_REQUEST * req)
       STR2AVAL(req->auth, arg);
       break;
     case 'C':
-      parseAMF(&req->extras, optarg, &req->edepth);
+      parseAMF(&req->extras, arg, &req->edepth);
       break;
     case 'm':
       req->timeout = atoi(arg);
@@ -1162,6 +3122,8 @@ main(int argc, char **argv)
     {"debug", 0, NULL, 'z'},
     {"quiet", 0, NULL, 'q'},
     {"verbose", 0, NULL, 'V'},
+    {"cache", 1, NULL, 'K'},
+    {"cachesize", 1, NULL, 'M'},
     {0, 0, 0, 0}
   };
 
@@ -1174,7 +3136,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-		      "hvqVzr:s:t:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:", longopts,
+		      "hvqVzr:s:t:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:K:M:", longopts,
 		      NULL)) != -1)
     {
       switch (opt)
@@ -1230,8 +3192,13 @@ main(int argc, char **argv)
 	    ("--device|-D             Streaming device ip address (default: %s)\n",
 	     DEFAULT_HTTP_STREAMING_DEVICE);
 	  LogPrintf
-	    ("--sport|-g              Streaming port (default: %d)\n\n",
+	    ("--sport|-g              Streaming port (default: %d)\n",
 	     nHttpStreamingPort);
+	  LogPrintf
+	    ("--cache|-K dir          Keep recorded streams relayed to the end in dir, and serve them from there\n");
+	  LogPrintf
+	    ("--cachesize|-M num      Size of the cache in MB (default: %d)\n\n",
+	     CACHE_MB);
 	  LogPrintf
 	    ("--quiet|-q              Supresses all command output.\n");
 	  LogPrintf("--verbose|-x            Verbose command output.\n");
@@ -1269,6 +3236,12 @@ main(int argc, char **argv)
 	      }
 	    break;
 	  }
+	case 'K':
+	  cacheDir = optarg;
+	  break;
+	case 'M':
+	  cacheMax = (uint64_t) atoi(optarg) * 1024 * 1024;
+	  break;
 	default:
 	  //LogPrintf("unknown option: %c\n", opt);
 	  ParseOption(opt, optarg, &defaultRTMPRequest);
@@ -1281,6 +3254,9 @@ main(int argc, char **argv)
   netstackdump_read = fopen("netstackdump_read", "wb");
 #endif
 
+  if (cacheDir && !LoadCache())
+    cacheDir = NULL;
+
   // start text UI
   ThreadCreate(controlServerThread, 0);
 
@@ -1294,7 +3270,7 @@ main(int argc, char **argv)
   LogPrintf("Streaming on http://%s:%d\n", httpStreamingDevice,
 	    nHttpStreamingPort);
 
-  while (httpServer->state != STREAMING_STOPPED)
+  while (STATE_GET(httpServer->state) != STREAMING_STOPPED)
     {
       sleep(1);
     }
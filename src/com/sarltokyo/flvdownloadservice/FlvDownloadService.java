@@ -12,9 +12,27 @@ public class FlvDownloadService extends Service {
 
 	private final static String TAG = "FlvDownloadService";
 
+	// fields of getProgress(jobId)
+	public final static int PROGRESS_STATE = 0; // 0 queued, 1 running, 2 done or cancelled
+	public final static int PROGRESS_STATUS = 1; // once done, as waitFlvdownload
+	public final static int PROGRESS_PERCENT = 2; // in 1/100 %, -1 if unknown
+	public final static int PROGRESS_BYTES = 3;
+	public final static int PROGRESS_TIMESTAMP = 4; // ms into the stream
+	public final static int PROGRESS_DURATION = 5; // ms, 0 if unknown
+	public final static int PROGRESS_BITRATE = 6; // kbit/s, last second
+	public final static int PROGRESS_AVG_BITRATE = 7; // kbit/s
+	public final static int PROGRESS_ELAPSED = 8; // ms
+	public final static int PROGRESS_STALLS = 9;
+	public final static int PROGRESS_RECONNECTS = 10;
+
 	private FlvDownloadService mFlvDownloadService;
 
-	private native int flvstreamerw(String url, String outfile);
+	private native int flvstreamerw(String url, String outfile, int parallel);
+	// downloads on the native thread pool, each with its own cancel
+	private native int flvstreamerStart(String url, String outfile, int parallel);
+	private native int flvstreamerWait(int jobId);
+	private native int flvstreamerCancel(int jobId);
+	private native long[] flvstreamerProgress(int jobId);
 
 	@Override
 	public void onCreate() {
@@ -36,7 +54,8 @@ public class FlvDownloadService extends Service {
 		return mInterfaceImpl;
 	}
 
-	private int flvdonwload(String urlbase, String title, String where) {
+	private int flvdonwload(String urlbase, String title, String where,
+			int parallel) {
 		String url = urlbase + title;
 		String outfile = where + title + ".flv";
 
@@ -44,14 +63,38 @@ public class FlvDownloadService extends Service {
 		Log.i(TAG, "outfile = " + outfile);
 
 		Log.i(TAG, "flvstreamerw");
-		int rtn = flvstreamerw(url, outfile);
+		int rtn = flvstreamerw(url, outfile, parallel);
 		Log.i(TAG, "return value of flvstreamerw = " + rtn);
 
 		return rtn;
 	}
 
+	private int startflvdownload(String urlbase, String title, String where,
+			int parallel) {
+		String url = urlbase + title;
+		String outfile = where + title + ".flv";
+
+		int jobId = flvstreamerStart(url, outfile, parallel);
+		Log.i(TAG, "job of " + outfile + " = " + jobId);
+
+		return jobId;
+	}
+
 	private int removeflv(String title, String where) {
 		File flvfile = new File(where + title + ".flv");
+		// keyframe index written next to the flv for resuming
+		new File(where + title + ".flv.idx").delete();
+		// segments of an unfinished parallel download, title.flv.1of4 etc.
+		File[] segments = new File(where).listFiles();
+		if (segments != null) {
+			for (File f : segments) {
+				String name = f.getName();
+				if (name.startsWith(title + ".flv.")
+						&& name.matches(".*\\.\\d+of\\d+(\\.idx)?")) {
+					f.delete();
+				}
+			}
+		}
 		if (flvfile.exists()) {
 			if (flvfile.delete()) {
 				Log.i(TAG, "remove flv file");
@@ -72,10 +115,42 @@ public class FlvDownloadService extends Service {
 		@Override
 		public int flvdownload(String urlbase, String title, String where)
 				throws RemoteException {
-			int rtn = FlvDownloadService.this.flvdonwload(urlbase, title, where);
+			int rtn = FlvDownloadService.this.flvdonwload(urlbase, title, where, 1);
+			return rtn;
+		}
+
+		@Override
+		public int flvdownloadParallel(String urlbase, String title,
+				String where, int parallel) throws RemoteException {
+			int rtn = FlvDownloadService.this.flvdonwload(urlbase, title, where,
+					parallel);
 			return rtn;
 		}
 
+		@Override
+		public int startFlvdownload(String urlbase, String title,
+				String where, int parallel) throws RemoteException {
+			return FlvDownloadService.this.startflvdownload(urlbase, title,
+					where, parallel);
+		}
+
+		@Override
+		public int waitFlvdownload(int jobId) throws RemoteException {
+			int rtn = flvstreamerWait(jobId);
+			Log.i(TAG, "return value of job " + jobId + " = " + rtn);
+			return rtn;
+		}
+
+		@Override
+		public int cancelFlvdownload(int jobId) throws RemoteException {
+			return flvstreamerCancel(jobId);
+		}
+
+		@Override
+		public long[] getProgress(int jobId) throws RemoteException {
+			return flvstreamerProgress(jobId);
+		}
+
 		@Override
 			public int removeflv(String title, String where) throws RemoteException {
 				int rtn = FlvDownloadService.this.removeflv(title, where);